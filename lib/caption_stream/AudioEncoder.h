@@ -0,0 +1,499 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_AUDIOENCODER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_AUDIOENCODER_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "AudioRingBuffer.h"
+
+// FLAC frame size limits. Frames hold whatever was dequeued so the encoder adds no latency, only a dequeue shorter than
+// the minimum is held back until the next one
+#define FLAC_MIN_BLOCK_SAMPLES 16
+#define FLAC_MAX_BLOCK_SAMPLES 4096
+
+#define FLAC_MAX_FIXED_ORDER 4
+#define FLAC_MAX_PARTITION_ORDER 8
+// 15 is the escape code
+#define FLAC_MAX_RICE_PARAMETER 14
+
+enum audio_upload_encoding {
+    AUDIO_UPLOAD_LINEAR16 = 0, // raw 16 kHz 16 bit mono, 256 kbit/s
+    AUDIO_UPLOAD_FLAC = 1,
+};
+
+inline const char *audio_upload_encoding_name(const audio_upload_encoding encoding) {
+    switch (encoding) {
+        case AUDIO_UPLOAD_LINEAR16:
+            return "linear16";
+        case AUDIO_UPLOAD_FLAC:
+            return "flac";
+    }
+    return "unknown";
+}
+
+struct AudioEncoderStats {
+    uint64_t input_bytes = 0;
+    uint64_t output_bytes = 0;
+    uint64_t encode_ns = 0;
+
+    // encoded size / raw size
+    double compression_ratio() const {
+        return input_bytes ? (double) output_bytes / input_bytes : 0;
+    }
+
+    // encoder time per second of audio, 10 ms is 1% of a core
+    double cpu_ms_per_audio_sec() const {
+        const double audio_secs = input_bytes / (AUDIO_BYTES_PER_MS * 1000.0);
+        return audio_secs > 0 ? encode_ns / 1e6 / audio_secs : 0;
+    }
+
+    std::string summary(const char *name) const {
+        char line[192];
+        snprintf(line, sizeof(line), "%s upload: %.1f KiB audio as %.1f KiB (%.1f%%), encoder %.2f ms per audio second",
+                 name, input_bytes / 1024.0, output_bytes / 1024.0, compression_ratio() * 100,
+                 cpu_ms_per_audio_sec());
+        return line;
+    }
+};
+
+// MSB first, appends whole bytes to the output as they fill up
+class FlacBitWriter {
+    std::string &out;
+    uint64_t bits = 0;
+    uint32_t bit_count = 0;
+
+public:
+    explicit FlacBitWriter(std::string &out) :
+            out(out) {}
+
+    // count <= 32
+    void write(const uint32_t value, const uint32_t count) {
+        if (!count)
+            return;
+
+        bits = (bits << count) | (value & (0xFFFFFFFFu >> (32 - count)));
+        bit_count += count;
+        while (bit_count >= 8) {
+            bit_count -= 8;
+            out.push_back((char) (uint8_t) (bits >> bit_count));
+        }
+    }
+
+    void write_signed(const int32_t value, const uint32_t count) {
+        write((uint32_t) value, count);
+    }
+
+    void write_zeros(uint32_t count) {
+        while (count >= 32) {
+            write(0, 32);
+            count -= 32;
+        }
+        write(0, count);
+    }
+
+    void write_rice(const uint32_t folded, const uint32_t parameter) {
+        write_zeros(folded >> parameter);
+        write(1, 1);
+        write(folded, parameter);
+    }
+
+    // zero padded to the next byte
+    void align() {
+        if (bit_count)
+            write(0, 8 - bit_count);
+    }
+};
+
+/*
+ Streaming FLAC encoder for the 16 kHz 16 bit mono upload audio. encode() appends complete frames for the audio given
+ (the stream header before the first), so every upload chunk carries decodable audio and nothing waits for a block
+ to fill up. Frames use the variable blocksize strategy for that, numbered by their first sample.
+
+ Each frame's subframe is the cheapest of constant (silence), the fixed polynomial predictors of order 0 to 4 with
+ partitioned Rice coded residuals, and verbatim. No LPC, for speech that costs a few percent of size but keeps the
+ encoder at a fraction of a millisecond per second of audio.
+
+ Not thread safe, meant to be used by the stream's upload side only.
+ */
+class FlacEncoder {
+    bool header_written = false;
+    uint64_t next_sample = 0;
+    std::vector<int32_t> pending;
+    std::vector<int32_t> residual;
+    AudioEncoderStats encoder_stats;
+
+    static const uint8_t *crc8_table() {
+        static uint8_t table[256];
+        static bool filled = [] {
+            for (int i = 0; i < 256; i++) {
+                uint8_t crc = (uint8_t) i;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (uint8_t) ((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+                table[i] = crc;
+            }
+            return true;
+        }();
+        (void) filled;
+        return table;
+    }
+
+    static const uint16_t *crc16_table() {
+        static uint16_t table[256];
+        static bool filled = [] {
+            for (int i = 0; i < 256; i++) {
+                uint16_t crc = (uint16_t) (i << 8);
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (uint16_t) ((crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1);
+                table[i] = crc;
+            }
+            return true;
+        }();
+        (void) filled;
+        return table;
+    }
+
+    static uint8_t crc8(const char *data, const size_t size) {
+        const uint8_t *table = crc8_table();
+        uint8_t crc = 0;
+        for (size_t i = 0; i < size; i++)
+            crc = table[crc ^ (uint8_t) data[i]];
+        return crc;
+    }
+
+    static uint16_t crc16(const char *data, const size_t size) {
+        const uint16_t *table = crc16_table();
+        uint16_t crc = 0;
+        for (size_t i = 0; i < size; i++)
+            crc = (uint16_t) ((crc << 8) ^ table[(crc >> 8) ^ (uint8_t) data[i]]);
+        return crc;
+    }
+
+    static uint32_t fold(const int32_t residual) {
+        return ((uint32_t) residual << 1) ^ (uint32_t) (residual >> 31);
+    }
+
+    // for a partition with this sum of folded residuals, from the mean and its neighbours
+    static uint32_t rice_parameter(const uint64_t sum, const uint32_t count, uint64_t &bits) {
+        uint32_t estimate = 0;
+        while (estimate < FLAC_MAX_RICE_PARAMETER && ((uint64_t) count << (estimate + 1)) < sum)
+            estimate++;
+
+        uint32_t best = estimate;
+        bits = UINT64_MAX;
+        for (uint32_t parameter = estimate ? estimate - 1 : 0;
+             parameter <= estimate + 1 && parameter <= FLAC_MAX_RICE_PARAMETER; parameter++) {
+            // sum >> parameter slightly underestimates the unary parts, good enough to compare
+            const uint64_t parameter_bits = (uint64_t) count * (parameter + 1) + (sum >> parameter);
+            if (parameter_bits < bits) {
+                bits = parameter_bits;
+                best = parameter;
+            }
+        }
+        return best;
+    }
+
+    // residual of the fixed predictor of the given order for samples[order..count)
+    static void fixed_residual(const int32_t *samples, const uint32_t count, const uint32_t order, int32_t *out) {
+        for (uint32_t i = order; i < count; i++) {
+            const int32_t *s = samples + i;
+            switch (order) {
+                case 0:
+                    out[i] = s[0];
+                    break;
+                case 1:
+                    out[i] = s[0] - s[-1];
+                    break;
+                case 2:
+                    out[i] = s[0] - 2 * s[-1] + s[-2];
+                    break;
+                case 3:
+                    out[i] = s[0] - 3 * s[-1] + 3 * s[-2] - s[-3];
+                    break;
+                default:
+                    out[i] = s[0] - 4 * s[-1] + 6 * s[-2] - 4 * s[-3] + s[-4];
+                    break;
+            }
+        }
+    }
+
+    // order with the smallest residual magnitude, the usual cheap stand-in for trying them all
+    static uint32_t pick_fixed_order(const int32_t *samples, const uint32_t count) {
+        uint64_t sums[FLAC_MAX_FIXED_ORDER + 1] = {};
+        for (uint32_t i = FLAC_MAX_FIXED_ORDER; i < count; i++) {
+            const int32_t *s = samples + i;
+            const int32_t e0 = s[0];
+            const int32_t e1 = e0 - s[-1];
+            const int32_t e2 = e1 - (s[-1] - s[-2]);
+            const int32_t e3 = e2 - (s[-1] - 2 * s[-2] + s[-3]);
+            const int32_t e4 = e3 - (s[-1] - 3 * s[-2] + 3 * s[-3] - s[-4]);
+            sums[0] += (uint32_t) std::abs(e0);
+            sums[1] += (uint32_t) std::abs(e1);
+            sums[2] += (uint32_t) std::abs(e2);
+            sums[3] += (uint32_t) std::abs(e3);
+            sums[4] += (uint32_t) std::abs(e4);
+        }
+
+        uint32_t best = 0;
+        for (uint32_t order = 1; order <= FLAC_MAX_FIXED_ORDER && order < count; order++) {
+            if (sums[order] < sums[best])
+                best = order;
+        }
+        return best;
+    }
+
+    // best partition order and its Rice parameters for residual[order..count), total bits of the residual section
+    static uint64_t plan_residual(const int32_t *residual, const uint32_t count, const uint32_t order,
+                                  uint32_t &partition_order, uint32_t *parameters) {
+        uint64_t best_bits = UINT64_MAX;
+        uint32_t candidate[1 << FLAC_MAX_PARTITION_ORDER];
+
+        for (uint32_t try_order = 0; try_order <= FLAC_MAX_PARTITION_ORDER; try_order++) {
+            const uint32_t partitions = 1u << try_order;
+            if (count % partitions || count / partitions <= order)
+                break;
+
+            const uint32_t partition_size = count / partitions;
+            uint64_t bits = 2 + 4;
+            for (uint32_t p = 0; p < partitions; p++) {
+                const uint32_t start = p ? p * partition_size : order;
+                const uint32_t end = (p + 1) * partition_size;
+                uint64_t sum = 0;
+                for (uint32_t i = start; i < end; i++)
+                    sum += fold(residual[i]);
+
+                uint64_t partition_bits;
+                candidate[p] = rice_parameter(sum, end - start, partition_bits);
+                bits += 4 + partition_bits;
+            }
+
+            if (bits < best_bits) {
+                best_bits = bits;
+                partition_order = try_order;
+                memcpy(parameters, candidate, partitions * sizeof(uint32_t));
+            }
+        }
+        return best_bits;
+    }
+
+    static void write_utf8_number(std::string &out, const uint64_t value) {
+        if (value < 0x80) {
+            out.push_back((char) value);
+            return;
+        }
+
+        int bytes = 2;
+        while (bytes < 7 && value >= (1ull << (5 * bytes + 1)))
+            bytes++;
+
+        const uint8_t prefix = (uint8_t) (0xFF00 >> bytes);
+        out.push_back((char) (uint8_t) (prefix | (bytes < 7 ? value >> (6 * (bytes - 1)) : 0)));
+        for (int i = bytes - 2; i >= 0; i--)
+            out.push_back((char) (uint8_t) (0x80 | ((value >> (6 * i)) & 0x3F)));
+    }
+
+    void write_stream_header(std::string &out) {
+        out.append("fLaC", 4);
+        FlacBitWriter writer(out);
+        writer.write(1, 1); // last metadata block
+        writer.write(0, 7); // STREAMINFO
+        writer.write(34, 24);
+        writer.write(FLAC_MIN_BLOCK_SAMPLES, 16);
+        writer.write(FLAC_MAX_BLOCK_SAMPLES, 16);
+        writer.write(0, 24); // frame sizes unknown
+        writer.write(0, 24);
+        writer.write(AUDIO_SAMPLE_RATE, 20);
+        writer.write(1 - 1, 3); // channels
+        writer.write(16 - 1, 5); // bits per sample
+        writer.write(0, 4); // total samples unknown, 36 bits
+        writer.write(0, 32);
+        writer.write_zeros(128); // no MD5
+    }
+
+    void write_frame(const int32_t *samples, const uint32_t count, std::string &out) {
+        const size_t frame_start = out.size();
+
+        // header, variable blocksize strategy, 16 kHz, mono, 16 bit
+        out.push_back((char) 0xFF);
+        out.push_back((char) 0xF9);
+        const bool short_blocksize = count <= 256;
+        out.push_back((char) ((short_blocksize ? 0x60 : 0x70) | 0x05));
+        out.push_back((char) 0x08);
+        write_utf8_number(out, next_sample);
+        if (short_blocksize) {
+            out.push_back((char) (count - 1));
+        } else {
+            out.push_back((char) ((count - 1) >> 8));
+            out.push_back((char) ((count - 1) & 0xFF));
+        }
+        out.push_back((char) crc8(&out[frame_start], out.size() - frame_start));
+
+        FlacBitWriter writer(out);
+        write_subframe(writer, samples, count);
+        writer.align();
+
+        const uint16_t crc = crc16(&out[frame_start], out.size() - frame_start);
+        out.push_back((char) (crc >> 8));
+        out.push_back((char) (crc & 0xFF));
+
+        next_sample += count;
+    }
+
+    void write_subframe(FlacBitWriter &writer, const int32_t *samples, const uint32_t count) {
+        bool constant = true;
+        for (uint32_t i = 1; i < count && constant; i++)
+            constant = samples[i] == samples[0];
+        if (constant) {
+            writer.write(0x00, 8);
+            writer.write_signed(samples[0], 16);
+            return;
+        }
+
+        const uint32_t order = pick_fixed_order(samples, count);
+        if (residual.size() < count)
+            residual.resize(count);
+        fixed_residual(samples, count, order, residual.data());
+
+        uint32_t partition_order = 0;
+        uint32_t parameters[1 << FLAC_MAX_PARTITION_ORDER];
+        const uint64_t residual_bits = plan_residual(residual.data(), count, order, partition_order, parameters);
+
+        if (residual_bits == UINT64_MAX || (uint64_t) order * 16 + residual_bits >= (uint64_t) count * 16) {
+            // noise, verbatim is smaller
+            writer.write(0x02, 8);
+            for (uint32_t i = 0; i < count; i++)
+                writer.write_signed(samples[i], 16);
+            return;
+        }
+
+        writer.write(0x10 | (order << 1), 8);
+        for (uint32_t i = 0; i < order; i++)
+            writer.write_signed(samples[i], 16);
+
+        writer.write(0, 2); // Rice coding, 4 bit parameters
+        writer.write(partition_order, 4);
+        const uint32_t partitions = 1u << partition_order;
+        const uint32_t partition_size = count >> partition_order;
+        for (uint32_t p = 0; p < partitions; p++) {
+            const uint32_t parameter = parameters[p];
+            writer.write(parameter, 4);
+            const uint32_t end = (p + 1) * partition_size;
+            for (uint32_t i = p ? p * partition_size : order; i < end; i++)
+                writer.write_rice(fold(residual[i]), parameter);
+        }
+    }
+
+    void encode_pending(std::string &out, const bool all) {
+        size_t done = 0;
+        while (pending.size() - done >= FLAC_MIN_BLOCK_SAMPLES || (all && done < pending.size())) {
+            if (!header_written) {
+                write_stream_header(out);
+                header_written = true;
+            }
+
+            size_t count = pending.size() - done;
+            if (count > FLAC_MAX_BLOCK_SAMPLES) {
+                // don't leave a remainder too short for a frame of its own
+                count = count - FLAC_MAX_BLOCK_SAMPLES < FLAC_MIN_BLOCK_SAMPLES
+                        ? FLAC_MAX_BLOCK_SAMPLES / 2 : FLAC_MAX_BLOCK_SAMPLES;
+            }
+            write_frame(&pending[done], (uint32_t) count, out);
+            done += count;
+        }
+        pending.erase(pending.begin(), pending.begin() + done);
+    }
+
+public:
+    // appends the frames for this audio to out, 16 bit native endian samples
+    void encode(const char *audio, const size_t size, std::string &out) {
+        const auto started_at = std::chrono::steady_clock::now();
+        const size_t out_before = out.size();
+
+        const size_t samples = size / AUDIO_BYTES_PER_SAMPLE;
+        const size_t offset = pending.size();
+        pending.resize(offset + samples);
+        for (size_t i = 0; i < samples; i++) {
+            int16_t sample;
+            memcpy(&sample, audio + i * AUDIO_BYTES_PER_SAMPLE, sizeof(sample));
+            pending[offset + i] = sample;
+        }
+        encode_pending(out, false);
+
+        encoder_stats.input_bytes += samples * AUDIO_BYTES_PER_SAMPLE;
+        encoder_stats.output_bytes += out.size() - out_before;
+        encoder_stats.encode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started_at).count();
+    }
+
+    // appends a last frame with any held back samples, nothing if there are none
+    void finish(std::string &out) {
+        const size_t out_before = out.size();
+        encode_pending(out, true);
+        encoder_stats.output_bytes += out.size() - out_before;
+    }
+
+    const AudioEncoderStats &stats() const {
+        return encoder_stats;
+    }
+};
+
+// for test servers: position after the audio of one piece of FlacEncoder output, in samples, 0 if it doesn't start
+// with a frame. Uploads carry one frame per dequeue, so that's every HTTP chunk or gRPC request, after the stream
+// header in the first.
+inline uint64_t flac_upload_end_sample(const std::string &chunk) {
+    size_t pos = 0;
+    if (chunk.compare(0, 4, "fLaC") == 0) {
+        pos = 4;
+        bool last = false;
+        while (!last && pos + 4 <= chunk.size()) {
+            last = (uint8_t) chunk[pos] & 0x80;
+            pos += 4 + (((uint8_t) chunk[pos + 1] << 16) | ((uint8_t) chunk[pos + 2] << 8) | (uint8_t) chunk[pos + 3]);
+        }
+    }
+    if (pos + 5 > chunk.size() || (uint8_t) chunk[pos] != 0xFF || (uint8_t) chunk[pos + 1] != 0xF9)
+        return 0;
+
+    const uint8_t blocksize_code = (uint8_t) chunk[pos + 2] >> 4;
+    pos += 4;
+
+    // UTF-8 style coded number of the first sample
+    const uint8_t first = (uint8_t) chunk[pos++];
+    int extra = 0;
+    while (extra < 7 && (first & (0x80 >> extra)))
+        extra++;
+    extra = extra ? extra - 1 : 0;
+    uint64_t sample = extra ? first & (0x3F >> extra) : first;
+    for (int i = 0; i < extra && pos < chunk.size(); i++)
+        sample = (sample << 6) | ((uint8_t) chunk[pos++] & 0x3F);
+
+    uint64_t blocksize;
+    if (blocksize_code == 6 && pos < chunk.size())
+        blocksize = (uint8_t) chunk[pos] + 1;
+    else if (blocksize_code == 7 && pos + 1 < chunk.size())
+        blocksize = (((uint8_t) chunk[pos] << 8) | (uint8_t) chunk[pos + 1]) + 1;
+    else
+        return 0;
+    return sample + blocksize;
+}
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_AUDIOENCODER_H
@@ -0,0 +1,155 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_AUDIOPACKETIZER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_AUDIOPACKETIZER_H
+
+#include <atomic>
+#include <cstdio>
+#include <vector>
+#include "AudioRingBuffer.h"
+
+typedef unsigned int uint;
+
+struct AudioPacketizerSettings {
+    uint frame_ms;
+
+    // pick the frame size between min_frame_ms and max_frame_ms from the measured round trip time instead
+    bool adapt_to_rtt;
+    uint min_frame_ms;
+    uint max_frame_ms;
+
+    AudioPacketizerSettings(
+            uint frame_ms,
+            bool adapt_to_rtt,
+            uint min_frame_ms,
+            uint max_frame_ms
+    ) :
+            frame_ms(frame_ms),
+            adapt_to_rtt(adapt_to_rtt),
+            min_frame_ms(min_frame_ms),
+            max_frame_ms(max_frame_ms) {}
+
+    bool operator==(const AudioPacketizerSettings &rhs) const {
+        return frame_ms == rhs.frame_ms &&
+               adapt_to_rtt == rhs.adapt_to_rtt &&
+               min_frame_ms == rhs.min_frame_ms &&
+               max_frame_ms == rhs.max_frame_ms;
+    }
+
+    bool operator!=(const AudioPacketizerSettings &rhs) const {
+        return !(rhs == *this);
+    }
+
+    void print(const char *line_prefix = "") {
+        printf("%sAudioPacketizerSettings\n", line_prefix);
+        printf("%s  frame_ms: %d\n", line_prefix, frame_ms);
+        printf("%s  adapt_to_rtt: %d\n", line_prefix, adapt_to_rtt);
+        printf("%s  min_frame_ms: %d\n", line_prefix, min_frame_ms);
+        printf("%s  max_frame_ms: %d\n", line_prefix, max_frame_ms);
+    }
+};
+
+/*
+ Coalesces the small ~10ms blocks OBS delivers into larger frames before they're queued for upload so each upload
+ request/HTTP chunk carries more audio. Every frame adds at most frame_ms of latency.
+
+ Not thread safe, push() and flush() are meant to be called from the audio thread only. set_rtt_ms() can be called
+ from anywhere.
+ */
+class AudioPacketizer {
+    AudioPacketizerSettings settings;
+    audio_frame_callback on_frame;
+
+    std::vector<char> frame;
+    size_t frame_fill = 0;
+    std::atomic<uint> rtt_ms;
+
+    uint frame_count = 0;
+
+    size_t target_frame_bytes() const {
+        uint use_ms = settings.frame_ms;
+        const uint rtt = rtt_ms.load(std::memory_order_relaxed);
+        if (settings.adapt_to_rtt && rtt) {
+            // frames much shorter than the RTT don't get results back any faster, they just cost more overhead
+            use_ms = rtt / 2 / 10 * 10;
+            if (use_ms < settings.min_frame_ms)
+                use_ms = settings.min_frame_ms;
+            if (use_ms > settings.max_frame_ms)
+                use_ms = settings.max_frame_ms;
+        }
+        return audio_ms_to_bytes(use_ms);
+    }
+
+    void emit_frame() {
+        if (!frame_fill)
+            return;
+
+        if (on_frame)
+            on_frame(&frame[0], frame_fill);
+        frame_fill = 0;
+        frame_count++;
+    }
+
+public:
+    AudioPacketizer(const AudioPacketizerSettings &settings, audio_frame_callback on_frame) :
+            settings(settings),
+            on_frame(on_frame),
+            rtt_ms(0) {
+        uint max_ms = settings.frame_ms;
+        if (settings.adapt_to_rtt && settings.max_frame_ms > max_ms)
+            max_ms = settings.max_frame_ms;
+
+        frame.resize(audio_ms_to_bytes(max_ms ? max_ms : 1));
+    }
+
+    void set_rtt_ms(const uint new_rtt_ms) {
+        rtt_ms.store(new_rtt_ms, std::memory_order_relaxed);
+    }
+
+    void push(const char *data, size_t size) {
+        const size_t target = std::min(target_frame_bytes(), frame.size());
+        if (!target) {
+            // packetizing disabled, pass through as is
+            if (on_frame && size)
+                on_frame(data, size);
+            return;
+        }
+
+        while (size) {
+            const size_t use = std::min(size, target > frame_fill ? target - frame_fill : 0);
+            memcpy(&frame[frame_fill], data, use);
+            frame_fill += use;
+            data += use;
+            size -= use;
+
+            if (frame_fill >= target)
+                emit_frame();
+        }
+    }
+
+    // send whatever is buffered right away
+    void flush() {
+        emit_frame();
+    }
+
+    uint get_frame_count() const {
+        return frame_count;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_AUDIOPACKETIZER_H
@@ -0,0 +1,260 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_AUDIOQUEUE_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_AUDIOQUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include "AudioRingBuffer.h"
+
+// ring size used when no queue limit is given
+#define AUDIO_QUEUE_UNLIMITED_CAPACITY_MS 10000
+
+// how many pushes the queue remembers timestamps for, older ones are forgotten if the consumer lags behind this much
+#define AUDIO_QUEUE_TIMING_MARKERS 1024
+
+// blocks with all samples below this are treated as silence by AUDIO_QUEUE_DROP_SILENCE_FIRST
+#define AUDIO_QUEUE_SILENCE_PEAK 300
+
+enum audio_queue_drop_policy {
+    AUDIO_QUEUE_DROP_OLDEST = 0,
+    AUDIO_QUEUE_DROP_NEWEST = 1,
+    AUDIO_QUEUE_DROP_SILENCE_FIRST = 2,
+};
+
+static const char *audio_queue_drop_policy_name(const audio_queue_drop_policy policy) {
+    switch (policy) {
+        case AUDIO_QUEUE_DROP_OLDEST:
+            return "drop_oldest";
+        case AUDIO_QUEUE_DROP_NEWEST:
+            return "drop_newest";
+        case AUDIO_QUEUE_DROP_SILENCE_FIRST:
+            return "drop_silence_first";
+    }
+    return "?";
+}
+
+static bool audio_block_is_silent(const char *data, const size_t bytes, const int peak_threshold) {
+    const int16_t *samples = (const int16_t *) data;
+    const size_t sample_cnt = bytes / AUDIO_BYTES_PER_SAMPLE;
+    for (size_t i = 0; i < sample_cnt; i++) {
+        if (std::abs((int) samples[i]) >= peak_threshold)
+            return false;
+    }
+    return true;
+}
+
+struct AudioQueueStats {
+    uint64_t dropped_bytes = 0;
+    uint64_t drop_events = 0;
+    uint64_t dropped_silent_bytes = 0;
+    size_t peak_depth_bytes = 0;
+
+    uint32_t dropped_ms() const {
+        return audio_bytes_to_ms(dropped_bytes);
+    }
+
+    uint32_t peak_depth_ms() const {
+        return audio_bytes_to_ms(peak_depth_bytes);
+    }
+};
+
+struct AudioTiming {
+    std::chrono::steady_clock::time_point captured_at;
+    std::chrono::steady_clock::time_point enqueued_at;
+};
+
+/*
+ Audio queue between the OBS audio thread (producer) and a stream's upload thread (consumer) with a limit on how
+ much audio in milliseconds may be buffered and a policy for what to throw away once the upload falls behind.
+
+ Dropping is O(1) either way: newest audio is dropped by simply not writing it, oldest audio is dropped by the consumer
+ skipping over it on its next read. The ring has as much headroom as the limit itself for the latter, if the consumer
+ is stuck for longer than that newer audio has to be dropped as well.
+ */
+class AudioQueue {
+    const audio_queue_drop_policy policy;
+    const size_t limit_bytes;
+    AudioRingBuffer ring;
+
+    std::atomic<uint64_t> dropped_bytes;
+    std::atomic<uint64_t> drop_events;
+    std::atomic<uint64_t> dropped_silent_bytes;
+    std::atomic<size_t> peak_depth_bytes;
+
+    // producer side, true while consecutive pushes keep dropping so a burst only counts as one event
+    bool dropping_newest = false;
+
+    // SPSC ring of (end byte position, timestamps) for every push, lets the consumer tell when the audio it read was
+    // captured. Slots can be overwritten while being read if the consumer lags far behind, harmless for timings.
+    struct TimingMarker {
+        std::atomic<uint64_t> end_pos;
+        std::atomic<int64_t> captured_at;
+        std::atomic<int64_t> enqueued_at;
+    };
+    TimingMarker markers[AUDIO_QUEUE_TIMING_MARKERS];
+    std::atomic<uint64_t> marker_write;
+    uint64_t marker_read = 0; // consumer only
+    uint64_t push_end_pos = 0; // producer only, total bytes written
+    uint64_t pop_end_pos = 0; // consumer only, total bytes read or skipped
+
+    void add_marker(const std::chrono::steady_clock::time_point captured_at) {
+        const uint64_t w = marker_write.load(std::memory_order_relaxed);
+        TimingMarker &marker = markers[w % AUDIO_QUEUE_TIMING_MARKERS];
+        marker.end_pos.store(push_end_pos, std::memory_order_relaxed);
+        marker.captured_at.store(captured_at.time_since_epoch().count(), std::memory_order_relaxed);
+        marker.enqueued_at.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        marker_write.store(w + 1, std::memory_order_release);
+    }
+
+    // timing of the newest push fully consumed up to pop_end_pos, false if none
+    bool consume_markers(AudioTiming *timing) {
+        const uint64_t w = marker_write.load(std::memory_order_acquire);
+        if (w - marker_read > AUDIO_QUEUE_TIMING_MARKERS)
+            marker_read = w - AUDIO_QUEUE_TIMING_MARKERS;
+
+        bool found = false;
+        while (marker_read < w) {
+            const TimingMarker &marker = markers[marker_read % AUDIO_QUEUE_TIMING_MARKERS];
+            if (marker.end_pos.load(std::memory_order_relaxed) > pop_end_pos)
+                break;
+
+            if (timing) {
+                typedef std::chrono::steady_clock::time_point time_point;
+                timing->captured_at = time_point(time_point::duration(marker.captured_at.load(std::memory_order_relaxed)));
+                timing->enqueued_at = time_point(time_point::duration(marker.enqueued_at.load(std::memory_order_relaxed)));
+            }
+            found = true;
+            marker_read++;
+        }
+        return found;
+    }
+
+    void count_drop(const size_t bytes, const bool new_event) {
+        dropped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (new_event)
+            drop_events.fetch_add(1, std::memory_order_relaxed);
+    }
+
+public:
+    AudioQueue(const uint32_t limit_ms, const audio_queue_drop_policy policy) :
+            policy(policy),
+            limit_bytes(audio_ms_to_bytes(limit_ms)),
+            ring(limit_ms ? 2 * audio_ms_to_bytes(limit_ms) : audio_ms_to_bytes(AUDIO_QUEUE_UNLIMITED_CAPACITY_MS)),
+            dropped_bytes(0),
+            drop_events(0),
+            dropped_silent_bytes(0),
+            peak_depth_bytes(0),
+            marker_write(0) {
+    }
+
+    // producer side, never blocks. Returns false if the given audio was dropped.
+    bool push(const char *data, const size_t bytes,
+              const std::chrono::steady_clock::time_point captured_at = std::chrono::steady_clock::now()) {
+        if (!bytes || ring.is_closed() || ring.is_finished())
+            return false;
+
+        const size_t depth = ring.size();
+        bool drop = false;
+        if (limit_bytes && depth + bytes > limit_bytes) {
+            if (policy == AUDIO_QUEUE_DROP_NEWEST) {
+                drop = true;
+            } else if (policy == AUDIO_QUEUE_DROP_SILENCE_FIRST
+                       && audio_block_is_silent(data, bytes, AUDIO_QUEUE_SILENCE_PEAK)) {
+                dropped_silent_bytes.fetch_add(bytes, std::memory_order_relaxed);
+                drop = true;
+            }
+            // otherwise queue it anyway and let the consumer skip the oldest audio
+        }
+
+        if (!drop && !ring.write(data, bytes))
+            drop = true; // out of headroom as well
+
+        if (drop) {
+            count_drop(bytes, !dropping_newest);
+            dropping_newest = true;
+            return false;
+        }
+        dropping_newest = false;
+        push_end_pos += bytes;
+        add_marker(captured_at);
+
+        const size_t new_depth = depth + bytes;
+        if (new_depth > peak_depth_bytes.load(std::memory_order_relaxed))
+            peak_depth_bytes.store(new_depth, std::memory_order_relaxed);
+        return true;
+    }
+
+    // consumer side. Returns the number of bytes copied, 0 on timeout or once closed.
+    // skipped_bytes is set to the amount of oldest audio thrown away before this read, timing to when the newest
+    // audio block completed by this read was captured and queued (left alone if no block was completed).
+    size_t pop(char *out, const size_t max_bytes, const std::int64_t timeout_us, size_t *skipped_bytes = nullptr,
+               AudioTiming *timing = nullptr) {
+        size_t skipped = 0;
+        if (limit_bytes) {
+            const size_t depth = ring.size();
+            if (depth > limit_bytes) {
+                // keep sample alignment
+                const size_t over = (depth - limit_bytes + AUDIO_BYTES_PER_SAMPLE - 1) / AUDIO_BYTES_PER_SAMPLE * AUDIO_BYTES_PER_SAMPLE;
+                skipped = ring.skip(over);
+                count_drop(skipped, true);
+            }
+        }
+        if (skipped_bytes)
+            *skipped_bytes = skipped;
+
+        const size_t read = ring.read(out, max_bytes, timeout_us);
+        pop_end_pos += skipped + read;
+        consume_markers(timing);
+        return read;
+    }
+
+    size_t size() const {
+        return ring.size();
+    }
+
+    // producer side, ends the audio: the consumer gets what's queued, then pop() returns 0 right away
+    void finish() {
+        ring.finish();
+    }
+
+    // true once finished and everything queued was taken
+    bool is_drained() const {
+        return ring.is_finished() && !ring.size();
+    }
+
+    void close() {
+        ring.close();
+    }
+
+    audio_queue_drop_policy get_policy() const {
+        return policy;
+    }
+
+    AudioQueueStats stats() const {
+        AudioQueueStats stats;
+        stats.dropped_bytes = dropped_bytes.load(std::memory_order_relaxed);
+        stats.drop_events = drop_events.load(std::memory_order_relaxed);
+        stats.dropped_silent_bytes = dropped_silent_bytes.load(std::memory_order_relaxed);
+        stats.peak_depth_bytes = peak_depth_bytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_AUDIOQUEUE_H
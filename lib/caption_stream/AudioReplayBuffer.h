@@ -0,0 +1,158 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_AUDIOREPLAYBUFFER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_AUDIOREPLAYBUFFER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "AudioRingBuffer.h"
+
+// every chunk written needs one of these, OBS hands over roughly 10ms blocks
+#define AUDIO_REPLAY_MIN_CHUNK_MS 5
+
+/*
+ Keeps the last capacity_ms of audio written to it, with the capture time of every written chunk, so it can be
+ read again from any position still held. Preallocated, write() never allocates.
+
+ Not thread safe, meant to be used from the audio thread only. Positions are total byte counts since construction.
+ */
+class AudioReplayBuffer {
+    struct ChunkMark {
+        uint64_t start_pos;
+        std::chrono::steady_clock::time_point captured_at;
+    };
+
+    std::vector<char> buffer;
+    std::vector<ChunkMark> marks;
+    uint64_t write_pos = 0;
+    uint64_t mark_count = 0;
+
+    uint64_t oldest_mark() const {
+        return mark_count > marks.size() ? mark_count - marks.size() : 0;
+    }
+
+    const ChunkMark &mark(const uint64_t index) const {
+        return marks[index % marks.size()];
+    }
+
+    // newest mark starting at or before pos, oldest_mark() if none
+    uint64_t mark_containing(const uint64_t pos) const {
+        uint64_t low = oldest_mark(), high = mark_count;
+        while (high - low > 1) {
+            const uint64_t middle = low + (high - low) / 2;
+            if (mark(middle).start_pos <= pos)
+                low = middle;
+            else
+                high = middle;
+        }
+        return low;
+    }
+
+public:
+    explicit AudioReplayBuffer(const uint32_t capacity_ms) :
+            buffer(audio_ms_to_bytes(capacity_ms)),
+            marks(capacity_ms / AUDIO_REPLAY_MIN_CHUNK_MS + 1) {
+    }
+
+    AudioReplayBuffer(const AudioReplayBuffer &) = delete;
+
+    AudioReplayBuffer &operator=(const AudioReplayBuffer &) = delete;
+
+    bool is_enabled() const {
+        return !buffer.empty();
+    }
+
+    void write(const char *data, size_t bytes, const std::chrono::steady_clock::time_point captured_at) {
+        if (!is_enabled() || !bytes)
+            return;
+
+        // only the newest part fits, it starts later than the chunk did
+        if (bytes > buffer.size()) {
+            write_pos += bytes - buffer.size();
+            data += bytes - buffer.size();
+            bytes = buffer.size();
+        }
+
+        marks[mark_count % marks.size()] = {write_pos, captured_at};
+        mark_count++;
+
+        const size_t start = (size_t) (write_pos % buffer.size());
+        const size_t first_part = std::min(bytes, buffer.size() - start);
+        memcpy(&buffer[start], data, first_part);
+        if (first_part < bytes)
+            memcpy(&buffer[0], data + first_part, bytes - first_part);
+        write_pos += bytes;
+    }
+
+    uint64_t end_pos() const {
+        return write_pos;
+    }
+
+    // oldest position that can still be read
+    uint64_t start_pos() const {
+        if (!mark_count)
+            return write_pos;
+
+        const uint64_t ring_start = write_pos > buffer.size() ? write_pos - buffer.size() : 0;
+        return std::max(ring_start, mark(oldest_mark()).start_pos);
+    }
+
+    // start of the oldest chunk captured after the given time, end_pos() if there is none
+    uint64_t position_after(const std::chrono::steady_clock::time_point captured_at) const {
+        uint64_t low = oldest_mark(), high = mark_count;
+        while (low < high) {
+            const uint64_t middle = low + (high - low) / 2;
+            if (mark(middle).captured_at <= captured_at)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low == mark_count)
+            return write_pos;
+
+        return std::max(mark(low).start_pos, start_pos());
+    }
+
+    // copies audio from pos up to the end of the chunk it's in, at most max_bytes, and moves pos past it.
+    // A pos that was overwritten already moves up to start_pos() first. Returns 0 once pos reached end_pos().
+    size_t read(uint64_t &pos, char *out, const size_t max_bytes, std::chrono::steady_clock::time_point *captured_at) const {
+        pos = std::max(pos, start_pos());
+        if (pos >= write_pos || !max_bytes)
+            return 0;
+
+        const uint64_t index = mark_containing(pos);
+        const uint64_t chunk_end = index + 1 < mark_count ? mark(index + 1).start_pos : write_pos;
+        const size_t bytes = (size_t) std::min((uint64_t) max_bytes, chunk_end - pos);
+        if (captured_at)
+            *captured_at = mark(index).captured_at;
+
+        const size_t start = (size_t) (pos % buffer.size());
+        const size_t first_part = std::min(bytes, buffer.size() - start);
+        memcpy(out, &buffer[start], first_part);
+        if (first_part < bytes)
+            memcpy(out + first_part, &buffer[0], bytes - first_part);
+
+        pos += bytes;
+        return bytes;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_AUDIOREPLAYBUFFER_H
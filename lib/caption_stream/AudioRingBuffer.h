@@ -0,0 +1,183 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_AUDIORINGBUFFER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_AUDIORINGBUFFER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <vector>
+#include "thirdparty/cameron314/blockingconcurrentqueue.h"
+
+// all audio handed to the speech APIs is 16kHz mono 16 bit LINEAR16
+#define AUDIO_SAMPLE_RATE 16000
+#define AUDIO_BYTES_PER_SAMPLE 2
+#define AUDIO_BYTES_PER_MS (AUDIO_SAMPLE_RATE * AUDIO_BYTES_PER_SAMPLE / 1000)
+
+typedef std::function<void(const char *data, const size_t size)> audio_frame_callback;
+
+static inline size_t audio_ms_to_bytes(const uint32_t ms) {
+    return (size_t) ms * AUDIO_BYTES_PER_MS;
+}
+
+static inline uint32_t audio_bytes_to_ms(const size_t bytes) {
+    return (uint32_t) (bytes / AUDIO_BYTES_PER_MS);
+}
+
+/*
+ Preallocated single producer/single consumer byte ring for passing raw audio from the OBS audio thread
+ to a stream's upload thread without any allocations after construction.
+
+ write() must only ever be called from one thread and read() only from one other thread.
+ read() can block with a timeout, write() never blocks and only touches the semaphore (no syscall unless
+ the reader is actually sleeping).
+ */
+class AudioRingBuffer {
+    std::vector<char> buffer;
+    const size_t capacity;
+
+    // monotonically increasing byte positions, index into buffer is pos % capacity
+    std::atomic<uint64_t> write_pos;
+    std::atomic<uint64_t> read_pos;
+
+    std::atomic<bool> closed;
+    std::atomic<bool> finished;
+    moodycamel::details::mpmc_sema::LightweightSemaphore data_signal;
+
+public:
+    explicit AudioRingBuffer(const size_t capacity_bytes) :
+            buffer(capacity_bytes ? capacity_bytes : 1),
+            capacity(capacity_bytes ? capacity_bytes : 1),
+            write_pos(0),
+            read_pos(0),
+            closed(false),
+            finished(false) {
+    }
+
+    AudioRingBuffer(const AudioRingBuffer &) = delete;
+
+    AudioRingBuffer &operator=(const AudioRingBuffer &) = delete;
+
+    size_t get_capacity() const {
+        return capacity;
+    }
+
+    size_t size() const {
+        return (size_t) (write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_acquire));
+    }
+
+    size_t free_space() const {
+        return capacity - size();
+    }
+
+    bool is_closed() const {
+        return closed.load(std::memory_order_acquire);
+    }
+
+    bool is_finished() const {
+        return finished.load(std::memory_order_acquire);
+    }
+
+    // producer side. Either writes all bytes or nothing if there isn't enough room.
+    bool write(const char *data, const size_t bytes) {
+        if (!bytes || is_closed() || is_finished())
+            return false;
+
+        const uint64_t w = write_pos.load(std::memory_order_relaxed);
+        const uint64_t r = read_pos.load(std::memory_order_acquire);
+        if (capacity - (size_t) (w - r) < bytes)
+            return false;
+
+        const size_t start = (size_t) (w % capacity);
+        const size_t first_part = std::min(bytes, capacity - start);
+        memcpy(&buffer[start], data, first_part);
+        if (first_part < bytes)
+            memcpy(&buffer[0], data + first_part, bytes - first_part);
+
+        write_pos.store(w + bytes, std::memory_order_release);
+        data_signal.signal();
+        return true;
+    }
+
+    // consumer side. Copies up to max_bytes of whatever is buffered, waiting up to timeout_us for
+    // anything to arrive. Returns 0 on timeout, once closed or right away once finished and empty.
+    size_t read(char *out, const size_t max_bytes, const std::int64_t timeout_us) {
+        if (!max_bytes)
+            return 0;
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_us);
+        while (true) {
+            // drop stale signals first so a write racing with the size check below can't get lost
+            data_signal.tryWaitMany(std::numeric_limits<moodycamel::details::mpmc_sema::LightweightSemaphore::ssize_t>::max());
+
+            if (is_closed())
+                return 0;
+
+            // checked before the size so everything written before finish() is seen
+            const bool no_more = is_finished();
+            const size_t available = size();
+            if (available)
+                return consume(out, std::min(available, max_bytes));
+            if (no_more)
+                return 0;
+
+            const auto left_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+            if (left_us <= 0 || !data_signal.wait(left_us))
+                return 0;
+        }
+    }
+
+    // consumer side. Throws away up to the given number of oldest bytes without copying them.
+    size_t skip(const size_t bytes) {
+        const size_t skipped = std::min(bytes, size());
+        read_pos.fetch_add(skipped, std::memory_order_release);
+        return skipped;
+    }
+
+    // producer side, no more writes. Reads still return what's buffered, then 0 without waiting
+    void finish() {
+        finished.store(true, std::memory_order_release);
+        data_signal.signal();
+    }
+
+    // wakes up a blocked reader and makes all further reads and writes fail
+    void close() {
+        closed.store(true, std::memory_order_release);
+        data_signal.signal();
+    }
+
+private:
+    size_t consume(char *out, const size_t bytes) {
+        const uint64_t r = read_pos.load(std::memory_order_relaxed);
+        const size_t start = (size_t) (r % capacity);
+        const size_t first_part = std::min(bytes, capacity - start);
+        memcpy(out, &buffer[start], first_part);
+        if (first_part < bytes)
+            memcpy(out + first_part, &buffer[0], bytes - first_part);
+
+        read_pos.store(r + bytes, std::memory_order_release);
+        return bytes;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_AUDIORINGBUFFER_H
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef OBS_GOOGLE_CAPTION_PLUGIN_CAPTIONRESULT_H
 #define OBS_GOOGLE_CAPTION_PLUGIN_CAPTIONRESULT_H
 
+#include "CaptionTrace.h"
 
 using namespace std;
 
@@ -29,6 +30,7 @@ struct CaptionResult {
     string raw_message;
 
     std::chrono::steady_clock::time_point created_at;
+    CaptionTrace trace;
 
     CaptionResult(){};
 
@@ -43,8 +45,15 @@ struct CaptionResult {
             final(final),
             stability(stability),
             caption_text(caption_text),
-            raw_message(raw_message),
-            created_at(std::chrono::steady_clock::now()) {
+            raw_message(raw_message) {
+        mark_received();
+    }
+
+    // for results that get reused for every message
+    void mark_received() {
+        created_at = std::chrono::steady_clock::now();
+        trace = CaptionTrace();
+        trace.set(CAPTION_TRACE_RECEIVED, created_at);
     }
 };
 
@@ -0,0 +1,256 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_CAPTIONTRACE_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_CAPTIONTRACE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+typedef unsigned int uint;
+
+enum caption_trace_stage {
+    CAPTION_TRACE_STREAM_START = 0, // API stream the result came from was started
+    CAPTION_TRACE_CAPTURE, // newest audio sent before the result was captured by OBS
+    CAPTION_TRACE_ENQUEUE, // ...and queued for upload
+    CAPTION_TRACE_SEND, // ...and sent
+    CAPTION_TRACE_RECEIVED, // result parsed from the API response
+    CAPTION_TRACE_DISPATCH, // result handled on the Qt thread
+    CAPTION_TRACE_FORMATTED, // caption lines built
+    CAPTION_TRACE_WRITER_DEQUEUE, // output writer picked the caption up
+    CAPTION_TRACE_OUTPUT, // caption handed to the OBS output
+
+    CAPTION_TRACE_STAGE_COUNT
+};
+
+/*
+ Monotonic timestamps of one caption result passing through the pipeline. The API doesn't say which audio a result
+ belongs to so the audio stages are the ones of the newest audio sent before the result arrived, which makes
+ capture -> received the latency of the result's most recent words.
+ */
+struct CaptionTrace {
+    std::chrono::steady_clock::time_point at[CAPTION_TRACE_STAGE_COUNT];
+    bool first_of_stream = false; // stream start -> received is the time to first result
+
+    void mark(const caption_trace_stage stage) {
+        at[stage] = std::chrono::steady_clock::now();
+    }
+
+    void set(const caption_trace_stage stage, const std::chrono::steady_clock::time_point time) {
+        at[stage] = time;
+    }
+
+    bool has(const caption_trace_stage stage) const {
+        return at[stage].time_since_epoch().count() != 0;
+    }
+
+    // negative if either stage is missing
+    double ms_between(const caption_trace_stage from, const caption_trace_stage to) const {
+        if (!has(from) || !has(to))
+            return -1;
+
+        return std::chrono::duration<double, std::milli>(at[to] - at[from]).count();
+    }
+};
+
+#define LATENCY_HISTOGRAM_BUCKETS 128
+// bucket i (> 0) holds values up to LATENCY_HISTOGRAM_GROWTH^i ms, ~5% resolution, last bucket ~190 s
+#define LATENCY_HISTOGRAM_GROWTH 1.1
+
+// fixed size log scale histogram, no allocations
+class LatencyHistogram {
+    uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS] = {};
+    uint64_t count = 0;
+    double max_ms = 0;
+
+    static double bucket_upper_ms(const int bucket) {
+        return std::pow(LATENCY_HISTOGRAM_GROWTH, bucket);
+    }
+
+public:
+    void add(const double ms) {
+        int bucket = 0;
+        if (ms > 1.0) {
+            bucket = (int) std::ceil(std::log(ms) / std::log(LATENCY_HISTOGRAM_GROWTH));
+            if (bucket >= LATENCY_HISTOGRAM_BUCKETS)
+                bucket = LATENCY_HISTOGRAM_BUCKETS - 1;
+        }
+        buckets[bucket]++;
+        count++;
+        if (ms > max_ms)
+            max_ms = ms;
+    }
+
+    uint64_t get_count() const {
+        return count;
+    }
+
+    double get_max_ms() const {
+        return max_ms;
+    }
+
+    // value below which the given fraction of samples fall, 0 if empty
+    double percentile_ms(const double fraction) const {
+        if (!count)
+            return 0;
+
+        const uint64_t wanted = (uint64_t) std::ceil(fraction * count);
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= wanted && seen)
+                return std::min(bucket_upper_ms(i), max_ms);
+        }
+        return max_ms;
+    }
+
+    void clear() {
+        *this = LatencyHistogram();
+    }
+};
+
+enum caption_latency_metric {
+    CAPTION_LATENCY_PIPELINE = 0, // capture -> enqueue
+    CAPTION_LATENCY_QUEUE, // enqueue -> send
+    CAPTION_LATENCY_API, // send -> received
+    CAPTION_LATENCY_DISPATCH, // received -> dispatch
+    CAPTION_LATENCY_FORMAT, // dispatch -> formatted
+    CAPTION_LATENCY_WRITER_QUEUE, // formatted -> writer dequeue
+    CAPTION_LATENCY_WRITER_OUTPUT, // writer dequeue -> output
+    CAPTION_LATENCY_CAPTION, // capture -> formatted, what the dock shows
+    CAPTION_LATENCY_END_TO_END, // capture -> output
+    CAPTION_LATENCY_FIRST_RESULT, // stream start -> first result received, connection setup cost
+
+    CAPTION_LATENCY_METRIC_COUNT
+};
+
+static const char *caption_latency_metric_name(const caption_latency_metric metric) {
+    switch (metric) {
+        case CAPTION_LATENCY_PIPELINE:
+            return "capture->enqueue";
+        case CAPTION_LATENCY_QUEUE:
+            return "enqueue->send";
+        case CAPTION_LATENCY_API:
+            return "send->received";
+        case CAPTION_LATENCY_DISPATCH:
+            return "received->dispatch";
+        case CAPTION_LATENCY_FORMAT:
+            return "dispatch->formatted";
+        case CAPTION_LATENCY_WRITER_QUEUE:
+            return "formatted->writer";
+        case CAPTION_LATENCY_WRITER_OUTPUT:
+            return "writer->output";
+        case CAPTION_LATENCY_CAPTION:
+            return "capture->caption";
+        case CAPTION_LATENCY_END_TO_END:
+            return "capture->output";
+        case CAPTION_LATENCY_FIRST_RESULT:
+            return "start->first result";
+        default:
+            return "?";
+    }
+}
+
+/*
+ Per session latency histograms, thread safe. Results are recorded once formatted, outputs once written out
+ (per output writer).
+ */
+class CaptionLatencyStats {
+    std::mutex mutex;
+    LatencyHistogram histograms[CAPTION_LATENCY_METRIC_COUNT];
+
+    void add(const caption_latency_metric metric, const CaptionTrace &trace,
+             const caption_trace_stage from, const caption_trace_stage to) {
+        const double ms = trace.ms_between(from, to);
+        if (ms >= 0)
+            histograms[metric].add(ms);
+    }
+
+public:
+    void record_result(const CaptionTrace &trace) {
+        std::lock_guard<std::mutex> lock(mutex);
+        add(CAPTION_LATENCY_PIPELINE, trace, CAPTION_TRACE_CAPTURE, CAPTION_TRACE_ENQUEUE);
+        add(CAPTION_LATENCY_QUEUE, trace, CAPTION_TRACE_ENQUEUE, CAPTION_TRACE_SEND);
+        add(CAPTION_LATENCY_API, trace, CAPTION_TRACE_SEND, CAPTION_TRACE_RECEIVED);
+        add(CAPTION_LATENCY_DISPATCH, trace, CAPTION_TRACE_RECEIVED, CAPTION_TRACE_DISPATCH);
+        add(CAPTION_LATENCY_FORMAT, trace, CAPTION_TRACE_DISPATCH, CAPTION_TRACE_FORMATTED);
+        add(CAPTION_LATENCY_CAPTION, trace, CAPTION_TRACE_CAPTURE, CAPTION_TRACE_FORMATTED);
+        if (trace.first_of_stream)
+            add(CAPTION_LATENCY_FIRST_RESULT, trace, CAPTION_TRACE_STREAM_START, CAPTION_TRACE_RECEIVED);
+    }
+
+    void record_output(const CaptionTrace &trace) {
+        std::lock_guard<std::mutex> lock(mutex);
+        add(CAPTION_LATENCY_WRITER_QUEUE, trace, CAPTION_TRACE_FORMATTED, CAPTION_TRACE_WRITER_DEQUEUE);
+        add(CAPTION_LATENCY_WRITER_OUTPUT, trace, CAPTION_TRACE_WRITER_DEQUEUE, CAPTION_TRACE_OUTPUT);
+        add(CAPTION_LATENCY_END_TO_END, trace, CAPTION_TRACE_CAPTURE, CAPTION_TRACE_OUTPUT);
+    }
+
+    LatencyHistogram get(const caption_latency_metric metric) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return histograms[metric];
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &histogram : histograms)
+            histogram.clear();
+    }
+
+    // one line, end to end if anything was output yet, otherwise up to the caption
+    std::string short_summary() {
+        std::lock_guard<std::mutex> lock(mutex);
+        caption_latency_metric metric = CAPTION_LATENCY_END_TO_END;
+        if (!histograms[metric].get_count())
+            metric = CAPTION_LATENCY_CAPTION;
+
+        const LatencyHistogram &histogram = histograms[metric];
+        if (!histogram.get_count())
+            return "";
+
+        char line[128];
+        snprintf(line, sizeof(line), "latency p50 %.0f / p95 %.0f / p99 %.0f ms",
+                 histogram.percentile_ms(0.5), histogram.percentile_ms(0.95), histogram.percentile_ms(0.99));
+        return line;
+    }
+
+    // one line per metric
+    std::string summary(const char *line_prefix = "") {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string out;
+        for (int i = 0; i < CAPTION_LATENCY_METRIC_COUNT; i++) {
+            const LatencyHistogram &histogram = histograms[i];
+            if (!histogram.get_count())
+                continue;
+
+            char line[192];
+            snprintf(line, sizeof(line), "%s%-20s n %6llu  p50 %7.1f  p95 %7.1f  p99 %7.1f  max %7.1f ms\n",
+                     line_prefix, caption_latency_metric_name((caption_latency_metric) i),
+                     (unsigned long long) histogram.get_count(), histogram.percentile_ms(0.5),
+                     histogram.percentile_ms(0.95), histogram.percentile_ms(0.99), histogram.get_max_ms());
+            out.append(line);
+        }
+        return out;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_CAPTIONTRACE_H
@@ -15,83 +15,329 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 ******************************************************************************/
 
+#include <algorithm>
 #include <utility>
 
 #include "ContinuousCaptions.h"
 #include "log.h"
 
+// replayed audio is queued in blocks of up to this
+#define REPLAY_CHUNK_MS 100
+
+// the prepared stream gets at least this much audio after being ready before it's switched to
+#define SWITCHOVER_MIN_OVERLAP_MS 1000
+// silence this long counts as a pause to switch streams at
+#define SWITCHOVER_PAUSE_MS 300
+// final results of the prepared stream kept for stitching at most, it only runs for the overlap
+#define PREPARED_RESULTS_MAX 32
+// how long a stream switched away from gets to deliver the final result of its last utterance
+#define STREAM_DRAIN_TIMEOUT_MS 3000
+
 ContinuousCaptions::ContinuousCaptions(
         ContinuousCaptionStreamSettings settings
 ) :
         current_stream(nullptr),
         prepared_stream(nullptr),
         settings(settings),
-        interrupted(false) {
-
+        interrupted(false),
+        replay_buffer(settings.replay_buffer_secs * 1000),
+        replay_chunk(audio_ms_to_bytes(REPLAY_CHUNK_MS)),
+        acked_captured_at(0),
+        last_final_at(0),
+        reconnect_policy(settings.reconnect) {
+
+    starter_thread = std::thread(&ContinuousCaptions::starter_run, this);
 }
 
 
-bool ContinuousCaptions::queue_audio_data(const char *data, const uint data_size) {
+bool ContinuousCaptions::queue_audio_data(const char *data, const uint data_size,
+                                          const std::chrono::steady_clock::time_point captured_at) {
     if (!data_size)
         return false;
 
-    if (!current_stream) {
-        debug_log("first time, no current stream, cycling");
-        cycle_streams();
+    // also while no stream is taking audio so it can be replayed once one is
+    replay_buffer.write(data, data_size, captured_at);
+
+    if (audio_block_is_silent(data, data_size, AUDIO_QUEUE_SILENCE_PEAK))
+        silent_ms += audio_bytes_to_ms(data_size);
+    else
+        silent_ms = 0;
+
+    collect_started();
+
+    if (current_stream && current_stream->is_stopped()) {
+        report_stream_end(*current_stream, current_started_at);
+        if (prepared_stream && !prepared_stream->is_stopped()) {
+            // it got the same audio as the dead one already
+            debug_log("current stream dead, switching to prepared stream");
+            cycle_streams({prepared_stream, prepared_started_at, prepared_stream_id}, true);
+        } else {
+            debug_log("current stream dead, reconnecting");
+            current_stream->stop();
+            current_stream = nullptr;
+            replaying = false;
+        }
     }
 
     if (!current_stream) {
-        error_log("WTF, NO UPSTREAM?????????????");
+        // never started here, the audio waits in the replay buffer meanwhile
+        request_stream(STREAM_CURRENT);
         return false;
     }
 
-    double secs_since_start = std::chrono::duration_cast<std::chrono::duration<double >>(
+    const double secs_since_start = std::chrono::duration_cast<std::chrono::duration<double >>(
             std::chrono::steady_clock::now() - current_started_at).count();
 
-    if (current_stream->is_stopped()) {
-        if (settings.minimum_reconnect_interval_secs && secs_since_start < settings.minimum_reconnect_interval_secs) {
-//            debug_log("current stream dead, not reconnecting yet, too soon, %f %u",
-//                      secs_since_start, settings.minimum_reconnect_interval_secs);
-            return false;
-        }
-        debug_log("current stream dead, cycling, %f", secs_since_start);
-        cycle_streams();
+    if (!startup_sampled && current_stream->ready_after_ms()) {
+        const uint ready_ms = current_stream->ready_after_ms();
+        startup_estimate_ms = startup_estimate_ms ? (startup_estimate_ms * 3 + ready_ms) / 4 : ready_ms;
+        startup_sampled = true;
 
+        std::lock_guard<std::mutex> lock(starter_mutex);
+        reconnect_policy.on_ready();
     }
 
+    if (prepared_stream && prepared_stream->is_stopped()) {
+        debug_log("prepared stream dead");
+        report_stream_end(*prepared_stream, prepared_started_at);
+        clear_prepared();
+    }
+
+    const double connect_secs = prepared_connect_secs();
     if (settings.switchover_second_after_secs && secs_since_start > settings.switchover_second_after_secs) {
         if (prepared_stream) {
-            if (prepared_stream->is_stopped()) {
-                debug_log("trying to switch to prepared stream but dead, recreating");
-                clear_prepared();
-                start_prepared();
+            const char *reason = switchover_reason(secs_since_start);
+            if (reason) {
+                info_log("switching over to prepared stream at %.1f s, %s, ready after %u ms, overlap %.1f s",
+                         secs_since_start, reason, prepared_stream->ready_after_ms(),
+                         std::chrono::duration_cast<std::chrono::duration<double >>(
+                                 std::chrono::steady_clock::now() - prepared_started_at).count());
+                cycle_streams({prepared_stream, prepared_started_at, prepared_stream_id}, true);
             } else {
-                debug_log("switching over to prepared stream, %f > %u", secs_since_start, settings.switchover_second_after_secs);
-                cycle_streams();
+                prepared_stream->queue_audio_data(data, data_size, captured_at);
             }
+        } else if (connect_secs) {
+            request_stream(STREAM_PREPARED);
         }
-    } else if (settings.connect_second_after_secs && secs_since_start > settings.connect_second_after_secs) {
-        if (!prepared_stream || prepared_stream->is_stopped()) {
-            debug_log("starting second stream %f", secs_since_start);
-            start_prepared();
+    } else if (connect_secs && secs_since_start > connect_secs) {
+        if (!prepared_stream) {
+            request_stream(STREAM_PREPARED);
         } else {
 //            debug_log("double queue");
-            prepared_stream->queue_audio_data(data, data_size);
+            prepared_stream->queue_audio_data(data, data_size, captured_at);
         }
     }
+
+    if (replaying) {
+        // data is at the end of the replay buffer
+        continue_replay();
+        return true;
+    }
+
 //    debug_log("queue");
-    return current_stream->queue_audio_data(data, data_size);
+    return current_stream->queue_audio_data(data, data_size, captured_at);
+}
+
+double ContinuousCaptions::prepared_connect_secs() {
+    if (!settings.connect_second_after_secs)
+        return 0;
+
+    // never earlier than configured, later if streams are known to start quicker than that leaves time for
+    double lead_secs = (double) settings.switchover_second_after_secs - settings.connect_second_after_secs;
+    if (startup_estimate_ms)
+        lead_secs = std::min(lead_secs, (2.0 * startup_estimate_ms + SWITCHOVER_MIN_OVERLAP_MS) / 1000);
+
+    return std::max((double) settings.switchover_second_after_secs - lead_secs, 0.001);
+}
+
+const char *ContinuousCaptions::switchover_reason(const double secs_since_start) {
+    if (secs_since_start >= std::max(settings.switchover_deadline_secs, settings.switchover_second_after_secs))
+        return "deadline";
+
+    if (!prepared_stream->ready_after_ms())
+        return nullptr;
+
+    typedef std::chrono::steady_clock::time_point time_point;
+    const time_point window_start = current_started_at + std::chrono::seconds(settings.switchover_second_after_secs);
+    if (time_point(time_point::duration(last_final_at.load(std::memory_order_relaxed))) >= window_start)
+        return "after final result";
+
+    if (silent_ms >= SWITCHOVER_PAUSE_MS)
+        return "at pause";
+
+    return nullptr;
 }
 
-void ContinuousCaptions::start_prepared() {
-    debug_log("starting second prepared connection");
-    clear_prepared();
-    prepared_stream = std::make_shared<CaptionStream>(settings.stream_settings);
-    if (!prepared_stream->start(prepared_stream)) {
-        error_log("FAILED starting prepared connection");
+void ContinuousCaptions::start_replay() {
+    if (!replay_buffer.is_enabled())
+        return;
+
+    typedef std::chrono::steady_clock::time_point time_point;
+    const time_point acked_at = time_point(time_point::duration(acked_captured_at.load(std::memory_order_relaxed)));
+
+    replay_pos = replay_start_pos = replay_buffer.position_after(acked_at);
+    replay_started_at = std::chrono::steady_clock::now();
+    replaying = replay_pos < replay_buffer.end_pos();
+    if (replaying)
+        info_log("replaying %u ms of unacknowledged audio into the new stream",
+                 audio_bytes_to_ms((size_t) (replay_buffer.end_pos() - replay_pos)));
+}
+
+void ContinuousCaptions::continue_replay() {
+    // leave room so the queue never drops any of it, the upload drains it as fast as the connection allows
+    const uint max_queued_ms = settings.stream_settings.max_queue_depth_ms / 2;
+
+    if (replay_pos < replay_buffer.start_pos()) {
+        error_log("replay fell behind the replay buffer, skipping %u ms",
+                  audio_bytes_to_ms((size_t) (replay_buffer.start_pos() - replay_pos)));
+        replay_pos = replay_buffer.start_pos();
+    }
+
+    while (!max_queued_ms || current_stream->queued_audio_ms() < max_queued_ms) {
+        std::chrono::steady_clock::time_point captured_at;
+        const size_t read = replay_buffer.read(replay_pos, &replay_chunk[0], replay_chunk.size(), &captured_at);
+        if (!read) {
+            info_log("replay caught up with live audio, %u ms of audio in %lld ms",
+                     audio_bytes_to_ms((size_t) (replay_pos - replay_start_pos)),
+                     (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+                             std::chrono::steady_clock::now() - replay_started_at).count());
+            replaying = false;
+            return;
+        }
+
+        if (!current_stream->queue_audio_data(&replay_chunk[0], (uint) read, captured_at))
+            return; // stopped, the next call cycles and starts over from what got acknowledged
+    }
+}
+
+uint ContinuousCaptions::current_rtt_ms() {
+    if (!current_stream)
+        return 0;
+
+    return current_stream->rtt_ms();
+}
+
+void ContinuousCaptions::request_stream(const stream_role role) {
+    {
+        // next time if the starter thread has it, never waits on the audio thread
+        std::unique_lock<std::mutex> lock(starter_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || stream_wanted[role] || started[role].stream)
+            return;
+
+        stream_wanted[role] = true;
+    }
+
+    if (role == STREAM_PREPARED)
+        debug_log("requesting second stream, expecting it ready in %u ms", startup_estimate_ms);
+    else
+        debug_log("requesting new stream");
+    starter_signal.notify_one();
+}
+
+void ContinuousCaptions::collect_started() {
+    StartedStream streams[2];
+    {
+        std::unique_lock<std::mutex> lock(starter_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || (!started[STREAM_CURRENT].stream && !started[STREAM_PREPARED].stream))
+            return;
+
+        for (int role = 0; role < 2; role++) {
+            streams[role] = std::move(started[role]);
+            started[role] = StartedStream();
+        }
     }
 
-    prepared_started_at = std::chrono::steady_clock::now();
+    // whatever is missing by now, the prepared stream might have taken over a dead current one meanwhile
+    for (auto &started_stream : streams) {
+        if (!started_stream.stream)
+            continue;
+
+        if (!current_stream) {
+            debug_log("got new stream");
+            // continues where the dead one left off, unless it's the first one
+            cycle_streams(started_stream, had_stream && replay_buffer.is_enabled());
+            start_replay();
+        } else if (!prepared_stream) {
+            debug_log("got prepared stream");
+            prepared_stream = started_stream.stream;
+            prepared_started_at = started_stream.started_at;
+
+            std::lock_guard<recursive_mutex> lock(on_caption_cb_handle.mutex);
+            prepared_stream_id = started_stream.id;
+            prepared_results.clear();
+        } else {
+            started_stream.stream->stop();
+        }
+    }
+}
+
+void ContinuousCaptions::report_stream_end(CaptionStream &stream, const std::chrono::steady_clock::time_point started_at) {
+    const auto now = std::chrono::steady_clock::now();
+    const double ran_secs = std::chrono::duration_cast<std::chrono::duration<double >>(now - started_at).count();
+    const bool clean_close = stream.ended_cleanly();
+    const bool stable = stream.ready_after_ms() && ran_secs >= settings.minimum_reconnect_interval_secs;
+
+    uint delay_ms;
+    ReconnectStatus status;
+    {
+        std::lock_guard<std::mutex> lock(starter_mutex);
+        delay_ms = reconnect_policy.on_stream_end(now, clean_close, stable);
+        status = reconnect_policy.status(now);
+    }
+    starter_signal.notify_one();
+
+    if (clean_close)
+        info_log("stream closed by the server after %.1f s, reconnecting right away", ran_secs);
+    else
+        info_log("stream failed after %.1f s%s, %s, next attempt in %u ms, %u failures in a row",
+                 ran_secs, stream.ready_after_ms() ? "" : " without getting ready", reconnect_state_name(status.state),
+                 delay_ms, status.failures);
+}
+
+void ContinuousCaptions::starter_run() {
+    debug_log("stream starter thread starting");
+    CaptionStream::prewarm(settings.stream_settings);
+
+    std::unique_lock<std::mutex> lock(starter_mutex);
+    while (!starter_stopping) {
+        const stream_role role = stream_wanted[STREAM_CURRENT] ? STREAM_CURRENT : STREAM_PREPARED;
+        if (!stream_wanted[role]) {
+            starter_signal.wait(lock);
+            continue;
+        }
+
+        if (!reconnect_policy.may_attempt(std::chrono::steady_clock::now())) {
+            starter_signal.wait_until(lock, reconnect_policy.get_next_attempt_at());
+            continue;
+        }
+
+        reconnect_policy.on_attempt();
+        const uint64_t stream_id = ++last_stream_id;
+        lock.unlock();
+
+        auto stream = std::make_shared<CaptionStream>(settings.stream_settings);
+        stream->on_caption_cb_handle.set(stream_callback(stream_id));
+        if (!stream->start(stream))
+            error_log("FAILED starting new connection");
+        const auto started_at = std::chrono::steady_clock::now();
+
+        lock.lock();
+        if (starter_stopping) {
+            stream->stop();
+            break;
+        }
+
+        started[role].stream = stream;
+        started[role].started_at = started_at;
+        started[role].id = stream_id;
+        stream_wanted[role] = false;
+    }
+    debug_log("stream starter thread done");
+}
+
+ReconnectStatus ContinuousCaptions::reconnect_status() {
+    std::lock_guard<std::mutex> lock(starter_mutex);
+    return reconnect_policy.status(std::chrono::steady_clock::now());
 }
 
 void ContinuousCaptions::clear_prepared() {
@@ -101,49 +347,116 @@ void ContinuousCaptions::clear_prepared() {
     debug_log("clearing prepared connection");
     prepared_stream->stop();
     prepared_stream = nullptr;
+
+    std::lock_guard<recursive_mutex> lock(on_caption_cb_handle.mutex);
+    prepared_stream_id = 0;
+    prepared_results.clear();
 }
 
-void ContinuousCaptions::cycle_streams() {
+void ContinuousCaptions::cycle_streams(const StartedStream &next, const bool stitch) {
     debug_log("cycling streams");
 
+    if (retiring_stream) {
+        retiring_stream->stop();
+        retiring_stream = nullptr;
+    }
+
     if (current_stream) {
-        current_stream->stop();
+        if (stitch && !current_stream->is_stopped()) {
+            // its last utterance is still coming, the replacement only got part of that audio
+            current_stream->drain(STREAM_DRAIN_TIMEOUT_MS);
+            retiring_stream = current_stream;
+        } else {
+            current_stream->stop();
+        }
         current_stream = nullptr;
     }
 
-    if (prepared_stream && prepared_stream->is_stopped()) {
+    if (prepared_stream && prepared_stream != next.stream)
         prepared_stream->stop();
-        prepared_stream = nullptr;
-    }
+    prepared_stream = nullptr;
 
-    caption_text_callback cb = std::bind(&ContinuousCaptions::on_caption_text_cb, this, std::placeholders::_1);
+    current_stream = next.stream;
+    current_started_at = next.started_at;
+    had_stream = true;
+    replaying = false;
+    startup_sampled = false;
+    last_final_at = 0;
+
+    std::lock_guard<recursive_mutex> lock(on_caption_cb_handle.mutex);
+    retiring_stream_id = retiring_stream ? current_stream_id : 0;
+    current_stream_id = next.id;
+    prepared_stream_id = 0;
+    interrupted = !stitch;
+    if (stitch)
+        stitcher.begin();
+    else
+        stitcher.reset();
+
+    // what the prepared stream recognized during the overlap
+    for (const auto &result : prepared_results)
+        emit_result(result);
+    prepared_results.clear();
+}
 
-    if (prepared_stream) {
-        debug_log("cycling streams, using prepared connection");
-        current_stream = prepared_stream;
-        current_started_at = prepared_started_at;
-        current_stream->on_caption_cb_handle.set(cb);
-    } else {
-        debug_log("cycling streams, creating new connection");
-        current_stream = std::make_shared<CaptionStream>(settings.stream_settings);
-        current_stream->on_caption_cb_handle.set(cb);
-        if (!current_stream->start(current_stream))
-            error_log("FAILED starting new connection");
-        current_started_at = std::chrono::steady_clock::now();
-    }
-    prepared_stream = nullptr;
-    interrupted = true;
+caption_text_callback ContinuousCaptions::stream_callback(const uint64_t stream_id) {
+    return std::bind(&ContinuousCaptions::on_caption_text_cb, this, std::placeholders::_1, stream_id);
 }
 
-void ContinuousCaptions::on_caption_text_cb(const CaptionResult &caption_result) {
+void ContinuousCaptions::on_caption_text_cb(const CaptionResult &caption_result, const uint64_t stream_id) {
 //    debug_log("got caption data");
 //    debug_log("got caption data %s", data.c_str());
 
-    {
-        std::lock_guard<recursive_mutex> lock(on_caption_cb_handle.mutex);
-        if (on_caption_cb_handle.callback_fn) {
-            on_caption_cb_handle.callback_fn(caption_result, interrupted);
+    std::lock_guard<recursive_mutex> lock(on_caption_cb_handle.mutex);
+    if (stream_id == prepared_stream_id) {
+        // only the latest interim result matters, it replaces the previous one
+        if (!prepared_results.empty() && !prepared_results.back().final)
+            prepared_results.pop_back();
+        if (prepared_results.size() < PREPARED_RESULTS_MAX)
+            prepared_results.push_back(caption_result);
+        return;
+    }
+
+    if (stream_id != current_stream_id) {
+        // a retired stream, the one replacing it covers that audio except for the final result of a draining one
+        if (stream_id == retiring_stream_id && caption_result.final && stitcher.old_final(caption_result.caption_text)) {
+            ack_final(caption_result);
+            if (on_caption_cb_handle.callback_fn)
+                on_caption_cb_handle.callback_fn(caption_result, false);
         }
+        return;
+    }
+
+    if (caption_result.final) {
+        last_final_at.store(caption_result.created_at.time_since_epoch().count(), std::memory_order_relaxed);
+        ack_final(caption_result);
+    }
+
+    emit_result(caption_result);
+}
+
+void ContinuousCaptions::ack_final(const CaptionResult &caption_result) {
+    const auto captured_at = last_final_sent_captured_at;
+    last_final_sent_captured_at = caption_result.trace.at[CAPTION_TRACE_CAPTURE].time_since_epoch().count();
+    if (captured_at > acked_captured_at.load(std::memory_order_relaxed))
+        acked_captured_at.store(captured_at, std::memory_order_relaxed);
+}
+
+void ContinuousCaptions::emit_result(const CaptionResult &caption_result) {
+    if (stitcher.is_stitching()) {
+        CaptionResult stitched(caption_result);
+        if (!stitcher.stitch(caption_result.caption_text, caption_result.final, stitched.caption_text))
+            return;
+
+        if (stitched.caption_text != caption_result.caption_text)
+            debug_log("stitched '%s' into '%s'", caption_result.caption_text.c_str(), stitched.caption_text.c_str());
+
+        if (on_caption_cb_handle.callback_fn)
+            on_caption_cb_handle.callback_fn(stitched, interrupted);
+    } else {
+        stitcher.track_emitted(caption_result.caption_text, caption_result.final);
+        if (on_caption_cb_handle.callback_fn)
+            on_caption_cb_handle.callback_fn(caption_result, interrupted);
     }
 
     interrupted = false;
@@ -154,6 +467,19 @@ ContinuousCaptions::~ContinuousCaptions() {
     debug_log("~ContinuousCaptions() decons");
     on_caption_cb_handle.clear();
 
+    {
+        std::lock_guard<std::mutex> lock(starter_mutex);
+        starter_stopping = true;
+    }
+    starter_signal.notify_all();
+    if (starter_thread.joinable())
+        starter_thread.join();
+
+    for (auto &started_stream : started) {
+        if (started_stream.stream)
+            started_stream.stream->stop();
+    }
+
     if (current_stream) {
         current_stream->stop();
     }
@@ -162,5 +488,8 @@ ContinuousCaptions::~ContinuousCaptions() {
         prepared_stream->stop();
     }
 
+    if (retiring_stream) {
+        retiring_stream->stop();
+    }
 }
 
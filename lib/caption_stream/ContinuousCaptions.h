@@ -19,17 +19,35 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef CPPTESTING_CONTINUOUSCAPTIONS_H
 #define CPPTESTING_CONTINUOUSCAPTIONS_H
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <CaptionStream.h>
+#include "AudioReplayBuffer.h"
+#include "ReconnectPolicy.h"
+#include "TranscriptStitcher.h"
 
 struct ContinuousCaptionStreamSettings {
     uint connect_second_after_secs;
     uint switchover_second_after_secs;
 
+    // streams ending sooner than this after they started count as failed, making reconnects back off
     uint minimum_reconnect_interval_secs;
 
     CaptionStreamSettings stream_settings;
 
+    // last audio kept to replay into the replacement stream after one died, 0 disables
+    uint replay_buffer_secs = 10;
+
+    // from switchover_second_after_secs on the switch waits for a final result or a pause, up to this,
+    // the API ends sessions after 5 minutes
+    uint switchover_deadline_secs = 295;
+
+    ReconnectPolicySettings reconnect;
+
     ContinuousCaptionStreamSettings(
             uint connectSecondAfterSecs,
             uint switchoverSecondAfterSecs,
@@ -45,7 +63,10 @@ struct ContinuousCaptionStreamSettings {
         return connect_second_after_secs == rhs.connect_second_after_secs &&
                switchover_second_after_secs == rhs.switchover_second_after_secs &&
                minimum_reconnect_interval_secs == rhs.minimum_reconnect_interval_secs &&
-               stream_settings == rhs.stream_settings;
+               stream_settings == rhs.stream_settings &&
+               replay_buffer_secs == rhs.replay_buffer_secs &&
+               switchover_deadline_secs == rhs.switchover_deadline_secs &&
+               reconnect == rhs.reconnect;
     }
 
     bool operator!=(const ContinuousCaptionStreamSettings &rhs) const {
@@ -57,6 +78,9 @@ struct ContinuousCaptionStreamSettings {
         printf("%s  connect_second_after_secs: %d\n", line_prefix, connect_second_after_secs);
         printf("%s  switchover_second_after_secs: %d\n", line_prefix, switchover_second_after_secs);
         printf("%s  minimum_reconnect_interval_secs: %d\n", line_prefix, minimum_reconnect_interval_secs);
+        printf("%s  replay_buffer_secs: %d\n", line_prefix, replay_buffer_secs);
+        printf("%s  switchover_deadline_secs: %d\n", line_prefix, switchover_deadline_secs);
+        reconnect.print(line_prefix);
 
         stream_settings.print((string(line_prefix) + "  ").c_str());
 //        printf("%s-----------\n", line_prefix);
@@ -72,10 +96,22 @@ typedef std::function<void(const CaptionResult &caption_result, bool interrupted
 
  Minimizes impact of these regular disconnects by starting a second connection shortly before the first once
  is about to hit the limit and feeds both with the same audio for a bit before switching to the new one to avoid captioning gap.
+ The second connection is started only as early as the measured stream startup time needs, the switch itself waits
+ for the old stream's next final result or a pause in the audio so it doesn't cut into a phrase. The old stream isn't
+ cut off either, it's drained: ends its request and delivers the final result of what it heard before being closed.
+
+ When a stream dies unexpectedly instead, the audio since the last final result (kept in a replay buffer) is fed into
+ its replacement as fast as it takes it before live audio continues, so a network blip doesn't lose what was said.
+ Replacements are started by a ReconnectPolicy: right away after the server closed a stream cleanly, with growing
+ delays while they keep failing and only now and then once the API looks unreachable.
+
+ Streams are created and started on a thread of its own, the audio thread only asks for them and picks them up, so
+ it never blocks on or starts any threads for a connect.
  */
 class ContinuousCaptions {
     std::shared_ptr<CaptionStream> current_stream;
     std::shared_ptr<CaptionStream> prepared_stream;
+    std::shared_ptr<CaptionStream> retiring_stream; // switched away from, draining its last results
 
     std::chrono::steady_clock::time_point current_started_at;
     std::chrono::steady_clock::time_point prepared_started_at;
@@ -84,13 +120,100 @@ class ContinuousCaptions {
 
     bool interrupted;
 
-    void on_caption_text_cb(const CaptionResult &caption_result);
+    // audio thread only, except for acked_captured_at
+    AudioReplayBuffer replay_buffer;
+    std::vector<char> replay_chunk;
+    bool replaying = false;
+    uint64_t replay_pos = 0;
+    uint64_t replay_start_pos = 0;
+    std::chrono::steady_clock::time_point replay_started_at;
+
+    // capture time of the newest audio sent when the second to last final result came in, audio up to there won't
+    // be replayed
+    std::atomic<std::chrono::steady_clock::time_point::rep> acked_captured_at;
+
+    // smoothed time streams took to be ready for audio, 0 until one was
+    uint startup_estimate_ms = 0;
+    bool startup_sampled = false; // for current_stream
+
+    // consecutive silent audio, for switching over at a pause
+    uint silent_ms = 0;
+
+    // when the current stream last delivered a final result
+    std::atomic<std::chrono::steady_clock::time_point::rep> last_final_at;
+
+    // seconds into the current stream to start the prepared one at, 0 if never
+    double prepared_connect_secs();
+
+    // why now is a good time to switch to the ready prepared stream, nullptr if it isn't
+    const char *switchover_reason(double secs_since_start);
+
+    void start_replay();
+
+    // queues replay audio as long as the stream has room for it, live audio is written to the replay buffer
+    // meanwhile and reaches the stream through it
+    void continue_replay();
+
+    // results are routed by the id of the stream they came from. Under on_caption_cb_handle.mutex
+    uint64_t current_stream_id = 0;
+    uint64_t prepared_stream_id = 0;
+    uint64_t retiring_stream_id = 0;
+    std::vector<CaptionResult> prepared_results; // final ones and the latest interim one, until switched to
+    TranscriptStitcher stitcher;
 
-    void start_prepared();
+    // capture time of the newest audio sent when the last final result came in, acked with the next one
+    std::chrono::steady_clock::time_point::rep last_final_sent_captured_at = 0;
+
+    caption_text_callback stream_callback(uint64_t stream_id);
+
+    void on_caption_text_cb(const CaptionResult &caption_result, uint64_t stream_id);
+
+    // audio sent by the previous final result won't be replayed. Not the audio sent by this one, that can already
+    // hold the start of the next utterance which only the next final result covers
+    void ack_final(const CaptionResult &caption_result);
+
+    // under on_caption_cb_handle.mutex
+    void emit_result(const CaptionResult &caption_result);
+
+    enum stream_role {
+        STREAM_CURRENT = 0,
+        STREAM_PREPARED = 1,
+    };
+
+    struct StartedStream {
+        std::shared_ptr<CaptionStream> stream;
+        std::chrono::steady_clock::time_point started_at;
+        uint64_t id = 0;
+    };
+
+    // everything below is under starter_mutex
+    std::thread starter_thread;
+    std::mutex starter_mutex;
+    std::condition_variable starter_signal;
+    bool starter_stopping = false;
+    bool stream_wanted[2] = {false, false};
+    StartedStream started[2]; // started, not picked up by the audio thread yet
+    ReconnectPolicy reconnect_policy;
+    uint64_t last_stream_id = 0;
+
+    // audio thread only
+    bool had_stream = false;
+
+    void starter_run();
+
+    // never blocks, asks again on the next call if it couldn't
+    void request_stream(stream_role role);
+
+    // takes what the starter thread started, never blocks
+    void collect_started();
+
+    // a stream died on its own
+    void report_stream_end(CaptionStream &stream, std::chrono::steady_clock::time_point started_at);
 
     void clear_prepared();
 
-    void cycle_streams();
+    // stitch: the new current stream got audio the old one got too, merge their results instead of interrupting
+    void cycle_streams(const StartedStream &next, bool stitch);
 
 public:
     ThreadsaferCallback<continuous_caption_text_callback> on_caption_cb_handle;
@@ -99,7 +222,14 @@ public:
             ContinuousCaptionStreamSettings settings
     );
 
-    bool queue_audio_data(const char *data, const uint data_size);
+    bool queue_audio_data(const char *data, const uint data_size,
+                          std::chrono::steady_clock::time_point captured_at = std::chrono::steady_clock::now());
+
+    // RTT estimate of the active stream, 0 if unknown
+    uint current_rtt_ms();
+
+    // any thread
+    ReconnectStatus reconnect_status();
 
 
     ~ContinuousCaptions();
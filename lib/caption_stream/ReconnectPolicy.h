@@ -0,0 +1,195 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_RECONNECTPOLICY_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_RECONNECTPOLICY_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+
+typedef unsigned int uint;
+
+struct ReconnectPolicySettings {
+    // wait after the first failure, doubled with every further one up to max_delay_ms
+    uint initial_delay_ms = 500;
+    uint max_delay_ms = 30000;
+
+    // each wait is shortened by a random part of up to this, so many clients don't retry in lockstep
+    uint jitter_percent = 50;
+
+    // consecutive failures that open the circuit, then only one attempt is made every breaker_open_secs
+    uint breaker_failures = 6;
+    uint breaker_open_secs = 60;
+
+    bool operator==(const ReconnectPolicySettings &rhs) const {
+        return initial_delay_ms == rhs.initial_delay_ms &&
+               max_delay_ms == rhs.max_delay_ms &&
+               jitter_percent == rhs.jitter_percent &&
+               breaker_failures == rhs.breaker_failures &&
+               breaker_open_secs == rhs.breaker_open_secs;
+    }
+
+    bool operator!=(const ReconnectPolicySettings &rhs) const {
+        return !(rhs == *this);
+    }
+
+    void print(const char *line_prefix = "") const {
+        printf("%s  reconnect: delay %u-%u ms, jitter %u%%, circuit opens after %u failures for %u s\n",
+               line_prefix, initial_delay_ms, max_delay_ms, jitter_percent, breaker_failures, breaker_open_secs);
+    }
+};
+
+enum reconnect_state {
+    RECONNECT_CONNECTED = 0, // circuit closed, streams are started right away
+    RECONNECT_BACKING_OFF,
+    RECONNECT_CIRCUIT_OPEN,
+    RECONNECT_PROBING, // the one attempt after the circuit was open, its failure opens it again
+};
+
+inline const char *reconnect_state_name(const reconnect_state state) {
+    switch (state) {
+        case RECONNECT_CONNECTED:
+            return "connected";
+        case RECONNECT_BACKING_OFF:
+            return "backing off";
+        case RECONNECT_CIRCUIT_OPEN:
+            return "circuit open";
+        case RECONNECT_PROBING:
+            return "probing";
+    }
+    return "?";
+}
+
+struct ReconnectStatus {
+    reconnect_state state = RECONNECT_CONNECTED;
+    uint failures = 0;
+    uint retry_in_ms = 0; // until the next attempt is allowed
+
+    bool operator==(const ReconnectStatus &rhs) const {
+        return state == rhs.state && failures == rhs.failures && retry_in_ms == rhs.retry_in_ms;
+    }
+
+    bool operator!=(const ReconnectStatus &rhs) const {
+        return !(rhs == *this);
+    }
+};
+
+/*
+ Decides when a new stream may be started after streams failed: exponential backoff with jitter up to a cap and
+ a circuit breaker that stops retrying at that rate once the API looks unreachable.
+
+ Every stream ending without a clean close counts as a failure. One the caller reports as stable (it ran long enough,
+ see on_stream_end()) starts the count over and waits at most initial_delay_ms. The server closing the stream cleanly
+ (session limit) resets everything and the next stream starts right away.
+
+ Not thread safe.
+ */
+class ReconnectPolicy {
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    ReconnectPolicySettings settings;
+    reconnect_state state = RECONNECT_CONNECTED;
+    uint failures = 0;
+    time_point next_attempt_at;
+    std::minstd_rand random;
+
+    uint jittered(const uint delay_ms) {
+        const uint jitter_ms = (uint) ((uint64_t) delay_ms * std::min(settings.jitter_percent, 100u) / 100);
+        if (!jitter_ms)
+            return delay_ms;
+
+        return delay_ms - (uint) (random() % (jitter_ms + 1));
+    }
+
+public:
+    explicit ReconnectPolicy(const ReconnectPolicySettings &settings) :
+            settings(settings),
+            random((std::minstd_rand::result_type) std::chrono::steady_clock::now().time_since_epoch().count()) {}
+
+    reconnect_state get_state() const {
+        return state;
+    }
+
+    uint get_failures() const {
+        return failures;
+    }
+
+    time_point get_next_attempt_at() const {
+        return next_attempt_at;
+    }
+
+    bool may_attempt(const time_point now) const {
+        return now >= next_attempt_at;
+    }
+
+    // a stream is being started
+    void on_attempt() {
+        if (state == RECONNECT_CIRCUIT_OPEN)
+            state = RECONNECT_PROBING;
+    }
+
+    // a stream got ready for audio, it still has to last to count as success
+    void on_ready() {
+        if (state == RECONNECT_PROBING)
+            failures = 0;
+        state = RECONNECT_CONNECTED;
+    }
+
+    // stable: the stream got ready and ran for a while before it ended. Returns the delay until the next attempt in ms
+    uint on_stream_end(const time_point now, const bool clean_close, const bool stable) {
+        if (clean_close) {
+            failures = 0;
+            state = RECONNECT_CONNECTED;
+            next_attempt_at = now;
+            return 0;
+        }
+
+        // lost after running fine for a while, a blip, retry soon
+        if (stable)
+            failures = 0;
+
+        const bool probe_failed = state == RECONNECT_PROBING;
+        failures++;
+
+        uint delay_ms;
+        if (probe_failed || (settings.breaker_failures && failures >= settings.breaker_failures)) {
+            state = RECONNECT_CIRCUIT_OPEN;
+            delay_ms = jittered(settings.breaker_open_secs * 1000);
+        } else {
+            state = RECONNECT_BACKING_OFF;
+            const uint shift = std::min(failures - 1, 20u);
+            delay_ms = jittered((uint) std::min((uint64_t) settings.initial_delay_ms << shift,
+                                                (uint64_t) std::max(settings.max_delay_ms, settings.initial_delay_ms)));
+        }
+        next_attempt_at = now + std::chrono::milliseconds(delay_ms);
+        return delay_ms;
+    }
+
+    ReconnectStatus status(const time_point now) const {
+        ReconnectStatus status;
+        status.state = state;
+        status.failures = failures;
+        if (next_attempt_at > now)
+            status.retry_in_ms = (uint) std::chrono::duration_cast<std::chrono::milliseconds>(next_attempt_at - now).count();
+        return status;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_RECONNECTPOLICY_H
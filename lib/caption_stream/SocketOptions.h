@@ -0,0 +1,67 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_SOCKETOPTIONS_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_SOCKETOPTIONS_H
+
+#include <cstdio>
+
+typedef unsigned int uint;
+
+// applied to every API connection once it's connected, 0 keeps the OS default
+struct TcpSocketOptions {
+    // audio goes out in small chunks, Nagle would hold them back until the previous one is acked
+    bool no_delay = true;
+
+    // bytes, setting these turns off the kernel's buffer autotuning on Linux
+    uint send_buffer_size = 0;
+    uint recv_buffer_size = 0;
+
+    // probe idle connections so a silently dropped one fails instead of waiting for recv_timeout_ms
+    uint keepalive_idle_secs = 30;
+    uint keepalive_interval_secs = 10;
+    uint keepalive_count = 3;
+
+    // fail a connection once sent data stays unacked this long, Linux only
+    uint user_timeout_ms = 0;
+
+    bool keepalive_enabled() const {
+        return keepalive_idle_secs != 0;
+    }
+
+    bool operator==(const TcpSocketOptions &rhs) const {
+        return no_delay == rhs.no_delay &&
+               send_buffer_size == rhs.send_buffer_size &&
+               recv_buffer_size == rhs.recv_buffer_size &&
+               keepalive_idle_secs == rhs.keepalive_idle_secs &&
+               keepalive_interval_secs == rhs.keepalive_interval_secs &&
+               keepalive_count == rhs.keepalive_count &&
+               user_timeout_ms == rhs.user_timeout_ms;
+    }
+
+    bool operator!=(const TcpSocketOptions &rhs) const {
+        return !(rhs == *this);
+    }
+
+    void print(const char *line_prefix = "") const {
+        printf("%s  socket_options: nodelay %d, sndbuf %u, rcvbuf %u, keepalive %u/%u/%u, user_timeout_ms %u\n",
+               line_prefix, no_delay, send_buffer_size, recv_buffer_size,
+               keepalive_idle_secs, keepalive_interval_secs, keepalive_count, user_timeout_ms);
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_SOCKETOPTIONS_H
@@ -0,0 +1,221 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_TRANSCRIPTSTITCHER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_TRANSCRIPTSTITCHER_H
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <vector>
+
+// emitted words kept to find the overlap in, a switchover overlap is a few seconds of speech
+#define STITCH_TAIL_WORDS 48
+// new stream words aligned at most, stitching gives up after that
+#define STITCH_MAX_WORDS 96
+
+// alignment scores, an overlap needs a net two matching words to count
+#define STITCH_MATCH_SCORE 2
+#define STITCH_MISMATCH_SCORE (-1)
+#define STITCH_GAP_SCORE (-1)
+#define STITCH_MIN_SCORE 3
+// how far behind the end of the emitted text the new stream's words may still be
+#define STITCH_MAX_LAG_WORDS 16
+
+/*
+ Merges the results of a stream taking over from another one that was (partly) fed the same audio, so the output reads
+ as one continuous transcript instead of repeating the overlap or resetting the shown text.
+
+ Everything emitted is passed to track_emitted(). After begin() the results of the new stream go through stitch()
+ instead: their words are aligned (local alignment ending close to the last emitted word, so the new stream can start
+ mid-word and lag behind a bit) against what was emitted last, words already shown are dropped and the old stream's
+ unfinished text is kept in front until the new stream finishes that utterance. A final result still coming from the
+ old stream (while it drains) completes that text instead, as long as the new stream hasn't shown anything yet.
+
+ Not thread safe.
+ */
+class TranscriptStitcher {
+    std::vector<std::string> tail_words; // of emitted final results, normalized
+    std::vector<std::string> pending_words; // emitted interim result, as shown
+
+    bool stitching = false;
+    std::vector<std::string> old_words; // normalized tail + pending at begin()
+    std::string carry; // old stream's interim text, still shown, in front of everything until a final
+    std::vector<std::string> new_final_words; // normalized, new stream finals that only repeated old text
+    bool new_emitted = false; // anything of the new stream was shown
+
+    static void split_words(const std::string &text, std::vector<std::string> &words) {
+        words.clear();
+        std::string word;
+        for (const char c : text) {
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                if (!word.empty())
+                    words.push_back(word);
+                word.clear();
+            } else {
+                word.push_back(c);
+            }
+        }
+        if (!word.empty())
+            words.push_back(word);
+    }
+
+    // lowercase without ASCII punctuation so "Fox," and "fox" match, non ASCII bytes are kept
+    static std::string normalized(const std::string &word) {
+        std::string result;
+        for (const char c : word) {
+            const unsigned char u = (unsigned char) c;
+            if (u >= 128 || isalnum(u))
+                result.push_back(u >= 128 ? c : (char) tolower(u));
+        }
+        return result.empty() ? word : result;
+    }
+
+    static void append_normalized(std::vector<std::string> &to, const std::vector<std::string> &words) {
+        for (const auto &word : words)
+            to.push_back(normalized(word));
+    }
+
+    static std::string joined(const std::vector<std::string> &words, const size_t from) {
+        std::string text;
+        for (size_t i = from; i < words.size(); i++) {
+            if (!text.empty())
+                text.push_back(' ');
+            text.append(words[i]);
+        }
+        return text;
+    }
+
+    // how many of the candidate words are covered by the end of old_words, 0 if there's no convincing overlap
+    size_t covered_words(const std::vector<std::string> &candidate) const {
+        const size_t rows = old_words.size(), cols = std::min(candidate.size(), (size_t) STITCH_MAX_WORDS);
+        if (!rows || !cols)
+            return 0;
+
+        // smith-waterman, the match has to end in the last few old words, the new stream might not have caught up
+        std::vector<int> previous(cols + 1, 0), current(cols + 1, 0);
+        size_t best_end = 0;
+        int best_score = 0;
+        for (size_t a = 1; a <= rows; a++) {
+            current[0] = 0;
+            for (size_t b = 1; b <= cols; b++) {
+                const int diagonal = previous[b - 1] +
+                                     (old_words[a - 1] == candidate[b - 1] ? STITCH_MATCH_SCORE : STITCH_MISMATCH_SCORE);
+                current[b] = std::max(std::max(0, diagonal),
+                                      std::max(previous[b] + STITCH_GAP_SCORE, current[b - 1] + STITCH_GAP_SCORE));
+
+                if (a + STITCH_MAX_LAG_WORDS >= rows && current[b] >= best_score && current[b] > 0) {
+                    best_score = current[b];
+                    best_end = b;
+                }
+            }
+            previous.swap(current);
+        }
+
+        // a single word is all there is to go by right after a switch
+        const int min_score = std::min(STITCH_MIN_SCORE, (int) std::min(rows, cols) * STITCH_MATCH_SCORE);
+        return best_score >= min_score ? best_end : 0;
+    }
+
+public:
+    bool is_stitching() const {
+        return stitching;
+    }
+
+    // text emitted as is
+    void track_emitted(const std::string &text, const bool final) {
+        split_words(text, pending_words);
+        if (!final)
+            return;
+
+        append_normalized(tail_words, pending_words);
+        pending_words.clear();
+        if (tail_words.size() > STITCH_TAIL_WORDS)
+            tail_words.erase(tail_words.begin(), tail_words.end() - STITCH_TAIL_WORDS);
+    }
+
+    // results from now on are from a new stream that got (some of) the audio of what was emitted last
+    void begin() {
+        old_words = tail_words;
+        append_normalized(old_words, pending_words);
+        carry = joined(pending_words, 0);
+        new_final_words.clear();
+        new_emitted = false;
+        stitching = true;
+    }
+
+    // a final result of the old stream after begin(), true if it's to be emitted as is. It then replaces the carried
+    // interim text, dropped once the new stream's text is shown already, that covers the same audio.
+    bool old_final(const std::string &text) {
+        if (!stitching || new_emitted)
+            return false;
+
+        track_emitted(text, true);
+        old_words = tail_words;
+        carry.clear();
+        return true;
+    }
+
+    // forget the overlap, the new stream doesn't share any audio with the old one
+    void reset() {
+        stitching = false;
+        tail_words.clear();
+        pending_words.clear();
+    }
+
+    // text to emit for a new stream result, false if it would only repeat what's shown already
+    bool stitch(const std::string &text, const bool final, std::string &out_text) {
+        if (!stitching) {
+            out_text = text;
+            track_emitted(text, final);
+            return true;
+        }
+
+        std::vector<std::string> words;
+        split_words(text, words);
+
+        std::vector<std::string> candidate = new_final_words;
+        append_normalized(candidate, words);
+        const size_t covered = covered_words(candidate);
+        const size_t skip = covered > new_final_words.size() ? covered - new_final_words.size() : 0;
+
+        const std::string continuation = joined(words, std::min(skip, words.size()));
+        if (continuation.empty() && (!final || carry.empty())) {
+            if (final) {
+                // repeated old text only, the next utterance is new
+                append_normalized(new_final_words, words);
+                if (new_final_words.size() > STITCH_MAX_WORDS)
+                    stitching = false;
+            }
+            return false;
+        }
+
+        out_text = carry;
+        if (!out_text.empty() && !continuation.empty())
+            out_text.push_back(' ');
+        out_text.append(continuation);
+
+        if (final)
+            stitching = false;
+
+        new_emitted = true;
+        track_emitted(out_text, final);
+        return true;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_TRANSCRIPTSTITCHER_H
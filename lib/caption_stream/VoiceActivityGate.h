@@ -0,0 +1,234 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_VOICEACTIVITYGATE_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_VOICEACTIVITYGATE_H
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include "AudioRingBuffer.h"
+
+typedef unsigned int uint;
+
+struct VoiceActivitySettings {
+    bool enabled;
+
+    // speech needs to be this much louder than the tracked noise floor and at least min_speech_dbfs
+    double speech_margin_db;
+    double min_speech_dbfs;
+
+    uint hangover_ms; // keep sending this long after the last speech frame
+    uint preroll_ms; // send this much of the audio before speech was detected
+    uint keepalive_interval_ms; // during silence only send one frame every this often
+
+    VoiceActivitySettings(
+            bool enabled,
+            double speech_margin_db,
+            double min_speech_dbfs,
+            uint hangover_ms,
+            uint preroll_ms,
+            uint keepalive_interval_ms
+    ) :
+            enabled(enabled),
+            speech_margin_db(speech_margin_db),
+            min_speech_dbfs(min_speech_dbfs),
+            hangover_ms(hangover_ms),
+            preroll_ms(preroll_ms),
+            keepalive_interval_ms(keepalive_interval_ms) {}
+
+    bool operator==(const VoiceActivitySettings &rhs) const {
+        return enabled == rhs.enabled &&
+               speech_margin_db == rhs.speech_margin_db &&
+               min_speech_dbfs == rhs.min_speech_dbfs &&
+               hangover_ms == rhs.hangover_ms &&
+               preroll_ms == rhs.preroll_ms &&
+               keepalive_interval_ms == rhs.keepalive_interval_ms;
+    }
+
+    bool operator!=(const VoiceActivitySettings &rhs) const {
+        return !(rhs == *this);
+    }
+
+    void print(const char *line_prefix = "") {
+        printf("%sVoiceActivitySettings\n", line_prefix);
+        printf("%s  enabled: %d\n", line_prefix, enabled);
+        printf("%s  speech_margin_db: %f\n", line_prefix, speech_margin_db);
+        printf("%s  min_speech_dbfs: %f\n", line_prefix, min_speech_dbfs);
+        printf("%s  hangover_ms: %d\n", line_prefix, hangover_ms);
+        printf("%s  preroll_ms: %d\n", line_prefix, preroll_ms);
+        printf("%s  keepalive_interval_ms: %d\n", line_prefix, keepalive_interval_ms);
+    }
+};
+
+struct VoiceActivityStats {
+    uint64_t total_bytes = 0;
+    uint64_t suppressed_bytes = 0;
+    uint speech_segments = 0;
+
+    double suppressed_percent() const {
+        if (!total_bytes)
+            return 0.0;
+
+        return 100.0 * (double) suppressed_bytes / (double) total_bytes;
+    }
+};
+
+/*
+ Energy + zero crossing rate voice activity gate. Forwards audio while there's speech (plus hangover afterwards and
+ the preroll before it) and replaces sustained silence with one frame every keepalive_interval_ms so the speech API
+ connection doesn't time out.
+
+ Not thread safe, meant to be called from the audio thread only.
+ */
+class VoiceActivityGate {
+    VoiceActivitySettings settings;
+    audio_frame_callback on_frame;
+
+    AudioRingBuffer preroll;
+    std::vector<char> preroll_out;
+
+    // starts speech_margin_db below min_speech_dbfs, so speech at the session start isn't taken for the floor
+    double noise_floor_dbfs;
+    bool in_speech = false;
+    uint hangover_left_ms = 0;
+    uint silence_since_keepalive_ms = 0;
+
+    VoiceActivityStats stats;
+
+    bool is_speech(const int16_t *samples, const size_t sample_cnt, const uint frame_ms) {
+        if (!sample_cnt)
+            return false;
+
+        double energy = 0;
+        uint zero_crossings = 0;
+        for (size_t i = 0; i < sample_cnt; i++) {
+            energy += (double) samples[i] * samples[i];
+            if (i && ((samples[i] >= 0) != (samples[i - 1] >= 0)))
+                zero_crossings++;
+        }
+        const double rms = std::sqrt(energy / sample_cnt);
+        const double dbfs = rms > 0 ? 20.0 * std::log10(rms / 32768.0) : -120.0;
+        const double zcr = (double) zero_crossings / sample_cnt;
+
+        // voiced speech is loud, unvoiced (s, f, sh) is quieter but crosses zero a lot more than hum and rumble
+        bool speech = dbfs >= settings.min_speech_dbfs && dbfs >= noise_floor_dbfs + settings.speech_margin_db;
+        if (!speech && zcr > 0.3 && dbfs >= settings.min_speech_dbfs && dbfs >= noise_floor_dbfs + settings.speech_margin_db / 2)
+            speech = true;
+
+        // noise floor drops fast and rises slowly (~1 dB/s) so speech doesn't pull it up. During speech it still
+        // rises at a quarter of that, steady noise loud enough to count as speech gets gated within a minute or so
+        if (dbfs < noise_floor_dbfs)
+            noise_floor_dbfs = dbfs < -100.0 ? -100.0 : dbfs;
+        else
+            noise_floor_dbfs += std::min(dbfs - noise_floor_dbfs, frame_ms / (speech ? 4000.0 : 1000.0));
+
+        return speech;
+    }
+
+    void emit(const char *data, const size_t size) {
+        if (on_frame && size)
+            on_frame(data, size);
+    }
+
+    void emit_preroll() {
+        size_t read;
+        while ((read = preroll.read(&preroll_out[0], preroll_out.size(), 0))) {
+            stats.suppressed_bytes -= read;
+            emit(&preroll_out[0], read);
+        }
+    }
+
+    void add_preroll(const char *data, const size_t size) {
+        if (size > preroll.get_capacity()) {
+            data += size - preroll.get_capacity();
+            preroll.skip(preroll.size());
+            preroll.write(data, preroll.get_capacity());
+            return;
+        }
+
+        if (preroll.free_space() < size)
+            preroll.skip(size - preroll.free_space());
+        preroll.write(data, size);
+    }
+
+public:
+    VoiceActivityGate(const VoiceActivitySettings &settings, audio_frame_callback on_frame) :
+            settings(settings),
+            on_frame(on_frame),
+            preroll(audio_ms_to_bytes(settings.preroll_ms)),
+            preroll_out(preroll.get_capacity()),
+            noise_floor_dbfs(settings.min_speech_dbfs - settings.speech_margin_db) {
+    }
+
+    void process(const char *data, const size_t size) {
+        if (!size)
+            return;
+
+        stats.total_bytes += size;
+        if (!settings.enabled) {
+            emit(data, size);
+            return;
+        }
+
+        const uint frame_ms = audio_bytes_to_ms(size);
+        if (is_speech((const int16_t *) data, size / AUDIO_BYTES_PER_SAMPLE, frame_ms)) {
+            if (!in_speech) {
+                in_speech = true;
+                stats.speech_segments++;
+                emit_preroll();
+            }
+            hangover_left_ms = settings.hangover_ms;
+            silence_since_keepalive_ms = 0;
+            emit(data, size);
+            return;
+        }
+
+        if (in_speech) {
+            if (hangover_left_ms > frame_ms) {
+                hangover_left_ms -= frame_ms;
+                emit(data, size);
+                return;
+            }
+            in_speech = false;
+            hangover_left_ms = 0;
+        }
+
+        silence_since_keepalive_ms += frame_ms;
+        if (settings.keepalive_interval_ms && silence_since_keepalive_ms >= settings.keepalive_interval_ms) {
+            silence_since_keepalive_ms = 0;
+            // the held back audio is older than this frame, a preroll from it would go out of order
+            preroll.skip(preroll.size());
+            emit(data, size);
+            return;
+        }
+
+        stats.suppressed_bytes += size;
+        if (settings.preroll_ms)
+            add_preroll(data, size);
+    }
+
+    bool is_in_speech() const {
+        return in_speech;
+    }
+
+    VoiceActivityStats get_stats() const {
+        return stats;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_VOICEACTIVITYGATE_H
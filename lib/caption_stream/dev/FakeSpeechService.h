@@ -0,0 +1,214 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_FAKESPEECHSERVICE_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_FAKESPEECHSERVICE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include <google/cloud/speech/v1/cloud_speech.grpc.pb.h>
+
+#include "AudioEncoder.h"
+
+// audio is 16 kHz 16 bit mono
+#define FAKE_SPEECH_BYTES_PER_MS 32
+
+// one scripted response, sent once the call received at_audio_ms of audio (plus the script's latency)
+struct FakeResponseStep {
+    unsigned int at_audio_ms;
+    google::cloud::speech::v1::StreamingRecognizeResponse response;
+};
+
+struct FakeSpeechScript {
+    std::vector<FakeResponseStep> steps;
+
+    // the steps start over every loop_ms of audio, 0 plays them once
+    unsigned int loop_ms = 0;
+
+    // from the audio a response is for arriving to sending it, plus up to latency_jitter_ms
+    unsigned int latency_ms = 0;
+    unsigned int latency_jitter_ms = 0;
+
+    // the call fails with abort_code once this much audio came in, 0 never
+    unsigned int abort_after_ms = 0;
+    grpc::StatusCode abort_code = grpc::StatusCode::UNAVAILABLE;
+
+    // utterance_ms long utterances growing by a word every interim_every_ms, with the given stability, and a final
+    // result ending each. Loops forever.
+    static FakeSpeechScript utterances(const unsigned int utterance_ms, const unsigned int interim_every_ms,
+                                       const float stability) {
+        FakeSpeechScript script;
+        script.loop_ms = utterance_ms;
+        std::string transcript;
+        for (unsigned int at = interim_every_ms; at <= utterance_ms; at += interim_every_ms) {
+            transcript.append(transcript.empty() ? "word" : " word");
+            const bool final = at + interim_every_ms > utterance_ms;
+
+            FakeResponseStep step{at, {}};
+            auto *result = step.response.add_results();
+            result->set_is_final(final);
+            result->set_stability(final ? 0.0f : stability);
+            auto *alternative = result->add_alternatives();
+            alternative->set_transcript(transcript);
+            if (final)
+                alternative->set_confidence(0.9f);
+            script.steps.push_back(step);
+        }
+        return script;
+    }
+};
+
+/*
+ Local stand-in for the Speech API's StreamingRecognize, replaying a FakeSpeechScript for every call. Checks the
+ first request is the config and only counts audio after that, like the API, FLAC by the frame positions. Responses
+ go out from a writer thread per call so latency doesn't hold up reading.
+
+ Register it with a grpc::ServerBuilder listening with InsecureServerCredentials and point CaptionStreamSettings at it
+ with endpoint_insecure set.
+ */
+class FakeSpeechService final : public google::cloud::speech::v1::Speech::Service {
+    using Request = google::cloud::speech::v1::StreamingRecognizeRequest;
+    using Response = google::cloud::speech::v1::StreamingRecognizeResponse;
+    using clock = std::chrono::steady_clock;
+
+    struct Pending {
+        clock::time_point send_at;
+        const Response *response;
+    };
+
+    const FakeSpeechScript script;
+
+public:
+    std::atomic<unsigned int> calls{0};
+    std::atomic<unsigned int> aborted{0};
+    std::atomic<unsigned long long> responses_sent{0};
+    std::atomic<unsigned long long> audio_bytes{0}; // decoded size for FLAC
+    std::atomic<unsigned long long> upload_bytes{0}; // as received
+
+    explicit FakeSpeechService(FakeSpeechScript script) :
+            script(std::move(script)) {}
+
+    grpc::Status StreamingRecognize(grpc::ServerContext *context,
+                                    grpc::ServerReaderWriter<Response, Request> *stream) override {
+        const unsigned int call = ++calls;
+        Request request;
+        if (!stream->Read(&request) || !request.has_streaming_config())
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "first request must be the config");
+
+        std::mutex mutex;
+        std::condition_variable signal;
+        std::deque<Pending> pending;
+        bool reading_done = false;
+        bool abort = false;
+
+        std::thread writer([&]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                if (abort || (reading_done && pending.empty()))
+                    return;
+                if (pending.empty()) {
+                    signal.wait(lock);
+                    continue;
+                }
+
+                const Pending next = pending.front();
+                if (clock::now() < next.send_at) {
+                    signal.wait_until(lock, next.send_at);
+                    continue;
+                }
+                pending.pop_front();
+
+                lock.unlock();
+                const bool written = stream->Write(*next.response);
+                lock.lock();
+                if (!written)
+                    return;
+                responses_sent++;
+            }
+        });
+
+        const bool flac = request.streaming_config().config().encoding()
+                          == google::cloud::speech::v1::RecognitionConfig_AudioEncoding_FLAC;
+        uint64_t received = 0;
+        size_t step = 0;
+        uint64_t loop_start_ms = 0;
+        unsigned int jitter_state = call * 2654435761u;
+        grpc::Status status = grpc::Status::OK;
+        while (stream->Read(&request)) {
+            upload_bytes += request.audio_content().size();
+            if (flac) {
+                const uint64_t end_bytes = flac_upload_end_sample(request.audio_content()) * AUDIO_BYTES_PER_SAMPLE;
+                if (end_bytes > received) {
+                    audio_bytes += end_bytes - received;
+                    received = end_bytes;
+                }
+            } else {
+                received += request.audio_content().size();
+                audio_bytes += request.audio_content().size();
+            }
+            const uint64_t audio_ms = received / FAKE_SPEECH_BYTES_PER_MS;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                while (step < script.steps.size() && loop_start_ms + script.steps[step].at_audio_ms <= audio_ms) {
+                    unsigned int latency_ms = script.latency_ms;
+                    if (script.latency_jitter_ms) {
+                        jitter_state = jitter_state * 1103515245u + 12345u;
+                        latency_ms += (jitter_state >> 16) % (script.latency_jitter_ms + 1);
+                    }
+                    // never overtaking the one before
+                    clock::time_point send_at = clock::now() + std::chrono::milliseconds(latency_ms);
+                    if (!pending.empty())
+                        send_at = std::max(send_at, pending.back().send_at);
+                    pending.push_back({send_at, &script.steps[step].response});
+
+                    step++;
+                    if (step == script.steps.size() && script.loop_ms) {
+                        step = 0;
+                        loop_start_ms += script.loop_ms;
+                    }
+                }
+            }
+            signal.notify_all();
+
+            if (script.abort_after_ms && audio_ms >= script.abort_after_ms) {
+                aborted++;
+                status = grpc::Status(script.abort_code, "scripted abort");
+                break;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            reading_done = true;
+            abort = !status.ok() || context->IsCancelled();
+        }
+        signal.notify_all();
+        writer.join();
+        return status;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_FAKESPEECHSERVICE_H
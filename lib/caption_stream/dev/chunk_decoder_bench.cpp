@@ -0,0 +1,388 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+// Replays a captured downstream body (eg. from caption_stream_mock_speech_server --capture) through the chunked
+// transfer decoding of _downstream_run, the previous std::string based version and HttpChunkDecoder, in the same
+// receive sized pieces. Reports time and heap allocations per message and checks both see the same payloads.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "HttpChunkDecoder.h"
+#include "CaptionResultParser.h"
+
+using namespace std;
+
+static std::atomic<uint64_t> allocation_count(0);
+
+void *operator new(size_t size) {
+    allocation_count++;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+struct BenchSettings {
+    string capture_path;
+    uint synthetic_messages = 20000;
+    uint max_read = 4096; // _downstream_run receives up to BUFFER_SIZE at once
+    uint rounds = 5;
+    bool parse = false;
+    uint seed = 1;
+};
+
+// stands in for the socket, hands out the stream in the same random sized pieces every round
+class ReplaySource {
+    const string &stream;
+    const vector<uint> &read_sizes;
+    size_t pos = 0;
+    size_t read_i = 0;
+
+public:
+    ReplaySource(const string &stream, const vector<uint> &read_sizes) :
+            stream(stream),
+            read_sizes(read_sizes) {}
+
+    int receive_at_most(char *buffer, const int bytes) {
+        if (pos >= stream.size())
+            return -1;
+
+        size_t cnt = read_sizes[read_i++ % read_sizes.size()];
+        cnt = std::min(cnt, std::min((size_t) bytes, stream.size() - pos));
+        memcpy(buffer, stream.data() + pos, cnt);
+        pos += cnt;
+        return (int) cnt;
+    }
+
+    int receive_at_least(string &buffer, const int bytes) {
+        int read = 0;
+        char chunk[4096];
+        while (read < bytes) {
+            const int cur_read = receive_at_most(chunk, sizeof(chunk));
+            if (cur_read == -1)
+                return -1;
+            read += cur_read;
+            buffer.append(chunk, cur_read);
+        }
+        return read;
+    }
+};
+
+struct ReplayResult {
+    uint64_t payloads = 0;
+    uint64_t payload_bytes = 0;
+    uint64_t checksum = 0;
+    uint64_t parsed = 0;
+};
+
+static bool verify_payloads = false;
+
+static void count_payload(ReplayResult &result, const char *data, const size_t size,
+                          CaptionResultParser *parser, CaptionResult &caption) {
+    result.payloads++;
+    result.payload_bytes += size;
+    // full checksum only in the untimed verification round, it would cost more than the decoding
+    if (verify_payloads) {
+        for (size_t i = 0; i < size; i++)
+            result.checksum = result.checksum * 31 + (unsigned char) data[i];
+    } else {
+        result.checksum += (unsigned char) data[0] + (unsigned char) data[size - 1];
+    }
+
+    if (parser && parser->parse(data, size, caption) == CAPTION_PARSE_OK)
+        result.parsed++;
+}
+
+// string::npos if the source ended first
+static size_t read_until_contains(ReplaySource &source, string &buffer, const char *required_contents) {
+    size_t newline_pos = buffer.find(required_contents);
+    if (newline_pos != string::npos)
+        return newline_pos;
+
+    char chunk[4096];
+    do {
+        int read_cnt = source.receive_at_most(chunk, sizeof(chunk));
+        if (read_cnt == -1)
+            return string::npos;
+
+        buffer.append(chunk, read_cnt);
+    } while ((newline_pos = buffer.find(required_contents)) == string::npos);
+    return newline_pos;
+}
+
+// the previous _downstream_run loop, minus the logging
+static ReplayResult replay_string(ReplaySource &source, CaptionResultParser *parser) {
+    ReplayResult result;
+    CaptionResult caption;
+    string rest;
+    while (true) {
+        const size_t crlf_pos = read_until_contains(source, rest, "\r\n");
+        if (crlf_pos == string::npos)
+            return result;
+
+        unsigned long chunk_length;
+        try {
+            chunk_length = std::stoul(rest.substr(0, crlf_pos), nullptr, 16);
+        }
+        catch (...) {
+            return result;
+        }
+
+        const size_t chunk_data_start = crlf_pos + 2;
+        const uint existing_chunk_byte_cnt = rest.size() - chunk_data_start;
+        const uint needed_bytes = chunk_length - existing_chunk_byte_cnt + 2;
+        if (needed_bytes && (int) needed_bytes > 0 && source.receive_at_least(rest, needed_bytes) == -1)
+            return result;
+
+        if (!chunk_length)
+            return result;
+
+        const string chunk_data = rest.substr(chunk_data_start, chunk_length);
+        count_payload(result, chunk_data.data(), chunk_data.size(), parser, caption);
+        rest.erase(0, chunk_data_start + chunk_length + 2);
+    }
+}
+
+static ReplayResult replay_decoder(ReplaySource &source, HttpChunkDecoder &decoder, CaptionResultParser *parser) {
+    ReplayResult result;
+    CaptionResult caption;
+    HttpChunkView chunk;
+    while (true) {
+        const http_chunk_status status = decoder.next(chunk);
+        if (status == HTTP_CHUNK_NEED_MORE) {
+            size_t available;
+            char *to = decoder.write_ptr(&available);
+            const int read_cnt = source.receive_at_most(to, (int) available);
+            if (read_cnt <= 0)
+                return result;
+            decoder.commit(read_cnt);
+            continue;
+        }
+        if (status != HTTP_CHUNK_PAYLOAD) {
+            if (status == HTTP_CHUNK_ERROR)
+                fprintf(stderr, "decode error: %s\n", decoder.get_error());
+            return result;
+        }
+
+        count_payload(result, chunk.data, chunk.size, parser, caption);
+    }
+}
+
+// all complete chunks of a capture, a capture of several sessions has several bodies
+static bool split_payloads(const string &capture, vector<string> &payloads) {
+    size_t pos = 0;
+    while (pos < capture.size()) {
+        const size_t crlf = capture.find("\r\n", pos);
+        if (crlf == string::npos)
+            break;
+
+        char *size_end = nullptr;
+        const unsigned long size = strtoul(capture.c_str() + pos, &size_end, 16);
+        if (size_end == capture.c_str() + pos)
+            return false;
+
+        if (!size) {
+            const size_t body_end = capture.find("\r\n\r\n", pos);
+            if (body_end == string::npos)
+                break;
+            pos = body_end + 4;
+            continue;
+        }
+
+        if (crlf + 2 + size + 2 > capture.size())
+            break;
+        payloads.push_back(capture.substr(crlf + 2, size));
+        pos = crlf + 2 + size + 2;
+    }
+    return true;
+}
+
+static void synthesize_payloads(const uint count, vector<string> &payloads) {
+    const char *words[] = {"the", "quick", "brown", "fox", "jumps", "over", "the", "lazy", "dog", "again"};
+    int result_index = 0;
+    uint word_cnt = 0;
+    payloads.push_back("{\"result\":[]}\n");
+    while (payloads.size() < count) {
+        word_cnt++;
+        string transcript;
+        for (uint i = 0; i < word_cnt; i++)
+            transcript.append(i ? " " : "").append(words[i % 10]);
+
+        ostringstream json;
+        json << "{\"result\":[{\"alternative\":[{\"transcript\":\"" << transcript << "\"";
+        if (word_cnt == 12) {
+            json << ",\"confidence\":0.92}],\"final\":true}],\"result_index\":" << result_index++ << "}\n";
+            word_cnt = 0;
+        } else {
+            json << "}],\"stability\":0.01},{\"alternative\":[{\"transcript\":\" " << words[word_cnt % 10]
+                 << "\"}],\"stability\":0.9}],\"result_index\":" << result_index << "}\n";
+        }
+        payloads.push_back(json.str());
+    }
+}
+
+static void print_usage(const char *name) {
+    printf("usage: %s [options] [capture file]\n"
+           "  --messages N   synthetic messages when no capture is given, default 20000\n"
+           "  --max-read B   largest receive, default 4096\n"
+           "  --rounds N     default 5\n"
+           "  --parse        also parse every message with CaptionResultParser\n"
+           "  --seed N       receive size sequence seed\n",
+           name);
+}
+
+int main(int argc, char **argv) {
+    BenchSettings settings;
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg == "--parse") {
+            settings.parse = true;
+        } else if (arg[0] != '-') {
+            settings.capture_path = arg;
+        } else if (i + 1 < argc) {
+            const uint value = (uint) atoi(argv[++i]);
+            if (arg == "--messages")
+                settings.synthetic_messages = value;
+            else if (arg == "--max-read")
+                settings.max_read = value ? value : 1;
+            else if (arg == "--rounds")
+                settings.rounds = value ? value : 1;
+            else if (arg == "--seed")
+                settings.seed = value;
+            else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    vector<string> payloads;
+    if (!settings.capture_path.empty()) {
+        ifstream file(settings.capture_path, ios::binary);
+        if (!file) {
+            fprintf(stderr, "failed opening %s\n", settings.capture_path.c_str());
+            return 1;
+        }
+        const string capture((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        if (!split_payloads(capture, payloads)) {
+            fprintf(stderr, "%s isn't a chunked transfer body\n", settings.capture_path.c_str());
+            return 1;
+        }
+        printf("capture %s: %lu bytes\n", settings.capture_path.c_str(), capture.size());
+    } else {
+        synthesize_payloads(settings.synthetic_messages, payloads);
+    }
+    if (payloads.empty()) {
+        fprintf(stderr, "no messages to replay\n");
+        return 1;
+    }
+
+    // one body, the captured sessions back to back
+    string stream;
+    for (const auto &payload : payloads) {
+        char size_line[24];
+        snprintf(size_line, sizeof(size_line), "%zx\r\n", payload.size());
+        stream.append(size_line).append(payload).append("\r\n");
+    }
+    stream.append("0\r\n\r\n");
+
+    std::mt19937 random_gen(settings.seed);
+    vector<uint> read_sizes(4096);
+    for (auto &size : read_sizes)
+        size = 1 + random_gen() % settings.max_read;
+
+    printf("%lu messages, %lu bytes, receives up to %u bytes%s\n",
+           payloads.size(), stream.size(), settings.max_read, settings.parse ? ", parsing" : "");
+
+    CaptionResultParser parser;
+    CaptionResultParser *use_parser = settings.parse ? &parser : nullptr;
+    {
+        verify_payloads = true;
+        ReplaySource string_source(stream, read_sizes);
+        const ReplayResult string_result = replay_string(string_source, nullptr);
+        HttpChunkDecoder decoder;
+        ReplaySource decoder_source(stream, read_sizes);
+        const ReplayResult decoder_result = replay_decoder(decoder_source, decoder, nullptr);
+        verify_payloads = false;
+
+        if (string_result.payloads != payloads.size() || decoder_result.payloads != payloads.size()
+            || string_result.checksum != decoder_result.checksum) {
+            printf("MISMATCH, string %llu messages, decoder %llu messages\n",
+                   (unsigned long long) string_result.payloads, (unsigned long long) decoder_result.payloads);
+            return 1;
+        }
+    }
+
+    for (uint round = 0; round < settings.rounds; round++) {
+        ReplaySource string_source(stream, read_sizes);
+        uint64_t allocs_before = allocation_count.load();
+        auto start = std::chrono::steady_clock::now();
+        const ReplayResult string_result = replay_string(string_source, use_parser);
+        const double string_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        const uint64_t string_allocs = allocation_count.load() - allocs_before;
+
+        // constructed outside the timing, it's created once per downstream connection
+        HttpChunkDecoder decoder;
+        ReplaySource decoder_source(stream, read_sizes);
+        allocs_before = allocation_count.load();
+        start = std::chrono::steady_clock::now();
+        const ReplayResult decoder_result = replay_decoder(decoder_source, decoder, use_parser);
+        const double decoder_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        const uint64_t decoder_allocs = allocation_count.load() - allocs_before;
+
+        const bool same = string_result.payloads == decoder_result.payloads
+                          && string_result.checksum == decoder_result.checksum;
+
+        printf("round %u: string %7.1f ns/msg %6.2f allocs/msg %7.1f MB/s | decoder %7.1f ns/msg %6.2f allocs/msg %7.1f MB/s, "
+               "%llu wrapped | %.2fx%s\n",
+               round + 1,
+               string_ns / string_result.payloads, (double) string_allocs / string_result.payloads,
+               stream.size() * 1000.0 / string_ns,
+               decoder_ns / decoder_result.payloads, (double) decoder_allocs / decoder_result.payloads,
+               stream.size() * 1000.0 / decoder_ns,
+               (unsigned long long) decoder.get_wrapped_count(),
+               decoder_ns > 0 ? string_ns / decoder_ns : 0.0,
+               same ? "" : " MISMATCH");
+        if (!same)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+// Encodes a 16kHz mono 16 bit WAV/raw PCM file with the upload FlacEncoder in dequeue sized pieces and reports the
+// compression ratio and encoder time per second of audio. --out writes the stream for checking with `flac -t`.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "AudioEncoder.h"
+
+using namespace std;
+
+static void print_usage(const char *name) {
+    printf("usage: %s [options] file.wav|file.pcm\n"
+           "  --chunk-ms MS   audio per encode() call, like one upload dequeue, default 20\n"
+           "  --repeat N      encode the file N times for steadier timings, default 10\n"
+           "  --out FILE      write the FLAC stream of the first pass\n",
+           name);
+}
+
+// skips a WAV header, anything else is taken as raw PCM
+static string pcm_data(const string &file) {
+    if (file.size() < 12 || file.compare(0, 4, "RIFF") || file.compare(8, 4, "WAVE"))
+        return file;
+
+    size_t pos = 12;
+    while (pos + 8 <= file.size()) {
+        const uint8_t *size_bytes = (const uint8_t *) &file[pos + 4];
+        const size_t chunk_size = size_bytes[0] | (size_bytes[1] << 8) | (size_bytes[2] << 16) | ((size_t) size_bytes[3] << 24);
+        if (!file.compare(pos, 4, "data"))
+            return file.substr(pos + 8, min(chunk_size, file.size() - pos - 8));
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+    return "";
+}
+
+int main(int argc, char **argv) {
+    string path, out_path;
+    uint chunk_ms = 20;
+    int repeat = 10;
+
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg == "--chunk-ms" && has_value) {
+            chunk_ms = (uint) atoi(argv[++i]);
+        } else if (arg == "--repeat" && has_value) {
+            repeat = atoi(argv[++i]);
+        } else if (arg == "--out" && has_value) {
+            out_path = argv[++i];
+        } else if (arg.rfind("--", 0) == 0) {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 1;
+        } else {
+            path = arg;
+        }
+    }
+    if (path.empty() || !chunk_ms || repeat < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    ifstream in(path, ios::binary);
+    stringstream contents;
+    contents << in.rdbuf();
+    string pcm = pcm_data(contents.str());
+    pcm.resize(pcm.size() / AUDIO_BYTES_PER_SAMPLE * AUDIO_BYTES_PER_SAMPLE);
+    if (pcm.empty()) {
+        fprintf(stderr, "no audio in %s\n", path.c_str());
+        return 1;
+    }
+
+    const size_t chunk_size = audio_ms_to_bytes(chunk_ms);
+    AudioEncoderStats total;
+    string out;
+    for (int pass = 0; pass < repeat; pass++) {
+        FlacEncoder encoder;
+        out.clear();
+        for (size_t pos = 0; pos < pcm.size(); pos += chunk_size)
+            encoder.encode(&pcm[pos], min(chunk_size, pcm.size() - pos), out);
+        encoder.finish(out);
+
+        if (!pass && !out_path.empty())
+            ofstream(out_path, ios::binary).write(out.data(), out.size());
+
+        total.input_bytes += encoder.stats().input_bytes;
+        total.output_bytes += encoder.stats().output_bytes;
+        total.encode_ns += encoder.stats().encode_ns;
+    }
+
+    printf("%u ms chunks, %.1f s of audio x %d\n", chunk_ms, audio_bytes_to_ms(pcm.size()) / 1000.0, repeat);
+    printf("%s\n", total.summary("flac").c_str());
+    printf("%.0f kbit/s instead of %d, %.0fx realtime\n",
+           total.compression_ratio() * AUDIO_BYTES_PER_MS * 8, AUDIO_BYTES_PER_MS * 8,
+           total.cpu_ms_per_audio_sec() > 0 ? 1000 / total.cpu_ms_per_audio_sec() : 0);
+    return 0;
+}
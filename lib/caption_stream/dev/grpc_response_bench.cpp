@@ -0,0 +1,205 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+// Reads synthetic StreamingRecognizeResponse messages the way the gRPC backend's result reader used to (by value
+// copies of every result and alternative, a new CaptionResult per message) and the way it does now (parsed into a
+// reused message on an arena, read by reference into a reused CaptionResult). Reports time and heap allocations per
+// message and checks both see the same transcripts.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <google/cloud/speech/v1/cloud_speech.pb.h>
+
+#include "CaptionResult.h"
+
+using google::cloud::speech::v1::StreamingRecognizeResponse;
+using namespace std;
+
+static std::atomic<uint64_t> allocation_count(0);
+
+void *operator new(size_t size) {
+    allocation_count++;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+struct ReadResult {
+    uint64_t delivered = 0;
+    uint64_t checksum = 0;
+};
+
+static void count_caption(ReadResult &result, const CaptionResult &caption) {
+    result.delivered++;
+    for (const char c : caption.caption_text)
+        result.checksum = result.checksum * 31 + (unsigned char) c;
+    result.checksum += caption.final;
+}
+
+// the previous read_results_loop_thread body, minus the std::cout prints
+static void read_copying(const StreamingRecognizeResponse &response, ReadResult &read_result) {
+    for (int r = 0; r < response.results_size(); ++r) {
+        auto result = response.results(r);
+        for (int a = 0; a < result.alternatives_size(); ++a) {
+            auto alternative = result.alternatives(a);
+            CaptionResult cap_result(0, result.is_final(), result.stability(), alternative.transcript(), "");
+            count_caption(read_result, cap_result);
+            break;
+        }
+        break;
+    }
+}
+
+// deliver_response()
+static void read_by_reference(const StreamingRecognizeResponse &response, CaptionResult &caption,
+                              ReadResult &read_result) {
+    if (!response.results_size() || !response.results(0).alternatives_size())
+        return;
+
+    const auto &result = response.results(0);
+    const auto &alternative = result.alternatives(0);
+    caption.index = 0;
+    caption.final = result.is_final();
+    caption.stability = result.stability();
+    caption.caption_text.assign(alternative.transcript());
+    caption.mark_received();
+    count_caption(read_result, caption);
+}
+
+// interim responses carry the stable start and the unstable rest as two results, like the API sends them
+static void synthesize_responses(const uint count, vector<string> &messages) {
+    const char *words[] = {"the", "quick", "brown", "fox", "jumps", "over", "the", "lazy", "dog", "again"};
+    uint word_cnt = 0;
+    while (messages.size() < count) {
+        word_cnt++;
+        string transcript;
+        for (uint i = 0; i < word_cnt; i++)
+            transcript.append(i ? " " : "").append(words[i % 10]);
+
+        StreamingRecognizeResponse response;
+        auto *result = response.add_results();
+        auto *alternative = result->add_alternatives();
+        alternative->set_transcript(transcript);
+        if (word_cnt == 12) {
+            result->set_is_final(true);
+            alternative->set_confidence(0.92f);
+            word_cnt = 0;
+        } else {
+            result->set_stability(0.9f);
+            auto *unstable = response.add_results();
+            unstable->set_stability(0.01f);
+            unstable->add_alternatives()->set_transcript(string(" ") + words[word_cnt % 10]);
+        }
+        messages.push_back(response.SerializeAsString());
+    }
+}
+
+static void print_usage(const char *name) {
+    printf("usage: %s [options]\n"
+           "  --messages N   default 20000\n"
+           "  --rounds N     default 5\n",
+           name);
+}
+
+int main(int argc, char **argv) {
+    uint message_count = 20000;
+    uint rounds = 5;
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (i + 1 < argc && arg == "--messages") {
+            message_count = (uint) atoi(argv[++i]);
+        } else if (i + 1 < argc && arg == "--rounds") {
+            rounds = (uint) atoi(argv[++i]);
+            rounds = rounds ? rounds : 1;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    vector<string> messages;
+    synthesize_responses(message_count, messages);
+    size_t total_bytes = 0;
+    for (const auto &message : messages)
+        total_bytes += message.size();
+    printf("%lu messages, %lu bytes\n", messages.size(), total_bytes);
+
+    for (uint round = 0; round < rounds; round++) {
+        // grpc deserializes into the message given to Read(), the old loop reused one on the stack
+        StreamingRecognizeResponse copying_response;
+        ReadResult copying_result;
+        uint64_t allocs_before = allocation_count.load();
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &message : messages) {
+            copying_response.ParseFromString(message);
+            read_copying(copying_response, copying_result);
+        }
+        const double copying_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        const uint64_t copying_allocs = allocation_count.load() - allocs_before;
+
+        // set up once per call, outside the timing
+        google::protobuf::ArenaOptions options;
+        options.start_block_size = 8192;
+        options.max_block_size = 8192;
+        google::protobuf::Arena arena(options);
+        auto *arena_response = google::protobuf::Arena::CreateMessage<StreamingRecognizeResponse>(&arena);
+        CaptionResult caption;
+        ReadResult arena_result;
+        allocs_before = allocation_count.load();
+        start = std::chrono::steady_clock::now();
+        for (const auto &message : messages) {
+            arena_response->ParseFromString(message);
+            read_by_reference(*arena_response, caption, arena_result);
+        }
+        const double arena_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        const uint64_t arena_allocs = allocation_count.load() - allocs_before;
+
+        const bool same = copying_result.delivered == arena_result.delivered
+                          && copying_result.checksum == arena_result.checksum;
+
+        printf("round %u: copying %7.1f ns/msg %6.2f allocs/msg | arena %7.1f ns/msg %6.3f allocs/msg, "
+               "arena %llu bytes | %.2fx%s\n",
+               round + 1,
+               copying_ns / messages.size(), (double) copying_allocs / messages.size(),
+               arena_ns / messages.size(), (double) arena_allocs / messages.size(),
+               (unsigned long long) arena.SpaceAllocated(),
+               arena_ns > 0 ? copying_ns / arena_ns : 0.0,
+               same ? "" : " MISMATCH");
+        if (!same)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,244 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+// Runs N caption streams against FakeSpeechService in this process, over plaintext loopback, and reports results/sec
+// and capture -> received latency. The service replays scripted utterances with set latency, stability and aborts so
+// runs are repeatable and compare the completion queue driver to threads per stream.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "CaptionStream.h"
+#include "CaptionTrace.h"
+#include "dev/FakeSpeechService.h"
+
+using namespace std;
+
+#define BENCH_CHUNK_MS 20
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --streams N            concurrent streams, default 8\n"
+            "  --secs N               audio seconds per stream, default 10\n"
+            "  --speed N              audio feed speed, 1 is realtime, default 1\n"
+            "  --threads              a writer and a reader thread per stream instead of the completion queue\n"
+            "  --flac                 upload FLAC instead of raw LINEAR16 audio\n"
+            "  --latency-ms N         server side delay of every response, default 50\n"
+            "  --jitter-ms N          up to this much extra delay, default 0\n"
+            "  --utterance-ms N       default 3000\n"
+            "  --interim-every-ms N   default 200\n"
+            "  --stability F          of interim results, default 0.8\n"
+            "  --abort-after-secs N   the server fails every call after N audio seconds, default never\n",
+            name);
+}
+
+static int process_thread_count() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 8, "Threads:") == 0)
+            return atoi(line.c_str() + 8);
+    }
+    return -1;
+}
+
+// a second of voiced sounding audio, looped. The fake service only counts audio, this is for FLAC to have something
+// realistic to compress.
+static vector<char> synthetic_voice() {
+    const int samples = 16000;
+    vector<char> audio(samples * 2);
+    uint32_t noise = 1;
+    for (int i = 0; i < samples; i++) {
+        const double t = i / 16000.0;
+        const double pitch = 120 + 30 * sin(t * 2 * M_PI * 3);
+        double value = 0;
+        for (int harmonic = 1; harmonic <= 10; harmonic++)
+            value += 2500.0 / harmonic * sin(2 * M_PI * pitch * harmonic * t + harmonic);
+        value *= 0.5 + 0.5 * sin(t * 2 * M_PI * 4);
+        noise = noise * 1103515245u + 12345u;
+        value += (int) ((noise >> 16) % 401) - 200;
+
+        const int16_t sample = (int16_t) max(-32768.0, min(32767.0, value));
+        memcpy(&audio[i * 2], &sample, sizeof(sample));
+    }
+    return audio;
+}
+
+struct BenchStats {
+    mutex stats_mutex;
+    LatencyHistogram latency;
+    uint64_t results = 0;
+    uint64_t finals = 0;
+};
+
+int main(int argc, char **argv) {
+    int stream_count = 8;
+    int secs = 10;
+    double speed = 1;
+    bool threads = false;
+    bool flac = false;
+    unsigned int latency_ms = 50;
+    unsigned int jitter_ms = 0;
+    unsigned int utterance_ms = 3000;
+    unsigned int interim_every_ms = 200;
+    float stability = 0.8f;
+    unsigned int abort_after_secs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--streams" && has_value)
+            stream_count = atoi(argv[++i]);
+        else if (arg == "--secs" && has_value)
+            secs = atoi(argv[++i]);
+        else if (arg == "--speed" && has_value)
+            speed = atof(argv[++i]);
+        else if (arg == "--threads")
+            threads = true;
+        else if (arg == "--flac")
+            flac = true;
+        else if (arg == "--latency-ms" && has_value)
+            latency_ms = (unsigned int) atoi(argv[++i]);
+        else if (arg == "--jitter-ms" && has_value)
+            jitter_ms = (unsigned int) atoi(argv[++i]);
+        else if (arg == "--utterance-ms" && has_value)
+            utterance_ms = (unsigned int) atoi(argv[++i]);
+        else if (arg == "--interim-every-ms" && has_value)
+            interim_every_ms = (unsigned int) atoi(argv[++i]);
+        else if (arg == "--stability" && has_value)
+            stability = (float) atof(argv[++i]);
+        else if (arg == "--abort-after-secs" && has_value)
+            abort_after_secs = (unsigned int) atoi(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (stream_count < 1 || secs < 1 || speed <= 0 || !interim_every_ms || interim_every_ms > utterance_ms) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FakeSpeechScript script = FakeSpeechScript::utterances(utterance_ms, interim_every_ms, stability);
+    script.latency_ms = latency_ms;
+    script.latency_jitter_ms = jitter_ms;
+    script.abort_after_ms = abort_after_secs * 1000;
+    FakeSpeechService service(script);
+
+    int port = 0;
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+    builder.RegisterService(&service);
+    unique_ptr<grpc::Server> server = builder.BuildAndStart();
+    if (!server || !port) {
+        fprintf(stderr, "failed starting the fake service\n");
+        return 1;
+    }
+    printf("fake service on 127.0.0.1:%d, %s, %d streams, %d s at %.1fx\n", port,
+           threads ? "threads per stream" : "completion queue", stream_count, secs, speed);
+
+    CaptionStreamSettings settings(5000, 5000, 180'000, 1000, AUDIO_QUEUE_DROP_OLDEST, "en-US", 0, "");
+    settings.endpoint_host = "127.0.0.1";
+    settings.endpoint_port_up = (uint) port;
+    settings.endpoint_insecure = true;
+    settings.use_io_reactor = !threads;
+    settings.upload_encoding = flac ? AUDIO_UPLOAD_FLAC : AUDIO_UPLOAD_LINEAR16;
+
+    BenchStats stats;
+    vector<shared_ptr<CaptionStream>> streams;
+    for (int i = 0; i < stream_count; i++) {
+        auto stream = make_shared<CaptionStream>(settings);
+        stream->on_caption_cb_handle.set([&stats](const CaptionResult &result) {
+            const double ms = result.trace.ms_between(CAPTION_TRACE_CAPTURE, CAPTION_TRACE_RECEIVED);
+            lock_guard<mutex> lock(stats.stats_mutex);
+            stats.results++;
+            if (result.final)
+                stats.finals++;
+            if (ms >= 0)
+                stats.latency.add(ms);
+        }, true);
+
+        if (!stream->start(stream)) {
+            fprintf(stderr, "stream %d failed starting\n", i);
+            return 1;
+        }
+        streams.push_back(stream);
+    }
+
+    const vector<char> audio = synthetic_voice();
+    const size_t chunk_size = BENCH_CHUNK_MS * FAKE_SPEECH_BYTES_PER_MS;
+    const auto chunk_interval = chrono::microseconds((long long) (BENCH_CHUNK_MS * 1000 / speed));
+    const int chunk_count = secs * 1000 / BENCH_CHUNK_MS;
+    const int threads_before = process_thread_count();
+
+    const auto started_at = chrono::steady_clock::now();
+    auto next_at = started_at;
+    int peak_threads = threads_before;
+    for (int i = 0; i < chunk_count; i++) {
+        const auto captured_at = chrono::steady_clock::now();
+        const char *chunk = &audio[(i * chunk_size) % audio.size()];
+        for (auto &stream : streams) {
+            if (!stream->is_stopped())
+                stream->queue_audio_data(chunk, (uint) chunk_size, captured_at);
+        }
+
+        if (i % 50 == 0)
+            peak_threads = max(peak_threads, process_thread_count());
+
+        next_at += chunk_interval;
+        this_thread::sleep_until(next_at);
+    }
+
+    // let the last responses through, then end every call
+    this_thread::sleep_for(chrono::milliseconds(latency_ms + jitter_ms + 200));
+    const double elapsed_secs = chrono::duration<double>(chrono::steady_clock::now() - started_at).count();
+    for (auto &stream : streams) {
+        stream->on_caption_cb_handle.clear();
+        stream->stop();
+    }
+    streams.clear();
+
+    server->Shutdown(chrono::system_clock::now() + chrono::seconds(2));
+
+    lock_guard<mutex> lock(stats.stats_mutex);
+    printf("results: %llu (%.1f/s), finals: %llu\n", (unsigned long long) stats.results,
+           stats.results / elapsed_secs, (unsigned long long) stats.finals);
+    printf("capture->received ms: p50 %.1f, p99 %.1f, max %.1f\n", stats.latency.percentile_ms(0.5),
+           stats.latency.percentile_ms(0.99), stats.latency.get_max_ms());
+    const double audio_secs = service.audio_bytes.load() / (FAKE_SPEECH_BYTES_PER_MS * 1000.0);
+    printf("server: %u calls, %u aborted, %llu responses sent, %.1f audio s\n", service.calls.load(),
+           service.aborted.load(), (unsigned long long) service.responses_sent.load(), audio_secs);
+    printf("upload: %.1f KiB, %.1f kbit/s per stream\n", service.upload_bytes.load() / 1024.0,
+           audio_secs > 0 ? service.upload_bytes.load() * 8 / audio_secs / 1000 : 0);
+    printf("process threads: %d while streaming (%d before feeding), server threads included\n", peak_threads,
+           threads_before);
+    return 0;
+}
@@ -0,0 +1,393 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+// Headless driver feeding WAV/raw PCM files through ContinuousCaptions without OBS, printing every caption
+// result with timings. Point it at a local server with --host/--port-up/--port-down for reproducible runs.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ContinuousCaptions.h"
+#include "AudioRingBuffer.h"
+
+using namespace std;
+
+// read only memory mapping of a whole file
+class MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+public:
+    explicit MappedFile(const string &path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw string("failed opening file");
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || !file_size.QuadPart)
+            throw string("failed getting file size");
+        size = (size_t) file_size.QuadPart;
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping)
+            throw string("failed mapping file");
+
+        data = (const char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data)
+            throw string("failed mapping file view");
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            throw string("failed opening file");
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 || !st.st_size) {
+            ::close(fd);
+            throw string("failed getting file size");
+        }
+        size = (size_t) st.st_size;
+
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+            throw string("failed mapping file");
+
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = (const char *) mapped;
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *get_data() const {
+        return data;
+    }
+
+    size_t get_size() const {
+        return size;
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (data)
+            munmap((void *) data, size);
+#endif
+    }
+};
+
+static uint32_t read_le32(const char *p) {
+    const unsigned char *u = (const unsigned char *) p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t) u[3] << 24);
+}
+
+static uint16_t read_le16(const char *p) {
+    const unsigned char *u = (const unsigned char *) p;
+    return (uint16_t) (u[0] | (u[1] << 8));
+}
+
+// finds the PCM samples in a mapped file. WAV files must already be 16kHz mono 16 bit, anything else is taken as raw PCM in that format.
+static bool find_pcm_data(const MappedFile &file, const char **pcm, size_t *pcm_size, string &error) {
+    const char *data = file.get_data();
+    const size_t size = file.get_size();
+
+    if (size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)) {
+        *pcm = data;
+        *pcm_size = size / AUDIO_BYTES_PER_SAMPLE * AUDIO_BYTES_PER_SAMPLE;
+        return true;
+    }
+
+    bool got_format = false;
+    size_t pos = 12;
+    while (pos + 8 <= size) {
+        const char *chunk_id = data + pos;
+        const size_t chunk_size = read_le32(data + pos + 4);
+        const char *chunk = data + pos + 8;
+        const size_t chunk_available = std::min(chunk_size, size - pos - 8);
+
+        if (!memcmp(chunk_id, "fmt ", 4)) {
+            if (chunk_available < 16) {
+                error = "broken fmt chunk";
+                return false;
+            }
+            const uint16_t format = read_le16(chunk);
+            const uint16_t channels = read_le16(chunk + 2);
+            const uint32_t sample_rate = read_le32(chunk + 4);
+            const uint16_t bits = read_le16(chunk + 14);
+            if (format != 1 || channels != 1 || sample_rate != AUDIO_SAMPLE_RATE || bits != 16) {
+                error = "unsupported WAV format, need 16kHz mono 16 bit PCM, got format " + to_string(format)
+                        + " channels " + to_string(channels) + " rate " + to_string(sample_rate) + " bits " + to_string(bits);
+                return false;
+            }
+            got_format = true;
+        } else if (!memcmp(chunk_id, "data", 4)) {
+            if (!got_format) {
+                error = "data chunk before fmt chunk";
+                return false;
+            }
+            *pcm = chunk;
+            *pcm_size = chunk_available / AUDIO_BYTES_PER_SAMPLE * AUDIO_BYTES_PER_SAMPLE;
+            return true;
+        }
+
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    error = "no data chunk";
+    return false;
+}
+
+struct DevMainSettings {
+    vector<string> files;
+    double speed = 1.0; // 0: as fast as possible
+    uint chunk_ms = 10; // OBS delivers roughly 10ms blocks
+    uint tail_secs = 5;
+    uint loops = 1;
+    bool print_raw = false;
+};
+
+static void print_usage(const char *name) {
+    printf("usage: %s [options] file.wav|file.pcm [more files...]\n"
+           "  --host HOST          speech API host\n"
+           "  --port-up PORT       upstream port\n"
+           "  --port-down PORT     downstream port\n"
+           "  --api-key KEY\n"
+           "  --lang LANG          default en-US\n"
+           "  --speed X            playback speed, 1 = realtime, 0 = as fast as possible\n"
+           "  --chunk-ms MS        audio block size queued at once, default 10\n"
+           "  --loops N            play the file list N times\n"
+           "  --tail-secs S        keep waiting for results after the audio ended, default 5\n"
+           "  --connect-after S    start the second stream after S seconds, default 280\n"
+           "  --switchover-after S switch to it S seconds later, default 5\n"
+           "  --replay-secs S      audio kept for replaying into a stream replacing a dead one, default 10\n"
+           "  --switch-anywhere    switch right away instead of waiting for a final result or a pause\n"
+           "  --raw                print raw result messages too\n"
+           "  --threads            blocking threads per stream instead of the IoReactor (grpc: completion queue)\n"
+           "  --flac               upload FLAC instead of raw LINEAR16 audio\n"
+           "  --no-nodelay         leave Nagle's algorithm on\n"
+           "  --sndbuf BYTES       socket send buffer size, default OS\n"
+           "  --rcvbuf BYTES       socket receive buffer size, default OS\n"
+           "  --keepalive-idle S   TCP keepalive idle time, 0 disables keepalive, default 30\n"
+           "  --user-timeout MS    TCP_USER_TIMEOUT, default OS\n",
+           name);
+}
+
+int main(int argc, char **argv) {
+    DevMainSettings dev_settings;
+    CaptionStreamSettings stream_settings(5000, 5000, 180'000, 1000, AUDIO_QUEUE_DROP_OLDEST, "en-US", 0, "");
+    uint connect_after_secs = 280;
+    uint switchover_after_secs = 5;
+    uint replay_secs = 10;
+    bool switch_anywhere = false;
+
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg == "--raw") {
+            dev_settings.print_raw = true;
+        } else if (arg == "--threads") {
+            stream_settings.use_io_reactor = false;
+        } else if (arg == "--flac") {
+            stream_settings.upload_encoding = AUDIO_UPLOAD_FLAC;
+        } else if (arg == "--switch-anywhere") {
+            switch_anywhere = true;
+        } else if (arg == "--no-nodelay") {
+            stream_settings.socket_options.no_delay = false;
+        } else if (arg.rfind("--", 0) == 0 && !has_value) {
+            fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return 1;
+        } else if (arg == "--host") {
+            stream_settings.endpoint_host = argv[++i];
+        } else if (arg == "--port-up") {
+            stream_settings.endpoint_port_up = (uint) atoi(argv[++i]);
+        } else if (arg == "--port-down") {
+            stream_settings.endpoint_port_down = (uint) atoi(argv[++i]);
+        } else if (arg == "--api-key") {
+            stream_settings.api_key = argv[++i];
+        } else if (arg == "--lang") {
+            stream_settings.language = argv[++i];
+        } else if (arg == "--sndbuf") {
+            stream_settings.socket_options.send_buffer_size = (uint) atoi(argv[++i]);
+        } else if (arg == "--rcvbuf") {
+            stream_settings.socket_options.recv_buffer_size = (uint) atoi(argv[++i]);
+        } else if (arg == "--keepalive-idle") {
+            stream_settings.socket_options.keepalive_idle_secs = (uint) atoi(argv[++i]);
+        } else if (arg == "--user-timeout") {
+            stream_settings.socket_options.user_timeout_ms = (uint) atoi(argv[++i]);
+        } else if (arg == "--speed") {
+            dev_settings.speed = atof(argv[++i]);
+        } else if (arg == "--chunk-ms") {
+            dev_settings.chunk_ms = (uint) atoi(argv[++i]);
+        } else if (arg == "--loops") {
+            dev_settings.loops = (uint) atoi(argv[++i]);
+        } else if (arg == "--tail-secs") {
+            dev_settings.tail_secs = (uint) atoi(argv[++i]);
+        } else if (arg == "--connect-after") {
+            connect_after_secs = (uint) atoi(argv[++i]);
+        } else if (arg == "--switchover-after") {
+            switchover_after_secs = (uint) atoi(argv[++i]);
+        } else if (arg == "--replay-secs") {
+            replay_secs = (uint) atoi(argv[++i]);
+        } else if (arg.rfind("--", 0) == 0) {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            dev_settings.files.push_back(arg);
+        }
+    }
+
+    if (dev_settings.files.empty() || !dev_settings.chunk_ms) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    vector<unique_ptr<MappedFile>> mapped_files;
+    vector<pair<const char *, size_t>> pcm_parts;
+    for (const string &path : dev_settings.files) {
+        try {
+            mapped_files.emplace_back(new MappedFile(path));
+        } catch (const string &ex) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), ex.c_str());
+            return 1;
+        }
+
+        const char *pcm;
+        size_t pcm_size;
+        string error;
+        if (!find_pcm_data(*mapped_files.back(), &pcm, &pcm_size, error)) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+            return 1;
+        }
+        printf("%s: %u ms of audio\n", path.c_str(), audio_bytes_to_ms(pcm_size));
+        pcm_parts.emplace_back(pcm, pcm_size);
+    }
+
+    ContinuousCaptionStreamSettings settings(connect_after_secs, switchover_after_secs, 10, stream_settings);
+    settings.replay_buffer_secs = replay_secs;
+    if (switch_anywhere)
+        settings.switchover_deadline_secs = 0;
+    settings.print();
+
+    const auto started_at = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> queued_audio_ms(0);
+
+    std::mutex print_mutex;
+    uint result_count = 0;
+    uint final_count = 0;
+    double first_result_ms = -1;
+    auto last_result_at = started_at;
+    CaptionLatencyStats latency_stats;
+
+    ContinuousCaptions captions(settings);
+    captions.on_caption_cb_handle.set([&](const CaptionResult &result, bool interrupted) {
+        const auto now = std::chrono::steady_clock::now();
+        const double since_start_ms = std::chrono::duration<double, std::milli>(now - started_at).count();
+        const double since_last_ms = std::chrono::duration<double, std::milli>(now - last_result_at).count();
+
+        std::lock_guard<std::mutex> lock(print_mutex);
+        last_result_at = now;
+        result_count++;
+        if (result.final)
+            final_count++;
+        if (first_result_ms < 0)
+            first_result_ms = since_start_ms;
+        latency_stats.record_result(result.trace);
+
+        printf("%9.1f ms | audio %7llu ms | +%7.1f ms | lat %7.1f ms | #%-4d %s stab %.3f%s | %s\n",
+               since_start_ms, (unsigned long long) queued_audio_ms.load(), since_last_ms,
+               result.trace.ms_between(CAPTION_TRACE_CAPTURE, CAPTION_TRACE_RECEIVED),
+               result.index, result.final ? "FINAL" : "     ", result.stability,
+               interrupted ? " INTERRUPTED" : "", result.caption_text.c_str());
+        if (dev_settings.print_raw)
+            printf("    raw: %s\n", result.raw_message.c_str());
+        fflush(stdout);
+    });
+
+    const size_t chunk_bytes = audio_ms_to_bytes(dev_settings.chunk_ms);
+    uint64_t sent_bytes = 0;
+    uint rejected_chunks = 0;
+    for (uint loop = 0; loop < dev_settings.loops; loop++) {
+        for (const auto &part : pcm_parts) {
+            for (size_t pos = 0; pos < part.second; pos += chunk_bytes) {
+                const size_t size = std::min(chunk_bytes, part.second - pos);
+                if (!captions.queue_audio_data(part.first + pos, (uint) size))
+                    rejected_chunks++;
+
+                sent_bytes += size;
+                queued_audio_ms.store(audio_bytes_to_ms(sent_bytes));
+
+                if (dev_settings.speed > 0) {
+                    const auto due = started_at + std::chrono::microseconds(
+                            (int64_t) (sent_bytes * 1000 / AUDIO_BYTES_PER_MS / dev_settings.speed));
+                    std::this_thread::sleep_until(due);
+                }
+            }
+        }
+    }
+
+    const double audio_done_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - started_at).count();
+    printf("all audio queued after %.1f ms, waiting %u s for remaining results\n", audio_done_ms, dev_settings.tail_secs);
+    std::this_thread::sleep_for(std::chrono::seconds(dev_settings.tail_secs));
+    captions.on_caption_cb_handle.clear();
+
+    {
+        std::lock_guard<std::mutex> lock(print_mutex);
+        const double audio_secs = audio_bytes_to_ms(sent_bytes) / 1000.0;
+        printf("\naudio: %.1f s in %.1f s (%.1fx realtime), rejected chunks: %u\n",
+               audio_secs, audio_done_ms / 1000.0, audio_done_ms > 0 ? audio_secs * 1000.0 / audio_done_ms : 0.0,
+               rejected_chunks);
+        printf("results: %u, finals: %u, first result after %.1f ms, %.2f results/s\n",
+               result_count, final_count, first_result_ms, audio_done_ms > 0 ? result_count * 1000.0 / audio_done_ms : 0.0);
+        printf("latency:\n%s", latency_stats.summary("    ").c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,623 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+// Local stand-in for the google_http_older full-duplex speech API: a chunked POST to /speech-api/full-duplex/v1/up
+// and a GET to /speech-api/full-duplex/v1/down, paired by the pair= query parameter. Results are scripted, one
+// word per word_ms of received audio, with injectable latency, forced disconnects and the ~5 minute session cutoff.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <plibsys.h>
+
+#include "AudioEncoder.h"
+#include "AudioRingBuffer.h"
+#include "log.h"
+
+using namespace std;
+
+#define MOCK_BUFFER_SIZE 4096
+#define MOCK_HEAD_MAX_SIZE 16384
+
+struct MockServerSettings {
+    uint port = 9125;
+    vector<string> script;
+
+    uint word_ms = 300; // audio per scripted word
+    uint final_after_ms = 500; // extra audio after the last word of an utterance before its final result
+    uint latency_ms = 0;
+    uint latency_jitter_ms = 0;
+
+    uint session_limit_secs = 300; // the API drops sessions after ~5 minutes
+    uint disconnect_after_secs = 0; // forced disconnect of every session, 0 off
+    uint fail_every = 0; // answer every Nth session with an error, 0 off
+    bool send_empty_first = true; // the API starts every downstream with an empty result
+    string capture_path; // downstream body bytes of every session appended here, for replaying in benchmarks
+};
+
+static const char *default_script[] = {
+        "the quick brown fox jumps over the lazy dog",
+        "pack my box with five dozen liquor jugs",
+        "how vexingly quick daft zebras jump",
+        "sphinx of black quartz judge my vow",
+};
+
+struct MockSession {
+    const string pair;
+    const uint number;
+    const std::chrono::steady_clock::time_point created_at;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    uint64_t audio_bytes = 0;
+    bool upload_done = false;
+    bool upload_ended = false; // the request was finished with the last chunk, not just closed
+    bool killed = false;
+    string kill_reason;
+    PSocket *upstream = nullptr;
+    PSocket *downstream = nullptr;
+
+    std::atomic<uint> results_sent;
+
+    MockSession(const string &pair, uint number) :
+            pair(pair),
+            number(number),
+            created_at(std::chrono::steady_clock::now()),
+            results_sent(0) {}
+
+    double age_secs() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - created_at).count();
+    }
+
+    uint audio_ms() const {
+        return audio_bytes_to_ms(audio_bytes);
+    }
+
+    // closes both directions so blocked reads on either connection return
+    void kill(const string &reason) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (killed)
+            return;
+
+        killed = true;
+        kill_reason = reason;
+        if (upstream)
+            p_socket_shutdown(upstream, TRUE, TRUE, nullptr);
+        if (downstream)
+            p_socket_shutdown(downstream, TRUE, TRUE, nullptr);
+        changed.notify_all();
+    }
+};
+
+class MockSpeechServer {
+    MockServerSettings settings;
+
+    std::mutex sessions_mutex;
+    map<string, shared_ptr<MockSession>> sessions;
+    uint session_count = 0;
+
+    std::mt19937 random_gen;
+    std::mutex random_mutex;
+
+    FILE *capture_file = nullptr;
+    std::mutex capture_mutex;
+
+    shared_ptr<MockSession> get_session(const string &pair) {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        auto found = sessions.find(pair);
+        if (found != sessions.end())
+            return found->second;
+
+        auto session = make_shared<MockSession>(pair, ++session_count);
+        sessions[pair] = session;
+        info_log("session %u created, pair %s", session->number, pair.c_str());
+        std::thread(&MockSpeechServer::watchdog_run, this, session).detach();
+        return session;
+    }
+
+    void remove_session(const shared_ptr<MockSession> &session) {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        sessions.erase(session->pair);
+    }
+
+    uint next_latency_ms() {
+        if (!settings.latency_jitter_ms)
+            return settings.latency_ms;
+
+        std::lock_guard<std::mutex> lock(random_mutex);
+        return settings.latency_ms + random_gen() % (settings.latency_jitter_ms + 1);
+    }
+
+    bool should_fail(const MockSession &session) const {
+        return settings.fail_every && session.number % settings.fail_every == 0;
+    }
+
+    static bool send_all(PSocket *socket, const char *data, size_t size) {
+        while (size) {
+            const pssize sent = p_socket_send(socket, data, size, nullptr);
+            if (sent <= 0)
+                return false;
+            data += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    static bool send_all(PSocket *socket, const string &data) {
+        return send_all(socket, data.c_str(), data.size());
+    }
+
+    void capture(const string &data) {
+        if (!capture_file)
+            return;
+
+        std::lock_guard<std::mutex> lock(capture_mutex);
+        fwrite(data.data(), 1, data.size(), capture_file);
+        fflush(capture_file);
+    }
+
+    bool send_chunk(PSocket *socket, const string &data) {
+        char size_line[24];
+        snprintf(size_line, sizeof(size_line), "%zx\r\n", data.size());
+        const string chunk = string(size_line) + data + "\r\n";
+        if (!send_all(socket, chunk))
+            return false;
+
+        capture(chunk);
+        return true;
+    }
+
+    static string json_escape(const string &text) {
+        string out;
+        for (const char c : text) {
+            if (c == '"' || c == '\\')
+                out.push_back('\\');
+            if ((unsigned char) c < 0x20)
+                continue;
+            out.push_back(c);
+        }
+        return out;
+    }
+
+    static string result_json(const string &transcript, const bool final, const double stability, const int result_index) {
+        ostringstream json;
+        json << "{\"result\":[{\"alternative\":[{\"transcript\":\"" << json_escape(transcript) << "\"";
+        if (final)
+            json << ",\"confidence\":0.92}],\"final\":true}]";
+        else
+            json << "}],\"stability\":" << stability << "}]";
+        json << ",\"result_index\":" << result_index << "}";
+        return json.str();
+    }
+
+    // reads the request head, returns false on error. rest gets whatever was read past the head.
+    static bool read_head(PSocket *socket, string &head, string &rest) {
+        char buffer[MOCK_BUFFER_SIZE];
+        size_t end;
+        while ((end = rest.find("\r\n\r\n")) == string::npos) {
+            if (rest.size() > MOCK_HEAD_MAX_SIZE)
+                return false;
+
+            const pssize read = p_socket_receive(socket, buffer, sizeof(buffer), nullptr);
+            if (read <= 0)
+                return false;
+            rest.append(buffer, read);
+        }
+        head = rest.substr(0, end);
+        rest.erase(0, end + 4);
+        return true;
+    }
+
+    static string query_param(const string &path, const string &name) {
+        const size_t query_start = path.find('?');
+        if (query_start == string::npos)
+            return "";
+
+        istringstream query(path.substr(query_start + 1));
+        string param;
+        while (getline(query, param, '&')) {
+            if (param.compare(0, name.size() + 1, name + "=") == 0)
+                return param.substr(name.size() + 1);
+        }
+        return "";
+    }
+
+    void handle_upstream(PSocket *socket, const shared_ptr<MockSession> &session, string rest, const bool flac) {
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            session->upstream = socket;
+        }
+
+        // chunked body, every chunk is raw LINEAR16 audio or FLAC frames
+        char buffer[MOCK_BUFFER_SIZE];
+        string flac_chunk;
+        bool clean_end = false;
+        bool in_chunk = false;
+        size_t chunk_left = 0; // payload plus its trailing CRLF
+        while (!clean_end) {
+            bool progressed = false;
+            if (!in_chunk) {
+                const size_t crlf = rest.find("\r\n");
+                if (crlf != string::npos) {
+                    const size_t chunk_size = strtoul(rest.substr(0, crlf).c_str(), nullptr, 16);
+                    rest.erase(0, crlf + 2);
+                    if (!chunk_size) {
+                        clean_end = true;
+                        break;
+                    }
+                    in_chunk = true;
+                    chunk_left = chunk_size + 2;
+                    progressed = true;
+                }
+            } else if (!rest.empty()) {
+                const size_t use = std::min(rest.size(), chunk_left);
+                const size_t audio = std::min(use, chunk_left > 2 ? chunk_left - 2 : 0);
+                if (audio && !flac) {
+                    std::lock_guard<std::mutex> lock(session->mutex);
+                    session->audio_bytes += audio;
+                    session->changed.notify_all();
+                }
+                if (audio && flac)
+                    flac_chunk.append(rest, 0, audio);
+                chunk_left -= use;
+                rest.erase(0, use);
+                in_chunk = chunk_left != 0;
+
+                if (flac && !in_chunk) {
+                    const uint64_t end_bytes = flac_upload_end_sample(flac_chunk) * AUDIO_BYTES_PER_SAMPLE;
+                    flac_chunk.clear();
+                    std::lock_guard<std::mutex> lock(session->mutex);
+                    if (end_bytes > session->audio_bytes) {
+                        session->audio_bytes = end_bytes;
+                        session->changed.notify_all();
+                    }
+                }
+                progressed = true;
+            }
+            if (progressed)
+                continue;
+
+            const pssize read = p_socket_receive(socket, buffer, sizeof(buffer), nullptr);
+            if (read <= 0)
+                break;
+            rest.append(buffer, read);
+        }
+
+        if (clean_end)
+            send_all(socket, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 0\r\n\r\n");
+
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            session->upload_done = true;
+            session->upload_ended = clean_end;
+            session->upstream = nullptr;
+            session->changed.notify_all();
+        }
+        info_log("session %u upstream %s after %.1f s, %u ms audio", session->number,
+                 clean_end ? "finished" : "closed", session->age_secs(), session->audio_ms());
+    }
+
+    void handle_downstream(PSocket *socket, const shared_ptr<MockSession> &session) {
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            session->downstream = socket;
+        }
+
+        if (!send_all(socket, "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/json; charset=utf-8\r\n"
+                              "Transfer-Encoding: chunked\r\n\r\n"))
+            return;
+
+        if (settings.send_empty_first && !send_chunk(socket, "{\"result\":[]}\n"))
+            return;
+
+        size_t utterance_i = (session->number - 1) % settings.script.size();
+        vector<string> words;
+        {
+            istringstream utterance(settings.script[utterance_i]);
+            string word;
+            while (utterance >> word)
+                words.push_back(word);
+        }
+        size_t word_cnt = 0;
+        int result_index = 0;
+        uint64_t utterance_start_ms = 0;
+
+        while (true) {
+            const uint64_t next_at_ms = utterance_start_ms + (word_cnt < words.size()
+                                                              ? (word_cnt + 1) * (uint64_t) settings.word_ms
+                                                              : words.size() * (uint64_t) settings.word_ms + settings.final_after_ms);
+            {
+                std::unique_lock<std::mutex> lock(session->mutex);
+                session->changed.wait_for(lock, std::chrono::milliseconds(200), [&] {
+                    return session->killed || session->upload_done || session->audio_ms() >= next_at_ms;
+                });
+                if (session->killed)
+                    break;
+
+                if (session->audio_ms() < next_at_ms) {
+                    // the end of the request finalizes what was heard of the utterance so far
+                    if (!session->upload_done)
+                        continue;
+                    if (!session->upload_ended || !word_cnt)
+                        break;
+                    words.resize(word_cnt);
+                }
+            }
+
+            const auto triggered_at = std::chrono::steady_clock::now();
+            string json;
+            if (word_cnt < words.size()) {
+                word_cnt++;
+                string transcript;
+                for (size_t i = 0; i < word_cnt; i++)
+                    transcript.append(i ? " " : "").append(words[i]);
+                json = result_json(transcript, false, std::min(0.9, 0.1 * word_cnt), result_index);
+            } else {
+                string transcript;
+                for (size_t i = 0; i < words.size(); i++)
+                    transcript.append(i ? " " : "").append(words[i]);
+                json = result_json(transcript, true, 0, result_index);
+
+                result_index++;
+                utterance_start_ms = next_at_ms;
+                utterance_i = (utterance_i + 1) % settings.script.size();
+                words.clear();
+                word_cnt = 0;
+                istringstream utterance(settings.script[utterance_i]);
+                string word;
+                while (utterance >> word)
+                    words.push_back(word);
+            }
+
+            const uint latency = next_latency_ms();
+            if (latency)
+                std::this_thread::sleep_until(triggered_at + std::chrono::milliseconds(latency));
+
+            if (!send_chunk(socket, json + "\n"))
+                break;
+            session->results_sent++;
+        }
+
+        // after a clean upload end the API sends the rest and finishes the response
+        bool clean = false;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            clean = !session->killed;
+            session->downstream = nullptr;
+        }
+        if (clean && send_all(socket, "0\r\n\r\n"))
+            capture("0\r\n\r\n");
+
+        info_log("session %u downstream done after %.1f s, %u results sent", session->number, session->age_secs(),
+                 session->results_sent.load());
+    }
+
+    void watchdog_run(shared_ptr<MockSession> session) {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(session->mutex);
+                session->changed.wait_for(lock, std::chrono::milliseconds(100));
+                if (session->killed || (session->upload_done && !session->downstream))
+                    break;
+            }
+
+            const double age = session->age_secs();
+            if (settings.session_limit_secs && age >= settings.session_limit_secs) {
+                session->kill("session time limit");
+                break;
+            }
+            if (settings.disconnect_after_secs && age >= settings.disconnect_after_secs) {
+                session->kill("forced disconnect");
+                break;
+            }
+        }
+
+        if (session->killed)
+            info_log("session %u killed after %.1f s: %s", session->number, session->age_secs(),
+                     session->kill_reason.c_str());
+    }
+
+    void connection_run(PSocket *socket) {
+        string head, rest;
+        if (!read_head(socket, head, rest)) {
+            p_socket_free(socket);
+            return;
+        }
+
+        const size_t line_end = head.find("\r\n");
+        istringstream request_line(head.substr(0, line_end));
+        string method, path;
+        request_line >> method >> path;
+
+        const string pair = query_param(path, "pair");
+        const bool is_up = method == "POST" && path.find("/speech-api/full-duplex/v1/up") == 0;
+        const bool is_down = method == "GET" && path.find("/speech-api/full-duplex/v1/down") == 0;
+        if ((!is_up && !is_down) || pair.empty()) {
+            debug_log("bad request: %s %s", method.c_str(), path.c_str());
+            send_all(socket, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+            p_socket_free(socket);
+            return;
+        }
+
+        auto session = get_session(pair);
+        if (should_fail(*session)) {
+            info_log("session %u failing %s on purpose", session->number, is_up ? "upstream" : "downstream");
+            send_all(socket, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+        } else {
+            if (is_up)
+                handle_upstream(socket, session, rest, head.find("audio/x-flac") != string::npos);
+            else
+                handle_downstream(socket, session);
+        }
+
+        p_socket_close(socket, nullptr);
+        p_socket_free(socket);
+
+        std::lock_guard<std::mutex> lock(session->mutex);
+        if ((session->upload_done || session->killed) && !session->downstream && !session->upstream)
+            remove_session(session);
+    }
+
+public:
+    explicit MockSpeechServer(const MockServerSettings &settings) :
+            settings(settings),
+            random_gen(std::random_device()()) {
+    }
+
+    int run() {
+        if (!settings.capture_path.empty()) {
+            capture_file = fopen(settings.capture_path.c_str(), "ab");
+            if (!capture_file) {
+                error_log("failed opening capture file %s", settings.capture_path.c_str());
+                return 1;
+            }
+        }
+
+        PError *error = nullptr;
+        PSocketAddress *address = p_socket_address_new("127.0.0.1", (puint16) settings.port);
+        PSocket *listen_socket = p_socket_new(P_SOCKET_FAMILY_INET, P_SOCKET_TYPE_STREAM, P_SOCKET_PROTOCOL_TCP, &error);
+        if (!address || !listen_socket) {
+            error_log("failed creating listen socket");
+            return 1;
+        }
+
+        if (!p_socket_bind(listen_socket, address, TRUE, &error) || !p_socket_listen(listen_socket, &error)) {
+            error_log("failed listening on port %u", settings.port);
+            p_socket_address_free(address);
+            p_socket_free(listen_socket);
+            return 1;
+        }
+        p_socket_address_free(address);
+
+        info_log("mock speech server listening on 127.0.0.1:%u, %lu scripted utterances, word %u ms, latency %u+%u ms, "
+                 "session limit %u s, disconnect after %u s, fail every %u",
+                 settings.port, settings.script.size(), settings.word_ms, settings.latency_ms, settings.latency_jitter_ms,
+                 settings.session_limit_secs, settings.disconnect_after_secs, settings.fail_every);
+
+        while (true) {
+            PSocket *socket = p_socket_accept(listen_socket, &error);
+            if (!socket) {
+                if (error) {
+                    p_error_free(error);
+                    error = nullptr;
+                }
+                continue;
+            }
+            std::thread(&MockSpeechServer::connection_run, this, socket).detach();
+        }
+    }
+};
+
+static void print_usage(const char *name) {
+    printf("usage: %s [options]\n"
+           "  --port PORT                listen port, default 9125\n"
+           "  --script FILE              one utterance per line\n"
+           "  --word-ms MS               audio per scripted word, default 300\n"
+           "  --final-after-ms MS        audio after the last word before the final result, default 500\n"
+           "  --latency-ms MS            delay before every result is sent\n"
+           "  --latency-jitter-ms MS     random extra delay up to this\n"
+           "  --session-limit-secs S     drop sessions after S seconds, default 300, 0 off\n"
+           "  --disconnect-after-secs S  drop every session after S seconds, 0 off\n"
+           "  --fail-every N             answer every Nth session with 503\n"
+           "  --no-empty-first           don't start downstreams with an empty result\n"
+           "  --capture FILE             append the downstream body bytes of all sessions to FILE\n",
+           name);
+}
+
+int main(int argc, char **argv) {
+    MockServerSettings settings;
+    string script_path;
+
+    for (int i = 1; i < argc; i++) {
+        const string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg == "--no-empty-first") {
+            settings.send_empty_first = false;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (arg == "--port")
+            settings.port = (uint) atoi(value);
+        else if (arg == "--script")
+            script_path = value;
+        else if (arg == "--word-ms")
+            settings.word_ms = (uint) atoi(value);
+        else if (arg == "--final-after-ms")
+            settings.final_after_ms = (uint) atoi(value);
+        else if (arg == "--latency-ms")
+            settings.latency_ms = (uint) atoi(value);
+        else if (arg == "--latency-jitter-ms")
+            settings.latency_jitter_ms = (uint) atoi(value);
+        else if (arg == "--session-limit-secs")
+            settings.session_limit_secs = (uint) atoi(value);
+        else if (arg == "--disconnect-after-secs")
+            settings.disconnect_after_secs = (uint) atoi(value);
+        else if (arg == "--fail-every")
+            settings.fail_every = (uint) atoi(value);
+        else if (arg == "--capture")
+            settings.capture_path = value;
+        else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!script_path.empty()) {
+        ifstream script_file(script_path);
+        if (!script_file) {
+            fprintf(stderr, "failed opening script %s\n", script_path.c_str());
+            return 1;
+        }
+        string line;
+        while (getline(script_file, line)) {
+            if (line.find_first_not_of(" \t\r") != string::npos)
+                settings.script.push_back(line);
+        }
+    }
+    if (settings.script.empty())
+        settings.script.assign(std::begin(default_script), std::end(default_script));
+
+    if (!settings.word_ms)
+        settings.word_ms = 1;
+
+    p_libsys_init();
+    MockSpeechServer server(settings);
+    const int ret = server.run();
+    p_libsys_shutdown();
+    return ret;
+}
@@ -0,0 +1,518 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_CAPTIONRESULTPARSER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_CAPTIONRESULTPARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "CaptionResult.h"
+
+#define CAPTION_PARSER_MAX_DEPTH 32
+
+enum caption_parse_status {
+    CAPTION_PARSE_OK = 0,
+    CAPTION_PARSE_EMPTY, // valid message without any transcript, eg. the first one of every stream
+    CAPTION_PARSE_ERROR,
+};
+
+/*
+ Single pass parser for the downstream messages, eg.
+   {"result":[{"alternative":[{"transcript":"hello there","confidence":0.9}],"final":true}],"result_index":0}
+
+ Only result_index and per result final, stability and the first alternative's transcript are looked at, everything
+ else is skipped over without being decoded. Strings are kept as spans into the message, only the chosen transcript
+ is unescaped, into the reused caption_text buffer. No exceptions, no allocations once the result buffers are big
+ enough.
+
+ Picks the first final transcript, otherwise the non final one with the highest stability.
+ */
+class CaptionResultParser {
+    struct StringSpan {
+        const char *data = nullptr;
+        size_t size = 0;
+        bool escaped = false;
+    };
+
+    struct ResultEntry {
+        StringSpan transcript;
+        bool final = false;
+        bool has_stability = false;
+        double stability = 0.0;
+    };
+
+    const char *pos = nullptr;
+    const char *end = nullptr;
+    const char *error = nullptr;
+    int depth = 0;
+
+    bool fail(const char *msg) {
+        if (!error)
+            error = msg;
+        return false;
+    }
+
+    void skip_ws() {
+        while (pos < end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t'))
+            pos++;
+    }
+
+    bool consume(const char c) {
+        skip_ws();
+        if (pos < end && *pos == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool expect(const char c) {
+        if (consume(c))
+            return true;
+        return fail("unexpected character");
+    }
+
+    static bool span_equals(const StringSpan &span, const char *literal) {
+        const size_t len = strlen(literal);
+        return !span.escaped && span.size == len && memcmp(span.data, literal, len) == 0;
+    }
+
+    bool parse_string(StringSpan &span) {
+        if (!consume('"'))
+            return fail("expected string");
+
+        span.data = pos;
+        span.escaped = false;
+        while (pos < end) {
+            const char c = *pos;
+            if (c == '"') {
+                span.size = pos - span.data;
+                pos++;
+                return true;
+            }
+            if (c == '\\') {
+                span.escaped = true;
+                pos++;
+            }
+            pos++;
+        }
+        return fail("unterminated string");
+    }
+
+    bool parse_literal(const char *literal) {
+        const size_t len = strlen(literal);
+        if ((size_t) (end - pos) < len || memcmp(pos, literal, len) != 0)
+            return fail("invalid literal");
+
+        pos += len;
+        return true;
+    }
+
+    bool parse_bool(bool &value) {
+        skip_ws();
+        if (pos < end && *pos == 't') {
+            value = true;
+            return parse_literal("true");
+        }
+        if (pos < end && *pos == 'f') {
+            value = false;
+            return parse_literal("false");
+        }
+        return fail("expected bool");
+    }
+
+    // locale independent, precision is plenty for stability values and indexes
+    bool parse_number(double &value) {
+        skip_ws();
+        const char *start = pos;
+        bool negative = false;
+        if (pos < end && *pos == '-') {
+            negative = true;
+            pos++;
+        }
+
+        double number = 0;
+        const char *digits_start = pos;
+        while (pos < end && *pos >= '0' && *pos <= '9')
+            number = number * 10 + (*pos++ - '0');
+        if (pos == digits_start)
+            return fail("expected number");
+
+        if (pos < end && *pos == '.') {
+            pos++;
+            double scale = 0.1;
+            while (pos < end && *pos >= '0' && *pos <= '9') {
+                number += (*pos++ - '0') * scale;
+                scale *= 0.1;
+            }
+        }
+
+        if (pos < end && (*pos == 'e' || *pos == 'E')) {
+            pos++;
+            bool negative_exponent = false;
+            if (pos < end && (*pos == '+' || *pos == '-'))
+                negative_exponent = *pos++ == '-';
+
+            int exponent = 0;
+            while (pos < end && *pos >= '0' && *pos <= '9' && exponent < 1000)
+                exponent = exponent * 10 + (*pos++ - '0');
+
+            for (int i = 0; i < exponent; i++)
+                number = negative_exponent ? number / 10 : number * 10;
+        }
+
+        if (pos == start)
+            return fail("expected number");
+
+        value = negative ? -number : number;
+        return true;
+    }
+
+    bool skip_value() {
+        skip_ws();
+        if (pos >= end)
+            return fail("unexpected end");
+
+        switch (*pos) {
+            case '"': {
+                StringSpan ignored;
+                return parse_string(ignored);
+            }
+            case '{':
+            case '[': {
+                const char close = *pos == '{' ? '}' : ']';
+                const bool is_object = *pos == '{';
+                pos++;
+                if (++depth > CAPTION_PARSER_MAX_DEPTH)
+                    return fail("nested too deep");
+
+                if (!consume(close)) {
+                    do {
+                        if (is_object) {
+                            StringSpan key;
+                            if (!parse_string(key) || !expect(':'))
+                                return false;
+                        }
+                        if (!skip_value())
+                            return false;
+                    } while (consume(','));
+
+                    if (!expect(close))
+                        return false;
+                }
+                depth--;
+                return true;
+            }
+            case 't':
+                return parse_literal("true");
+            case 'f':
+                return parse_literal("false");
+            case 'n':
+                return parse_literal("null");
+            default: {
+                double ignored;
+                return parse_number(ignored);
+            }
+        }
+    }
+
+    // {"transcript": "..", ...}, the first alternative is the most likely one
+    bool parse_alternatives(StringSpan &transcript) {
+        if (!expect('['))
+            return false;
+        if (consume(']'))
+            return true;
+
+        bool first = true;
+        do {
+            if (!first) {
+                if (!skip_value())
+                    return false;
+                continue;
+            }
+            first = false;
+
+            if (!expect('{'))
+                return false;
+            if (consume('}'))
+                continue;
+
+            do {
+                StringSpan key;
+                if (!parse_string(key) || !expect(':'))
+                    return false;
+
+                skip_ws();
+                if (span_equals(key, "transcript") && pos < end && *pos == '"') {
+                    if (!parse_string(transcript))
+                        return false;
+                } else if (!skip_value()) {
+                    return false;
+                }
+            } while (consume(','));
+
+            if (!expect('}'))
+                return false;
+        } while (consume(','));
+
+        return expect(']');
+    }
+
+    bool parse_result_entry(ResultEntry &entry) {
+        entry = ResultEntry();
+        if (!expect('{'))
+            return false;
+        if (consume('}'))
+            return true;
+
+        do {
+            StringSpan key;
+            if (!parse_string(key) || !expect(':'))
+                return false;
+
+            skip_ws();
+            bool ok;
+            if (span_equals(key, "alternative") && pos < end && *pos == '[') {
+                ok = parse_alternatives(entry.transcript);
+            } else if (span_equals(key, "final") && pos < end && (*pos == 't' || *pos == 'f')) {
+                ok = parse_bool(entry.final);
+            } else if (span_equals(key, "stability") && pos < end && (*pos == '-' || (*pos >= '0' && *pos <= '9'))) {
+                ok = parse_number(entry.stability);
+                entry.has_stability = true;
+            } else {
+                ok = skip_value();
+            }
+            if (!ok)
+                return false;
+        } while (consume(','));
+
+        return expect('}');
+    }
+
+    static void append_utf8(std::string &out, uint32_t code_point) {
+        if (code_point < 0x80) {
+            out.push_back((char) code_point);
+        } else if (code_point < 0x800) {
+            out.push_back((char) (0xC0 | (code_point >> 6)));
+            out.push_back((char) (0x80 | (code_point & 0x3F)));
+        } else if (code_point < 0x10000) {
+            out.push_back((char) (0xE0 | (code_point >> 12)));
+            out.push_back((char) (0x80 | ((code_point >> 6) & 0x3F)));
+            out.push_back((char) (0x80 | (code_point & 0x3F)));
+        } else {
+            out.push_back((char) (0xF0 | (code_point >> 18)));
+            out.push_back((char) (0x80 | ((code_point >> 12) & 0x3F)));
+            out.push_back((char) (0x80 | ((code_point >> 6) & 0x3F)));
+            out.push_back((char) (0x80 | (code_point & 0x3F)));
+        }
+    }
+
+    static bool parse_hex4(const char *at, const char *limit, uint32_t &value) {
+        if (limit - at < 4)
+            return false;
+
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            const char c = at[i];
+            value <<= 4;
+            if (c >= '0' && c <= '9')
+                value |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                value |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                value |= c - 'A' + 10;
+            else
+                return false;
+        }
+        return true;
+    }
+
+    bool unescape(const StringSpan &span, std::string &out) {
+        out.clear();
+        if (!span.escaped) {
+            out.append(span.data, span.size);
+            return true;
+        }
+
+        const char *at = span.data;
+        const char *limit = span.data + span.size;
+        while (at < limit) {
+            if (*at != '\\') {
+                out.push_back(*at++);
+                continue;
+            }
+            if (++at >= limit)
+                return fail("invalid escape");
+
+            const char c = *at++;
+            switch (c) {
+                case '"':
+                case '\\':
+                case '/':
+                    out.push_back(c);
+                    break;
+                case 'b':
+                    out.push_back('\b');
+                    break;
+                case 'f':
+                    out.push_back('\f');
+                    break;
+                case 'n':
+                    out.push_back('\n');
+                    break;
+                case 'r':
+                    out.push_back('\r');
+                    break;
+                case 't':
+                    out.push_back('\t');
+                    break;
+                case 'u': {
+                    uint32_t code_point;
+                    if (!parse_hex4(at, limit, code_point))
+                        return fail("invalid unicode escape");
+                    at += 4;
+
+                    if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+                        uint32_t low;
+                        if (limit - at >= 6 && at[0] == '\\' && at[1] == 'u' && parse_hex4(at + 2, limit, low)
+                            && low >= 0xDC00 && low <= 0xDFFF) {
+                            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                            at += 6;
+                        } else {
+                            code_point = 0xFFFD;
+                        }
+                    } else if (code_point >= 0xDC00 && code_point <= 0xDFFF) {
+                        code_point = 0xFFFD;
+                    }
+                    append_utf8(out, code_point);
+                    break;
+                }
+                default:
+                    return fail("invalid escape");
+            }
+        }
+        return true;
+    }
+
+public:
+    /*
+     Parses one complete downstream message into result, reusing its string buffers. result is only partially
+     updated unless CAPTION_PARSE_OK is returned, get_error() says why for CAPTION_PARSE_ERROR.
+     */
+    caption_parse_status parse(const char *data, const size_t size, CaptionResult &result) {
+        pos = data;
+        end = data + size;
+        error = nullptr;
+        depth = 0;
+
+        bool has_results = false;
+        bool has_result_index = false;
+        double result_index = 0;
+
+        StringSpan chosen_text;
+        bool chosen_final = false;
+        double highest_stability = 0.0;
+
+        if (!expect('{'))
+            return CAPTION_PARSE_ERROR;
+
+        if (!consume('}')) {
+            do {
+                StringSpan key;
+                if (!parse_string(key) || !expect(':'))
+                    return CAPTION_PARSE_ERROR;
+
+                skip_ws();
+                if (span_equals(key, "result") && pos < end && *pos == '[') {
+                    has_results = true;
+                    pos++;
+                    if (!consume(']')) {
+                        ResultEntry entry;
+                        do {
+                            if (chosen_final) {
+                                // got the final one already, rest is of no interest
+                                if (!skip_value())
+                                    return CAPTION_PARSE_ERROR;
+                                continue;
+                            }
+
+                            if (!parse_result_entry(entry))
+                                return CAPTION_PARSE_ERROR;
+
+                            if (!entry.transcript.size)
+                                continue;
+
+                            if (entry.final) {
+                                chosen_final = true;
+                                chosen_text = entry.transcript;
+                                continue;
+                            }
+
+                            if (entry.has_stability && entry.stability >= highest_stability) {
+                                chosen_text = entry.transcript;
+                                highest_stability = entry.stability;
+                            }
+                        } while (consume(','));
+
+                        if (!expect(']'))
+                            return CAPTION_PARSE_ERROR;
+                    }
+                } else if (span_equals(key, "result_index") && pos < end && (*pos == '-' || (*pos >= '0' && *pos <= '9'))) {
+                    if (!parse_number(result_index))
+                        return CAPTION_PARSE_ERROR;
+                    has_result_index = true;
+                } else if (!skip_value()) {
+                    return CAPTION_PARSE_ERROR;
+                }
+            } while (consume(','));
+
+            if (!expect('}'))
+                return CAPTION_PARSE_ERROR;
+        }
+
+        if (!has_results) {
+            fail("no result");
+            return CAPTION_PARSE_ERROR;
+        }
+
+        if (!chosen_text.size)
+            return CAPTION_PARSE_EMPTY;
+
+        if (!has_result_index) {
+            fail("no result index");
+            return CAPTION_PARSE_ERROR;
+        }
+
+        if (!unescape(chosen_text, result.caption_text))
+            return CAPTION_PARSE_ERROR;
+
+        result.index = (int) result_index;
+        result.final = chosen_final;
+        result.stability = highest_stability;
+        result.raw_message.assign(data, size);
+        result.mark_received();
+        return CAPTION_PARSE_OK;
+    }
+
+    const char *get_error() const {
+        return error ? error : "";
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_CAPTIONRESULTPARSER_H
@@ -18,76 +18,36 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <utility>
 
 
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include "CaptionStream.h"
+#include "CaptionResultParser.h"
+#include "HttpChunkDecoder.h"
 #include "utils.h"
 #include "log.h"
 
 //#define BUFFER_SIZE 1024
 #define BUFFER_SIZE 4096
 
-#include <json11.cpp>
-using namespace json11;
+// upper limit of audio sent per HTTP chunk, whatever is queued up to this is sent at once
+#define UPLOAD_CHUNK_MAX_MS 100
 
-static CaptionResult *parse_caption_obj(const string &msg_obj) {
-    bool is_final = false;
-    double highest_stability = 0.0;
-    string caption_text;
-    int result_index;
-
-    string err;
-    Json json = Json::parse(msg_obj, err);
-    if (!err.empty()) {
-        throw err;
-    }
-    Json result_val = json["result"];
-    if (!result_val.is_array())
-        throw string("no result");
-
-    if (!result_val.array_items().size())
-        throw string("empty");
-
-    Json result_index_val = json["result_index"];
-    if (!result_index_val.is_number())
-        throw string("no result index");
-
-    result_index = result_index_val.int_value();
-
-    for (auto &result_obj : result_val.array_items()) {
-        string text = result_obj["alternative"][0]["transcript"].string_value();
-        if (text.empty())
-            continue;
-
-        if (result_obj["final"].bool_value()) {
-            is_final = true;
-            caption_text = text;
-            break;
-        }
-
-        Json stability_val = result_obj["stability"];
-        if (!stability_val.is_number())
-            continue;
-
-        if (stability_val.number_value() >= highest_stability) {
-            caption_text = text;
-            highest_stability = stability_val.number_value();
-        }
-//        info_log("val %s", text_val.dump().c_str());
-
-//        printf("Result: %s\n", json.dump().c_str());
-//        cout<< a.dump() << endl;
-//        printf("Result: %s\n", json.dump().c_str());
-    }
-
-    if (caption_text.empty())
-        throw string("no caption text");
+// chunked transfer encoding framing, sent straight from the given buffer without building the chunk in memory first
+static bool send_http_chunk(TcpConnection &connection, const char *data, const size_t size) {
+    char size_line[24];
+    const int size_line_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+    if (size_line_len <= 0)
+        return false;
 
-//    debug_log("stab: %f, final: %d, index: %d, text: '%s'", highest_stability, is_final, result_index, caption_text.c_str());
-    return new CaptionResult(result_index, is_final, highest_stability, caption_text, msg_obj);
+    const TcpSendBuffer parts[] = {
+            {size_line, (size_t) size_line_len},
+            {data,      size},
+            {"\r\n",      2},
+    };
+    return connection.send_all_vectored(parts, 3);
 }
 
-
 int read_until_contains(TcpConnection *connection, string &buffer, const char *required_contents) {
     int newline_pos = buffer.find(required_contents);
     if (newline_pos != string::npos)
@@ -107,14 +67,15 @@ int read_until_contains(TcpConnection *connection, string &buffer, const char *r
 
 CaptionStream::CaptionStream(
         CaptionStreamSettings settings
-) : upstream(TcpConnection(GOOGLE, PORTUP)),
-    downstream(TcpConnection(GOOGLE, PORTDOWN)),
+) : upstream(settings.endpoint_host, settings.endpoint_port_up, settings.socket_options),
+    downstream(settings.endpoint_host, settings.endpoint_port_down, settings.socket_options),
 
     settings(settings),
-
     session_pair(random_string(15)),
     upstream_thread(nullptr),
-    downstream_thread(nullptr) {
+    downstream_thread(nullptr),
+    audio_queue(settings.max_queue_depth_ms, settings.queue_drop_policy),
+    use_reactor(settings.use_io_reactor && IoReactor::is_supported()) {
 
     debug_log("CaptionStream Google HTTP, created session pair: %s", session_pair.c_str());
 }
@@ -132,14 +93,58 @@ bool CaptionStream::start(std::shared_ptr<CaptionStream> self) {
         return false;
 
     started = true;
+    started_at = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        last_sent_trace.set(CAPTION_TRACE_STREAM_START, started_at);
+    }
+
+    if (use_reactor) {
+        if (IoReactor::shared().add(self))
+            return true;
+
+        error_log("couldn't add to IoReactor, using threads");
+        use_reactor = false;
+    }
+
     upstream_thread = new thread(&CaptionStream::upstream_run, this, self);
+    downstream_thread = new thread(&CaptionStream::downstream_run, this, self);
     return true;
 }
 
+void CaptionStream::set_handshake(bool &flag) {
+    {
+        std::lock_guard<std::mutex> lock(handshake_mutex);
+        flag = true;
+    }
+    handshake_signal.notify_all();
+}
+
+bool CaptionStream::wait_for_handshake(const bool &flag) {
+    std::unique_lock<std::mutex> lock(handshake_mutex);
+    handshake_signal.wait_for(lock, std::chrono::milliseconds(settings.connect_timeout_ms), [this, &flag]() {
+        return flag || stopped;
+    });
+    return flag && !stopped;
+}
+
+void CaptionStream::wait_for_drain() {
+    std::unique_lock<std::mutex> lock(handshake_mutex);
+    if (!handshake_signal.wait_until(lock, drain_deadline, [this]() { return stopped.load(); }))
+        info_log("drain timed out, %s", session_pair.c_str());
+}
+
+uint CaptionStream::ms_since_start() {
+    return (uint) std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started_at).count();
+}
+
 
 void CaptionStream::upstream_run(std::shared_ptr<CaptionStream> self) {
     debug_log("starting upstream_run()");
     _upstream_run(self);
+    if (upload_ended)
+        wait_for_drain();
     stop();
     debug_log("finished upstream_run()");
 }
@@ -160,33 +165,12 @@ void CaptionStream::_upstream_run(std::shared_ptr<CaptionStream> self) {
         return;
     }
 
+    upstream_connected_ms = ms_since_start();
     debug_log("upstream connected!");
 
     upstream.set_timeout(settings.send_timeout_ms);
 
-    string post_req("POST /speech-api/full-duplex/v1/up?key=");
-    post_req.append(settings.api_key);
-
-    post_req.append("&pair=");
-    post_req.append(session_pair);
-
-    post_req.append("&lang=");
-    post_req.append(settings.language);
-
-    if (settings.profanity_filter)
-        post_req.append("&pFilter=1");
-    else
-        post_req.append("&pFilter=0");
-
-    post_req.append("&client=chromium&continuous&interim HTTP/1.1\r\n"
-                    "Host: www.google.com\r\n"
-                    "content-type: audio/l16; rate=16000\r\n"
-                    "Accept: */\r\n"
-                    "Accept-Encoding: gzip, deflat\r\n"
-                    "User-Agent: TwitchStreamCaptioner ThanksGoogle\r\n"
-                    "Transfer-Encoding: chunked\r\n"
-                    "\r\n");
-
+    const string post_req = build_upstream_head();
 //    info_log("GOOGLE_API_KEY_STR: '%s'", GOOGLE_API_KEY_STR);
     if (!upstream.send_all(post_req.c_str(), post_req.size())) {
         error_log("upstream send head error");
@@ -200,50 +184,52 @@ void CaptionStream::_upstream_run(std::shared_ptr<CaptionStream> self) {
     debug_log("sent head bytes %lu, language: %s, profanity filter: %d",
               post_req.size(), settings.language.c_str(), settings.profanity_filter);
 
-    if (downstream_thread) {
-        error_log("already has downstream thread, wtf");
+    set_handshake(upstream_head_sent);
+    if (!wait_for_handshake(downstream_ready)) {
+        if (!is_stopped())
+            error_log("downstream not ready in time, %s", session_pair.c_str());
         return;
     }
 
-    downstream_thread = new thread(&CaptionStream::downstream_run, this, self);
-
-    const string crlf("\r\n");
+    vector<char> audio_chunk(audio_ms_to_bytes(UPLOAD_CHUNK_MAX_MS));
+    AudioTiming audio_timing = {};
     uint chunk_count = 0;
     while (true) {
         if (is_stopped())
             return;
 
-        string *audio_chunk = dequeue_audio_data(settings.send_timeout_ms * 1000);
-        if (audio_chunk == nullptr) {
-            error_log("couldn't deque audio chunk in time");
+        const char *upload_data;
+        const size_t audio_chunk_size = dequeue_upload(audio_chunk, &upload_data, settings.send_timeout_ms * 1000,
+                                                       &audio_timing);
+        if (!audio_chunk_size) {
+            if (audio_queue.is_drained() && !is_stopped()) {
+                // zero size last chunk
+                if (!send_http_chunk(upstream, nullptr, 0)) {
+                    error_log("couldn't send upload end");
+                    return;
+                }
+                mark_upload_ended();
+                return;
+            }
+            if (!is_stopped())
+                error_log("couldn't deque audio chunk in time");
             return;
         }
 
-//        info_log("qs %zu", audio_queue.size_approx());
+//        info_log("qs %zu", audio_queue.size());
 //        std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 30));
 //        std::this_thread::sleep_for(std::chrono::milliseconds(30));
 
-        if (!audio_chunk->empty()) {
-
-            std::stringstream stream;
-            stream << std::hex << audio_chunk->size() << crlf << *audio_chunk << crlf;
-            std::string request(stream.str());
-
-            if (!upstream.send_all(request.c_str(), request.size())) {
-                error_log("couldn't send audio chunk");
-                delete audio_chunk;
-                return;
-            }
-
-            if (chunk_count % 1000 == 0)
-                debug_log("sent audio chunk %d, %lu bytes", chunk_count, audio_chunk->size());
-//            debug_log("sent audio chunk %d, %lu bytes", chunk_count, audio_chunk->size());
-
-        } else {
-            error_log("got 0 size audio chunk. ignoring");
+        if (!send_http_chunk(upstream, upload_data, audio_chunk_size)) {
+            error_log("couldn't send audio chunk");
+            return;
         }
+        mark_audio_sent(audio_timing);
+
+        if (chunk_count % 1000 == 0)
+            debug_log("sent audio chunk %d, %lu bytes", chunk_count, audio_chunk_size);
+//        debug_log("sent audio chunk %d, %lu bytes", chunk_count, audio_chunk_size);
 
-        delete audio_chunk;
         chunk_count++;
     }
 }
@@ -252,11 +238,6 @@ void CaptionStream::_upstream_run(std::shared_ptr<CaptionStream> self) {
 void CaptionStream::_downstream_run() {
     const uint crlf_len = 2;
 
-    if (settings.download_thread_start_delay_ms) {
-        debug_log("waiting %d ms to start download connection", settings.download_thread_start_delay_ms);
-        std::this_thread::sleep_for(std::chrono::milliseconds(settings.download_thread_start_delay_ms));
-    }
-
     try {
         downstream.connect(settings.connect_timeout_ms);
     } catch (ConnectError &ex) {
@@ -269,16 +250,14 @@ void CaptionStream::_downstream_run() {
     debug_log("downstream connected!");
     downstream.set_timeout(settings.send_timeout_ms);
 
+    if (!wait_for_handshake(upstream_head_sent)) {
+        if (!is_stopped())
+            error_log("upstream head not sent in time, %s", session_pair.c_str());
+        return;
+    }
 
-    string get_req("GET /speech-api/full-duplex/v1/down?pair=");
-    get_req.append(session_pair);
-    get_req.append(" HTTP/1.1\r\n"
-                   "Host: www.google.com\r\n"
-                   "Accept: */*\r\n"
-                   //                   "Accept-Encoding: gzip, deflate\r\n"
-                   "User-Agent: TwitchStreamCaptioner ThanksGoogle\r\n"
-                   "\r\n");
 
+    const string get_req = build_downstream_head();
     if (!downstream.send_all(get_req.c_str(), get_req.size())) {
         error_log("downstream send head error");
         return;
@@ -303,136 +282,684 @@ void CaptionStream::_downstream_run() {
         return;
     }
 
+    downstream_ready_ms = ms_since_start();
+    ready_ms = std::max(downstream_ready_ms, 1u);
+    set_handshake(downstream_ready);
+
     if (is_stopped())
         return;
 
 //    debug_log("RESPONSE:\n%s\n", head.c_str());
 
-    string rest = head.substr(newlines_pos + crlf_len + crlf_len, string::npos);
-//    debug_log("rest: '%s'", rest.c_str());
-
-    unsigned long chunk_length;
+    chunk_decoder.reset(new HttpChunkDecoder());
+    HttpChunkDecoder &decoder = *chunk_decoder;
+    const size_t body_start = newlines_pos + crlf_len + crlf_len;
+    if (!decoder.feed(head.data() + body_start, head.size() - body_start)) {
+        error_log("downstream head read too far, %lu bytes", head.size() - body_start);
+        return;
+    }
 
+    HttpChunkView chunk;
 
-    int crlf_pos;
     while (true) {
-//        debug_log("rest: '%s'", rest.c_str());
-        crlf_pos = read_until_contains(&downstream, rest, "\r\n");
-        if (crlf_pos == -1) {
-            error_log("downstream read chunksize error, rest: %lu %s", rest.size(), rest.c_str());
+        const http_chunk_status chunk_status = decoder.next(chunk);
+        if (chunk_status == HTTP_CHUNK_NEED_MORE) {
+            size_t available;
+            char *receive_to = decoder.write_ptr(&available);
+            const int read_cnt = downstream.receive_at_most(receive_to, (int) available);
+            if (read_cnt <= 0) {
+                error_log("downstream read chunk error, %d, %s", read_cnt, session_pair.c_str());
+                return;
+            }
+            decoder.commit(read_cnt);
+
+            if (is_stopped())
+                return;
+            continue;
+        }
+
+        if (chunk_status == HTTP_CHUNK_ERROR) {
+            error_log("downstream chunk decode error, %s", decoder.get_error());
             return;
         }
 
-        if (is_stopped())
+        if (chunk_status == HTTP_CHUNK_END) {
+            info_log("downstream response done, %llu chunks, %s",
+                     (unsigned long long) decoder.get_payload_count(), session_pair.c_str());
+            if (!draining)
+                server_ended = true;
             return;
+        }
 
-        try {
-            chunk_length = std::stoul(rest.substr(0, crlf_pos), nullptr, 16);
-//            if (!chunk_length) {
-//                error_log("downstream parse chunksize = 0, wtf");
-//                return;
-//            }
+        handle_caption_message(chunk);
+
+        if (is_stopped() || drained)
+            return;
+//        info_log("downstream chunk: %lu bytes, %.*s", chunk.size, (int) chunk.size, chunk.data);
+    }
+};
+
+string CaptionStream::build_upstream_head() {
+    string post_req("POST /speech-api/full-duplex/v1/up?key=");
+    post_req.append(settings.api_key);
+
+    post_req.append("&pair=");
+    post_req.append(session_pair);
+
+    post_req.append("&lang=");
+    post_req.append(settings.language);
+
+    if (settings.profanity_filter)
+        post_req.append("&pFilter=1");
+    else
+        post_req.append("&pFilter=0");
+
+    post_req.append("&client=chromium&continuous&interim HTTP/1.1\r\n"
+                    "Host: www.google.com\r\n"
+                    "content-type: ");
+    post_req.append(settings.upload_encoding == AUDIO_UPLOAD_FLAC ? "audio/x-flac" : "audio/l16");
+    post_req.append("; rate=16000\r\n"
+                    "Accept: */\r\n"
+                    "Accept-Encoding: gzip, deflat\r\n"
+                    "User-Agent: TwitchStreamCaptioner ThanksGoogle\r\n"
+                    "Transfer-Encoding: chunked\r\n"
+                    "\r\n");
+    return post_req;
+}
+
+string CaptionStream::build_downstream_head() {
+    string get_req("GET /speech-api/full-duplex/v1/down?pair=");
+    get_req.append(session_pair);
+    get_req.append(" HTTP/1.1\r\n"
+                   "Host: www.google.com\r\n"
+                   "Accept: */*\r\n"
+                   //                   "Accept-Encoding: gzip, deflate\r\n"
+                   "User-Agent: TwitchStreamCaptioner ThanksGoogle\r\n"
+                   "\r\n");
+    return get_req;
+}
+
+void CaptionStream::handle_caption_message(const HttpChunkView &chunk) {
+    const caption_parse_status parse_status = result_parser.parse(chunk.data, chunk.size, result);
+    if (parse_status == CAPTION_PARSE_OK) {
+        fill_trace(result.trace);
+        if (result.trace.first_of_stream)
+            info_log("first result after %.0f ms, upstream connected after %u ms, downstream ready after %u ms, %s",
+                     result.trace.ms_between(CAPTION_TRACE_STREAM_START, CAPTION_TRACE_RECEIVED),
+                     upstream_connected_ms, downstream_ready_ms, session_pair.c_str());
+
+        std::lock_guard<recursive_mutex> lock(on_caption_cb_handle.mutex);
+        if (on_caption_cb_handle.callback_fn) {
+////            debug_log("calling caption cb");
+            on_caption_cb_handle.callback_fn(result);
+        }
+
+        if (result.final && upload_ended && !drained) {
+            drained = true;
+            info_log("drained, final result %lld ms after the upload ended, %s",
+                     (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+                             result.created_at - upload_ended_at).count(), session_pair.c_str());
         }
-        catch (...) {
-            error_log("downstream parse chunksize error, %s", rest.c_str());
+    } else if (parse_status == CAPTION_PARSE_ERROR) {
+        info_log("couldn't parse caption message. Error: '%s'. Messsage: '%.*s'",
+                 result_parser.get_error(), (int) chunk.size, chunk.data);
+    }
+}
+
+#if IO_REACTOR_SUPPORTED
+
+// moves the parts forward by the bytes sent, returns the bytes left
+static size_t consume_send_parts(TcpSendBuffer *parts, const int part_cnt, size_t sent) {
+    size_t left = 0;
+    for (int i = 0; i < part_cnt; i++) {
+        const size_t cnt = std::min(sent, parts[i].size);
+        parts[i].data += cnt;
+        parts[i].size -= cnt;
+        sent -= cnt;
+        left += parts[i].size;
+    }
+    return left;
+}
+
+static reactor_time_point deadline_after(const reactor_time_point now, const uint ms) {
+    return now + std::chrono::milliseconds(ms);
+}
+
+void CaptionStream::on_attach(IoReactor &reactor) {
+    debug_log("starting reactor streams, %s", session_pair.c_str());
+    const reactor_time_point now = std::chrono::steady_clock::now();
+
+    upstream_state = UPSTREAM_RESOLVING;
+    upstream_deadline = deadline_after(now, settings.connect_timeout_ms);
+    downstream_state = DOWNSTREAM_RESOLVING;
+    downstream_deadline = deadline_after(now, settings.connect_timeout_ms);
+
+    reactor_upstream_io(reactor, now, -1);
+    reactor_downstream_io(reactor, now, -1);
+}
+
+// one step of resolving and connecting without blocking, fd is the socket that became ready or -1
+CaptionStream::reactor_connect_step CaptionStream::reactor_connect(IoReactor &reactor, TcpConnection &connection,
+                                                                   vector<int> &watched, const bool resolving,
+                                                                   const int fd, const reactor_time_point now,
+                                                                   reactor_time_point &attempt_at) {
+    bool connected;
+    if (resolving) {
+        vector<ResolvedAddress> addresses;
+        string error;
+        const resolve_status status = Resolver::shared().resolve_cached(settings.endpoint_host, addresses, &error, []() {
+            IoReactor::shared().wake();
+        });
+        if (status == RESOLVE_PENDING)
+            return REACTOR_CONNECT_RESOLVING;
+        if (status == RESOLVE_FAILED)
+            throw ConnectError(("couldn't resolve hostname, " + error).c_str());
+
+        connected = connection.connect_start(addresses);
+    } else {
+        connected = fd != -1 && connection.connect_continue(fd);
+    }
+    attempt_at = connected ? reactor_time_point::max() : connection.connect_tick(now);
+
+    // attempts come and go, dropped ones are closed already
+    vector<int> fds;
+    connection.get_connect_fds(fds);
+    for (const int old_fd : watched) {
+        if (std::find(fds.begin(), fds.end(), old_fd) == fds.end())
+            reactor.unwatch(old_fd);
+    }
+    for (const int new_fd : fds)
+        reactor.watch(this, new_fd, false, true);
+    watched = fds;
+
+    return connected ? REACTOR_CONNECT_DONE : REACTOR_CONNECT_PENDING;
+}
+
+void CaptionStream::on_io(IoReactor &reactor, const int fd, const bool readable, const bool writable, const bool failed) {
+    if (is_stopped())
+        return;
+
+    const reactor_time_point now = std::chrono::steady_clock::now();
+    if (std::find(upstream_fds.begin(), upstream_fds.end(), fd) != upstream_fds.end()) {
+        // nothing is ever read from upstream, only errors matter
+        if (failed && upstream_state != UPSTREAM_CONNECTING) {
+            error_log("upstream connection error, %s", session_pair.c_str());
+            stop();
             return;
         }
+        if (writable || failed)
+            reactor_upstream_io(reactor, now, fd);
+    } else if (std::find(downstream_fds.begin(), downstream_fds.end(), fd) != downstream_fds.end()) {
+        if (readable || writable || failed)
+            reactor_downstream_io(reactor, now, fd);
+    }
+}
 
-        uint chunk_data_start = crlf_pos + crlf_len;
-        uint existing_chunk_byte_cnt = rest.size() - chunk_data_start;
-        uint needed_bytes = chunk_length - existing_chunk_byte_cnt + crlf_len;
+reactor_time_point CaptionStream::on_tick(IoReactor &reactor, const reactor_time_point now) {
+    if (is_stopped())
+        return reactor_time_point::max();
 
-        if (needed_bytes) {
-//            debug_log("reading chunk, size: %lu, existing_chunk_byte_cnt: %d, needed %d",
-//                      chunk_length, existing_chunk_byte_cnt, needed_bytes);
+    // woken by queue_audio_data() or a finished lookup, or time for the next connect attempt
+    if (upstream_state == UPSTREAM_WAITING_AUDIO || upstream_state == UPSTREAM_RESOLVING ||
+        (upstream_state == UPSTREAM_CONNECTING && now >= upstream_attempt_at))
+        reactor_upstream_io(reactor, now, -1);
 
-            int read = downstream.receive_at_least(rest, needed_bytes);
-//            debug_log("hmm read: %d", read);
-            if (read == -1) {
-                error_log("downstream read chunk data error");
-                return;
-            }
+    if (downstream_state == DOWNSTREAM_RESOLVING ||
+        (downstream_state == DOWNSTREAM_CONNECTING && now >= downstream_attempt_at))
+        reactor_downstream_io(reactor, now, -1);
+
+    if (is_stopped())
+        return reactor_time_point::max();
+
+    if (draining && now >= drain_deadline) {
+        info_log("drain timed out, %s", session_pair.c_str());
+        stop();
+        return reactor_time_point::max();
+    }
+
+    if (now >= upstream_deadline) {
+        if (upstream_state == UPSTREAM_RESOLVING || upstream_state == UPSTREAM_CONNECTING)
+            debug_log("upstream connect error, timed out");
+        else if (upstream_state == UPSTREAM_WAITING_READY)
+            error_log("downstream not ready in time, %s", session_pair.c_str());
+        else if (upstream_state == UPSTREAM_WAITING_AUDIO)
+            error_log("couldn't deque audio chunk in time");
+        else
+            error_log("upstream send timed out, %s", session_pair.c_str());
+        stop();
+        return reactor_time_point::max();
+    }
+
+    if (now >= downstream_deadline) {
+        if (downstream_state == DOWNSTREAM_RESOLVING || downstream_state == DOWNSTREAM_CONNECTING)
+            error_log("downstream connect() error, timed out");
+        else if (downstream_state == DOWNSTREAM_SENDING_HEAD)
+            error_log("downstream send head error, timed out");
+        else
+            error_log("downstream read timed out, %s", session_pair.c_str());
+        stop();
+        return reactor_time_point::max();
+    }
+
+    const reactor_time_point next_at = std::min(std::min(upstream_deadline, downstream_deadline),
+                                                std::min(upstream_attempt_at, downstream_attempt_at));
+    return draining ? std::min(next_at, drain_deadline) : next_at;
+}
+
+bool CaptionStream::is_done() {
+    return is_stopped();
+}
+
+void CaptionStream::on_detach(IoReactor &reactor) {
+    if (!is_stopped())
+        stop();
+
+    reactor_close(reactor);
+    debug_log("finished reactor streams, %s", session_pair.c_str());
+}
+
+void CaptionStream::reactor_close(IoReactor &reactor) {
+    for (const int fd : upstream_fds)
+        reactor.unwatch(fd);
+    for (const int fd : downstream_fds)
+        reactor.unwatch(fd);
+    upstream_fds.clear();
+    downstream_fds.clear();
+
+    upstream.close();
+    downstream.close();
+}
+
+void CaptionStream::reactor_upstream_io(IoReactor &reactor, const reactor_time_point now, const int fd) {
+    if (upstream_state == UPSTREAM_RESOLVING || upstream_state == UPSTREAM_CONNECTING) {
+        reactor_connect_step step;
+        try {
+            step = reactor_connect(reactor, upstream, upstream_fds, upstream_state == UPSTREAM_RESOLVING, fd, now,
+                                   upstream_attempt_at);
+        } catch (ConnectError &ex) {
+            debug_log("upstream connect error, %s", ex.what());
+            stop();
+            return;
         }
+        if (step == REACTOR_CONNECT_RESOLVING)
+            return;
 
-        if (is_stopped())
+        upstream_state = UPSTREAM_CONNECTING;
+        if (step != REACTOR_CONNECT_DONE)
             return;
 
-        if (chunk_length) {
-            string chunk_data = rest.substr(chunk_data_start, chunk_length);
-            if (chunk_data.size() != chunk_length) {
-                error_log("downstream read chunk data error, too few bytes, wtf, %lu %lu", chunk_data.size(), chunk_length);
+        upstream_connected_ms = ms_since_start();
+        debug_log("upstream connected!");
+
+        upstream_head = build_upstream_head();
+        upstream_parts[0] = {upstream_head.data(), upstream_head.size()};
+        upstream_parts[1] = upstream_parts[2] = {nullptr, 0};
+        upstream_state = UPSTREAM_SENDING_HEAD;
+        upstream_deadline = deadline_after(now, settings.send_timeout_ms);
+    }
+
+    while (!is_stopped()) {
+        if (upstream_state == UPSTREAM_SENDING_HEAD || upstream_state == UPSTREAM_SENDING_AUDIO ||
+            upstream_state == UPSTREAM_SENDING_END) {
+            const int sent = upstream.send_some_vectored(upstream_parts, 3);
+            if (sent < 0) {
+                error_log("%s", upstream_state == UPSTREAM_SENDING_HEAD ? "upstream send head error" : "couldn't send audio chunk");
+                stop();
                 return;
             }
 
+            if (consume_send_parts(upstream_parts, 3, (size_t) sent)) {
+                // socket buffer full, continue once writable
+                reactor.watch(this, upstream.get_fd(), false, true);
+                return;
+            }
 
-            try {
-                CaptionResult *result = parse_caption_obj(chunk_data);
+            if (upstream_state == UPSTREAM_SENDING_HEAD) {
+                debug_log("sent head bytes %lu, language: %s, profanity filter: %d",
+                          upstream_head.size(), settings.language.c_str(), settings.profanity_filter);
 
-                {
-                    std::lock_guard<recursive_mutex> lock(on_caption_cb_handle.mutex);
-                    if (on_caption_cb_handle.callback_fn) {
-////                    debug_log("calling caption cb");
-                        on_caption_cb_handle.callback_fn(*result);
-                    }
-                }
+                // the downstream being accepted moves this on
+                set_handshake(upstream_head_sent);
+                upstream_state = UPSTREAM_WAITING_READY;
+                upstream_deadline = deadline_after(now, settings.connect_timeout_ms);
+                reactor.watch(this, upstream.get_fd(), false, false);
 
-                delete result;
+                if (downstream_state == DOWNSTREAM_WAITING_UPSTREAM)
+                    reactor_downstream_io(reactor, now, -1);
+                return;
+            }
 
-            } catch (string &ex) {
-                info_log("couldn't parse caption message. Error: '%s'. Messsage: '%s'", ex.c_str(), chunk_data.c_str());
+            if (upstream_state == UPSTREAM_SENDING_END) {
+                // the downstream finishes the drain, the server may close this side any time now
+                mark_upload_ended();
+                upstream_state = UPSTREAM_DONE;
+                upstream_deadline = reactor_time_point::max();
+                reactor.unwatch(upstream.get_fd());
+                return;
             }
-            catch (...) {
-                info_log("couldn't parse caption message. Messsage: '%s'", chunk_data.c_str());
+
+            mark_audio_sent(upstream_timing);
+            if (upstream_chunk_count % 1000 == 0)
+                debug_log("sent audio chunk %d, %lu bytes", upstream_chunk_count, upstream_chunk_size);
+            upstream_chunk_count++;
+
+            upstream_state = UPSTREAM_WAITING_AUDIO;
+            upstream_deadline = deadline_after(now, settings.send_timeout_ms);
+            reactor.watch(this, upstream.get_fd(), false, false);
+        }
+
+        // set before checking so audio queued right after an empty check still wakes the reactor
+        upload_waiting = true;
+        if (upstream_chunk.empty())
+            upstream_chunk.resize(audio_ms_to_bytes(UPLOAD_CHUNK_MAX_MS));
+
+        const char *upload_data;
+        upstream_chunk_size = dequeue_upload(upstream_chunk, &upload_data, 0, &upstream_timing);
+        if (!upstream_chunk_size && !audio_queue.is_drained())
+            return;
+
+        upload_waiting = false;
+        const int size_line_len = snprintf(upstream_size_line, sizeof(upstream_size_line), "%zx\r\n", upstream_chunk_size);
+        upstream_parts[0] = {upstream_size_line, (size_t) size_line_len};
+        upstream_parts[1] = {upload_data, upstream_chunk_size};
+        upstream_parts[2] = {"\r\n", 2};
+        // an empty chunk ends the request once drained
+        upstream_state = upstream_chunk_size ? UPSTREAM_SENDING_AUDIO : UPSTREAM_SENDING_END;
+        upstream_deadline = deadline_after(now, settings.send_timeout_ms);
+    }
+}
+
+void CaptionStream::reactor_downstream_io(IoReactor &reactor, const reactor_time_point now, const int fd) {
+    const uint crlf_len = 2;
+
+    if (downstream_state == DOWNSTREAM_RESOLVING || downstream_state == DOWNSTREAM_CONNECTING) {
+        reactor_connect_step step;
+        try {
+            step = reactor_connect(reactor, downstream, downstream_fds, downstream_state == DOWNSTREAM_RESOLVING, fd, now,
+                                   downstream_attempt_at);
+        } catch (ConnectError &ex) {
+            error_log("downstream connect() error, %s", ex.what());
+            stop();
+            return;
+        }
+        if (step == REACTOR_CONNECT_RESOLVING)
+            return;
+
+        downstream_state = DOWNSTREAM_CONNECTING;
+        if (step != REACTOR_CONNECT_DONE)
+            return;
+
+        debug_log("downstream connected!");
+        downstream_state = DOWNSTREAM_WAITING_UPSTREAM;
+        downstream_deadline = reactor_time_point::max();
+        reactor.watch(this, downstream.get_fd(), false, false);
+    }
+
+    if (downstream_state == DOWNSTREAM_WAITING_UPSTREAM) {
+        if (!upstream_head_sent)
+            return;
+
+        downstream_request = build_downstream_head();
+        downstream_parts[0] = {downstream_request.data(), downstream_request.size()};
+        downstream_state = DOWNSTREAM_SENDING_HEAD;
+        downstream_deadline = deadline_after(now, settings.send_timeout_ms);
+    }
+
+    if (downstream_state == DOWNSTREAM_SENDING_HEAD) {
+        const int sent = downstream.send_some_vectored(downstream_parts, 1);
+        if (sent < 0) {
+            error_log("downstream send head error");
+            stop();
+            return;
+        }
+        if (consume_send_parts(downstream_parts, 1, (size_t) sent)) {
+            // socket buffer full, continue once writable
+            reactor.watch(this, downstream.get_fd(), false, true);
+            return;
+        }
+
+        debug_log("downstream header sent, %lu bytes!", downstream_request.size());
+        downstream_state = DOWNSTREAM_READING_HEAD;
+        downstream_deadline = deadline_after(now, settings.recv_timeout_ms);
+        reactor.watch(this, downstream.get_fd(), true, false);
+        return;
+    }
+
+    if (downstream_state == DOWNSTREAM_READING_HEAD) {
+        char chunk[BUFFER_SIZE];
+        while (true) {
+            const int read_cnt = downstream.receive_some(chunk, BUFFER_SIZE);
+            if (read_cnt < 0) {
+                error_log("downstream read head error");
+                stop();
+                return;
             }
+            if (!read_cnt)
+                return;
 
-            if (is_stopped())
+            downstream_deadline = deadline_after(now, settings.recv_timeout_ms);
+            downstream_head.append(chunk, read_cnt);
+            const size_t newlines_pos = downstream_head.find("\r\n\r\n");
+            if (newlines_pos == string::npos)
+                continue;
+
+            if (downstream_head.find("HTTP/1.1 200 OK") != 0) {
+                error_log("downstream invalid response %s", downstream_head.c_str());
+                stop();
                 return;
-//            info_log("downstream chunk: %lu bytes, %s", chunk_data.size(), chunk_data.c_str());
+            }
 
-        } else {
-            info_log("ignoring zero data chunk");
+            chunk_decoder.reset(new HttpChunkDecoder());
+            const size_t body_start = newlines_pos + crlf_len + crlf_len;
+            if (!chunk_decoder->feed(downstream_head.data() + body_start, downstream_head.size() - body_start)) {
+                error_log("downstream head read too far, %lu bytes", downstream_head.size() - body_start);
+                stop();
+                return;
+            }
+            downstream_state = DOWNSTREAM_READING_BODY;
+            downstream_ready_ms = ms_since_start();
+            ready_ms = std::max(downstream_ready_ms, 1u);
+            set_handshake(downstream_ready);
+            if (upstream_state == UPSTREAM_WAITING_READY) {
+                upstream_state = UPSTREAM_WAITING_AUDIO;
+                upstream_deadline = deadline_after(now, settings.send_timeout_ms);
+                reactor_upstream_io(reactor, now, -1);
+            }
+            break;
         }
-        rest.erase(0, chunk_data_start + chunk_length + 2); // also erase ending CRLF after data
     }
-};
+
+    if (downstream_state == DOWNSTREAM_READING_BODY) {
+        if (reactor_downstream_body())
+            downstream_deadline = deadline_after(now, settings.recv_timeout_ms);
+    }
+}
+
+// decodes everything that can be read without blocking, true if anything was received
+bool CaptionStream::reactor_downstream_body() {
+    HttpChunkDecoder &decoder = *chunk_decoder;
+    HttpChunkView chunk;
+    bool received = false;
+
+    while (!is_stopped()) {
+        const http_chunk_status chunk_status = decoder.next(chunk);
+        if (chunk_status == HTTP_CHUNK_NEED_MORE) {
+            size_t available;
+            char *receive_to = decoder.write_ptr(&available);
+            const int read_cnt = downstream.receive_some(receive_to, (int) available);
+            if (read_cnt < 0) {
+                error_log("downstream read chunk error, %d, %s", read_cnt, session_pair.c_str());
+                stop();
+                break;
+            }
+            if (!read_cnt)
+                break;
+
+            decoder.commit(read_cnt);
+            received = true;
+            continue;
+        }
+
+        if (chunk_status == HTTP_CHUNK_ERROR) {
+            error_log("downstream chunk decode error, %s", decoder.get_error());
+            stop();
+            break;
+        }
+
+        if (chunk_status == HTTP_CHUNK_END) {
+            info_log("downstream response done, %llu chunks, %s",
+                     (unsigned long long) decoder.get_payload_count(), session_pair.c_str());
+            if (!draining)
+                server_ended = true;
+            stop();
+            break;
+        }
+
+        handle_caption_message(chunk);
+        if (drained) {
+            stop();
+            break;
+        }
+    }
+    return received;
+}
+
+#else
+
+// windows, never added to a reactor (use_reactor is always false)
+void CaptionStream::on_attach(IoReactor &reactor) {
+    stop();
+}
+
+void CaptionStream::on_io(IoReactor &reactor, int fd, bool readable, bool writable, bool failed) {}
+
+reactor_time_point CaptionStream::on_tick(IoReactor &reactor, reactor_time_point now) {
+    return reactor_time_point::max();
+}
+
+bool CaptionStream::is_done() {
+    return is_stopped();
+}
+
+void CaptionStream::on_detach(IoReactor &reactor) {}
+
+#endif
+
+void CaptionStream::prewarm(const CaptionStreamSettings &settings) {
+    // connections are per stream, only the lookup can be done ahead
+    vector<ResolvedAddress> addresses;
+    Resolver::shared().resolve_cached(settings.endpoint_host, addresses);
+}
 
 bool CaptionStream::is_stopped() {
     return stopped;
 }
 
-bool CaptionStream::queue_audio_data(const char *audio_data, const uint data_size) {
+void CaptionStream::drain(const uint timeout_ms) {
+    if (is_stopped() || draining)
+        return;
+
+    if (!ready_ms) {
+        // nothing was uploaded yet, there's nothing to wait for
+        stop();
+        return;
+    }
+
+    info_log("draining, %u ms audio left to upload, %s", queued_audio_ms(), session_pair.c_str());
+    drain_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    draining = true;
+    audio_queue.finish();
+
+    if (use_reactor)
+        IoReactor::shared().wake();
+}
+
+bool CaptionStream::is_draining() {
+    return draining && !is_stopped();
+}
+
+bool CaptionStream::ended_cleanly() {
+    return server_ended;
+}
+
+void CaptionStream::mark_upload_ended() {
+    upload_ended_at = std::chrono::steady_clock::now();
+    upload_ended = true;
+    debug_log("upload ended, %s", session_pair.c_str());
+}
+
+bool CaptionStream::queue_audio_data(const char *audio_data, const uint data_size,
+                                     const std::chrono::steady_clock::time_point captured_at) {
     if (is_stopped())
         return false;
 
-    string *str = new string(audio_data, data_size);
+    if (!audio_queue.push(audio_data, data_size, captured_at)) {
+        // over max_queue_depth_ms, counted in audio_queue_stats(), not logging on the audio thread
+        return false;
+    }
 
-    const int over_limit_cnt = audio_queue.size_approx() - settings.max_queue_depth;
-    if (settings.max_queue_depth) {
-        // rough estimate in dropping, dont care about being off by one or two in threaded cases
+    // only wakes the reactor if the uploader is actually waiting for audio
+    if (use_reactor && upload_waiting.exchange(false))
+        IoReactor::shared().wake();
 
-        int cleared_cnt = 0;
-        while (audio_queue.size_approx() > settings.max_queue_depth) {
-            string *item;
-            if (audio_queue.try_dequeue(item)) {
-                delete item;
-                cleared_cnt++;
-            }
+//    debug_log("queued %s", session_pair.c_str());
+    return true;
+}
+
+size_t CaptionStream::dequeue_audio_data(char *buffer, const size_t max_bytes, const std::int64_t timeout_us,
+                                         AudioTiming *timing) {
+    size_t skipped = 0;
+    const size_t read = audio_queue.pop(buffer, max_bytes, timeout_us, &skipped, timing);
+    if (skipped)
+        info_log("upload fell behind, dropped %u ms of oldest audio, %s", audio_bytes_to_ms(skipped), session_pair.c_str());
+
+    return read;
+}
+
+size_t CaptionStream::dequeue_upload(vector<char> &buffer, const char **data, const std::int64_t timeout_us,
+                                     AudioTiming *timing) {
+    if (settings.upload_encoding == AUDIO_UPLOAD_LINEAR16) {
+        *data = &buffer[0];
+        return dequeue_audio_data(&buffer[0], buffer.size(), timeout_us, timing);
+    }
+
+    upload_encoded.clear();
+    // a dequeue too short for a frame of its own encodes to nothing, the next one takes it along
+    while (upload_encoded.empty()) {
+        const size_t audio_size = dequeue_audio_data(&buffer[0], buffer.size(), timeout_us, timing);
+        if (!audio_size) {
+            if (audio_queue.is_drained())
+                upload_encoder.finish(upload_encoded);
+            break;
         }
-        if (cleared_cnt)
-            debug_log("queue too big, dropped %d old items from queue %s", cleared_cnt, session_pair.c_str());
+        upload_encoder.encode(&buffer[0], audio_size, upload_encoded);
     }
+    *data = upload_encoded.data();
+    return upload_encoded.size();
+}
 
-//    debug_log("queued %s", session_pair.c_str());
-    audio_queue.enqueue(str);
-    return true;
+AudioQueueStats CaptionStream::audio_queue_stats() {
+    return audio_queue.stats();
 }
 
-string *CaptionStream::dequeue_audio_data(const std::int64_t timeout_us) {
-    string *ret;
-    if (audio_queue.wait_dequeue_timed(ret, timeout_us))
-        return ret;
+void CaptionStream::mark_audio_sent(const AudioTiming &timing) {
+    if (!timing.captured_at.time_since_epoch().count())
+        return;
 
-    return nullptr;
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    last_sent_trace.set(CAPTION_TRACE_CAPTURE, timing.captured_at);
+    last_sent_trace.set(CAPTION_TRACE_ENQUEUE, timing.enqueued_at);
+    last_sent_trace.mark(CAPTION_TRACE_SEND);
+}
+
+void CaptionStream::fill_trace(CaptionTrace &trace) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace.set(CAPTION_TRACE_CAPTURE, last_sent_trace.at[CAPTION_TRACE_CAPTURE]);
+    trace.set(CAPTION_TRACE_ENQUEUE, last_sent_trace.at[CAPTION_TRACE_ENQUEUE]);
+    trace.set(CAPTION_TRACE_SEND, last_sent_trace.at[CAPTION_TRACE_SEND]);
+    trace.set(CAPTION_TRACE_STREAM_START, last_sent_trace.at[CAPTION_TRACE_STREAM_START]);
+    trace.first_of_stream = !has_result;
+    has_result = true;
 }
 
 
@@ -441,11 +968,24 @@ void CaptionStream::stop() {
     on_caption_cb_handle.clear();
     stopped = true;
 
+    // wakes threads waiting for the other connection
+    {
+        std::lock_guard<std::mutex> lock(handshake_mutex);
+    }
+    handshake_signal.notify_all();
+
+    if (use_reactor) {
+        // the sockets are closed on the reactor thread once it sees this, never from here
+        audio_queue.close();
+        IoReactor::shared().wake();
+        return;
+    }
+
     upstream.close();
     downstream.close();
 
-    string *to_unblock_uploader = new string();
-    audio_queue.enqueue(to_unblock_uploader);
+    // unblocks the uploader
+    audio_queue.close();
 }
 
 
@@ -454,14 +994,16 @@ CaptionStream::~CaptionStream() {
     if (!is_stopped())
         stop();
 
-    int cleared = 0;
-    {
-        string *item;
-        while (audio_queue.try_dequeue(item)) {
-            delete item;
-            cleared++;
-        }
-    }
+    const AudioQueueStats stats = audio_queue.stats();
+    info_log("~CaptionStream %s audio queue %s: dropped %u ms in %llu events (%u ms silence), peak depth %u ms",
+             session_pair.c_str(), audio_queue_drop_policy_name(audio_queue.get_policy()),
+             stats.dropped_ms(), (unsigned long long) stats.drop_events, audio_bytes_to_ms(stats.dropped_silent_bytes),
+             stats.peak_depth_ms());
+    if (settings.upload_encoding != AUDIO_UPLOAD_LINEAR16 && upload_encoder.stats().input_bytes)
+        info_log("~CaptionStream %s %s", session_pair.c_str(),
+                 upload_encoder.stats().summary(audio_upload_encoding_name(settings.upload_encoding)).c_str());
+
+    const size_t cleared = audio_queue.size();
     debug_log("~CaptionStream deleting");
 
 
@@ -477,8 +1019,20 @@ CaptionStream::~CaptionStream() {
         downstream_thread = nullptr;
     }
 
-    debug_log("~CaptionStream deconstructor, deleted left %d in queue", cleared);
+    debug_log("~CaptionStream deconstructor, dropped %lu bytes left in queue", cleared);
+
+}
+
+uint CaptionStream::rtt_ms() {
+    return upstream.get_connect_ms();
+}
+
+uint CaptionStream::queued_audio_ms() {
+    return audio_bytes_to_ms(audio_queue.size());
+}
 
+uint CaptionStream::ready_after_ms() {
+    return ready_ms;
 }
 
 bool CaptionStream::is_started() {
@@ -26,7 +26,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <queue>
 #include <chrono>
 #include <mutex>
-#include "thirdparty/cameron314/blockingconcurrentqueue.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include "AudioEncoder.h"
+#include "AudioQueue.h"
+#include "SocketOptions.h"
+#include "CaptionResultParser.h"
+#include "HttpChunkDecoder.h"
+#include "IoReactor.h"
 
 #include "ThreadsaferCallback.h"
 #include "CaptionResult.h"
@@ -34,6 +42,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 typedef unsigned int uint;
 using namespace std;
 
+#ifndef GOOGLE
+#define GOOGLE "www.google.com"
+#endif
+#ifndef PORTUP
+#define PORTUP 80
+#endif
+#ifndef PORTDOWN
+#define PORTDOWN 80
+#endif
+
 typedef std::function<void(const CaptionResult &caption_result)> caption_text_callback;
 
 struct CaptionStreamSettings {
@@ -41,20 +59,33 @@ struct CaptionStreamSettings {
     uint send_timeout_ms;
     uint recv_timeout_ms;
 
-    uint max_queue_depth;
-    uint download_thread_start_delay_ms;
+    uint max_queue_depth_ms;
+    audio_queue_drop_policy queue_drop_policy;
 
     string language;
     int profanity_filter;
     string api_key;
 
+    // compile time defaults unless pointed at a local test server
+    string endpoint_host = GOOGLE;
+    uint endpoint_port_up = PORTUP;
+    uint endpoint_port_down = PORTDOWN;
+
+    // drive both connections from the shared IoReactor thread instead of a blocking thread each, where supported
+    bool use_io_reactor = IO_REACTOR_SUPPORTED;
+
+    // upload body format, lossless FLAC is usually a quarter to two thirds the size of the raw audio
+    audio_upload_encoding upload_encoding = AUDIO_UPLOAD_LINEAR16;
+
+    TcpSocketOptions socket_options;
+
     CaptionStreamSettings(
             uint connect_timeout_ms,
             uint send_timeout_ms,
             uint recv_timeout_ms,
 
-            uint max_queue_depth,
-            uint download_thread_start_delay_ms,
+            uint max_queue_depth_ms,
+            audio_queue_drop_policy queue_drop_policy,
             const string &language,
             int profanity_filter,
             const string &api_key
@@ -63,8 +94,8 @@ struct CaptionStreamSettings {
             send_timeout_ms(send_timeout_ms),
             recv_timeout_ms(recv_timeout_ms),
 
-            max_queue_depth(max_queue_depth),
-            download_thread_start_delay_ms(download_thread_start_delay_ms),
+            max_queue_depth_ms(max_queue_depth_ms),
+            queue_drop_policy(queue_drop_policy),
             language(language),
             profanity_filter(profanity_filter),
             api_key(api_key) {}
@@ -73,11 +104,17 @@ struct CaptionStreamSettings {
         return connect_timeout_ms == rhs.connect_timeout_ms &&
                send_timeout_ms == rhs.send_timeout_ms &&
                recv_timeout_ms == rhs.recv_timeout_ms &&
-               max_queue_depth == rhs.max_queue_depth &&
-               download_thread_start_delay_ms == rhs.download_thread_start_delay_ms &&
+               max_queue_depth_ms == rhs.max_queue_depth_ms &&
+               queue_drop_policy == rhs.queue_drop_policy &&
                language == rhs.language &&
                profanity_filter == rhs.profanity_filter &&
-               api_key == rhs.api_key;
+               api_key == rhs.api_key &&
+               endpoint_host == rhs.endpoint_host &&
+               endpoint_port_up == rhs.endpoint_port_up &&
+               endpoint_port_down == rhs.endpoint_port_down &&
+               use_io_reactor == rhs.use_io_reactor &&
+               upload_encoding == rhs.upload_encoding &&
+               socket_options == rhs.socket_options;
     }
 
     bool operator!=(const CaptionStreamSettings &rhs) const {
@@ -93,15 +130,45 @@ struct CaptionStreamSettings {
         printf("%s  send_timeout_ms: %d\n", line_prefix, send_timeout_ms);
         printf("%s  recv_timeout_ms: %d\n", line_prefix, recv_timeout_ms);
 
-        printf("%s  max_queue_depth: %d\n", line_prefix, max_queue_depth);
-        printf("%s  download_thread_start_delay_ms: %d\n", line_prefix, download_thread_start_delay_ms);
+        printf("%s  max_queue_depth_ms: %d\n", line_prefix, max_queue_depth_ms);
+        printf("%s  queue_drop_policy: %s\n", line_prefix, audio_queue_drop_policy_name(queue_drop_policy));
+        printf("%s  endpoint: %s up %d down %d\n", line_prefix, endpoint_host.c_str(), endpoint_port_up, endpoint_port_down);
+        printf("%s  use_io_reactor: %d\n", line_prefix, use_io_reactor);
+        printf("%s  upload_encoding: %s\n", line_prefix, audio_upload_encoding_name(upload_encoding));
+        socket_options.print(line_prefix);
 
 //        printf("%s-----------\n", line_prefix);
     }
 };
 
 
-class CaptionStream {
+class CaptionStream : public IoHandler {
+    enum reactor_upstream_state {
+        UPSTREAM_RESOLVING,
+        UPSTREAM_CONNECTING,
+        UPSTREAM_SENDING_HEAD,
+        UPSTREAM_WAITING_READY,
+        UPSTREAM_WAITING_AUDIO,
+        UPSTREAM_SENDING_AUDIO,
+        UPSTREAM_SENDING_END, // last chunk while draining
+        UPSTREAM_DONE,
+    };
+
+    enum reactor_downstream_state {
+        DOWNSTREAM_RESOLVING,
+        DOWNSTREAM_CONNECTING,
+        DOWNSTREAM_WAITING_UPSTREAM,
+        DOWNSTREAM_SENDING_HEAD,
+        DOWNSTREAM_READING_HEAD,
+        DOWNSTREAM_READING_BODY,
+    };
+
+    enum reactor_connect_step {
+        REACTOR_CONNECT_RESOLVING,
+        REACTOR_CONNECT_PENDING,
+        REACTOR_CONNECT_DONE,
+    };
+
     TcpConnection upstream;
     TcpConnection downstream;
 
@@ -111,12 +178,91 @@ class CaptionStream {
     std::thread *upstream_thread = nullptr;
     std::thread *downstream_thread = nullptr;
 
-    moodycamel::BlockingConcurrentQueue<string *> audio_queue;
+    AudioQueue audio_queue;
 
     bool started = false;
-    bool stopped = false;
-
-    string *dequeue_audio_data(const std::int64_t timeout_us);
+    std::atomic<bool> stopped{false}; // set by stop() from any thread, the reactor shuts the stream down on it
+    bool use_reactor;
+    std::chrono::steady_clock::time_point started_at;
+
+    // both connections are set up in parallel. The downstream GET only goes out once the upstream POST head is sent
+    // so the server knows the pair, audio only flows once the downstream was accepted.
+    std::mutex handshake_mutex;
+    std::condition_variable handshake_signal;
+    bool upstream_head_sent = false;
+    bool downstream_ready = false;
+    uint upstream_connected_ms = 0; // since start
+    uint downstream_ready_ms = 0;
+    std::atomic<uint> ready_ms{0}; // downstream_ready_ms for other threads, 0 until then
+
+    void set_handshake(bool &flag);
+
+    // threads only, false if stopped or timed out
+    bool wait_for_handshake(const bool &flag);
+
+    uint ms_since_start();
+
+    // drain(): no more audio is taken, once the queued audio is uploaded the request is ended so the server finalizes
+    // the last utterance, results keep coming until then
+    std::atomic<bool> draining{false};
+    std::chrono::steady_clock::time_point drain_deadline; // written before draining is set
+    std::atomic<bool> upload_ended{false}; // the last chunk went out
+    std::chrono::steady_clock::time_point upload_ended_at;
+    bool drained = false; // downstream only, a final result arrived after the upload ended
+
+    std::atomic<bool> server_ended{false}; // the response was finished by the server without a drain
+
+    void mark_upload_ended();
+
+    // threads only, upstream waits for the downstream to finish draining
+    void wait_for_drain();
+
+    // downstream body decoding, the result is reused for every message, callbacks copy what they keep
+    std::unique_ptr<HttpChunkDecoder> chunk_decoder;
+    CaptionResultParser result_parser;
+    CaptionResult result;
+
+    // reactor mode only, touched on the reactor thread except for upload_waiting
+    std::atomic<bool> upload_waiting{false}; // uploader ran out of audio, next queue_audio_data() wakes the reactor
+    reactor_upstream_state upstream_state = UPSTREAM_RESOLVING;
+    reactor_time_point upstream_deadline = reactor_time_point::max();
+    reactor_time_point upstream_attempt_at = reactor_time_point::max(); // next parallel connect attempt
+    vector<int> upstream_fds; // watched sockets, all connect attempts until connected
+    string upstream_head;
+    vector<char> upstream_chunk;
+    size_t upstream_chunk_size = 0;
+    char upstream_size_line[24];
+    TcpSendBuffer upstream_parts[3]; // what's left to send of the head or current chunk
+    AudioTiming upstream_timing = {};
+    uint upstream_chunk_count = 0;
+
+    reactor_downstream_state downstream_state = DOWNSTREAM_RESOLVING;
+    reactor_time_point downstream_deadline = reactor_time_point::max();
+    reactor_time_point downstream_attempt_at = reactor_time_point::max();
+    vector<int> downstream_fds;
+    string downstream_request;
+    TcpSendBuffer downstream_parts[1];
+    string downstream_head;
+
+    // capture/enqueue/send times of the newest audio sent, copied into every result
+    std::mutex trace_mutex;
+    CaptionTrace last_sent_trace; // also holds the stream start
+    bool has_result = false;
+
+    // upload encoding other than LINEAR16, only touched by whatever runs the upload
+    FlacEncoder upload_encoder;
+    string upload_encoded;
+
+    void mark_audio_sent(const AudioTiming &timing);
+
+    void fill_trace(CaptionTrace &trace);
+
+    size_t dequeue_audio_data(char *buffer, const size_t max_bytes, const std::int64_t timeout_us,
+                              AudioTiming *timing = nullptr);
+
+    // next piece of the upload body, the raw audio dequeued into buffer or what it encoded to, data points at it.
+    // Samples the encoder held back come out once the queue is drained. 0 if no audio came in time.
+    size_t dequeue_upload(vector<char> &buffer, const char **data, const std::int64_t timeout_us, AudioTiming *timing);
 
     void upstream_run(std::shared_ptr<CaptionStream> self);
 
@@ -127,6 +273,33 @@ class CaptionStream {
 
     void _downstream_run();
 
+    string build_upstream_head();
+
+    string build_downstream_head();
+
+    void handle_caption_message(const HttpChunkView &chunk);
+
+    reactor_connect_step reactor_connect(IoReactor &reactor, TcpConnection &connection, vector<int> &watched,
+                                         bool resolving, int fd, reactor_time_point now, reactor_time_point &attempt_at);
+
+    void reactor_upstream_io(IoReactor &reactor, reactor_time_point now, int fd);
+
+    void reactor_downstream_io(IoReactor &reactor, reactor_time_point now, int fd);
+
+    bool reactor_downstream_body();
+
+    void reactor_close(IoReactor &reactor);
+
+    void on_attach(IoReactor &reactor) override;
+
+    void on_io(IoReactor &reactor, int fd, bool readable, bool writable, bool failed) override;
+
+    reactor_time_point on_tick(IoReactor &reactor, reactor_time_point now) override;
+
+    bool is_done() override;
+
+    void on_detach(IoReactor &reactor) override;
+
 public:
     ThreadsaferCallback<caption_text_callback> on_caption_cb_handle;
 
@@ -136,15 +309,38 @@ public:
 
     bool start(std::shared_ptr<CaptionStream> self);
 
+    // gets what can be shared between streams ready ahead of the first one
+    static void prewarm(const CaptionStreamSettings &settings);
+
     void stop();
 
+    // graceful stop: uploads what's queued, ends the request and keeps delivering results until the final one for the
+    // last utterance arrived, the server ended the response or timeout_ms passed. Stops right away if never ready.
+    void drain(uint timeout_ms);
+
+    bool is_draining();
+
+    // the server closed the stream cleanly (session limit) instead of it failing, only meaningful once stopped
+    bool ended_cleanly();
+
     bool is_connected();
 
     bool is_started();
 
     bool is_stopped();
 
-    bool queue_audio_data(const char *data, const uint data_size);
+    uint rtt_ms();
+
+    // audio waiting for upload
+    uint queued_audio_ms();
+
+    // how long after start() the stream could take audio, 0 while it can't yet
+    uint ready_after_ms();
+
+    bool queue_audio_data(const char *data, const uint data_size,
+                          std::chrono::steady_clock::time_point captured_at = std::chrono::steady_clock::now());
+
+    AudioQueueStats audio_queue_stats();
 
     ~CaptionStream();
 };
@@ -0,0 +1,275 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_HTTPCHUNKDECODER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_HTTPCHUNKDECODER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// downstream messages are a few hundred bytes, this also is the largest chunk accepted
+#define HTTP_CHUNK_DECODER_CAPACITY 65536
+#define HTTP_CHUNK_SIZE_LINE_MAX 256
+
+enum http_chunk_status {
+    HTTP_CHUNK_NEED_MORE = 0, // receive into write_ptr() and commit()
+    HTTP_CHUNK_PAYLOAD, // payload of one chunk
+    HTTP_CHUNK_END, // last chunk and trailers done
+    HTTP_CHUNK_ERROR,
+};
+
+struct HttpChunkView {
+    const char *data = nullptr;
+    size_t size = 0;
+};
+
+/*
+ Incremental chunked transfer encoding decoder on a fixed ring buffer.
+
+ Data is received straight into the ring (write_ptr()/commit()), next() continues decoding from where it stopped
+ last time so nothing is scanned twice. Payloads are handed out as views into the ring, valid until the next call to
+ next(). A payload that wraps around the end of the ring is the only thing ever copied, into a fixed size side
+ buffer. Nothing is moved or reallocated after construction.
+ */
+class HttpChunkDecoder {
+    enum decoder_state {
+        STATE_SIZE,
+        STATE_SIZE_EXTENSION,
+        STATE_SIZE_LF,
+        STATE_DATA,
+        STATE_DATA_CR,
+        STATE_DATA_LF,
+        STATE_TRAILER,
+        STATE_TRAILER_LF,
+        STATE_DONE,
+        STATE_ERROR,
+    };
+
+    const size_t capacity; // power of 2
+    std::vector<char> ring;
+    std::vector<char> linear; // wrapped payloads
+
+    // absolute stream positions, masked to index the ring
+    uint64_t read_pos = 0; // everything before is free space
+    uint64_t scan_pos = 0; // decoded up to here
+    uint64_t write_pos = 0; // received up to here
+
+    decoder_state state = STATE_SIZE;
+    uint64_t chunk_size = 0;
+    unsigned int size_line_len = 0;
+    unsigned int trailer_line_len = 0;
+    const char *error = nullptr;
+    uint64_t payload_count = 0;
+    uint64_t wrapped_count = 0;
+
+    char at(const uint64_t pos) const {
+        return ring[pos & (capacity - 1)];
+    }
+
+    http_chunk_status fail(const char *msg) {
+        state = STATE_ERROR;
+        error = msg;
+        return HTTP_CHUNK_ERROR;
+    }
+
+    static int hex_value(const char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    static size_t round_up_pow2(const size_t size) {
+        size_t pow2 = 64;
+        while (pow2 < size)
+            pow2 *= 2;
+        return pow2;
+    }
+
+public:
+    explicit HttpChunkDecoder(const size_t min_capacity = HTTP_CHUNK_DECODER_CAPACITY) :
+            capacity(round_up_pow2(min_capacity)),
+            ring(capacity),
+            linear(capacity) {}
+
+    // contiguous free space to receive into, 0 if the ring is full
+    char *write_ptr(size_t *available) {
+        const size_t free_bytes = capacity - (size_t) (write_pos - read_pos);
+        const size_t index = (size_t) (write_pos & (capacity - 1));
+        *available = std::min(free_bytes, capacity - index);
+        return &ring[index];
+    }
+
+    void commit(const size_t bytes) {
+        write_pos += bytes;
+    }
+
+    // copies already received bytes in, eg. what was read past the HTTP head. false if they don't fit
+    bool feed(const char *data, size_t size) {
+        while (size) {
+            size_t available;
+            char *to = write_ptr(&available);
+            if (!available)
+                return false;
+
+            const size_t cnt = std::min(available, size);
+            memcpy(to, data, cnt);
+            commit(cnt);
+            data += cnt;
+            size -= cnt;
+        }
+        return true;
+    }
+
+    // the view of the previous payload is invalid after this
+    http_chunk_status next(HttpChunkView &payload) {
+        read_pos = scan_pos;
+
+        while (true) {
+            switch (state) {
+                case STATE_SIZE:
+                case STATE_SIZE_EXTENSION:
+                case STATE_SIZE_LF:
+                case STATE_DATA_CR:
+                case STATE_DATA_LF:
+                case STATE_TRAILER:
+                case STATE_TRAILER_LF: {
+                    if (scan_pos == write_pos)
+                        return HTTP_CHUNK_NEED_MORE;
+
+                    const char c = at(scan_pos++);
+                    read_pos = scan_pos;
+
+                    if (state == STATE_SIZE || state == STATE_SIZE_EXTENSION) {
+                        if (++size_line_len > HTTP_CHUNK_SIZE_LINE_MAX)
+                            return fail("chunk size line too long");
+
+                        if (c == '\r') {
+                            state = STATE_SIZE_LF;
+                        } else if (state == STATE_SIZE_EXTENSION) {
+                            // ;name=value, ignored
+                        } else if (c == ';') {
+                            if (size_line_len == 1)
+                                return fail("missing chunk size");
+                            state = STATE_SIZE_EXTENSION;
+                        } else {
+                            const int value = hex_value(c);
+                            if (value < 0)
+                                return fail("invalid chunk size");
+                            chunk_size = chunk_size * 16 + value;
+                            if (chunk_size > capacity)
+                                return fail("chunk larger than the receive buffer");
+                        }
+                    } else if (state == STATE_SIZE_LF) {
+                        if (c != '\n' || size_line_len == 1)
+                            return fail("invalid chunk size line");
+
+                        size_line_len = 0;
+                        if (chunk_size) {
+                            state = STATE_DATA;
+                        } else {
+                            state = STATE_TRAILER;
+                            trailer_line_len = 0;
+                        }
+                    } else if (state == STATE_DATA_CR) {
+                        if (c != '\r')
+                            return fail("missing CRLF after chunk data");
+                        state = STATE_DATA_LF;
+                    } else if (state == STATE_DATA_LF) {
+                        if (c != '\n')
+                            return fail("missing CRLF after chunk data");
+                        state = STATE_SIZE;
+                        chunk_size = 0;
+                    } else if (state == STATE_TRAILER) {
+                        if (c == '\r') {
+                            state = STATE_TRAILER_LF;
+                        } else if (++trailer_line_len > HTTP_CHUNK_SIZE_LINE_MAX) {
+                            return fail("trailer line too long");
+                        }
+                    } else {
+                        if (c != '\n')
+                            return fail("invalid trailer line");
+
+                        // empty line ends the trailers and the body
+                        if (!trailer_line_len) {
+                            state = STATE_DONE;
+                            return HTTP_CHUNK_END;
+                        }
+                        trailer_line_len = 0;
+                        state = STATE_TRAILER;
+                    }
+                    break;
+                }
+
+                case STATE_DATA: {
+                    if (write_pos - scan_pos < chunk_size)
+                        return HTTP_CHUNK_NEED_MORE;
+
+                    const size_t index = (size_t) (scan_pos & (capacity - 1));
+                    const size_t size = (size_t) chunk_size;
+                    if (index + size <= capacity) {
+                        payload.data = &ring[index];
+                    } else {
+                        const size_t first = capacity - index;
+                        memcpy(&linear[0], &ring[index], first);
+                        memcpy(&linear[first], &ring[0], size - first);
+                        payload.data = &linear[0];
+                        wrapped_count++;
+                    }
+                    payload.size = size;
+
+                    // read_pos stays at the payload start until the next call so it won't be overwritten
+                    scan_pos += size;
+                    state = STATE_DATA_CR;
+                    payload_count++;
+                    return HTTP_CHUNK_PAYLOAD;
+                }
+
+                case STATE_DONE:
+                    return HTTP_CHUNK_END;
+
+                case STATE_ERROR:
+                default:
+                    return HTTP_CHUNK_ERROR;
+            }
+        }
+    }
+
+    const char *get_error() const {
+        return error ? error : "";
+    }
+
+    uint64_t get_payload_count() const {
+        return payload_count;
+    }
+
+    uint64_t get_wrapped_count() const {
+        return wrapped_count;
+    }
+
+    uint64_t get_received_bytes() const {
+        return write_pos;
+    }
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_HTTPCHUNKDECODER_H
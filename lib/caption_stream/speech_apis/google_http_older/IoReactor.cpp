@@ -0,0 +1,315 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include "IoReactor.h"
+
+#include <algorithm>
+#include "log.h"
+
+#if IO_REACTOR_SUPPORTED
+
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef IO_REACTOR_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#include <poll.h>
+#endif
+
+#define IO_REACTOR_MAX_EVENTS 64
+
+IoReactor::IoReactor() {
+#ifdef IO_REACTOR_EPOLL
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_read_fd = wake_write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wake_read_fd == -1) {
+        error_log("IoReactor epoll/eventfd setup failed, %d", errno);
+        return;
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wake_read_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_read_fd, &event) == -1)
+        error_log("IoReactor adding eventfd failed, %d", errno);
+#else
+    int fds[2];
+    if (pipe(fds) == -1) {
+        error_log("IoReactor wakeup pipe setup failed, %d", errno);
+        return;
+    }
+    for (int fd : fds) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    wake_read_fd = fds[0];
+    wake_write_fd = fds[1];
+#endif
+}
+
+IoReactor::~IoReactor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutting_down = true;
+    }
+    wake();
+    if (thread.joinable())
+        thread.join();
+
+#ifdef IO_REACTOR_EPOLL
+    if (epoll_fd != -1)
+        ::close(epoll_fd);
+#endif
+    if (wake_write_fd != -1 && wake_write_fd != wake_read_fd)
+        ::close(wake_write_fd);
+    if (wake_read_fd != -1)
+        ::close(wake_read_fd);
+}
+
+IoReactor &IoReactor::shared() {
+    static IoReactor reactor;
+    return reactor;
+}
+
+bool IoReactor::add(std::shared_ptr<IoHandler> handler) {
+    if (!handler || wake_read_fd == -1)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (shutting_down)
+            return false;
+
+        pending.push_back(handler);
+        if (!running) {
+            // a finished previous thread has left the loop already, joining is quick
+            if (thread.joinable())
+                thread.join();
+
+            running = true;
+            thread = std::thread(&IoReactor::run, this);
+        }
+    }
+    wake();
+    return true;
+}
+
+void IoReactor::wake() {
+    if (wake_write_fd == -1)
+        return;
+
+#ifdef IO_REACTOR_EPOLL
+    const uint64_t one = 1;
+    ssize_t ret = ::write(wake_write_fd, &one, sizeof(one));
+#else
+    const char one = 1;
+    ssize_t ret = ::write(wake_write_fd, &one, sizeof(one));
+#endif
+    // EAGAIN means there's a wakeup pending already
+    (void) ret;
+}
+
+void IoReactor::drain_wakeups() {
+#ifdef IO_REACTOR_EPOLL
+    uint64_t count;
+    while (::read(wake_read_fd, &count, sizeof(count)) > 0);
+#else
+    char buffer[64];
+    while (::read(wake_read_fd, buffer, sizeof(buffer)) > 0);
+#endif
+    woken = true;
+}
+
+bool IoReactor::watch(IoHandler *handler, const int fd, const bool read, const bool write) {
+    auto found = watches.find(fd);
+    const bool existing = found != watches.end();
+    if (existing && found->second.read == read && found->second.write == write)
+        return true;
+
+#ifdef IO_REACTOR_EPOLL
+    struct epoll_event event = {};
+    event.events = (read ? (uint32_t) (EPOLLIN | EPOLLRDHUP) : 0u) | (write ? (uint32_t) EPOLLOUT : 0u);
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, existing ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) == -1) {
+        error_log("IoReactor watching fd %d failed, %d", fd, errno);
+        return false;
+    }
+#endif
+
+    watches[fd] = Watch{handler, read, write};
+    return true;
+}
+
+void IoReactor::unwatch(const int fd) {
+    if (!watches.erase(fd))
+        return;
+
+#ifdef IO_REACTOR_EPOLL
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+// waits for and dispatches events, returns the number of ready fds or -1
+int IoReactor::wait(const int timeout_ms) {
+#ifdef IO_REACTOR_EPOLL
+    struct epoll_event events[IO_REACTOR_MAX_EVENTS];
+    const int ready = epoll_wait(epoll_fd, events, IO_REACTOR_MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < ready; i++) {
+        const int fd = events[i].data.fd;
+        if (fd == wake_read_fd) {
+            drain_wakeups();
+            continue;
+        }
+
+        // might have been unwatched by an earlier handler in this batch
+        auto found = watches.find(fd);
+        if (found == watches.end())
+            continue;
+
+        const uint32_t flags = events[i].events;
+        found->second.handler->on_io(*this, fd,
+                                     (flags & (EPOLLIN | EPOLLRDHUP)) != 0,
+                                     (flags & EPOLLOUT) != 0,
+                                     (flags & (EPOLLERR | EPOLLHUP)) != 0);
+    }
+    return ready;
+#else
+    static thread_local std::vector<struct pollfd> poll_fds;
+    poll_fds.clear();
+    poll_fds.push_back({wake_read_fd, POLLIN, 0});
+    for (const auto &watch : watches) {
+        const short events = (short) ((watch.second.read ? POLLIN : 0) | (watch.second.write ? POLLOUT : 0));
+        poll_fds.push_back({watch.first, events, 0});
+    }
+
+    const int ready = poll(poll_fds.data(), (nfds_t) poll_fds.size(), timeout_ms);
+    if (ready <= 0)
+        return ready;
+
+    if (poll_fds[0].revents)
+        drain_wakeups();
+
+    for (size_t i = 1; i < poll_fds.size(); i++) {
+        const short flags = poll_fds[i].revents;
+        if (!flags)
+            continue;
+
+        auto found = watches.find(poll_fds[i].fd);
+        if (found == watches.end())
+            continue;
+
+        found->second.handler->on_io(*this, poll_fds[i].fd,
+                                     (flags & POLLIN) != 0,
+                                     (flags & POLLOUT) != 0,
+                                     (flags & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+    }
+    return ready;
+#endif
+}
+
+void IoReactor::run() {
+    debug_log("IoReactor thread starting");
+    std::vector<std::shared_ptr<IoHandler>> added;
+    int timeout_ms = 0;
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (shutting_down) {
+                for (auto &handler : pending)
+                    handlers.push_back(handler);
+                pending.clear();
+                break;
+            }
+
+            added.swap(pending);
+            if (added.empty() && handlers.empty()) {
+                // only stops with the lock held so add() either sees it running or starts a new thread
+                running = false;
+                break;
+            }
+        }
+
+        for (auto &handler : added) {
+            handlers.push_back(handler);
+            handler->on_attach(*this);
+        }
+        added.clear();
+
+        if (wait(timeout_ms) == -1 && errno != EINTR) {
+            error_log("IoReactor wait failed, %d", errno);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        woken = false;
+
+        // every handler gets ticked after every wakeup, there are only ever a few
+        const reactor_time_point now = std::chrono::steady_clock::now();
+        reactor_time_point next_at = now + std::chrono::milliseconds(IO_REACTOR_MAX_WAIT_MS);
+        for (auto &handler : handlers) {
+            if (!handler->is_done())
+                next_at = std::min(next_at, handler->on_tick(*this, now));
+        }
+
+        for (auto it = handlers.begin(); it != handlers.end();) {
+            if ((*it)->is_done()) {
+                (*it)->on_detach(*this);
+                it = handlers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        const auto wait_for = std::chrono::duration_cast<std::chrono::milliseconds>(next_at - std::chrono::steady_clock::now());
+        timeout_ms = (int) std::max((std::int64_t) 0, std::min((std::int64_t) wait_for.count(), (std::int64_t) IO_REACTOR_MAX_WAIT_MS));
+    }
+
+    // shutting down, close everything still open
+    for (auto &handler : handlers)
+        handler->on_detach(*this);
+    handlers.clear();
+    watches.clear();
+    debug_log("IoReactor thread done");
+}
+
+#else
+
+IoReactor::IoReactor() {}
+
+IoReactor::~IoReactor() {}
+
+IoReactor &IoReactor::shared() {
+    static IoReactor reactor;
+    return reactor;
+}
+
+bool IoReactor::add(std::shared_ptr<IoHandler> handler) {
+    return false;
+}
+
+void IoReactor::wake() {}
+
+bool IoReactor::watch(IoHandler *handler, int fd, bool read, bool write) {
+    return false;
+}
+
+void IoReactor::unwatch(int fd) {}
+
+#endif
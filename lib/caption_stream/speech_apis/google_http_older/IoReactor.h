@@ -0,0 +1,138 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_IOREACTOR_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_IOREACTOR_H
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#define IO_REACTOR_SUPPORTED 1
+#define IO_REACTOR_EPOLL 1
+#elif defined(__unix__) || defined(__APPLE__)
+#define IO_REACTOR_SUPPORTED 1
+#define IO_REACTOR_POLL 1
+#else
+// windows keeps a thread per socket
+#define IO_REACTOR_SUPPORTED 0
+#endif
+
+// longest sleep without any deadline, only matters if a wakeup got lost somehow
+#define IO_REACTOR_MAX_WAIT_MS 1000
+
+using reactor_time_point = std::chrono::steady_clock::time_point;
+
+class IoReactor;
+
+/*
+ Something driven by the reactor. All calls are made on the reactor thread, so implementations don't need locking
+ for state only touched from these.
+ */
+class IoHandler {
+public:
+    virtual ~IoHandler() = default;
+
+    // once, right after being added
+    virtual void on_attach(IoReactor &reactor) = 0;
+
+    // a watched fd is ready
+    virtual void on_io(IoReactor &reactor, int fd, bool readable, bool writable, bool failed) = 0;
+
+    // after every wakeup, returns when it next wants to be called at the latest (time_point::max() for never)
+    virtual reactor_time_point on_tick(IoReactor &reactor, reactor_time_point now) = 0;
+
+    // true once finished, then on_detach() is called, which must unwatch and close its fds, and it's dropped
+    virtual bool is_done() = 0;
+
+    virtual void on_detach(IoReactor &reactor) = 0;
+};
+
+/*
+ One thread driving any number of non-blocking sockets with epoll (Linux) or poll, shared by all caption streams.
+ The thread is started when the first handler is added and exits once the last one is done.
+
+ Other threads only ever call add() and wake(), wakeups go through an eventfd (a pipe without epoll) so nothing is
+ ever closed from another thread to interrupt a blocking call.
+ */
+class IoReactor {
+#if IO_REACTOR_SUPPORTED
+    struct Watch {
+        IoHandler *handler;
+        bool read;
+        bool write;
+    };
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<IoHandler>> pending; // added, not attached yet
+    bool running = false;
+    bool shutting_down = false;
+    std::thread thread;
+
+    int wake_read_fd = -1;
+    int wake_write_fd = -1; // same as wake_read_fd for an eventfd
+#ifdef IO_REACTOR_EPOLL
+    int epoll_fd = -1;
+#endif
+
+    // reactor thread only
+    std::vector<std::shared_ptr<IoHandler>> handlers;
+    std::unordered_map<int, Watch> watches;
+    bool woken = false;
+
+    void run();
+
+    void drain_wakeups();
+
+    int wait(int timeout_ms);
+
+#endif
+
+    IoReactor();
+
+public:
+    IoReactor(const IoReactor &) = delete;
+
+    IoReactor &operator=(const IoReactor &) = delete;
+
+    // the process wide instance
+    static IoReactor &shared();
+
+    static bool is_supported() {
+        return IO_REACTOR_SUPPORTED;
+    }
+
+    // any thread. false if the reactor isn't usable
+    bool add(std::shared_ptr<IoHandler> handler);
+
+    // any thread, makes the reactor tick all handlers soon
+    void wake();
+
+    // reactor thread only, updates the events wanted from fd (or starts watching it)
+    bool watch(IoHandler *handler, int fd, bool read, bool write);
+
+    // reactor thread only
+    void unwatch(int fd);
+
+    ~IoReactor();
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_IOREACTOR_H
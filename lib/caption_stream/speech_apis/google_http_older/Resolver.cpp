@@ -0,0 +1,347 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include "Resolver.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
+#include "log.h"
+
+// addresses failing or connecting slower sort later, unknown ones after the known good
+static unsigned int connect_rank(const ResolvedAddress &address) {
+    const unsigned int known_ms = address.connect_ms ? address.connect_ms : 10000;
+    return address.connect_failures * 100000 + known_ms;
+}
+
+struct sockaddr_storage ResolvedAddress::with_port(const unsigned int port) const {
+    struct sockaddr_storage copy = address;
+    if (family == AF_INET6)
+        ((struct sockaddr_in6 *) &copy)->sin6_port = htons((uint16_t) port);
+    else
+        ((struct sockaddr_in *) &copy)->sin_port = htons((uint16_t) port);
+    return copy;
+}
+
+Resolver &Resolver::shared() {
+    static Resolver resolver;
+    return resolver;
+}
+
+resolve_status Resolver::resolve_cached(const std::string &hostname, std::vector<ResolvedAddress> &addresses,
+                                        std::string *error, std::function<void()> on_done) {
+    return resolve_entry(hostname, addresses, error, std::move(on_done), true);
+}
+
+resolve_status Resolver::resolve_entry(const std::string &hostname, std::vector<ResolvedAddress> &addresses,
+                                       std::string *error, std::function<void()> on_done, const bool may_lookup) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (shutting_down) {
+        if (error)
+            *error = "shutting down";
+        return RESOLVE_FAILED;
+    }
+
+    Entry &entry = cache[hostname];
+
+    if (entry.resolved) {
+        const auto age_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - entry.resolved_at).count();
+
+        if (!entry.addresses.empty() && age_ms < RESOLVER_CACHE_MAX_STALE_MS) {
+            // old but usable, refresh for next time without making this connect wait
+            if (age_ms >= RESOLVER_CACHE_TTL_MS && may_lookup)
+                queue_lookup(hostname, entry);
+
+            hit_count++;
+            addresses = entry.addresses;
+            return RESOLVE_OK;
+        }
+
+        if (entry.addresses.empty() && age_ms < RESOLVER_NEGATIVE_TTL_MS) {
+            if (error)
+                *error = entry.error;
+            return RESOLVE_FAILED;
+        }
+    }
+
+    if (!may_lookup)
+        return RESOLVE_PENDING;
+
+    if (on_done)
+        entry.waiting.push_back(on_done);
+    queue_lookup(hostname, entry);
+    return RESOLVE_PENDING;
+}
+
+bool Resolver::resolve(const std::string &hostname, std::vector<ResolvedAddress> &addresses, std::string *error) {
+    struct Waiter {
+        std::mutex mutex;
+        std::condition_variable signal;
+        bool done = false;
+    };
+    auto waiter = std::make_shared<Waiter>();
+
+    resolve_status status = resolve_cached(hostname, addresses, error, [waiter]() {
+        std::lock_guard<std::mutex> lock(waiter->mutex);
+        waiter->done = true;
+        waiter->signal.notify_all();
+    });
+    if (status != RESOLVE_PENDING)
+        return status == RESOLVE_OK;
+
+    {
+        std::unique_lock<std::mutex> lock(waiter->mutex);
+        waiter->signal.wait(lock, [&waiter]() { return waiter->done; });
+    }
+
+    // the lookup answered, a new one from here would only be left behind
+    status = resolve_entry(hostname, addresses, error, nullptr, false);
+    if (status == RESOLVE_PENDING && error)
+        *error = "lookup didn't finish";
+
+    return status == RESOLVE_OK;
+}
+
+void Resolver::report_connect(const std::string &hostname, const std::string &ip, const unsigned int connect_ms,
+                              const bool success) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = cache.find(hostname);
+    if (found == cache.end())
+        return;
+
+    for (auto &address : found->second.addresses) {
+        if (address.ip != ip)
+            continue;
+
+        if (success) {
+            const unsigned int ms = std::max(connect_ms, 1u);
+            address.connect_ms = address.connect_ms ? (address.connect_ms * 3 + ms) / 4 : ms;
+            address.connect_failures = 0;
+        } else {
+            address.connect_failures++;
+        }
+        connect_order(found->second.addresses);
+        return;
+    }
+}
+
+std::string Resolver::summary() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string summary = "lookups " + std::to_string(lookup_count) + ", cache hits " + std::to_string(hit_count);
+    for (const auto &entry : cache) {
+        summary.append("\n  ").append(entry.first).append(":");
+        if (entry.second.addresses.empty())
+            summary.append(" ").append(entry.second.error.empty() ? "-" : entry.second.error);
+
+        for (const auto &address : entry.second.addresses) {
+            summary.append(" ").append(address.ip);
+            if (address.connect_failures)
+                summary.append(" (").append(std::to_string(address.connect_failures)).append(" failed)");
+            else if (address.connect_ms)
+                summary.append(" (").append(std::to_string(address.connect_ms)).append(" ms)");
+        }
+    }
+    return summary;
+}
+
+// under lock
+void Resolver::queue_lookup(const std::string &hostname, Entry &entry) {
+    if (entry.lookup_queued || shutting_down)
+        return;
+
+    entry.lookup_queued = true;
+    lookup_queue.push_back(hostname);
+    if (!lookup_thread.joinable())
+        lookup_thread = std::thread(&Resolver::lookup_run, this);
+
+    queue_signal.notify_one();
+}
+
+void Resolver::lookup_run() {
+    while (true) {
+        std::string hostname;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queue_signal.wait(lock, [this]() { return shutting_down || !lookup_queue.empty(); });
+            if (shutting_down)
+                break;
+
+            hostname = lookup_queue.front();
+            lookup_queue.pop_front();
+        }
+
+        std::vector<ResolvedAddress> addresses;
+        std::string error;
+        const auto started_at = std::chrono::steady_clock::now();
+        const bool success = lookup(hostname, addresses, error);
+        const long long lookup_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - started_at).count();
+
+        std::vector<std::function<void()>> waiting;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Entry &entry = cache[hostname];
+            entry.lookup_queued = false;
+            lookup_count++;
+
+            if (success) {
+                // keep what was learned about addresses that are still around
+                for (auto &address : addresses) {
+                    for (const auto &old : entry.addresses) {
+                        if (old.ip == address.ip) {
+                            address.connect_ms = old.connect_ms;
+                            address.connect_failures = old.connect_failures;
+                        }
+                    }
+                }
+                connect_order(addresses);
+                entry.addresses = addresses;
+                entry.error.clear();
+                entry.resolved_at = std::chrono::steady_clock::now();
+                entry.resolved = true;
+            } else {
+                entry.error = error;
+                // stale addresses are better than none, until they are too old to hand out. Then the failure is
+                // remembered like a fresh one, so RESOLVER_NEGATIVE_TTL_MS applies
+                const auto age_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - entry.resolved_at).count();
+                if (entry.addresses.empty() || !entry.resolved || age_ms >= RESOLVER_CACHE_MAX_STALE_MS) {
+                    entry.addresses.clear();
+                    entry.resolved_at = std::chrono::steady_clock::now();
+                    entry.resolved = true;
+                }
+            }
+            waiting.swap(entry.waiting);
+        }
+
+        if (success) {
+            std::string ips;
+            for (const auto &address : addresses)
+                ips.append(" ").append(address.ip);
+            info_log("resolved %s in %lld ms:%s", hostname.c_str(), lookup_ms, ips.c_str());
+        } else {
+            error_log("couldn't resolve %s in %lld ms, %s", hostname.c_str(), lookup_ms, error.c_str());
+        }
+
+        debug_log("resolver %s", summary().c_str());
+
+        for (auto &callback : waiting)
+            callback();
+    }
+}
+
+bool Resolver::lookup(const std::string &hostname, std::vector<ResolvedAddress> &addresses, std::string &error) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    struct addrinfo *results = nullptr;
+    const int ret = getaddrinfo(hostname.c_str(), nullptr, &hints, &results);
+    if (ret != 0) {
+        error = gai_strerror(ret);
+        return false;
+    }
+
+    for (struct addrinfo *result = results; result; result = result->ai_next) {
+        if (result->ai_family != AF_INET && result->ai_family != AF_INET6)
+            continue;
+        if (result->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        ResolvedAddress address;
+        memset(&address.address, 0, sizeof(address.address));
+        memcpy(&address.address, result->ai_addr, result->ai_addrlen);
+        address.address_len = (socklen_t) result->ai_addrlen;
+        address.family = result->ai_family;
+
+        char ip[INET6_ADDRSTRLEN] = "";
+        const void *raw = result->ai_family == AF_INET6
+                          ? (const void *) &((struct sockaddr_in6 *) result->ai_addr)->sin6_addr
+                          : (const void *) &((struct sockaddr_in *) result->ai_addr)->sin_addr;
+        if (!inet_ntop(result->ai_family, (void *) raw, ip, sizeof(ip)))
+            continue;
+        address.ip = ip;
+
+        const bool duplicate = std::any_of(addresses.begin(), addresses.end(), [&address](const ResolvedAddress &other) {
+            return other.ip == address.ip;
+        });
+        if (!duplicate)
+            addresses.push_back(address);
+    }
+    freeaddrinfo(results);
+
+    if (addresses.empty()) {
+        error = "no IPv4 or IPv6 addresses";
+        return false;
+    }
+    return true;
+}
+
+// best first within each family, then alternating families starting with the better one, IPv6 on a tie (RFC 8305)
+void Resolver::connect_order(std::vector<ResolvedAddress> &addresses) {
+    std::vector<ResolvedAddress> v6, v4;
+    for (auto &address : addresses)
+        (address.family == AF_INET6 ? v6 : v4).push_back(address);
+
+    const auto by_rank = [](const ResolvedAddress &a, const ResolvedAddress &b) {
+        return connect_rank(a) < connect_rank(b);
+    };
+    std::stable_sort(v6.begin(), v6.end(), by_rank);
+    std::stable_sort(v4.begin(), v4.end(), by_rank);
+
+    bool take_v6 = v4.empty() || (!v6.empty() && connect_rank(v6[0]) <= connect_rank(v4[0]));
+    size_t i6 = 0, i4 = 0;
+    addresses.clear();
+    while (i6 < v6.size() || i4 < v4.size()) {
+        if ((take_v6 && i6 < v6.size()) || i4 == v4.size())
+            addresses.push_back(v6[i6++]);
+        else
+            addresses.push_back(v4[i4++]);
+        take_v6 = !take_v6;
+    }
+}
+
+Resolver::~Resolver() {
+    std::vector<std::function<void()>> waiting;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutting_down = true;
+        for (auto &entry : cache) {
+            for (auto &callback : entry.second.waiting)
+                waiting.push_back(callback);
+            entry.second.waiting.clear();
+        }
+    }
+    queue_signal.notify_all();
+    if (lookup_thread.joinable())
+        lookup_thread.join();
+
+    // nothing will answer these anymore
+    for (auto &callback : waiting)
+        callback();
+}
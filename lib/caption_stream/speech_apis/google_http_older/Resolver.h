@@ -0,0 +1,135 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_RESOLVER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_RESOLVER_H
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// getaddrinfo() doesn't give the record TTL, addresses are used without a lookup for this long
+#define RESOLVER_CACHE_TTL_MS 60000
+// after that they're still used but refreshed in the background, up to this age
+#define RESOLVER_CACHE_MAX_STALE_MS 900000
+// a failed lookup is remembered this long so retries don't hammer the resolver
+#define RESOLVER_NEGATIVE_TTL_MS 2000
+
+// head start each connect attempt gets before the next address is tried in parallel, RFC 8305
+#define HAPPY_EYEBALLS_DELAY_MS 250
+
+enum resolve_status {
+    RESOLVE_OK = 0,
+    RESOLVE_PENDING, // lookup queued, the callback is called once it's done
+    RESOLVE_FAILED,
+};
+
+struct ResolvedAddress {
+    struct sockaddr_storage address;
+    socklen_t address_len = 0;
+    int family = AF_UNSPEC;
+    std::string ip;
+
+    // smoothed connect time, 0 if never connected
+    unsigned int connect_ms = 0;
+    unsigned int connect_failures = 0;
+
+    // copy of address with the port set
+    struct sockaddr_storage with_port(unsigned int port) const;
+};
+
+/*
+ Process wide hostname cache, thread safe.
+
+ Lookups go through getaddrinfo() (all addresses, IPv4 and IPv6) on a background thread, so asking for a hostname that
+ was looked up before never blocks, even once its entry got old. Addresses are handed out in the order they should be
+ tried: interleaved by family (RFC 8305) and ones that connected quickly before first, using the connect times
+ reported back with report_connect().
+ */
+class Resolver {
+    struct Entry {
+        std::vector<ResolvedAddress> addresses;
+        std::string error;
+        std::chrono::steady_clock::time_point resolved_at;
+        bool resolved = false;
+        bool lookup_queued = false;
+        std::vector<std::function<void()>> waiting;
+    };
+
+    std::mutex mutex;
+    std::condition_variable queue_signal;
+    std::unordered_map<std::string, Entry> cache;
+    std::deque<std::string> lookup_queue;
+    std::thread lookup_thread;
+    bool shutting_down = false;
+
+    uint64_t lookup_count = 0;
+    uint64_t hit_count = 0;
+
+    Resolver() = default;
+
+    // resolve_cached(), may_lookup false never queues a lookup
+    resolve_status resolve_entry(const std::string &hostname, std::vector<ResolvedAddress> &addresses,
+                                 std::string *error, std::function<void()> on_done, bool may_lookup);
+
+    void queue_lookup(const std::string &hostname, Entry &entry);
+
+    void lookup_run();
+
+    static bool lookup(const std::string &hostname, std::vector<ResolvedAddress> &addresses, std::string &error);
+
+    static void connect_order(std::vector<ResolvedAddress> &addresses);
+
+public:
+    Resolver(const Resolver &) = delete;
+
+    Resolver &operator=(const Resolver &) = delete;
+
+    static Resolver &shared();
+
+    // never blocks. RESOLVE_PENDING if nothing usable is cached yet, then on_done is called from the lookup thread
+    // once there's an answer and this can be called again
+    resolve_status resolve_cached(const std::string &hostname, std::vector<ResolvedAddress> &addresses,
+                                  std::string *error = nullptr, std::function<void()> on_done = nullptr);
+
+    // blocks for the lookup if needed, false on failure
+    bool resolve(const std::string &hostname, std::vector<ResolvedAddress> &addresses, std::string *error = nullptr);
+
+    // connect result for an address handed out before, orders future connects
+    void report_connect(const std::string &hostname, const std::string &ip, unsigned int connect_ms, bool success);
+
+    std::string summary();
+
+    ~Resolver();
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_RESOLVER_H
@@ -17,16 +17,34 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "TcpConnection.h"
 
+#include <algorithm>
+#include <chrono>
+
 #include "utils.h"
 #include "log.h"
 
 #define READ_BUFFER_SIZE 2048
 
-#include "ip_utils.c"
-
-//testing
-#define SOCKET_RECV_BUFFER_SIZE 4096
-#define SOCKET_SEND_BUFFER_SIZE 1024
+#ifdef _WIN32
+#define NATIVE_SOCKET(socket) ((SOCKET) p_socket_get_fd(socket))
+#else
+#include <errno.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#define NATIVE_SOCKET(socket) p_socket_get_fd(socket)
+#endif
+
+// macOS calls the keepalive idle time TCP_KEEPALIVE
+#if defined(TCP_KEEPIDLE)
+#define KEEPALIVE_IDLE_OPTION TCP_KEEPIDLE
+#elif defined(TCP_KEEPALIVE)
+#define KEEPALIVE_IDLE_OPTION TCP_KEEPALIVE
+#endif
+
+// max buffers per send_all_vectored() call
+#define MAX_SEND_BUFFERS 16
 
 volatile bool is_setup = false;
 
@@ -40,58 +58,345 @@ static void setup_check() {
 }
 
 
-TcpConnection::TcpConnection(string hostname, uint port)
-        : hostname(hostname), port(port) {
+static bool set_int_option(PSocket *socket, const int level, const int name, const int value, const char *option_name) {
+    if (setsockopt(NATIVE_SOCKET(socket), level, name, (const char *) &value, sizeof(value)) == 0)
+        return true;
+
+    debug_log("couldn't set %s to %d", option_name, value);
+    return false;
+}
+
+// -1 if it couldn't be read
+static int get_int_option(PSocket *socket, const int level, const int name) {
+    int value = 0;
+    socklen_t value_len = sizeof(value);
+    if (getsockopt(NATIVE_SOCKET(socket), level, name, (char *) &value, &value_len) != 0)
+        return -1;
+    return value;
+}
+
+// before connecting, the window scale is settled during the handshake
+static void set_buffer_sizes(PSocket *socket, const TcpSocketOptions &options) {
+    if (options.send_buffer_size)
+        set_int_option(socket, SOL_SOCKET, SO_SNDBUF, (int) options.send_buffer_size, "SO_SNDBUF");
+    if (options.recv_buffer_size)
+        set_int_option(socket, SOL_SOCKET, SO_RCVBUF, (int) options.recv_buffer_size, "SO_RCVBUF");
+}
+
+TcpConnection::TcpConnection(string hostname, uint port, const TcpSocketOptions &socket_options)
+        : hostname(hostname), port(port), socket_options(socket_options) {
     setup_check();
     debug_log("TcpConnection!!!!!!!!!!");
 }
 
+void TcpConnection::apply_socket_options() {
+    if (!p_socket)
+        return;
+
+    set_int_option(p_socket, IPPROTO_TCP, TCP_NODELAY, socket_options.no_delay, "TCP_NODELAY");
+
+    set_int_option(p_socket, SOL_SOCKET, SO_KEEPALIVE, socket_options.keepalive_enabled(), "SO_KEEPALIVE");
+    if (socket_options.keepalive_enabled()) {
+#ifdef KEEPALIVE_IDLE_OPTION
+        set_int_option(p_socket, IPPROTO_TCP, KEEPALIVE_IDLE_OPTION, (int) socket_options.keepalive_idle_secs,
+                       "keepalive idle");
+#endif
+#ifdef TCP_KEEPINTVL
+        if (socket_options.keepalive_interval_secs)
+            set_int_option(p_socket, IPPROTO_TCP, TCP_KEEPINTVL, (int) socket_options.keepalive_interval_secs,
+                           "TCP_KEEPINTVL");
+#endif
+#ifdef TCP_KEEPCNT
+        if (socket_options.keepalive_count)
+            set_int_option(p_socket, IPPROTO_TCP, TCP_KEEPCNT, (int) socket_options.keepalive_count, "TCP_KEEPCNT");
+#endif
+    }
+
+#ifdef TCP_USER_TIMEOUT
+    if (socket_options.user_timeout_ms)
+        set_int_option(p_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, (int) socket_options.user_timeout_ms,
+                       "TCP_USER_TIMEOUT");
+    const int user_timeout_ms = get_int_option(p_socket, IPPROTO_TCP, TCP_USER_TIMEOUT);
+#else
+    const int user_timeout_ms = -1;
+#endif
+
+#ifdef KEEPALIVE_IDLE_OPTION
+    const int keepalive_idle_secs = get_int_option(p_socket, IPPROTO_TCP, KEEPALIVE_IDLE_OPTION);
+#else
+    const int keepalive_idle_secs = -1;
+#endif
+#ifdef TCP_KEEPINTVL
+    const int keepalive_interval_secs = get_int_option(p_socket, IPPROTO_TCP, TCP_KEEPINTVL);
+#else
+    const int keepalive_interval_secs = -1;
+#endif
+#ifdef TCP_KEEPCNT
+    const int keepalive_count = get_int_option(p_socket, IPPROTO_TCP, TCP_KEEPCNT);
+#else
+    const int keepalive_count = -1;
+#endif
+
+    // what the OS ended up using, -1 where it can't be read. Linux reports the doubled buffer sizes it allocates
+    info_log("socket options %s:%u, nodelay %d, sndbuf %d, rcvbuf %d, keepalive %d (idle %d s, interval %d s, "
+             "count %d), user timeout %d ms",
+             hostname.c_str(), port,
+             get_int_option(p_socket, IPPROTO_TCP, TCP_NODELAY) > 0,
+             get_int_option(p_socket, SOL_SOCKET, SO_SNDBUF),
+             get_int_option(p_socket, SOL_SOCKET, SO_RCVBUF),
+             get_int_option(p_socket, SOL_SOCKET, SO_KEEPALIVE) > 0,
+             keepalive_idle_secs, keepalive_interval_secs, keepalive_count, user_timeout_ms);
+}
+
 void TcpConnection::connect(uint timeoutMs) {
+#ifdef _WIN32
+    connect_sequential(timeoutMs);
+#else
+    vector<ResolvedAddress> resolved;
+    string error;
+    if (!Resolver::shared().resolve(hostname, resolved, &error))
+        throw ConnectError(("couldn't resolve hostname, " + error).c_str());
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    vector<int> fds;
+    vector<struct pollfd> poll_fds;
+    bool done = connect_start(resolved);
+    while (!done) {
+        const auto now = std::chrono::steady_clock::now();
+        if (timeoutMs && now >= deadline)
+            throw ConnectError("connect timed out");
+
+        auto wake_at = connect_tick(now);
+        if (timeoutMs)
+            wake_at = std::min(wake_at, deadline);
+        const int wait_ms = wake_at == std::chrono::steady_clock::time_point::max() ? -1 :
+                            (int) std::chrono::duration_cast<std::chrono::milliseconds>(wake_at - now).count() + 1;
+
+        get_connect_fds(fds);
+        poll_fds.clear();
+        for (const int fd : fds)
+            poll_fds.push_back({fd, POLLOUT, 0});
+
+        if (poll(poll_fds.data(), (nfds_t) poll_fds.size(), wait_ms) < 0 && errno != EINTR)
+            throw ConnectError("couldn't wait for connect");
+
+        for (const auto &poll_fd : poll_fds) {
+            if (poll_fd.revents && connect_continue(poll_fd.fd)) {
+                done = true;
+                break;
+            }
+        }
+    }
+
+    // the rest of this connection uses blocking sends and receives with plibsys timeouts
+    p_socket_set_blocking(p_socket, TRUE);
+#endif
+
+//    info_log("blocking: %d\n", p_socket_get_blocking(p_socket));
+    if (timeoutMs) {
+//        debug_log("timeout: %d", p_socket_get_timeout(p_socket));
+        p_socket_set_timeout(p_socket, timeoutMs);
+//        debug_log("timeout: %d", p_socket_get_timeout(p_socket));
+    }
+}
+
+#ifdef _WIN32
+
+// one address after the other, each with the full timeout
+void TcpConnection::connect_sequential(uint timeoutMs) {
+    if (started)
+        throw ConnectError("connection already started, wuttt");
+
+    started = true;
+
+    string error;
+    if (!Resolver::shared().resolve(hostname, addresses, &error))
+        throw ConnectError(("couldn't resolve hostname, " + error).c_str());
+
+    for (const auto &address : addresses) {
+        const struct sockaddr_storage native = address.with_port(port);
+        p_address = p_socket_address_new_from_native(&native, address.address_len);
+        p_socket = p_socket_new(address.family == AF_INET6 ? P_SOCKET_FAMILY_INET6 : P_SOCKET_FAMILY_INET,
+                                P_SOCKET_TYPE_STREAM, P_SOCKET_PROTOCOL_TCP, nullptr);
+        if (p_address && p_socket) {
+            if (timeoutMs)
+                p_socket_set_timeout(p_socket, timeoutMs);
+            set_buffer_sizes(p_socket, socket_options);
+
+            const auto connect_start = std::chrono::steady_clock::now();
+            const bool success = p_socket_connect(p_socket, p_address, nullptr);
+            const uint attempt_ms = (uint) std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - connect_start).count();
+
+            Resolver::shared().report_connect(hostname, address.ip, attempt_ms, success);
+            if (success) {
+                ip_address = address.ip;
+                connect_ms = attempt_ms;
+                connected = true;
+                info_log("connected to %s:%u (%s) in %u ms", hostname.c_str(), port, ip_address.c_str(), connect_ms.load());
+                apply_socket_options();
+                return;
+            }
+            debug_log("connect to %s failed after %u ms", address.ip.c_str(), attempt_ms);
+        }
+        close();
+    }
+    throw ConnectError("couldn't connect to server");
+}
+
+#else
+
+bool TcpConnection::connect_start(const vector<ResolvedAddress> &resolved) {
     if (started)
         throw ConnectError("connection already started, wuttt");
 
     started = true;
+    addresses = resolved;
+    next_address = 0;
+    if (addresses.empty())
+        throw ConnectError("no addresses to connect to");
 
-    const char *ip_str = host_to_ip(hostname.c_str());
+    start_attempts();
+    next_attempt_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(HAPPY_EYEBALLS_DELAY_MS);
+    return connected;
+}
+
+bool TcpConnection::connect_continue(const int fd) {
+    if (connected)
+        return true;
 
-    if (ip_str == nullptr)
-        throw ConnectError("couldn't resolve hostname");
+    for (size_t i = 0; i < attempts.size(); i++) {
+        if (p_socket_get_fd(attempts[i].socket) != fd)
+            continue;
 
-    ip_address = ip_str;
-    debug_log("address %s %s", ip_address.c_str(), ip_str);
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0)
+            error = errno;
 
-    // Construct address for server.  Since the server is assumed to be on the same machine for the sake of this program, the address is loopback, but typically this would be an external address.
-    if ((p_address = p_socket_address_new(ip_address.c_str(), port)) == nullptr)
-        throw ConnectError("couldn't create address");
+        if (error == EINPROGRESS || error == EALREADY)
+            return false;
 
+        if (error) {
+            debug_log("connect to %s failed, %d", addresses[attempts[i].address_index].ip.c_str(), error);
+            attempt_failed(i);
 
-    // Create p_socket
-    if ((p_socket = p_socket_new(P_SOCKET_FAMILY_INET, P_SOCKET_TYPE_STREAM, P_SOCKET_PROTOCOL_TCP, nullptr)) == nullptr) {
-        throw ConnectError("couldn't create p_socket");
+            // no point waiting for the head start to pass
+            if (attempts.empty()) {
+                start_attempts();
+                next_attempt_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(HAPPY_EYEBALLS_DELAY_MS);
+            }
+            return connected;
+        }
+
+        attempt_won(i);
+        return true;
     }
+    return false;
+}
 
-//    info_log("blocking: %d\n", p_socket_get_blocking(p_socket));
-    if (timeoutMs) {
-//        debug_log("timeout: %d", p_socket_get_timeout(p_socket));
-        p_socket_set_timeout(p_socket, timeoutMs);
-//        debug_log("timeout: %d", p_socket_get_timeout(p_socket));
+std::chrono::steady_clock::time_point TcpConnection::connect_tick(const std::chrono::steady_clock::time_point now) {
+    if (connected || next_address >= addresses.size())
+        return std::chrono::steady_clock::time_point::max();
+
+    if (now >= next_attempt_at) {
+        start_attempts();
+        next_attempt_at = now + std::chrono::milliseconds(HAPPY_EYEBALLS_DELAY_MS);
+        if (connected || next_address >= addresses.size())
+            return std::chrono::steady_clock::time_point::max();
     }
+    return next_attempt_at;
+}
 
+void TcpConnection::get_connect_fds(vector<int> &fds) {
+    fds.clear();
+    if (p_socket) {
+        fds.push_back(p_socket_get_fd(p_socket));
+        return;
+    }
 
-//    p_socket_set_buffer_size(p_socket, P_SOCKET_DIRECTION_RCV, 1024, nullptr);
-//    p_socket_set_buffer_size(p_socket, P_SOCKET_DIRECTION_RCV, SOCKET_RECV_BUFFER_SIZE, nullptr);
-//    p_socket_set_buffer_size(p_socket, P_SOCKET_DIRECTION_SND, SOCKET_SEND_BUFFER_SIZE, nullptr);
-//    info_log("buffer size", );
+    for (const auto &attempt : attempts)
+        fds.push_back(p_socket_get_fd(attempt.socket));
+}
 
-    // Connect to server.
-    if (!p_socket_connect(p_socket, p_address, nullptr)) {
+// starts attempts until one is in flight, throws if none are left and nothing is in flight
+void TcpConnection::start_attempts() {
+    while (next_address < addresses.size()) {
+        if (start_attempt())
+            return;
+    }
+
+    if (attempts.empty() && !connected)
         throw ConnectError("couldn't connect to server");
+}
+
+// false if it failed right away
+bool TcpConnection::start_attempt() {
+    const size_t index = next_address++;
+    const ResolvedAddress &address = addresses[index];
+
+    PSocket *socket = p_socket_new(address.family == AF_INET6 ? P_SOCKET_FAMILY_INET6 : P_SOCKET_FAMILY_INET,
+                                   P_SOCKET_TYPE_STREAM, P_SOCKET_PROTOCOL_TCP, nullptr);
+    if (!socket) {
+        debug_log("couldn't create socket for %s", address.ip.c_str());
+        Resolver::shared().report_connect(hostname, address.ip, 0, false);
+        return false;
+    }
+    p_socket_set_blocking(socket, FALSE);
+    set_buffer_sizes(socket, socket_options);
+    attempts.push_back({socket, index, std::chrono::steady_clock::now()});
+    debug_log("connecting to %s:%u (%s), address %zu of %zu",
+              hostname.c_str(), port, address.ip.c_str(), index + 1, addresses.size());
+
+    // plibsys doesn't tell EINPROGRESS apart from other errors, so this one is done directly
+    const struct sockaddr_storage native = address.with_port(port);
+    if (::connect(p_socket_get_fd(socket), (const struct sockaddr *) &native, address.address_len) == 0) {
+        attempt_won(attempts.size() - 1);
+        return true;
+    }
+
+    if (errno != EINPROGRESS && errno != EINTR) {
+        debug_log("connect to %s failed right away, %d", address.ip.c_str(), errno);
+        attempt_failed(attempts.size() - 1);
+        return false;
     }
+    return true;
+}
 
-    debug_log("Connected!!!!!!!!!");
+void TcpConnection::attempt_won(const size_t attempt) {
+    const ConnectAttempt won = attempts[attempt];
+    attempts.erase(attempts.begin() + attempt);
+
+    const ResolvedAddress &address = addresses[won.address_index];
+    connect_ms = (uint) std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - won.started_at).count();
+    Resolver::shared().report_connect(hostname, address.ip, connect_ms.load(), true);
+
+    for (const auto &lost : attempts) {
+        debug_log("dropping slower connect to %s", addresses[lost.address_index].ip.c_str());
+        p_socket_free(lost.socket);
+    }
+    attempts.clear();
+
+    p_socket = won.socket;
+    ip_address = address.ip;
     connected = true;
+    info_log("connected to %s:%u (%s) in %u ms, address %zu of %zu",
+             hostname.c_str(), port, ip_address.c_str(), connect_ms.load(), won.address_index + 1, addresses.size());
+    apply_socket_options();
+}
+
+void TcpConnection::attempt_failed(const size_t attempt) {
+    const ConnectAttempt failed = attempts[attempt];
+    attempts.erase(attempts.begin() + attempt);
+
+    const uint attempt_ms = (uint) std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - failed.started_at).count();
+    Resolver::shared().report_connect(hostname, addresses[failed.address_index].ip, attempt_ms, false);
+    p_socket_free(failed.socket);
 }
 
+#endif
 
 bool TcpConnection::is_connected() {
     return connected;
@@ -101,7 +406,21 @@ bool TcpConnection::is_dead() {
     return dead;
 }
 
+uint TcpConnection::get_connect_ms() {
+    return connect_ms;
+}
+
+const string &TcpConnection::get_ip_address() {
+    return ip_address;
+}
+
 void TcpConnection::close() {
+#ifndef _WIN32
+    for (const auto &attempt : attempts)
+        p_socket_free(attempt.socket);
+    attempts.clear();
+#endif
+
     if (p_socket != nullptr) {
         debug_log("freeing p_socket");
         p_socket_close(p_socket, nullptr);
@@ -142,6 +461,150 @@ bool TcpConnection::send_all(const char *buffer, const int bytes) {
     return true;
 }
 
+bool TcpConnection::send_all_vectored(const TcpSendBuffer *buffers, const int buffer_count) {
+    if (!p_socket || buffer_count <= 0 || buffer_count > MAX_SEND_BUFFERS)
+        return false;
+
+#ifdef _WIN32
+    WSABUF parts[MAX_SEND_BUFFERS];
+#else
+    struct iovec parts[MAX_SEND_BUFFERS];
+#endif
+
+    int part_cnt = 0;
+    size_t left = 0;
+    for (int i = 0; i < buffer_count; i++) {
+        if (!buffers[i].size)
+            continue;
+#ifdef _WIN32
+        parts[part_cnt].buf = (CHAR *) buffers[i].data;
+        parts[part_cnt].len = (ULONG) buffers[i].size;
+#else
+        parts[part_cnt].iov_base = (void *) buffers[i].data;
+        parts[part_cnt].iov_len = buffers[i].size;
+#endif
+        left += buffers[i].size;
+        part_cnt++;
+    }
+
+    int first_part = 0;
+    while (left > 0) {
+        // plibsys timeout handling, blocks until writable or the set timeout passes
+        if (!p_socket_io_condition_wait(p_socket, P_SOCKET_IO_CONDITION_POLLOUT, nullptr))
+            return false;
+
+        size_t just_sent;
+#ifdef _WIN32
+        DWORD sent_cnt = 0;
+        if (WSASend((SOCKET) p_socket_get_fd(p_socket), &parts[first_part], part_cnt - first_part, &sent_cnt, 0, nullptr, nullptr) != 0) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK)
+                continue;
+            return false;
+        }
+        just_sent = sent_cnt;
+#else
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &parts[first_part];
+        msg.msg_iovlen = part_cnt - first_part;
+
+        int flags = 0;
+#ifdef MSG_NOSIGNAL
+        flags |= MSG_NOSIGNAL;
+#endif
+        const ssize_t sent_cnt = sendmsg(p_socket_get_fd(p_socket), &msg, flags);
+        if (sent_cnt < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            return false;
+        }
+        just_sent = (size_t) sent_cnt;
+#endif
+        left -= just_sent;
+
+        // partial send, skip what's done and resume mid part
+        while (just_sent && first_part < part_cnt) {
+#ifdef _WIN32
+            size_t part_len = parts[first_part].len;
+#else
+            size_t part_len = parts[first_part].iov_len;
+#endif
+            if (just_sent < part_len) {
+#ifdef _WIN32
+                parts[first_part].buf += just_sent;
+                parts[first_part].len -= (ULONG) just_sent;
+#else
+                parts[first_part].iov_base = (char *) parts[first_part].iov_base + just_sent;
+                parts[first_part].iov_len -= just_sent;
+#endif
+                just_sent = 0;
+            } else {
+                just_sent -= part_len;
+                first_part++;
+            }
+        }
+    }
+    return true;
+}
+
+#ifndef _WIN32
+
+int TcpConnection::get_fd() {
+    return p_socket ? p_socket_get_fd(p_socket) : -1;
+}
+
+int TcpConnection::send_some_vectored(const TcpSendBuffer *buffers, const int buffer_count) {
+    if (!p_socket || buffer_count <= 0 || buffer_count > MAX_SEND_BUFFERS)
+        return -1;
+
+    struct iovec parts[MAX_SEND_BUFFERS];
+    int part_cnt = 0;
+    for (int i = 0; i < buffer_count; i++) {
+        if (!buffers[i].size)
+            continue;
+
+        parts[part_cnt].iov_base = (void *) buffers[i].data;
+        parts[part_cnt].iov_len = buffers[i].size;
+        part_cnt++;
+    }
+    if (!part_cnt)
+        return 0;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = parts;
+    msg.msg_iovlen = part_cnt;
+
+    int flags = MSG_DONTWAIT;
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+    const ssize_t sent_cnt = sendmsg(p_socket_get_fd(p_socket), &msg, flags);
+    if (sent_cnt < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+    return (int) sent_cnt;
+}
+
+int TcpConnection::receive_some(char *buffer, const int bytes) {
+    if (!p_socket || bytes <= 0)
+        return -1;
+
+    const ssize_t read_cnt = recv(p_socket_get_fd(p_socket), buffer, (size_t) bytes, MSG_DONTWAIT);
+    if (read_cnt < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+
+    // 0 is the server closing the connection
+    return read_cnt ? (int) read_cnt : -1;
+}
+
+#endif
+
 int TcpConnection::receive_at_most(char *buffer, int bytes) {
     return p_socket_receive(p_socket, buffer, bytes, nullptr);
 }
@@ -20,12 +20,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 
 #include <plibsys.h>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <vector>
+#include "Resolver.h"
+#include "SocketOptions.h"
 
 typedef unsigned int uint;
 using namespace std;
 
 
+// one part of a vectored send, points at memory owned by the caller
+struct TcpSendBuffer {
+    const char *data;
+    size_t size;
+};
+
 class ConnectError : public std::exception {
     string error_message;
 public:
@@ -43,16 +54,45 @@ class TcpConnection {
 
     string hostname;
     const uint port;
+    const TcpSocketOptions socket_options;
     string ip_address;
     PSocketAddress *p_address = nullptr;
     PSocket *p_socket = nullptr;
     bool started = false;
     bool dead = false;
     bool connected = false;
+    std::atomic<uint> connect_ms{0}; // read from other threads through rtt_ms()
+
+    // connect attempts racing over the resolved addresses, see connect_start()
+    struct ConnectAttempt {
+        PSocket *socket;
+        size_t address_index;
+        std::chrono::steady_clock::time_point started_at;
+    };
+
+    vector<ResolvedAddress> addresses;
+    size_t next_address = 0;
+    vector<ConnectAttempt> attempts;
+    std::chrono::steady_clock::time_point next_attempt_at;
+
+    // after connecting, logs what the OS actually uses
+    void apply_socket_options();
+
+#ifdef _WIN32
+    void connect_sequential(uint timeoutMs);
+#else
+    bool start_attempt();
+
+    void start_attempts();
+
+    void attempt_won(size_t attempt);
+
+    void attempt_failed(size_t attempt);
+#endif
 
 public:
 
-    explicit TcpConnection(string hostname, uint port);
+    explicit TcpConnection(string hostname, uint port, const TcpSocketOptions &socket_options = TcpSocketOptions());
 
     void connect(uint timeoutMs);
 
@@ -60,6 +100,9 @@ public:
 
     bool send_all(const char *buffer, const int bytes);
 
+    // sends all given buffers in order with as few syscalls as possible (writev/WSASend), buffers aren't copied
+    bool send_all_vectored(const TcpSendBuffer *buffers, const int buffer_count);
+
     int receive_at_most(char *buffer, int bytes);
 
     int receive_at_least(string &buffer, int bytes);
@@ -70,6 +113,41 @@ public:
 
     bool is_dead();
 
+    // how long the TCP handshake took, rough RTT estimate
+    uint get_connect_ms();
+
+    const string &get_ip_address();
+
+#ifndef _WIN32
+    // non-blocking use from a single thread, see IoReactor
+
+    /*
+     Happy eyeballs: starts connecting to the first address, every HAPPY_EYEBALLS_DELAY_MS (or right away when one
+     fails) connect_tick() starts another in parallel, the first to connect wins and the others are dropped.
+     Wait for any of get_connect_fds() to become writable and pass it to connect_continue().
+     All of these throw ConnectError once every address failed.
+     */
+    // true if already connected
+    bool connect_start(const vector<ResolvedAddress> &resolved);
+
+    // true once connected
+    bool connect_continue(int fd);
+
+    // starts the next attempt if it's time, returns when to call again
+    std::chrono::steady_clock::time_point connect_tick(std::chrono::steady_clock::time_point now);
+
+    // the connected socket, or all attempts in flight
+    void get_connect_fds(vector<int> &fds);
+
+    int get_fd();
+
+    // bytes sent, 0 if it would block, -1 on error
+    int send_some_vectored(const TcpSendBuffer *buffers, const int buffer_count);
+
+    // bytes received, 0 if it would block, -1 on error or closed by the server
+    int receive_some(char *buffer, const int bytes);
+#endif
+
     void close();
 
     ~TcpConnection();
@@ -15,17 +15,19 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 ******************************************************************************/
 
+#include <algorithm>
 #include <utility>
 
 
 #include <string>
 #include <sstream>
 #include "CaptionStream.h"
+#include "ChannelManager.h"
+#include "CompletionQueueDriver.h"
 #include "utils.h"
 #include "log.h"
 
-#include <grpcpp/grpcpp.h>
-#include <google/cloud/speech/v1/cloud_speech.grpc.pb.h>
+#include <grpcpp/alarm.h>
 
 using google::cloud::speech::v1::RecognitionConfig;
 using google::cloud::speech::v1::Speech;
@@ -33,10 +35,19 @@ using google::cloud::speech::v1::StreamingRecognizeRequest;
 using google::cloud::speech::v1::StreamingRecognizeResponse;
 using google::cloud::speech::v1::RecognitionConfig_AudioEncoding;
 
+// upper limit of audio sent per request, whatever is queued up to this is sent at once
+#define UPLOAD_CHUNK_MAX_MS 100
+
+// responses are parsed into a reused message on an arena, a few KB hold even long transcripts
+#define RESPONSE_ARENA_BLOCK_SIZE 8192
+
 static void audio_sender_thread(std::shared_ptr<CaptionStream> self);
 
 static void _audio_sender(CaptionStream &self);
 
+// call is set before the call starts, so queue_audio_data() can wake it as soon as it waits for audio
+static void start_async_call(std::shared_ptr<CaptionStream> self, std::shared_ptr<AsyncCall> &call);
+
 static void read_results_loop_thread(
         CaptionStream &self,
         grpc::ClientReaderWriterInterface<StreamingRecognizeRequest, StreamingRecognizeResponse> *streamer
@@ -46,7 +57,8 @@ CaptionStream::CaptionStream(
         const CaptionStreamSettings settings
 ) :
         settings(settings),
-        session_pair(random_string(15)) {
+        session_pair(random_string(15)),
+        audio_queue(settings.max_queue_depth_ms, settings.queue_drop_policy) {
     debug_log("CaptionStream GRPC Speech, created session pair: %s", session_pair.c_str());
 }
 
@@ -62,6 +74,17 @@ bool CaptionStream::start(std::shared_ptr<CaptionStream> self) {
         return false;
 
     started = true;
+    started_at = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        last_sent_trace.set(CAPTION_TRACE_STREAM_START, started_at);
+    }
+
+    if (settings.use_io_reactor) {
+        start_async_call(self, async_call);
+        return true;
+    }
+
     thread upstream_thread(audio_sender_thread, self);
     upstream_thread.detach();
     return true;
@@ -81,59 +104,104 @@ static void audio_sender_thread(std::shared_ptr<CaptionStream> self) {
     debug_log("finished audio_sender_thread() thread");
 }
 
-static bool write_config(
-        grpc::ClientReaderWriterInterface<StreamingRecognizeRequest, StreamingRecognizeResponse> *streamer,
-        const CaptionStreamSettings &settings
-) {
-    StreamingRecognizeRequest request;
+static void build_config_request(StreamingRecognizeRequest &request, const CaptionStreamSettings &settings) {
     auto *streaming_config = request.mutable_streaming_config();
     streaming_config->set_interim_results(true);
     auto *rec_config = streaming_config->mutable_config();
-    rec_config->set_encoding(RecognitionConfig_AudioEncoding::RecognitionConfig_AudioEncoding_LINEAR16);
+    rec_config->set_encoding(settings.upload_encoding == AUDIO_UPLOAD_FLAC
+                             ? RecognitionConfig_AudioEncoding::RecognitionConfig_AudioEncoding_FLAC
+                             : RecognitionConfig_AudioEncoding::RecognitionConfig_AudioEncoding_LINEAR16);
     rec_config->set_sample_rate_hertz(16000);
     rec_config->set_language_code(settings.language);
     rec_config->set_profanity_filter(bool(settings.profanity_filter));
     rec_config->set_max_alternatives(0);
+}
 
-
+static bool write_config(
+        grpc::ClientReaderWriterInterface<StreamingRecognizeRequest, StreamingRecognizeResponse> *streamer,
+        const CaptionStreamSettings &settings
+) {
+    StreamingRecognizeRequest request;
+    build_config_request(request, settings);
     return streamer->Write(request);
 }
 
+static google::protobuf::ArenaOptions response_arena_options() {
+    google::protobuf::ArenaOptions options;
+    options.start_block_size = RESPONSE_ARENA_BLOCK_SIZE;
+    options.max_block_size = RESPONSE_ARENA_BLOCK_SIZE;
+    return options;
+}
+
+// hands the first alternative of the first result to the callback, true if it finished the drain.
+// Read by reference and into the reused caption, so once its strings have grown this doesn't allocate.
+static bool deliver_response(CaptionStream &self, const StreamingRecognizeResponse &response, CaptionResult &caption) {
+    if (!response.results_size() || !response.results(0).alternatives_size())
+        return false;
+
+    const auto &result = response.results(0);
+    const auto &alternative = result.alternatives(0);
+    caption.index = 0;
+    caption.final = result.is_final();
+    caption.stability = result.stability();
+    caption.caption_text.assign(alternative.transcript());
+    caption.mark_received();
+    self.fill_trace(caption.trace);
+    {
+        std::lock_guard<recursive_mutex> lock(self.on_caption_cb_handle.mutex);
+        if (self.on_caption_cb_handle.callback_fn) {
+            self.on_caption_cb_handle.callback_fn(caption);
+        }
+    }
+    return self.drain_complete(caption);
+}
+
+// dequeues straight into the request's audio_content, which keeps its capacity from chunk to chunk, so there's no
+// intermediate buffer to copy from and nothing is allocated after the first chunk. Encoded uploads are encoded into it.
+// 0 if no audio came in time.
+static size_t dequeue_into_request(CaptionStream &self, StreamingRecognizeRequest &request,
+                                   const std::int64_t timeout_us, AudioTiming &timing) {
+    std::string *audio_content = request.mutable_audio_content();
+    if (self.settings.upload_encoding != AUDIO_UPLOAD_LINEAR16)
+        return self.dequeue_encoded(*audio_content, timeout_us, &timing);
+
+    audio_content->resize(audio_ms_to_bytes(UPLOAD_CHUNK_MAX_MS));
+    const size_t audio_chunk_size = self.dequeue_audio_data(&(*audio_content)[0], audio_content->size(), timeout_us,
+                                                            &timing);
+    audio_content->resize(audio_chunk_size);
+    return audio_chunk_size;
+}
+
 static void write_audio_loop(
         grpc::ClientReaderWriterInterface<StreamingRecognizeRequest, StreamingRecognizeResponse> *streamer,
         CaptionStream &self
 ) {
     uint chunk_count = 0;
     StreamingRecognizeRequest request;
+    AudioTiming audio_timing = {};
 
     while (!self.is_stopped()) {
-        string *audio_chunk = self.dequeue_audio_data(self.settings.send_timeout_ms * 1000);
-        if (audio_chunk == nullptr) {
-            debug_log("couldn't deque audio chunk in time");
+        const size_t audio_chunk_size = dequeue_into_request(self, request, self.settings.send_timeout_ms * 1000,
+                                                             audio_timing);
+        if (!audio_chunk_size) {
+            if (!self.is_draining())
+                debug_log("couldn't deque audio chunk in time");
             break;
         }
 
-        if (audio_chunk->empty()) {
-            debug_log("got 0 size audio chunk. ignoring");
-            delete audio_chunk;
-            continue;
-        }
-
-//        debug_log("qs %zu", audio_queue.size_approx());
+//        debug_log("qs %zu", audio_queue.size());
 //        std::this_thread::sleep_for(std::chrono::milliseconds(rand() % 30));
 //        std::this_thread::sleep_for(std::chrono::milliseconds(30));
 
-        request.set_audio_content(*audio_chunk);
         if (!streamer->Write(request)) {
             debug_log("write_audio_loop write failed, stopping");
-            delete audio_chunk;
             break;
         }
+        self.mark_audio_sent(audio_timing);
         if (chunk_count % 20 == 0)
-            debug_log("sent audio chunk %d, %lu bytes", chunk_count, audio_chunk->size());
-//        debug_log("sent audio chunk %d, %lu bytes", chunk_count, audio_chunk->size());
+            debug_log("sent audio chunk %d, %lu bytes", chunk_count, audio_chunk_size);
+//        debug_log("sent audio chunk %d, %lu bytes", chunk_count, audio_chunk_size);
 
-        delete audio_chunk;
         chunk_count++;
     }
 
@@ -145,76 +213,65 @@ static void read_results_loop_thread(
 ) {
 
     debug_log("read_results_loop_thread starting");
-    StreamingRecognizeResponse response;
-    while (streamer->Read(&response)) {
+    google::protobuf::Arena arena(response_arena_options());
+    auto *response = google::protobuf::Arena::CreateMessage<StreamingRecognizeResponse>(&arena);
+    CaptionResult caption;
+    bool drained = false;
+    while (!drained && streamer->Read(response)) {
 
         if (self.is_stopped())
             break;
 
-        std::cout << "Result size: " << response.results_size() << std::endl;
-        for (int r = 0; r < response.results_size(); ++r) {
-            auto result = response.results(r);
-            std::cout << "ind: " << r << " Result stability: " << result.stability() << " final: " << result.is_final() << std::endl;
-
-            for (int a = 0; a < result.alternatives_size(); ++a) {
-                auto alternative = result.alternatives(a);
-                std::cout << "conf: " << alternative.confidence() << "; " << alternative.transcript() << std::endl;
-
-                CaptionResult cap_result(0, result.is_final(), result.stability(), alternative.transcript(), "");
-                {
-                    std::lock_guard<recursive_mutex> lock(self.on_caption_cb_handle.mutex);
-                    if (self.on_caption_cb_handle.callback_fn) {
-                        self.on_caption_cb_handle.callback_fn(cap_result);
-                    }
-                }
-                break;
-
-            }
-            break;
-        }
+        drained = deliver_response(self, *response, caption);
     }
     debug_log("read_results_loop_thread done");
-    self.stop();
+    self.end_reading();
 };
 
-#ifdef GRPC_USE_INCLUDED_CERTS
-#include "certs/roots.h"
-#endif
+static void check_finish_status(CaptionStream &self, const grpc::Status &status) {
+    if (!status.ok() && !self.is_stopped()) {
+        error_log("grpc stream error: %s", status.error_message().c_str());
+    }
+    // the API ends streams at its duration limit with OUT_OF_RANGE
+    if (!self.is_stopped() && !self.is_draining()
+        && (status.ok() || status.error_code() == grpc::StatusCode::OUT_OF_RANGE))
+        self.mark_ended_cleanly();
+}
 
 static void _audio_sender(CaptionStream &self) {
     debug_log("_audio_sender");
 
     try {
-        auto options = grpc::SslCredentialsOptions();
-
-#ifdef GRPC_USE_INCLUDED_CERTS
-        debug_log("using embedded certs");
-        // grpc needs CA certs on Windows (and Unix depending on how it's been built)
-        // just include as string directly, more convenient than shipping the roots.pem file
-        std::string certs(roots_pem, roots_pem + sizeof roots_pem / sizeof roots_pem[0]);
-        options.pem_root_certs = certs;
-#endif
-        auto creds = grpc::SslCredentials(options);
-        auto channel = grpc::CreateChannel("speech.googleapis.com", creds);
-        std::unique_ptr<Speech::Stub> speech(Speech::NewStub(channel));
+        // shared with the other streams, usually connected already so the call is just a new HTTP/2 stream
+        const SpeechChannel speech = ChannelManager::shared().get(self.settings);
 
         grpc::ClientContext context;
         context.AddMetadata("x-goog-api-key", self.settings.api_key);
 //        context.set_deadline()
 
-        auto streamer = speech->StreamingRecognize(&context);
+        auto streamer = speech.stub->StreamingRecognize(&context);
 
         debug_log("write speech config");
         if (write_config(streamer.get(), self.settings)) {
             debug_log("write speech config done");
+            self.mark_ready();
 
             std::thread downstream_thread(&read_results_loop_thread, std::ref(self), streamer.get());
 
             debug_log("starting audio writes");
             write_audio_loop(streamer.get(), self);
+            const bool draining = self.is_draining();
+            if (draining)
+                self.mark_writes_done();
             streamer->WritesDone();
             debug_log("audio writing finished");
 
+            // the reader stops once the last final result is in, the call is cancelled if it doesn't come
+            if (draining && !self.wait_for_drain()) {
+                info_log("drain timed out");
+                context.TryCancel();
+            }
+
             debug_log("waiting for downstream thread finish");
             downstream_thread.join();
             debug_log("downstream thread finished!");
@@ -227,10 +284,7 @@ static void _audio_sender(CaptionStream &self) {
             debug_log("write speech config failed");
         }
 
-        auto status = streamer->Finish();
-        if (!status.ok()) {
-            error_log("grpc stream error: %s", status.error_message().c_str());
-        }
+        check_finish_status(self, streamer->Finish());
     }
     catch (const std::exception &ex) {
         error_log("_audio_sender exception catch %s", ex.what());
@@ -239,45 +293,470 @@ static void _audio_sender(CaptionStream &self) {
     } catch (...) {
         error_log("_audio_sender exception any error");
     }
+    debug_log("grpc %s", ChannelManager::shared().summary().c_str());
     debug_log("_audio_sender done");
 }
 
+enum async_call_op {
+    ASYNC_CALL_START = 0,
+    ASYNC_CALL_WRITE,
+    ASYNC_CALL_WRITES_DONE,
+    ASYNC_CALL_READ,
+    ASYNC_CALL_FINISH,
+    ASYNC_CALL_ALARM,
+    ASYNC_CALL_WAKE,
+    ASYNC_CALL_OP_COUNT
+};
+
+/*
+ One StreamingRecognize call driven on the shared completion queue, instead of _audio_sender and
+ read_results_loop_thread blocking a thread each.
+
+ At most one write (audio or WritesDone), one read, the alarm and the wake alarm are outstanding at a time. The alarm
+ times the send timeout while the audio queue is empty and the drain. Running out of audio sets upload_waiting, the
+ next queue_audio_data() or drain() takes it back and sets the wake alarm to now, like the HTTP reactor's wake(). The
+ wake alarm counts as outstanding from setting upload_waiting on, whoever takes it back either sets it or uncounts it.
+ stop() cancels the call, which completes everything outstanding, and Finish() is only started once reading ended and
+ no write is in flight.
+ */
+class AsyncCall : public CompletionQueueHandler {
+    std::mutex mutex;
+    std::shared_ptr<CaptionStream> self; // until finished
+    std::shared_ptr<AsyncCall> keep_alive; // until nothing is outstanding anymore
+    CompletionQueueDriver &driver;
+    grpc::CompletionQueue *queue;
+    const SpeechChannel speech;
+
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientAsyncReaderWriter<StreamingRecognizeRequest, StreamingRecognizeResponse>> streamer;
+    grpc::Alarm alarm;
+    grpc::Alarm wake_alarm;
+    std::mutex wake_mutex; // between threads waking the call, never held by the completion queue
+    CompletionQueueTag tags[ASYNC_CALL_OP_COUNT];
+    int outstanding = 0;
+
+    StreamingRecognizeRequest request;
+    google::protobuf::Arena response_arena;
+    StreamingRecognizeResponse *response; // on response_arena
+    CaptionResult caption;
+    AudioTiming audio_timing = {};
+    uint chunk_count = 0;
+    std::chrono::steady_clock::time_point waiting_since;
+
+    bool config_written = false;
+    bool writing = false;
+    bool writes_ended = false;
+    bool alarm_set = false;
+    bool wake_armed = false; // upload_waiting set and its wake alarm not completed yet
+    bool reading_done = false;
+    bool drained = false;
+    bool finishing = false;
+    bool finished = false;
+    grpc::Status status;
+
+    void set_alarm(const std::chrono::steady_clock::time_point at) {
+        if (alarm_set)
+            return;
+
+        // grpc deadlines are system_clock only
+        const auto now = std::chrono::steady_clock::now();
+        const auto deadline = std::chrono::system_clock::now()
+                              + std::chrono::duration_cast<std::chrono::system_clock::duration>(std::max(at, now) - now);
+        alarm_set = true;
+        outstanding++;
+        alarm.Set(queue, deadline, &tags[ASYNC_CALL_ALARM]);
+    }
+
+    // set before checking the queue so audio queued right after an empty check still wakes the call
+    void arm_wake() {
+        if (wake_armed)
+            return;
+
+        wake_armed = true;
+        outstanding++;
+        self->upload_waiting = true;
+    }
+
+    void disarm_wake() {
+        // if queue_audio_data() took it first its wake alarm is on the way
+        if (wake_armed && self->upload_waiting.exchange(false)) {
+            wake_armed = false;
+            outstanding--;
+        }
+    }
+
+    void start_read() {
+        outstanding++;
+        streamer->Read(response, &tags[ASYNC_CALL_READ]);
+    }
+
+    void end_writes() {
+        writes_ended = true;
+        writing = true;
+        outstanding++;
+        streamer->WritesDone(&tags[ASYNC_CALL_WRITES_DONE]);
+
+        // the reader finishes the drain, the call is cancelled if the final result doesn't come in time
+        if (self->is_draining())
+            set_alarm(self->drain_deadline);
+    }
+
+    void write_next() {
+        if (writing || writes_ended || reading_done || self->is_stopped())
+            return;
+
+        arm_wake();
+        const size_t audio_chunk_size = dequeue_into_request(*self, request, 0, audio_timing);
+        const auto now = std::chrono::steady_clock::now();
+        if (audio_chunk_size) {
+            disarm_wake();
+            waiting_since = now;
+            writing = true;
+            outstanding++;
+            streamer->Write(request, &tags[ASYNC_CALL_WRITE]);
+            return;
+        }
+
+        if (self->audio_queue.is_drained()) {
+            disarm_wake();
+            debug_log("audio writing finished");
+            self->mark_writes_done();
+            end_writes();
+            return;
+        }
+
+        const auto timeout_at = waiting_since + std::chrono::milliseconds(self->settings.send_timeout_ms);
+        if (now >= timeout_at) {
+            disarm_wake();
+            debug_log("couldn't deque audio chunk in time");
+            end_writes();
+            return;
+        }
+        set_alarm(timeout_at);
+    }
+
+    void finish_when_done() {
+        if (finishing || !reading_done || writing)
+            return;
+
+        finishing = true;
+        if (alarm_set)
+            alarm.Cancel();
+        disarm_wake();
+
+        outstanding++;
+        streamer->Finish(&status, &tags[ASYNC_CALL_FINISH]);
+    }
+
+public:
+    explicit AsyncCall(std::shared_ptr<CaptionStream> stream) :
+            self(std::move(stream)),
+            driver(CompletionQueueDriver::shared()),
+            queue(driver.attach()),
+            speech(ChannelManager::shared().get(self->settings)),
+            response_arena(response_arena_options()),
+            response(google::protobuf::Arena::CreateMessage<StreamingRecognizeResponse>(&response_arena)) {
+        for (int op = 0; op < ASYNC_CALL_OP_COUNT; op++)
+            tags[op] = {this, op};
+
+        context.AddMetadata("x-goog-api-key", self->settings.api_key);
+    }
+
+    void begin(std::shared_ptr<AsyncCall> call) {
+        std::lock_guard<std::mutex> lock(mutex);
+        keep_alive = std::move(call);
+        streamer = speech.stub->PrepareAsyncStreamingRecognize(&context, queue);
+        outstanding++;
+        streamer->StartCall(&tags[ASYNC_CALL_START]);
+    }
+
+    // any thread, everything outstanding completes soon after
+    void cancel() {
+        context.TryCancel();
+    }
+
+    // only after taking upload_waiting, the wake alarm completes right away on the call's queue
+    void wake() {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        wake_alarm.Set(queue, std::chrono::system_clock::now(), &tags[ASYNC_CALL_WAKE]);
+    }
+
+    void on_complete(const int op, const bool ok) override {
+        // dropped after unlocking, the stream owns this call
+        std::shared_ptr<CaptionStream> done_stream;
+        std::shared_ptr<AsyncCall> done_call;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        outstanding--;
+
+        switch (op) {
+            case ASYNC_CALL_START:
+                if (!ok) {
+                    debug_log("grpc call start failed");
+                    reading_done = true;
+                    break;
+                }
+
+                debug_log("write speech config");
+                build_config_request(request, self->settings);
+                writing = true;
+                outstanding++;
+                streamer->Write(request, &tags[ASYNC_CALL_WRITE]);
+                start_read();
+                break;
+
+            case ASYNC_CALL_WRITE:
+                writing = false;
+                if (!ok) {
+                    // the read fails as well
+                    debug_log("%s", config_written ? "write_audio failed, stopping" : "write speech config failed");
+                    writes_ended = true;
+                    break;
+                }
+
+                if (!config_written) {
+                    debug_log("write speech config done");
+                    config_written = true;
+                    waiting_since = std::chrono::steady_clock::now();
+                    self->mark_ready();
+                } else {
+                    self->mark_audio_sent(audio_timing);
+                    if (chunk_count % 20 == 0)
+                        debug_log("sent audio chunk %d, %lu bytes", chunk_count, request.audio_content().size());
+                    chunk_count++;
+                }
+                write_next();
+                break;
+
+            case ASYNC_CALL_WRITES_DONE:
+                writing = false;
+                break;
+
+            case ASYNC_CALL_READ:
+                if (!ok) {
+                    debug_log("read_results done");
+                    reading_done = true;
+                    self->end_reading();
+                    break;
+                }
+
+                // results after the drain's final one aren't wanted anymore, reading goes on until the server ends
+                if (!drained && !self->is_stopped())
+                    drained = deliver_response(*self, *response, caption);
+                start_read();
+                break;
+
+            case ASYNC_CALL_ALARM:
+                alarm_set = false;
+                if (!ok || finishing)
+                    break;
+
+                if (!writes_ended)
+                    write_next();
+                else if (!drained && self->is_draining()) {
+                    // could still be a send timeout alarm from before the writes ended
+                    if (std::chrono::steady_clock::now() < self->drain_deadline) {
+                        set_alarm(self->drain_deadline);
+                        break;
+                    }
+                    info_log("drain timed out");
+                    context.TryCancel();
+                }
+                break;
+
+            case ASYNC_CALL_WAKE:
+                wake_armed = false;
+                if (ok && !finishing)
+                    write_next();
+                break;
+
+            case ASYNC_CALL_FINISH:
+                finished = true;
+                check_finish_status(*self, status);
+                self->stop();
+                debug_log("grpc %s", ChannelManager::shared().summary().c_str());
+                break;
+
+            default:
+                break;
+        }
+
+        finish_when_done();
+
+        if (finished && !outstanding) {
+            driver.detach();
+            done_stream.swap(self);
+            done_call.swap(keep_alive);
+        }
+    }
+};
+
+static void start_async_call(std::shared_ptr<CaptionStream> self, std::shared_ptr<AsyncCall> &call) {
+    call = std::make_shared<AsyncCall>(std::move(self));
+    call->begin(call);
+}
+
+void CaptionStream::prewarm(const CaptionStreamSettings &settings) {
+    ChannelManager::shared().warm(settings);
+}
+
 bool CaptionStream::is_stopped() {
     return stopped;
 }
 
-bool CaptionStream::queue_audio_data(const char *audio_data, const uint data_size) {
-    if (is_stopped())
+void CaptionStream::drain(const uint timeout_ms) {
+    if (is_stopped() || draining)
+        return;
+
+    if (!ready_ms) {
+        // nothing was written yet, there's nothing to wait for
+        stop();
+        return;
+    }
+
+    info_log("draining, %u ms audio left to write, %s", queued_audio_ms(), session_pair.c_str());
+    drain_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    draining = true;
+    audio_queue.finish();
+
+    // a call waiting for audio ends the requests now
+    wake_upload();
+}
+
+bool CaptionStream::is_draining() {
+    return draining && !is_stopped();
+}
+
+void CaptionStream::mark_writes_done() {
+    writes_done_at = std::chrono::steady_clock::now();
+    writes_done = true;
+}
+
+bool CaptionStream::wait_for_drain() {
+    std::unique_lock<std::mutex> lock(drain_mutex);
+    return drain_signal.wait_until(lock, drain_deadline, [this]() { return stopped || reading_ended; });
+}
+
+void CaptionStream::end_reading() {
+    {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+        reading_ended = true;
+    }
+    drain_signal.notify_all();
+
+    // unblocks the writer so the call can be finished
+    audio_queue.close();
+}
+
+void CaptionStream::mark_ended_cleanly() {
+    server_ended = true;
+}
+
+bool CaptionStream::ended_cleanly() {
+    return server_ended;
+}
+
+bool CaptionStream::drain_complete(const CaptionResult &result) {
+    if (!result.final || !writes_done)
         return false;
 
-    string *str = new string(audio_data, data_size);
+    info_log("drained, final result %lld ms after the requests ended, %s",
+             (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+                     result.created_at - writes_done_at).count(), session_pair.c_str());
+    return true;
+}
 
-    if (settings.max_queue_depth) {
-        // rough estimate in dropping, dont care about being off by one or two in threaded cases
+uint CaptionStream::rtt_ms() {
+    // not measured for grpc yet
+    return 0;
+}
 
-        int cleared_cnt = 0;
-        while (audio_queue.size_approx() > settings.max_queue_depth) {
-            string *item;
-            if (audio_queue.try_dequeue(item)) {
-                delete item;
-                cleared_cnt++;
-            }
-        }
-        if (cleared_cnt)
-            debug_log("queue too big, dropped %d old items from queue %s", cleared_cnt, session_pair.c_str());
+uint CaptionStream::queued_audio_ms() {
+    return audio_bytes_to_ms(audio_queue.size());
+}
+
+uint CaptionStream::ready_after_ms() {
+    return ready_ms;
+}
+
+void CaptionStream::mark_ready() {
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started_at).count();
+    ready_ms = std::max((uint) ms, 1u);
+}
+
+bool CaptionStream::queue_audio_data(const char *audio_data, const uint data_size,
+                                     const std::chrono::steady_clock::time_point captured_at) {
+    if (is_stopped())
+        return false;
+
+    if (!audio_queue.push(audio_data, data_size, captured_at)) {
+        // over max_queue_depth_ms, counted in audio_queue_stats(), not logging on the audio thread
+        return false;
     }
 
+    wake_upload();
+
 //    debug_log("queued %s", session_pair.c_str());
-    audio_queue.enqueue(str);
     return true;
 }
 
-string *CaptionStream::dequeue_audio_data(const std::int64_t timeout_us) {
-    string *ret;
-    if (audio_queue.wait_dequeue_timed(ret, timeout_us))
-        return ret;
+void CaptionStream::wake_upload() {
+    // only the call sets upload_waiting
+    if (upload_waiting.exchange(false))
+        async_call->wake();
+}
+
+size_t CaptionStream::dequeue_audio_data(char *buffer, const size_t max_bytes, const std::int64_t timeout_us,
+                                         AudioTiming *timing) {
+    size_t skipped = 0;
+    const size_t read = audio_queue.pop(buffer, max_bytes, timeout_us, &skipped, timing);
+    if (skipped)
+        info_log("upload fell behind, dropped %u ms of oldest audio, %s", audio_bytes_to_ms(skipped), session_pair.c_str());
+
+    return read;
+}
+
+size_t CaptionStream::dequeue_encoded(std::string &out, const std::int64_t timeout_us, AudioTiming *timing) {
+    if (upload_audio.empty())
+        upload_audio.resize(audio_ms_to_bytes(UPLOAD_CHUNK_MAX_MS));
+
+    out.clear();
+    // a dequeue too short for a frame of its own encodes to nothing, the next one takes it along
+    while (out.empty()) {
+        const size_t audio_size = dequeue_audio_data(&upload_audio[0], upload_audio.size(), timeout_us, timing);
+        if (!audio_size) {
+            if (audio_queue.is_drained())
+                upload_encoder.finish(out);
+            break;
+        }
+        upload_encoder.encode(&upload_audio[0], audio_size, out);
+    }
+    return out.size();
+}
 
-    return nullptr;
+AudioQueueStats CaptionStream::audio_queue_stats() {
+    return audio_queue.stats();
+}
+
+void CaptionStream::mark_audio_sent(const AudioTiming &timing) {
+    if (!timing.captured_at.time_since_epoch().count())
+        return;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    last_sent_trace.set(CAPTION_TRACE_CAPTURE, timing.captured_at);
+    last_sent_trace.set(CAPTION_TRACE_ENQUEUE, timing.enqueued_at);
+    last_sent_trace.mark(CAPTION_TRACE_SEND);
+}
+
+void CaptionStream::fill_trace(CaptionTrace &trace) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace.set(CAPTION_TRACE_CAPTURE, last_sent_trace.at[CAPTION_TRACE_CAPTURE]);
+    trace.set(CAPTION_TRACE_ENQUEUE, last_sent_trace.at[CAPTION_TRACE_ENQUEUE]);
+    trace.set(CAPTION_TRACE_SEND, last_sent_trace.at[CAPTION_TRACE_SEND]);
+    trace.set(CAPTION_TRACE_STREAM_START, last_sent_trace.at[CAPTION_TRACE_STREAM_START]);
+    trace.first_of_stream = !has_result;
+    has_result = true;
 }
 
 
@@ -286,8 +765,18 @@ void CaptionStream::stop() {
     on_caption_cb_handle.clear();
     stopped = true;
 
-    string *to_unblock_uploader = new string();
-    audio_queue.enqueue(to_unblock_uploader);
+    // completes everything outstanding on the completion queue
+    if (async_call)
+        async_call->cancel();
+
+    // wakes the sender waiting for a drain
+    {
+        std::lock_guard<std::mutex> lock(drain_mutex);
+    }
+    drain_signal.notify_all();
+
+    // unblocks the uploader
+    audio_queue.close();
 }
 
 
@@ -296,14 +785,15 @@ CaptionStream::~CaptionStream() {
     if (!is_stopped())
         stop();
 
-    int cleared = 0;
-    {
-        string *item;
-        while (audio_queue.try_dequeue(item)) {
-            delete item;
-            cleared++;
-        }
-    }
-    debug_log("~CaptionStream deconstructor, deleted left %d in queue", cleared);
+    const AudioQueueStats stats = audio_queue.stats();
+    info_log("~CaptionStream %s audio queue %s: dropped %u ms in %llu events (%u ms silence), peak depth %u ms",
+             session_pair.c_str(), audio_queue_drop_policy_name(audio_queue.get_policy()),
+             stats.dropped_ms(), (unsigned long long) stats.drop_events, audio_bytes_to_ms(stats.dropped_silent_bytes),
+             stats.peak_depth_ms());
+    if (settings.upload_encoding != AUDIO_UPLOAD_LINEAR16 && upload_encoder.stats().input_bytes)
+        info_log("~CaptionStream %s %s", session_pair.c_str(),
+                 upload_encoder.stats().summary(audio_upload_encoding_name(settings.upload_encoding)).c_str());
+
+    debug_log("~CaptionStream deconstructor, dropped %lu bytes left in queue", audio_queue.size());
 
 }
@@ -25,7 +25,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <queue>
 #include <chrono>
 #include <mutex>
-#include "thirdparty/cameron314/blockingconcurrentqueue.h"
+#include <atomic>
+#include <condition_variable>
+#include "AudioEncoder.h"
+#include "AudioQueue.h"
+#include "SocketOptions.h"
 
 #include "ThreadsaferCallback.h"
 #include "CaptionResult.h"
@@ -40,20 +44,36 @@ struct CaptionStreamSettings {
     uint send_timeout_ms;
     uint recv_timeout_ms;
 
-    uint max_queue_depth;
-    uint download_thread_start_delay_ms;
+    uint max_queue_depth_ms;
+    audio_queue_drop_policy queue_drop_policy;
 
     string language;
     int profanity_filter;
     string api_key;
 
+    // speech API host, endpoint_port_up is used as the grpc port if set, endpoint_port_down is unused
+    string endpoint_host = "speech.googleapis.com";
+    uint endpoint_port_up = 0;
+    uint endpoint_port_down = 0;
+    // plaintext instead of TLS, only for local test servers
+    bool endpoint_insecure = false;
+
+    // drive the call on the shared completion queue threads instead of a writer and a reader thread per stream
+    bool use_io_reactor = true;
+
+    // audio_content format, lossless FLAC is usually a quarter to two thirds the size of the raw audio
+    audio_upload_encoding upload_encoding = AUDIO_UPLOAD_LINEAR16;
+
+    // only the keepalive part is used, as grpc channel keepalive pings. grpc always sets TCP_NODELAY itself
+    TcpSocketOptions socket_options;
+
     CaptionStreamSettings(
             uint connect_timeout_ms,
             uint send_timeout_ms,
             uint recv_timeout_ms,
 
-            uint max_queue_depth,
-            uint download_thread_start_delay_ms,
+            uint max_queue_depth_ms,
+            audio_queue_drop_policy queue_drop_policy,
             const string &language,
             int profanity_filter,
             const string &api_key
@@ -62,8 +82,8 @@ struct CaptionStreamSettings {
             send_timeout_ms(send_timeout_ms),
             recv_timeout_ms(recv_timeout_ms),
 
-            max_queue_depth(max_queue_depth),
-            download_thread_start_delay_ms(download_thread_start_delay_ms),
+            max_queue_depth_ms(max_queue_depth_ms),
+            queue_drop_policy(queue_drop_policy),
             language(language),
             profanity_filter(profanity_filter),
             api_key(api_key) {}
@@ -72,11 +92,18 @@ struct CaptionStreamSettings {
         return connect_timeout_ms == rhs.connect_timeout_ms &&
                send_timeout_ms == rhs.send_timeout_ms &&
                recv_timeout_ms == rhs.recv_timeout_ms &&
-               max_queue_depth == rhs.max_queue_depth &&
-               download_thread_start_delay_ms == rhs.download_thread_start_delay_ms &&
+               max_queue_depth_ms == rhs.max_queue_depth_ms &&
+               queue_drop_policy == rhs.queue_drop_policy &&
                language == rhs.language &&
                profanity_filter == rhs.profanity_filter &&
-               api_key == rhs.api_key;
+               api_key == rhs.api_key &&
+               endpoint_host == rhs.endpoint_host &&
+               endpoint_port_up == rhs.endpoint_port_up &&
+               endpoint_port_down == rhs.endpoint_port_down &&
+               endpoint_insecure == rhs.endpoint_insecure &&
+               use_io_reactor == rhs.use_io_reactor &&
+               upload_encoding == rhs.upload_encoding &&
+               socket_options == rhs.socket_options;
     }
 
     bool operator!=(const CaptionStreamSettings &rhs) const {
@@ -92,21 +119,58 @@ struct CaptionStreamSettings {
         printf("%s  send_timeout_ms: %d\n", line_prefix, send_timeout_ms);
         printf("%s  recv_timeout_ms: %d\n", line_prefix, recv_timeout_ms);
 
-        printf("%s  max_queue_depth: %d\n", line_prefix, max_queue_depth);
-        printf("%s  download_thread_start_delay_ms: %d\n", line_prefix, download_thread_start_delay_ms);
+        printf("%s  max_queue_depth_ms: %d\n", line_prefix, max_queue_depth_ms);
+        printf("%s  queue_drop_policy: %s\n", line_prefix, audio_queue_drop_policy_name(queue_drop_policy));
+        printf("%s  endpoint: %s port %d%s\n", line_prefix, endpoint_host.c_str(), endpoint_port_up,
+               endpoint_insecure ? " insecure" : "");
+        printf("%s  use_io_reactor: %d\n", line_prefix, use_io_reactor);
+        printf("%s  upload_encoding: %s\n", line_prefix, audio_upload_encoding_name(upload_encoding));
+        socket_options.print(line_prefix);
 
 //        printf("%s-----------\n", line_prefix);
     }
 };
 
 
+class AsyncCall;
+
 class CaptionStream {
+    // drives the call when settings.use_io_reactor is set
+    friend class AsyncCall;
+    std::shared_ptr<AsyncCall> async_call;
+    std::atomic<bool> upload_waiting{false}; // the call ran out of audio, next queue_audio_data() wakes it
+
+    // wakes the call if it's waiting for audio
+    void wake_upload();
+
     string session_pair;
-    moodycamel::BlockingConcurrentQueue<string *> audio_queue;
+    AudioQueue audio_queue;
 
     bool started = false;
     bool stopped = false;
-
+    std::chrono::steady_clock::time_point started_at;
+    std::atomic<uint> ready_ms{0};
+
+    // drain(): no more audio is taken, the requests end once the queued audio is written and results keep coming
+    // until the final one for the last utterance
+    std::atomic<bool> draining{false};
+    std::chrono::steady_clock::time_point drain_deadline; // written before draining is set
+    std::atomic<bool> writes_done{false};
+    std::chrono::steady_clock::time_point writes_done_at;
+    std::mutex drain_mutex;
+    std::condition_variable drain_signal;
+    bool reading_ended = false; // under drain_mutex
+
+    std::atomic<bool> server_ended{false};
+
+    // capture/enqueue/send times of the newest audio sent, copied into every result
+    std::mutex trace_mutex;
+    CaptionTrace last_sent_trace; // also holds the stream start
+    bool has_result = false;
+
+    // upload encoding other than LINEAR16, only touched by whichever writes the requests
+    FlacEncoder upload_encoder;
+    vector<char> upload_audio;
 
 public:
     const CaptionStreamSettings settings;
@@ -118,13 +182,63 @@ public:
 
     bool start(std::shared_ptr<CaptionStream> self);
 
+    // connects the shared channel ahead of the first stream
+    static void prewarm(const CaptionStreamSettings &settings);
+
     void stop();
 
+    // graceful stop: writes what's queued, ends the requests and keeps delivering results until the final one for the
+    // last utterance arrived, the server ended the call or timeout_ms passed. Stops right away if never ready.
+    void drain(uint timeout_ms);
+
+    bool is_draining();
+
+    // the requests were ended while draining
+    void mark_writes_done();
+
+    // until the drain finished, false if it timed out
+    bool wait_for_drain();
+
+    // whether this result finishes the drain
+    bool drain_complete(const CaptionResult &result);
+
+    // the reader is done, the call gets finished and the stream stopped by the sender
+    void end_reading();
+
+    // the call was finished by the server (session limit), not failed
+    void mark_ended_cleanly();
+
+    // only meaningful once stopped
+    bool ended_cleanly();
+
     bool is_stopped();
 
-    bool queue_audio_data(const char *data, const uint data_size);
+    uint rtt_ms();
+
+    // audio waiting for upload
+    uint queued_audio_ms();
+
+    // how long after start() the stream could take audio, 0 while it can't yet
+    uint ready_after_ms();
+
+    // the config went out, audio written from now on gets recognized
+    void mark_ready();
+
+    bool queue_audio_data(const char *data, const uint data_size,
+                          std::chrono::steady_clock::time_point captured_at = std::chrono::steady_clock::now());
+
+    AudioQueueStats audio_queue_stats();
+
+    void mark_audio_sent(const AudioTiming &timing);
+
+    void fill_trace(CaptionTrace &trace);
+
+    size_t dequeue_audio_data(char *buffer, const size_t max_bytes, const std::int64_t timeout_us,
+                              AudioTiming *timing = nullptr);
 
-    string *dequeue_audio_data(const std::int64_t timeout_us);
+    // replaces out with the next encoded audio for upload_encoding. Samples the encoder held back come out once the
+    // queue is drained. 0 if no audio came in time.
+    size_t dequeue_encoded(std::string &out, const std::int64_t timeout_us, AudioTiming *timing);
 
     ~CaptionStream();
 };
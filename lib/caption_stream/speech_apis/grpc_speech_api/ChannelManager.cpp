@@ -0,0 +1,140 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include "ChannelManager.h"
+
+#include <algorithm>
+
+#include "log.h"
+
+#ifdef GRPC_USE_INCLUDED_CERTS
+#include "certs/roots.h"
+#endif
+
+using google::cloud::speech::v1::Speech;
+
+ChannelManager &ChannelManager::shared() {
+    // never destroyed, grpc's own globals might already be gone when statics are torn down at exit
+    static ChannelManager *manager = new ChannelManager();
+    return *manager;
+}
+
+std::string ChannelManager::channel_key(const CaptionStreamSettings &settings) {
+    const TcpSocketOptions &socket_options = settings.socket_options;
+    return settings.endpoint_host + ":" + std::to_string(settings.endpoint_port_up)
+           + (settings.endpoint_insecure ? " insecure " : " ") + std::to_string(socket_options.keepalive_idle_secs)
+           + "/" + std::to_string(socket_options.keepalive_interval_secs);
+}
+
+grpc::ChannelArguments ChannelManager::channel_arguments(const CaptionStreamSettings &settings) {
+    grpc::ChannelArguments channel_args;
+    const TcpSocketOptions &socket_options = settings.socket_options;
+
+    // HTTP/2 pings instead of TCP probes, failing after one interval without an answer
+    int keepalive_ms = CHANNEL_IDLE_KEEPALIVE_MS;
+    int keepalive_timeout_ms = 20000;
+    if (socket_options.keepalive_enabled()) {
+        keepalive_ms = (int) socket_options.keepalive_idle_secs * 1000;
+        keepalive_timeout_ms = (int) std::max(socket_options.keepalive_interval_secs, 1u) * 1000;
+    }
+    channel_args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, keepalive_ms);
+    channel_args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, keepalive_timeout_ms);
+
+    // keeps the connection warm between streams. grpc backs off the ping interval by itself if the server finds
+    // them too frequent
+    channel_args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+    channel_args.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+    return channel_args;
+}
+
+// under lock
+std::shared_ptr<grpc::ChannelCredentials> ChannelManager::credentials_for(const CaptionStreamSettings &settings) {
+    if (settings.endpoint_insecure) {
+        if (!insecure_credentials)
+            insecure_credentials = grpc::InsecureChannelCredentials();
+        return insecure_credentials;
+    }
+
+    if (!credentials) {
+        auto options = grpc::SslCredentialsOptions();
+#ifdef GRPC_USE_INCLUDED_CERTS
+        debug_log("using embedded certs");
+        // grpc needs CA certs on Windows (and Unix depending on how it's been built)
+        // just include as string directly, more convenient than shipping the roots.pem file
+        options.pem_root_certs.assign(roots_pem, roots_pem + sizeof roots_pem / sizeof roots_pem[0]);
+#endif
+        credentials = grpc::SslCredentials(options);
+    }
+    return credentials;
+}
+
+// under lock
+ChannelManager::Entry &ChannelManager::entry_for(const CaptionStreamSettings &settings) {
+    const std::string key = channel_key(settings);
+    auto found = channels.find(key);
+    if (found != channels.end())
+        return found->second;
+
+    // settings changed, channels no stream uses anymore can go
+    for (auto it = channels.begin(); it != channels.end();) {
+        if (it->second.speech.stub.use_count() == 1)
+            it = channels.erase(it);
+        else
+            ++it;
+    }
+
+    std::string target = settings.endpoint_host;
+    if (settings.endpoint_port_up)
+        target.append(":").append(std::to_string(settings.endpoint_port_up));
+
+    Entry &entry = channels[key];
+    entry.speech.channel = grpc::CreateCustomChannel(target, credentials_for(settings), channel_arguments(settings));
+    entry.speech.stub = std::shared_ptr<Speech::Stub>(Speech::NewStub(entry.speech.channel));
+    created_count++;
+    info_log("created grpc channel %s, %llu channels created so far", key.c_str(), (unsigned long long) created_count);
+    return entry;
+}
+
+SpeechChannel ChannelManager::get(const CaptionStreamSettings &settings) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &entry = entry_for(settings);
+    entry.calls++;
+    return entry.speech;
+}
+
+void ChannelManager::warm(const CaptionStreamSettings &settings) {
+    std::shared_ptr<grpc::Channel> channel;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        channel = entry_for(settings).speech.channel;
+    }
+
+    // try_to_connect, returns right away
+    const grpc_connectivity_state state = channel->GetState(true);
+    debug_log("warming grpc channel, state %d", (int) state);
+}
+
+std::string ChannelManager::summary() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string summary = "channels created " + std::to_string(created_count);
+    for (const auto &entry : channels) {
+        summary.append("\n  ").append(entry.first)
+                .append(": state ").append(std::to_string((int) entry.second.speech.channel->GetState(false)))
+                .append(", calls ").append(std::to_string(entry.second.calls));
+    }
+    return summary;
+}
@@ -0,0 +1,89 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_CHANNELMANAGER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_CHANNELMANAGER_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <grpcpp/grpcpp.h>
+#include <google/cloud/speech/v1/cloud_speech.grpc.pb.h>
+
+#include "CaptionStream.h"
+
+// keepalive ping interval used when the socket options turn TCP keepalive off, the channel still has to notice a
+// dead connection between streams
+#define CHANNEL_IDLE_KEEPALIVE_MS 60000
+
+struct SpeechChannel {
+    std::shared_ptr<grpc::Channel> channel;
+    std::shared_ptr<google::cloud::speech::v1::Speech::Stub> stub;
+};
+
+/*
+ Process wide gRPC channels to the speech API, thread safe.
+
+ Credentials (and the embedded root certs) are set up once and every CaptionStream with the same endpoint and
+ keepalive settings gets the same channel, so a new StreamingRecognize call is just another HTTP/2 stream on the
+ connection that's already up instead of a TCP+TLS+HTTP/2 handshake. The channel keeps its connection open with
+ keepalive pings while no call is running and reconnects on its own if it drops.
+ */
+class ChannelManager {
+    struct Entry {
+        SpeechChannel speech;
+        uint64_t calls = 0;
+    };
+
+    std::mutex mutex;
+    std::shared_ptr<grpc::ChannelCredentials> credentials;
+    std::shared_ptr<grpc::ChannelCredentials> insecure_credentials;
+    std::unordered_map<std::string, Entry> channels;
+    uint64_t created_count = 0;
+
+    ChannelManager() = default;
+
+    static std::string channel_key(const CaptionStreamSettings &settings);
+
+    static grpc::ChannelArguments channel_arguments(const CaptionStreamSettings &settings);
+
+    // under lock
+    std::shared_ptr<grpc::ChannelCredentials> credentials_for(const CaptionStreamSettings &settings);
+
+    // under lock
+    Entry &entry_for(const CaptionStreamSettings &settings);
+
+public:
+    ChannelManager(const ChannelManager &) = delete;
+
+    ChannelManager &operator=(const ChannelManager &) = delete;
+
+    static ChannelManager &shared();
+
+    // the channel and stub for a new call
+    SpeechChannel get(const CaptionStreamSettings &settings);
+
+    // starts connecting without making a call, so the first stream doesn't wait for the handshake
+    void warm(const CaptionStreamSettings &settings);
+
+    std::string summary();
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_CHANNELMANAGER_H
@@ -0,0 +1,67 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include "CompletionQueueDriver.h"
+
+#include "log.h"
+
+CompletionQueueDriver &CompletionQueueDriver::shared() {
+    // never destroyed, same as the channels it's used with
+    static CompletionQueueDriver *driver = new CompletionQueueDriver();
+    return *driver;
+}
+
+grpc::CompletionQueue *CompletionQueueDriver::attach() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!running) {
+        // a previous queue was shut down, its threads are on their way out already
+        for (auto &thread : threads)
+            thread.join();
+        threads.clear();
+
+        queue.reset(new grpc::CompletionQueue());
+        running = true;
+        for (int i = 0; i < COMPLETION_QUEUE_THREADS; i++)
+            threads.emplace_back(&CompletionQueueDriver::run, queue.get());
+    }
+    attached++;
+    return queue.get();
+}
+
+void CompletionQueueDriver::detach() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!attached)
+        return;
+
+    attached--;
+    if (!attached && running) {
+        // Next() returns false for all threads once the queue is empty
+        queue->Shutdown();
+        running = false;
+    }
+}
+
+void CompletionQueueDriver::run(grpc::CompletionQueue *queue) {
+    debug_log("CompletionQueueDriver thread starting");
+    void *tag;
+    bool ok;
+    while (queue->Next(&tag, &ok)) {
+        auto *completed = static_cast<CompletionQueueTag *>(tag);
+        completed->handler->on_complete(completed->op, ok);
+    }
+    debug_log("CompletionQueueDriver thread done");
+}
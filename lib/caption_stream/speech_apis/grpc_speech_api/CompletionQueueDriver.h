@@ -0,0 +1,82 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_COMPLETIONQUEUEDRIVER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_COMPLETIONQUEUEDRIVER_H
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+// threads polling the completion queue. More than one so a slow caption callback doesn't hold up the other streams
+#define COMPLETION_QUEUE_THREADS 2
+
+class CompletionQueueHandler;
+
+// what's passed as the tag of every async operation, one per kind of operation a handler can have outstanding
+struct CompletionQueueTag {
+    CompletionQueueHandler *handler;
+    int op;
+};
+
+/*
+ Something with async operations on the driver's queue. Completions can come in on any of the driver threads,
+ implementations lock themselves.
+ */
+class CompletionQueueHandler {
+public:
+    virtual ~CompletionQueueHandler() = default;
+
+    virtual void on_complete(int op, bool ok) = 0;
+};
+
+/*
+ A grpc CompletionQueue shared by all async caption streams, polled by COMPLETION_QUEUE_THREADS threads which
+ dispatch each completed operation to its handler.
+
+ The queue and threads are started with the first attach() and shut down once every attached handler detached, so
+ nothing keeps running while no stream is. Handlers must only detach once all their operations completed.
+ */
+class CompletionQueueDriver {
+    std::mutex mutex;
+    std::unique_ptr<grpc::CompletionQueue> queue;
+    std::vector<std::thread> threads;
+    bool running = false;
+    unsigned int attached = 0;
+
+    CompletionQueueDriver() = default;
+
+    static void run(grpc::CompletionQueue *queue);
+
+public:
+    CompletionQueueDriver(const CompletionQueueDriver &) = delete;
+
+    CompletionQueueDriver &operator=(const CompletionQueueDriver &) = delete;
+
+    static CompletionQueueDriver &shared();
+
+    // any thread, the queue to start operations on until detach()
+    grpc::CompletionQueue *attach();
+
+    // any thread, including the driver's own
+    void detach();
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_COMPLETIONQUEUEDRIVER_H
@@ -50,6 +50,7 @@ AudioCaptureSession::AudioCaptureSession(
         on_caption_cb_handle(audio_data_cb),
         on_status_cb_handle(status_change_cb),
         muted_handling(muted_handling),
+        resampler(nullptr),
         use_muting_cb_signal(true),
         id(id) {
     debug_log("AudioCaptureSession()");
@@ -67,9 +68,21 @@ AudioCaptureSession::AudioCaptureSession(
             backend_audio_settings.speakers
     };
 
-    resampler = audio_resampler_create(&resample_to, &src);
-    if (!resampler)
-        throw std::string("Failed to create audio resampler");
+    const size_t channels = get_audio_channels(backend_audio_settings.speakers);
+    // surround layouts are left to libobs, its downmix weights channels differently than a plain average
+    if (resample_to.samples_per_sec == DOWNSAMPLER_OUTPUT_RATE && resample_to.format == AUDIO_FORMAT_16BIT
+        && resample_to.speakers == SPEAKERS_MONO && channels <= 2
+        && AudioDownsampler::supports(backend_audio_settings.samples_per_sec, channels)) {
+        downsampler.reset(new AudioDownsampler(backend_audio_settings.samples_per_sec, channels));
+        info_log("using %s audio downsampler, %d Hz %d channels", downsampler->kernel_name(),
+                 backend_audio_settings.samples_per_sec, (int) channels);
+    }
+
+    if (!downsampler) {
+        resampler = audio_resampler_create(&resample_to, &src);
+        if (!resampler)
+            throw std::string("Failed to create audio resampler");
+    }
 
     const char *name = obs_source_get_name(audio_source);
     info_log("source %s active: %d", name, obs_source_active(audio_source));
@@ -154,9 +167,11 @@ void AudioCaptureSession::audio_capture_cb(obs_source_t *source, const struct au
     if (!audio || !audio->frames)
         return;
 
-    uint8_t *out[MAX_AV_PLANES];
-    uint32_t out_frames;
-    uint64_t ts_offset;
+    // libobs audio timestamps are os_gettime_ns() based, fall back to now if this one looks off
+    std::chrono::steady_clock::time_point captured_at = std::chrono::steady_clock::now();
+    const uint64_t now_ns = os_gettime_ns();
+    if (audio->timestamp && audio->timestamp <= now_ns && now_ns - audio->timestamp < 10000000000ULL)
+        captured_at -= std::chrono::nanoseconds(now_ns - audio->timestamp);
 
     if (muted && !use_muting_cb_signal) {
         muted = false;
@@ -177,7 +192,7 @@ void AudioCaptureSession::audio_capture_cb(obs_source_t *source, const struct au
             {
                 std::lock_guard<std::recursive_mutex> lock(on_caption_cb_handle.mutex);
                 if (on_caption_cb_handle.callback_fn)
-                    on_caption_cb_handle.callback_fn(id, buffer, size);
+                    on_caption_cb_handle.callback_fn(id, buffer, size, captured_at);
             }
 
             delete[] buffer;
@@ -188,21 +203,47 @@ void AudioCaptureSession::audio_capture_cb(obs_source_t *source, const struct au
             return; // unknown val, capture not allowed explicitliy do nothing
     }
 
-    bool success = audio_resampler_resample(resampler, out, &out_frames, &ts_offset,
-                                            (const uint8_t *const *) audio->data, audio->frames);
-
-    if (!success || !out[0]) {
+    const uint8_t *out_data;
+    unsigned int size;
+    if (!convert_audio(audio, &out_data, &size)) {
         warn_log("failed resampling audio data");
         return;
     }
-    unsigned int size = out_frames * FRAME_SIZE;
+    if (!size)
+        return;
+
     {
         std::lock_guard<std::recursive_mutex> lock(on_caption_cb_handle.mutex);
         if (on_caption_cb_handle.callback_fn)
-            on_caption_cb_handle.callback_fn(id, out[0], size);
+            on_caption_cb_handle.callback_fn(id, out_data, size, captured_at);
     }
 }
 
+bool AudioCaptureSession::convert_audio(const struct audio_data *audio, const uint8_t **out_data,
+                                        unsigned int *out_size) {
+    uint8_t *out[MAX_AV_PLANES];
+    uint32_t out_frames;
+    uint64_t ts_offset;
+
+    if (!downsampler) {
+        bool success = audio_resampler_resample(resampler, out, &out_frames, &ts_offset,
+                                                (const uint8_t *const *) audio->data, audio->frames);
+        if (!success || !out[0])
+            return false;
+
+        *out_data = out[0];
+        *out_size = out_frames * FRAME_SIZE;
+        return true;
+    }
+
+    const int16_t *samples;
+    const size_t frames = downsampler->process((const float *const *) audio->data, audio->frames, &samples);
+
+    *out_data = (const uint8_t *) samples;
+    *out_size = frames * FRAME_SIZE;
+    return true;
+}
+
 AudioCaptureSession::~AudioCaptureSession() {
     on_caption_cb_handle.clear();
     on_status_cb_handle.clear();
@@ -219,7 +260,8 @@ AudioCaptureSession::~AudioCaptureSession() {
     signal_handler_disconnect(obs_source_get_signal_handler(muting_source), "activate", state_changed_fwder, this);
     signal_handler_disconnect(obs_source_get_signal_handler(muting_source), "deactivate", state_changed_fwder, this);
 
-    audio_resampler_destroy(resampler);
+    if (resampler)
+        audio_resampler_destroy(resampler);
 
     debug_log("~AudioCaptureSession() deaded");
 }
@@ -22,9 +22,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <obs-frontend-api.h>
 #include <media-io/audio-resampler.h>
 #include <obs.hpp>
+#include <chrono>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <lib/caption_stream/ThreadsaferCallback.h>
+#include "AudioDownsampler.h"
 
 
 enum audio_source_capture_status {
@@ -41,7 +44,8 @@ enum source_capture_config {
 
 
 using std::string;
-typedef std::function<void(const int id, const uint8_t *, const size_t)> audio_chunk_data_cb;
+typedef std::function<void(const int id, const uint8_t *, const size_t,
+                           const std::chrono::steady_clock::time_point captured_at)> audio_chunk_data_cb;
 typedef std::function<void(const int id, const audio_source_capture_status status)> audio_capture_status_change_cb;
 
 #define FRAME_SIZE 2
@@ -52,7 +56,13 @@ class AudioCaptureSession {
     OBSSource muting_source;
     source_capture_config muted_handling;
 
+    // fast path for 16kHz mono output, the libobs resampler is only used if that doesn't support the OBS audio format.
+    // src/dev/audio_downsampler_check.cpp compares both sample by sample.
+    std::unique_ptr<AudioDownsampler> downsampler;
     audio_resampler_t *resampler;
+
+    bool convert_audio(const struct audio_data *audio, const uint8_t **out_data, unsigned int *out_size);
+
     audio_source_capture_status capture_status;
     bool use_muting_cb_signal = true;
     const int id;
@@ -0,0 +1,448 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "AudioDownsampler.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define DOWNSAMPLER_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define DOWNSAMPLER_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define DOWNSAMPLER_TARGET(x) __attribute__((target(x)))
+#else
+#define DOWNSAMPLER_TARGET(x)
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// scalar
+
+static void downmix_scalar(const float *const *planes, size_t channels, size_t frames, float scale, float *out) {
+    if (channels == 1) {
+        memcpy(out, planes[0], frames * sizeof(float));
+        return;
+    }
+
+    for (size_t i = 0; i < frames; i++) {
+        float sum = 0;
+        for (size_t c = 0; c < channels; c++)
+            sum += planes[c][i];
+        out[i] = sum * scale;
+    }
+}
+
+static void decimate_scalar(const float *in, size_t out_count, size_t step, const float *taps, size_t tap_count,
+                            float *out) {
+    for (size_t i = 0; i < out_count; i++) {
+        const float *src = in + i * step;
+        float sum = 0;
+        for (size_t t = 0; t < tap_count; t++)
+            sum += src[t] * taps[t];
+        out[i] = sum;
+    }
+}
+
+static void to_int16_scalar(const float *in, size_t count, int16_t *out) {
+    for (size_t i = 0; i < count; i++) {
+        float val = in[i] * 32768.0f;
+        if (val > 32767.0f)
+            val = 32767.0f;
+        else if (val < -32768.0f)
+            val = -32768.0f;
+        out[i] = (int16_t) lrintf(val);
+    }
+}
+
+static const downsample_kernel kernel_scalar = {"scalar", downmix_scalar, decimate_scalar, to_int16_scalar};
+
+#ifdef DOWNSAMPLER_X86
+
+// SSE2
+
+static void downmix_sse2(const float *const *planes, size_t channels, size_t frames, float scale, float *out) {
+    if (channels == 1) {
+        memcpy(out, planes[0], frames * sizeof(float));
+        return;
+    }
+
+    const __m128 scale_v = _mm_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        __m128 sum = _mm_loadu_ps(planes[0] + i);
+        for (size_t c = 1; c < channels; c++)
+            sum = _mm_add_ps(sum, _mm_loadu_ps(planes[c] + i));
+        _mm_storeu_ps(out + i, _mm_mul_ps(sum, scale_v));
+    }
+    for (; i < frames; i++) {
+        float sum = 0;
+        for (size_t c = 0; c < channels; c++)
+            sum += planes[c][i];
+        out[i] = sum * scale;
+    }
+}
+
+static inline float hsum_sse2(__m128 v) {
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+static void decimate_sse2(const float *in, size_t out_count, size_t step, const float *taps, size_t tap_count,
+                          float *out) {
+    for (size_t i = 0; i < out_count; i++) {
+        const float *src = in + i * step;
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        for (size_t t = 0; t < tap_count; t += 8) {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(src + t), _mm_loadu_ps(taps + t)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(src + t + 4), _mm_loadu_ps(taps + t + 4)));
+        }
+        out[i] = hsum_sse2(_mm_add_ps(acc0, acc1));
+    }
+}
+
+static void to_int16_sse2(const float *in, size_t count, int16_t *out) {
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 max_v = _mm_set1_ps(32767.0f);
+    const __m128 min_v = _mm_set1_ps(-32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        // clamp before converting, out of range floats would convert to INT_MIN
+        const __m128 a = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), max_v), min_v);
+        const __m128 b = _mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale), max_v), min_v);
+        const __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128((__m128i *) (out + i), packed);
+    }
+    to_int16_scalar(in + i, count - i, out + i);
+}
+
+static const downsample_kernel kernel_sse2 = {"sse2", downmix_sse2, decimate_sse2, to_int16_sse2};
+
+// AVX2
+
+DOWNSAMPLER_TARGET("avx2")
+static void downmix_avx2(const float *const *planes, size_t channels, size_t frames, float scale, float *out) {
+    if (channels == 1) {
+        memcpy(out, planes[0], frames * sizeof(float));
+        return;
+    }
+
+    const __m256 scale_v = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256 sum = _mm256_loadu_ps(planes[0] + i);
+        for (size_t c = 1; c < channels; c++)
+            sum = _mm256_add_ps(sum, _mm256_loadu_ps(planes[c] + i));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(sum, scale_v));
+    }
+    for (; i < frames; i++) {
+        float sum = 0;
+        for (size_t c = 0; c < channels; c++)
+            sum += planes[c][i];
+        out[i] = sum * scale;
+    }
+}
+
+DOWNSAMPLER_TARGET("avx2")
+static void decimate_avx2(const float *in, size_t out_count, size_t step, const float *taps, size_t tap_count,
+                          float *out) {
+    for (size_t i = 0; i < out_count; i++) {
+        const float *src = in + i * step;
+        __m256 acc = _mm256_setzero_ps();
+        for (size_t t = 0; t < tap_count; t += 8)
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(src + t), _mm256_loadu_ps(taps + t)));
+
+        const __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        __m128 shuf = _mm_shuffle_ps(half, half, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128 sums = _mm_add_ps(half, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        sums = _mm_add_ss(sums, shuf);
+        out[i] = _mm_cvtss_f32(sums);
+    }
+}
+
+DOWNSAMPLER_TARGET("avx2")
+static void to_int16_avx2(const float *in, size_t count, int16_t *out) {
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 max_v = _mm256_set1_ps(32767.0f);
+    const __m256 min_v = _mm256_set1_ps(-32768.0f);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m256 a = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale), max_v), min_v);
+        const __m256 b = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale), max_v), min_v);
+        // packs works per 128 bit lane, permute back into order afterwards
+        const __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    to_int16_sse2(in + i, count - i, out + i);
+}
+
+static const downsample_kernel kernel_avx2 = {"avx2", downmix_avx2, decimate_avx2, to_int16_avx2};
+
+static bool cpu_has_avx2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx)
+        return false;
+
+    // OS has to save the ymm registers too
+    if ((_xgetbv(0) & 0x6) != 0x6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+#endif // DOWNSAMPLER_X86
+
+#ifdef DOWNSAMPLER_NEON
+
+static void downmix_neon(const float *const *planes, size_t channels, size_t frames, float scale, float *out) {
+    if (channels == 1) {
+        memcpy(out, planes[0], frames * sizeof(float));
+        return;
+    }
+
+    const float32x4_t scale_v = vdupq_n_f32(scale);
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        float32x4_t sum = vld1q_f32(planes[0] + i);
+        for (size_t c = 1; c < channels; c++)
+            sum = vaddq_f32(sum, vld1q_f32(planes[c] + i));
+        vst1q_f32(out + i, vmulq_f32(sum, scale_v));
+    }
+    for (; i < frames; i++) {
+        float sum = 0;
+        for (size_t c = 0; c < channels; c++)
+            sum += planes[c][i];
+        out[i] = sum * scale;
+    }
+}
+
+static void decimate_neon(const float *in, size_t out_count, size_t step, const float *taps, size_t tap_count,
+                          float *out) {
+    for (size_t i = 0; i < out_count; i++) {
+        const float *src = in + i * step;
+        float32x4_t acc0 = vdupq_n_f32(0);
+        float32x4_t acc1 = vdupq_n_f32(0);
+        for (size_t t = 0; t < tap_count; t += 8) {
+            acc0 = vaddq_f32(acc0, vmulq_f32(vld1q_f32(src + t), vld1q_f32(taps + t)));
+            acc1 = vaddq_f32(acc1, vmulq_f32(vld1q_f32(src + t + 4), vld1q_f32(taps + t + 4)));
+        }
+        out[i] = vaddvq_f32(vaddq_f32(acc0, acc1));
+    }
+}
+
+static void to_int16_neon(const float *in, size_t count, int16_t *out) {
+    const float32x4_t scale = vdupq_n_f32(32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        // the float -> int32 conversion and the narrowing both saturate
+        const int32x4_t a = vcvtnq_s32_f32(vmulq_f32(vld1q_f32(in + i), scale));
+        const int32x4_t b = vcvtnq_s32_f32(vmulq_f32(vld1q_f32(in + i + 4), scale));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+    }
+    to_int16_scalar(in + i, count - i, out + i);
+}
+
+static const downsample_kernel kernel_neon = {"neon", downmix_neon, decimate_neon, to_int16_neon};
+
+#endif // DOWNSAMPLER_NEON
+
+// runs both kernels over a test signal with some clipping and checks they're at most 1 LSB apart
+static bool kernel_matches_scalar(const downsample_kernel *kernel) {
+    const size_t channels = 2;
+    const size_t frames = 1021; // odd size to hit the non SIMD tails too
+    const size_t step = 3;
+    const size_t tap_count = 3 * DOWNSAMPLER_TAPS_PER_RATIO;
+
+    std::vector<float> left(frames), right(frames), taps(tap_count);
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = 0.6f * (float) sin(i * 0.05) + 0.3f * (float) sin(i * 0.71);
+        right[i] = 1.4f * (float) sin(i * 0.013);
+    }
+    for (size_t t = 0; t < tap_count; t++)
+        taps[t] = (float) ((t % 7) + 1) / (7.0f * tap_count);
+    const float *planes[] = {&left[0], &right[0]};
+
+    std::vector<float> mono_ref(frames), mono(frames);
+    kernel_scalar.downmix(planes, channels, frames, 0.5f, &mono_ref[0]);
+    kernel->downmix(planes, channels, frames, 0.5f, &mono[0]);
+
+    const size_t out_count = (frames - tap_count) / step + 1;
+    std::vector<float> filtered_ref(out_count), filtered(out_count);
+    kernel_scalar.decimate(&mono_ref[0], out_count, step, &taps[0], tap_count, &filtered_ref[0]);
+    kernel->decimate(&mono[0], out_count, step, &taps[0], tap_count, &filtered[0]);
+
+    // include the unfiltered clipping signal for the conversion
+    filtered_ref.insert(filtered_ref.end(), right.begin(), right.end());
+    filtered.insert(filtered.end(), right.begin(), right.end());
+
+    std::vector<int16_t> out_ref(filtered_ref.size()), out(filtered.size());
+    kernel_scalar.to_int16(&filtered_ref[0], filtered_ref.size(), &out_ref[0]);
+    kernel->to_int16(&filtered[0], filtered.size(), &out[0]);
+
+    for (size_t i = 0; i < out.size(); i++) {
+        if (std::abs((int) out[i] - (int) out_ref[i]) > 1)
+            return false;
+    }
+    return true;
+}
+
+static const downsample_kernel *pick_kernel() {
+#ifdef DOWNSAMPLER_X86
+    if (cpu_has_avx2() && kernel_matches_scalar(&kernel_avx2))
+        return &kernel_avx2;
+
+    if (kernel_matches_scalar(&kernel_sse2))
+        return &kernel_sse2;
+#endif
+
+#ifdef DOWNSAMPLER_NEON
+    if (kernel_matches_scalar(&kernel_neon))
+        return &kernel_neon;
+#endif
+
+    return &kernel_scalar;
+}
+
+const downsample_kernel *AudioDownsampler::scalar_kernel() {
+    return &kernel_scalar;
+}
+
+const downsample_kernel *AudioDownsampler::best_kernel() {
+    static const downsample_kernel *best = pick_kernel();
+    return best;
+}
+
+bool AudioDownsampler::supports(uint32_t input_rate, size_t channels) {
+    if (!channels || input_rate < DOWNSAMPLER_OUTPUT_RATE || input_rate % DOWNSAMPLER_OUTPUT_RATE)
+        return false;
+
+    return input_rate / DOWNSAMPLER_OUTPUT_RATE <= DOWNSAMPLER_MAX_RATIO;
+}
+
+AudioDownsampler::AudioDownsampler(uint32_t input_rate, size_t channels, int channel) :
+        channels(channels),
+        channel(channel),
+        step(input_rate / DOWNSAMPLER_OUTPUT_RATE),
+        kernel(best_kernel()),
+        mono_fill(0) {
+
+    if (!supports(input_rate, channels))
+        throw std::string("unsupported downsampler input rate");
+
+    if (channel != DOWNSAMPLER_DOWNMIX_ALL && (channel < 0 || (size_t) channel >= channels))
+        throw std::string("invalid downsampler channel");
+
+    if (step == 1) {
+        // same rate, only downmix and convert
+        taps.assign(8, 0.0f);
+        taps[0] = 1.0f;
+    } else {
+        // blackman windowed sinc lowpass, normalized to unity gain at DC
+        const size_t tap_count = step * DOWNSAMPLER_TAPS_PER_RATIO;
+        const double cutoff = (double) DOWNSAMPLER_CUTOFF_HZ / input_rate;
+        const double center = (tap_count - 1) / 2.0;
+        taps.resize(tap_count);
+
+        double sum = 0;
+        for (size_t t = 0; t < tap_count; t++) {
+            const double x = t - center;
+            const double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+            const double window = 0.42 - 0.5 * cos(2 * M_PI * t / (tap_count - 1))
+                                  + 0.08 * cos(4 * M_PI * t / (tap_count - 1));
+            taps[t] = (float) (sinc * window);
+            sum += taps[t];
+        }
+        for (float &tap : taps)
+            tap = (float) (tap / sum);
+    }
+
+    // start with silence as history so the first block already produces output
+    mono.assign(taps.size() - 1 + 1024, 0.0f);
+    mono_fill = taps.size() - 1;
+}
+
+size_t AudioDownsampler::process(const float *const *planes, size_t frames, const int16_t **out) {
+    *out = nullptr;
+    if (!frames)
+        return 0;
+
+    if (mono.size() < mono_fill + frames)
+        mono.resize(mono_fill + frames);
+
+    if (channel == DOWNSAMPLER_DOWNMIX_ALL)
+        kernel->downmix(planes, channels, frames, 1.0f / channels, &mono[mono_fill]);
+    else
+        kernel->downmix(planes + channel, 1, frames, 1.0f, &mono[mono_fill]);
+    mono_fill += frames;
+
+    const size_t tap_count = taps.size();
+    if (mono_fill < tap_count)
+        return 0;
+
+    const size_t out_count = (mono_fill - tap_count) / step + 1;
+    if (filtered.size() < out_count) {
+        filtered.resize(out_count);
+        output.resize(out_count);
+    }
+
+    kernel->decimate(&mono[0], out_count, step, &taps[0], tap_count, &filtered[0]);
+    kernel->to_int16(&filtered[0], out_count, &output[0]);
+
+    // keep what the next output samples still need
+    const size_t consumed = out_count * step;
+    memmove(&mono[0], &mono[consumed], (mono_fill - consumed) * sizeof(float));
+    mono_fill -= consumed;
+
+    *out = &output[0];
+    return out_count;
+}
+
+const char *AudioDownsampler::kernel_name() const {
+    return kernel->name;
+}
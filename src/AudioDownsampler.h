@@ -0,0 +1,88 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#ifndef OBS_GOOGLE_CAPTION_PLUGIN_AUDIODOWNSAMPLER_H
+#define OBS_GOOGLE_CAPTION_PLUGIN_AUDIODOWNSAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define DOWNSAMPLER_OUTPUT_RATE 16000
+#define DOWNSAMPLER_MAX_RATIO 6
+
+// taps per output sample, more taps = steeper lowpass
+#define DOWNSAMPLER_TAPS_PER_RATIO 32
+
+// lowpass cutoff, a bit below the 8kHz output nyquist
+#define DOWNSAMPLER_CUTOFF_HZ 7200
+
+// mix all channels together instead of picking one
+#define DOWNSAMPLER_DOWNMIX_ALL -1
+
+struct downsample_kernel {
+    const char *name;
+
+    void (*downmix)(const float *const *planes, size_t channels, size_t frames, float scale, float *out);
+
+    // out[i] = sum(in[i * step + t] * taps[t]) for t < tap_count, tap_count always a multiple of 8
+    void (*decimate)(const float *in, size_t out_count, size_t step, const float *taps, size_t tap_count, float *out);
+
+    // [-1, 1] float to int16 with saturation, round to nearest
+    void (*to_int16)(const float *in, size_t count, int16_t *out);
+};
+
+/*
+ Fixed float planar (OBS backend format) to 16kHz mono int16 conversion for integer input/output rate ratios,
+ ie. 16/32/48/96kHz. Downmixes (or picks one channel), runs a windowed sinc lowpass only at the output sample positions
+ and converts to int16. The SIMD variant is picked at runtime (AVX2/SSE2 or NEON) and checked against the
+ scalar one before use.
+
+ Not thread safe, meant to be called from the audio thread only. No allocations after the first few blocks.
+ */
+class AudioDownsampler {
+    const size_t channels;
+    const int channel;
+    const size_t step;
+    std::vector<float> taps;
+    const downsample_kernel *kernel;
+
+    // unconsumed mono input, the last tap_count - 1 samples of history followed by the new block
+    std::vector<float> mono;
+    size_t mono_fill;
+
+    std::vector<float> filtered;
+    std::vector<int16_t> output;
+
+public:
+    // channel: channel to use or DOWNSAMPLER_DOWNMIX_ALL
+    AudioDownsampler(uint32_t input_rate, size_t channels, int channel = DOWNSAMPLER_DOWNMIX_ALL);
+
+    static bool supports(uint32_t input_rate, size_t channels);
+
+    // returns the number of 16kHz samples in *out, valid until the next call
+    size_t process(const float *const *planes, size_t frames, const int16_t **out);
+
+    const char *kernel_name() const;
+
+    static const downsample_kernel *scalar_kernel();
+
+    // best kernel this CPU supports that matches the scalar one
+    static const downsample_kernel *best_kernel();
+};
+
+#endif //OBS_GOOGLE_CAPTION_PLUGIN_AUDIODOWNSAMPLER_H
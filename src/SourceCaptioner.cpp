@@ -27,7 +27,8 @@ SourceCaptioner::SourceCaptioner(const SourceCaptionerSettings &settings, const
         settings(settings),
         selected_scene_collection_name(scene_collection_name),
         last_caption_at(std::chrono::steady_clock::now()),
-        last_caption_cleared(true) {
+        last_caption_cleared(true),
+        latency_stats(std::make_shared<CaptionLatencyStats>()) {
 
     QObject::connect(&timer, &QTimer::timeout, this, &SourceCaptioner::clear_output_timer_cb);
 
@@ -53,9 +54,10 @@ SourceCaptioner::SourceCaptioner(const SourceCaptionerSettings &settings, const
 void SourceCaptioner::stop_caption_stream(bool send_signal) {
     if (!send_signal) {
         std::lock_guard<recursive_mutex> lock(settings_change_mutex);
-        audio_capture_session = nullptr;
+        clear_audio_pipeline();
         caption_result_handler = nullptr;
         continuous_captions = nullptr;
+        last_reconnect_status = ReconnectStatus();
         audio_capture_id++;
         return;
     }
@@ -65,9 +67,10 @@ void SourceCaptioner::stop_caption_stream(bool send_signal) {
     SourceCaptionerSettings cur_settings = settings;
     string cur_scene_collection_name = this->selected_scene_collection_name;
 
-    audio_capture_session = nullptr;
+    clear_audio_pipeline();
     caption_result_handler = nullptr;
     continuous_captions = nullptr;
+    last_reconnect_status = ReconnectStatus();
     audio_capture_id++;
 
     settings_change_mutex.unlock();
@@ -128,7 +131,7 @@ bool SourceCaptioner::start_caption_stream(const SourceCaptionerSettings &new_se
         settings = new_settings;
         selected_scene_collection_name = scene_collection_name;
 
-        audio_capture_session = nullptr;
+        clear_audio_pipeline();
         caption_result_handler = nullptr;
         audio_capture_id++;
 
@@ -233,10 +236,17 @@ bool SourceCaptioner::_start_caption_stream(bool restart_stream) {
         }
         caption_result_handler = std::make_unique<CaptionResultHandler>(settings.format_settings);
 
+        auto voice_cb = std::bind(&SourceCaptioner::on_voice_audio_callback, this, std::placeholders::_1, std::placeholders::_2);
+        voice_activity_gate = std::make_unique<VoiceActivityGate>(settings.vad_settings, voice_cb);
+
+        auto frame_cb = std::bind(&SourceCaptioner::on_audio_frame_callback, this, std::placeholders::_1, std::placeholders::_2);
+        audio_packetizer = std::make_unique<AudioPacketizer>(settings.packetizer_settings, frame_cb);
+
         try {
             resample_info resample_to = {16000, AUDIO_FORMAT_16BIT, SPEAKERS_MONO};
             audio_chunk_data_cb audio_cb = std::bind(&SourceCaptioner::on_audio_data_callback, this,
-                                                     std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+                                                     std::placeholders::_1, std::placeholders::_2, std::placeholders::_3,
+                                                     std::placeholders::_4);
 
             auto audio_status_cb = std::bind(&SourceCaptioner::on_audio_capture_status_change_callback, this,
                                              std::placeholders::_1, std::placeholders::_2);
@@ -277,6 +287,7 @@ void SourceCaptioner::process_audio_capture_status_change(const int cb_audio_cap
     SourceCaptionerSettings cur_settings = settings;
     string cur_scene_collection_name = selected_scene_collection_name;
     bool active = continuous_captions != nullptr;
+    ReconnectStatus reconnect_status = last_reconnect_status;
 
     settings_change_mutex.unlock();
 
@@ -285,7 +296,7 @@ void SourceCaptioner::process_audio_capture_status_change(const int cb_audio_cap
         return;
     }
 
-    emit source_capture_status_changed(std::make_shared<SourceCaptionerStatus>(
+    auto status = std::make_shared<SourceCaptionerStatus>(
             SOURCE_CAPTIONER_STATUS_EVENT_AUDIO_CAPTURE_STATUS_CHANGE,
             false,
             false,
@@ -293,21 +304,100 @@ void SourceCaptioner::process_audio_capture_status_change(const int cb_audio_cap
             cur_scene_collection_name,
             (audio_source_capture_status) new_status,
             active
-    ));
+    );
+    status->reconnect_status = reconnect_status;
+    emit source_capture_status_changed(status);
+}
+
+void SourceCaptioner::check_reconnect_status() {
+    ReconnectStatus reconnect_status;
+    SourceCaptionerSettings cur_settings;
+    string cur_scene_collection_name;
+    audio_source_capture_status audio_cap_status;
+    {
+        std::lock_guard<recursive_mutex> lock(settings_change_mutex);
+        if (!continuous_captions || !audio_capture_session)
+            return;
+
+        reconnect_status = continuous_captions->reconnect_status();
+        // counts down in whole seconds
+        reconnect_status.retry_in_ms = (reconnect_status.retry_in_ms + 999) / 1000 * 1000;
+        if (reconnect_status == last_reconnect_status)
+            return;
+
+        last_reconnect_status = reconnect_status;
+        cur_settings = settings;
+        cur_scene_collection_name = selected_scene_collection_name;
+        audio_cap_status = audio_capture_session->get_current_capture_status();
+    }
+
+    auto status = std::make_shared<SourceCaptionerStatus>(
+            SOURCE_CAPTIONER_STATUS_EVENT_RECONNECT_STATUS_CHANGE,
+            false,
+            false,
+            cur_settings,
+            cur_scene_collection_name,
+            audio_cap_status,
+            true
+    );
+    status->reconnect_status = reconnect_status;
+    emit source_capture_status_changed(status);
 }
 
 
-void SourceCaptioner::on_audio_data_callback(const int id, const uint8_t *data, const size_t size) {
+void SourceCaptioner::on_audio_data_callback(const int id, const uint8_t *data, const size_t size,
+                                             const std::chrono::steady_clock::time_point captured_at) {
 //    info_log("audio data");
-    if (continuous_captions) {
-        continuous_captions->queue_audio_data((char *) data, size);
+    if (continuous_captions && audio_packetizer) {
+        current_captured_at = captured_at;
+        if (settings.packetizer_settings.adapt_to_rtt)
+            audio_packetizer->set_rtt_ms(continuous_captions->current_rtt_ms());
+
+        audio_packetizer->push((const char *) data, size);
     }
     audio_chunk_count++;
 
 }
 
+void SourceCaptioner::on_audio_frame_callback(const char *data, const size_t size) {
+    if (voice_activity_gate) {
+        voice_activity_gate->process(data, size);
+    }
+}
+
+void SourceCaptioner::on_voice_audio_callback(const char *data, const size_t size) {
+    if (continuous_captions) {
+        continuous_captions->queue_audio_data(data, size, current_captured_at);
+    }
+}
+
+void SourceCaptioner::clear_audio_pipeline() {
+    // capture session first, stops the audio callbacks using the other stages
+    audio_capture_session = nullptr;
+    audio_packetizer = nullptr;
+
+    if (voice_activity_gate) {
+        const VoiceActivityStats stats = voice_activity_gate->get_stats();
+        if (stats.total_bytes)
+            info_log("voice activity gate suppressed %.1f%% of %u secs audio, %u speech segments",
+                     stats.suppressed_percent(), (uint) (stats.total_bytes / audio_ms_to_bytes(1000)), stats.speech_segments);
+        voice_activity_gate = nullptr;
+    }
+
+    const string latency = latency_stats->summary("    ");
+    if (!latency.empty())
+        info_log("caption latency this session:\n%s", latency.c_str());
+    latency_stats->clear();
+    latency_result_count = 0;
+}
+
+string SourceCaptioner::latency_summary() {
+    return latency_stats->short_summary();
+}
+
 void SourceCaptioner::clear_output_timer_cb() {
 //    info_log("clear timer checkkkkkkkkkkkkkkk");
+    check_reconnect_status();
 
     bool to_stream, to_recording;
     {
@@ -397,7 +487,10 @@ void SourceCaptioner::on_caption_text_callback(const CaptionResult &caption_resu
     emit received_caption_result(caption_result, interrupted);
 }
 
-void SourceCaptioner::process_caption_result(const CaptionResult caption_result, bool interrupted) {
+void SourceCaptioner::process_caption_result(const CaptionResult received_caption_result, bool interrupted) {
+    CaptionResult caption_result(received_caption_result);
+    caption_result.trace.mark(CAPTION_TRACE_DISPATCH);
+
     shared_ptr<OutputCaptionResult> output_result;
     string recent_caption_text;
     bool to_stream, to_recording;
@@ -416,6 +509,11 @@ void SourceCaptioner::process_caption_result(const CaptionResult caption_result,
         if (!output_result)
             return;
 
+        output_result->caption_result.trace.mark(CAPTION_TRACE_FORMATTED);
+        latency_stats->record_result(output_result->caption_result.trace);
+        if (++latency_result_count % 500 == 0)
+            info_log("caption latency, %u results:\n%s", latency_result_count, latency_stats->summary("    ").c_str());
+
         store_result(output_result, interrupted);
 
 //        info_log("got caption '%s'", output_result->clean_caption_text.c_str());
@@ -461,7 +559,7 @@ void SourceCaptioner::caption_was_output() {
 
 
 void SourceCaptioner::stream_started_event() {
-    auto control = std::make_shared<CaptionOutputControl>();
+    auto control = std::make_shared<CaptionOutputControl>(latency_stats);
     streaming_output.set_control(control);
     std::thread th(caption_output_writer_loop, control, true);
     th.detach();
@@ -472,7 +570,7 @@ void SourceCaptioner::stream_stopped_event() {
 }
 
 void SourceCaptioner::recording_started_event() {
-    auto control = std::make_shared<CaptionOutputControl>();
+    auto control = std::make_shared<CaptionOutputControl>(latency_stats);
     recording_output.set_control(control);
     std::thread th(caption_output_writer_loop, control, false);
     th.detach();
@@ -22,6 +22,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 
 #include <ContinuousCaptions.h>
+#include <AudioPacketizer.h>
+#include <VoiceActivityGate.h>
 #include "AudioCaptureSession.h"
 #include "CaptionResultHandler.h"
 #include "caption_output_writer.h"
@@ -70,6 +72,8 @@ struct SourceCaptionerSettings {
 
     CaptionFormatSettings format_settings;
     ContinuousCaptionStreamSettings stream_settings;
+    AudioPacketizerSettings packetizer_settings;
+    VoiceActivitySettings vad_settings;
 
     SourceCaptionerSettings();
 
@@ -78,19 +82,25 @@ struct SourceCaptionerSettings {
             bool recording_output_enabled,
             const CaptionSourceSettings caption_source_settings,
             const CaptionFormatSettings format_settings,
-            const ContinuousCaptionStreamSettings stream_settings
+            const ContinuousCaptionStreamSettings stream_settings,
+            const AudioPacketizerSettings packetizer_settings,
+            const VoiceActivitySettings vad_settings
     ) :
             streaming_output_enabled(streaming_output_enabled),
             recording_output_enabled(recording_output_enabled),
             format_settings(format_settings),
-            stream_settings(stream_settings) {}
+            stream_settings(stream_settings),
+            packetizer_settings(packetizer_settings),
+            vad_settings(vad_settings) {}
 
     bool operator==(const SourceCaptionerSettings &rhs) const {
         return streaming_output_enabled == rhs.streaming_output_enabled &&
                recording_output_enabled == rhs.recording_output_enabled &&
                caption_source_settings_map == rhs.caption_source_settings_map &&
                format_settings == rhs.format_settings &&
-               stream_settings == rhs.stream_settings;
+               stream_settings == rhs.stream_settings &&
+               packetizer_settings == rhs.packetizer_settings &&
+               vad_settings == rhs.vad_settings;
     }
 
 
@@ -111,6 +121,8 @@ struct SourceCaptionerSettings {
 
         stream_settings.print((string(line_prefix) + "  ").c_str());
         format_settings.print((string(line_prefix) + "  ").c_str());
+        packetizer_settings.print((string(line_prefix) + "  ").c_str());
+        vad_settings.print((string(line_prefix) + "  ").c_str());
     }
 
     const CaptionSourceSettings *get_caption_source_settings_ptr(const string scene_collection_name) const {
@@ -163,6 +175,8 @@ enum SourceCaptionerStatusEvent {
     SOURCE_CAPTIONER_STATUS_EVENT_NEW_SETTINGS_STOPPED,
 
     SOURCE_CAPTIONER_STATUS_EVENT_AUDIO_CAPTURE_STATUS_CHANGE,
+
+    SOURCE_CAPTIONER_STATUS_EVENT_RECONNECT_STATUS_CHANGE,
 };
 
 struct SourceCaptionerStatus {
@@ -178,6 +192,9 @@ struct SourceCaptionerStatus {
 
     bool active;
 
+    // while the API connection is failing
+    ReconnectStatus reconnect_status;
+
     SourceCaptionerStatus(SourceCaptionerStatusEvent eventType, bool settingsChanged, bool streamSettingsChanged,
                           const SourceCaptionerSettings &settings, string scene_collection_name,
                           audio_source_capture_status audioCaptureStatus, bool active)
@@ -191,8 +208,16 @@ class SourceCaptioner : public QObject {
 Q_OBJECT
 
     std::unique_ptr<AudioCaptureSession> audio_capture_session;
+    std::unique_ptr<AudioPacketizer> audio_packetizer;
+    std::unique_ptr<VoiceActivityGate> voice_activity_gate;
     std::unique_ptr<ContinuousCaptions> continuous_captions;
     uint audio_chunk_count = 0;
+    // capture time of the audio currently going through the packetizer and gate, audio thread only
+    std::chrono::steady_clock::time_point current_captured_at;
+
+    // per session, shared with the output writers
+    std::shared_ptr<CaptionLatencyStats> latency_stats;
+    uint latency_result_count = 0;
 
     SourceCaptionerSettings settings;
     string selected_scene_collection_name;
@@ -204,6 +229,9 @@ Q_OBJECT
     bool last_caption_cleared;
     QTimer timer;
 
+    // last one sent with a status event, retry_in_ms rounded up to seconds
+    ReconnectStatus last_reconnect_status;
+
     std::vector<std::shared_ptr<OutputCaptionResult>> results_history; // final ones + last ones before interruptions
     std::shared_ptr<OutputCaptionResult> held_nonfinal_caption_result;
 
@@ -225,7 +253,14 @@ Q_OBJECT
 
     void prepare_recent(string &recent_captions_output);
 
-    void on_audio_data_callback(const int id, const uint8_t *data, const size_t size);
+    void on_audio_data_callback(const int id, const uint8_t *data, const size_t size,
+                                const std::chrono::steady_clock::time_point captured_at);
+
+    void on_audio_frame_callback(const char *data, const size_t size);
+
+    void on_voice_audio_callback(const char *data, const size_t size);
+
+    void clear_audio_pipeline();
 
     void on_audio_capture_status_change_callback(const int id, const audio_source_capture_status status);
 
@@ -237,6 +272,8 @@ Q_OBJECT
 
     void process_audio_capture_status_change(const int id, const int new_status);
 
+    void check_reconnect_status();
+
 private slots:
 
     void clear_output_timer_cb();
@@ -278,6 +315,8 @@ public:
 
     void recording_stopped_event();
 
+    string latency_summary();
+
 };
 
 
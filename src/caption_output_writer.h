@@ -29,6 +29,10 @@ struct CaptionOutput {
 struct CaptionOutputControl {
     moodycamel::BlockingConcurrentQueue<CaptionOutput> caption_queue;
     volatile bool stop = false;
+    std::shared_ptr<CaptionLatencyStats> latency_stats;
+
+    explicit CaptionOutputControl(std::shared_ptr<CaptionLatencyStats> latency_stats) :
+            latency_stats(latency_stats) {}
 
     void stop_soon() {
         debug_log("CaptionOutputControl stop_soon()");
@@ -53,6 +57,7 @@ static void caption_output_writer_loop(shared_ptr<CaptionOutputControl> control,
     int active_delay_sec;
     bool got_item;
     obs_output_t *output = nullptr;
+    CaptionTrace trace;
 
     double waited_left_secs = 0;
     while (!control->stop) {
@@ -66,6 +71,10 @@ static void caption_output_writer_loop(shared_ptr<CaptionOutputControl> control,
             continue;
         }
 
+        // copy, the result is shared with the other writer
+        trace = caption_output.output_result->caption_result.trace;
+        trace.mark(CAPTION_TRACE_WRITER_DEQUEUE);
+
         if (output) {
             obs_output_release(output);
             output = nullptr;
@@ -141,6 +150,12 @@ static void caption_output_writer_loop(shared_ptr<CaptionOutputControl> control,
                   to_what.c_str(), waited_left_secs, caption_output.output_result->output_line.c_str());
 
         obs_output_output_caption_text2(output, caption_output.output_result->output_line.c_str(), 0.0);
+
+        // with a stream delay the wait is on purpose, not latency
+        if (!active_delay_sec && !caption_output.is_clearance && control->latency_stats) {
+            trace.mark(CAPTION_TRACE_OUTPUT);
+            control->latency_stats->record_output(trace);
+        }
     }
     if (output) {
         obs_output_release(output);
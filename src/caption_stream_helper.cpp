@@ -28,14 +28,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define SAVE_ENTRY_NAME "cloud_closed_caption_rat"
 
 static CaptionStreamSettings default_CaptionStreamSettings() {
-    uint download_start_delay_ms = 4000;
-    download_start_delay_ms = 40;
     return {
             5000,
             5000,
             180'000,
-            50,
-            download_start_delay_ms,
+            1000,
+            AUDIO_QUEUE_DROP_OLDEST,
             "en-US",
             0,
             ""
@@ -64,6 +62,26 @@ static CaptionFormatSettings default_CaptionFormatSettings() {
 };
 
 
+static AudioPacketizerSettings default_AudioPacketizerSettings() {
+    return {
+            50,
+            true,
+            20,
+            100,
+    };
+};
+
+static VoiceActivitySettings default_VoiceActivitySettings() {
+    return {
+            false, // opt in, existing setups keep uploading everything
+            9.0,
+            -55.0,
+            600,
+            300,
+            1000,
+    };
+};
+
 static CaptionSourceSettings default_CaptionSourceSettings() {
     return {
             "",
@@ -78,7 +96,9 @@ static SourceCaptionerSettings default_SourceCaptionerSettings() {
             false,
             default_CaptionSourceSettings(),
             default_CaptionFormatSettings(),
-            default_ContinuousCaptionStreamSettings()
+            default_ContinuousCaptionStreamSettings(),
+            default_AudioPacketizerSettings(),
+            default_VoiceActivitySettings()
     );
 };
 
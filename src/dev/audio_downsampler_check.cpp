@@ -0,0 +1,272 @@
+/******************************************************************************
+Copyright (C) 2019 by <rat.with.a.compiler@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+// Feeds fixed test signals through the AudioDownsampler and through the libobs resampler the plugin uses otherwise
+// (audio_resampler_resample) and compares the 16kHz outputs sample by sample after aligning their delays.
+// Exits non zero when a passband signal differs by more than the SNR/max error limits below or when a tone above
+// the output nyquist is not attenuated enough.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <media-io/audio-resampler.h>
+
+#include "AudioDownsampler.h"
+
+using namespace std;
+
+// minimum signal to difference ratio for passband signals
+#define CHECK_MIN_SNR_DB 40.0
+
+// largest allowed difference of a single sample, 1% of full scale
+#define CHECK_MAX_ERROR 328
+
+// maximum output level of a stopband tone relative to its input level
+#define CHECK_MAX_ALIAS_DB -40.0
+
+#define CHECK_SECONDS 2
+#define CHECK_BLOCK_FRAMES 1024
+
+// output samples ignored at both ends, covers filter startup and the resampler's buffered tail
+#define CHECK_SKIP_SAMPLES 2000
+
+// search range for the delay between both outputs, in output samples
+#define CHECK_MAX_LAG 64
+
+// half width of the interpolator used for fractional delays
+#define CHECK_INTERP_HALF_TAPS 24
+
+struct test_signal {
+    const char *name;
+    vector<double> left_hz;
+    vector<double> right_hz; // empty: same as left
+    bool stopband;
+};
+
+static vector<float> tones(const vector<double> &hz, uint32_t rate, size_t frames) {
+    vector<float> out(frames, 0.0f);
+    const double amplitude = 0.5 / hz.size();
+    for (size_t i = 0; i < hz.size(); i++) {
+        const double phase = 0.7 * i;
+        for (size_t n = 0; n < frames; n++)
+            out[n] += (float) (amplitude * sin(2 * M_PI * hz[i] * n / rate + phase));
+    }
+    return out;
+}
+
+static vector<double> run_downsampler(const vector<vector<float>> &planes, uint32_t rate) {
+    AudioDownsampler downsampler(rate, planes.size());
+    vector<double> out;
+    const size_t frames = planes[0].size();
+
+    for (size_t pos = 0; pos < frames; pos += CHECK_BLOCK_FRAMES) {
+        const float *block[MAX_AV_PLANES] = {};
+        for (size_t c = 0; c < planes.size(); c++)
+            block[c] = &planes[c][pos];
+
+        const int16_t *samples;
+        const size_t count = downsampler.process(block, min((size_t) CHECK_BLOCK_FRAMES, frames - pos), &samples);
+        out.insert(out.end(), samples, samples + count);
+    }
+    return out;
+}
+
+static vector<double> run_resampler(const vector<vector<float>> &planes, uint32_t rate) {
+    const resample_info src = {rate, AUDIO_FORMAT_FLOAT_PLANAR, planes.size() == 1 ? SPEAKERS_MONO : SPEAKERS_STEREO};
+    const resample_info dst = {DOWNSAMPLER_OUTPUT_RATE, AUDIO_FORMAT_16BIT, SPEAKERS_MONO};
+    audio_resampler_t *resampler = audio_resampler_create(&dst, &src);
+    if (!resampler)
+        throw string("failed to create audio resampler");
+
+    vector<double> out;
+    const size_t frames = planes[0].size();
+    for (size_t pos = 0; pos < frames; pos += CHECK_BLOCK_FRAMES) {
+        const uint8_t *block[MAX_AV_PLANES] = {};
+        for (size_t c = 0; c < planes.size(); c++)
+            block[c] = (const uint8_t *) &planes[c][pos];
+
+        uint8_t *samples[MAX_AV_PLANES];
+        uint32_t count;
+        uint64_t ts_offset;
+        if (!audio_resampler_resample(resampler, samples, &count, &ts_offset, block,
+                                      (uint32_t) min((size_t) CHECK_BLOCK_FRAMES, frames - pos))) {
+            audio_resampler_destroy(resampler);
+            throw string("audio resampler failed");
+        }
+        if (samples[0])
+            out.insert(out.end(), (const int16_t *) samples[0], (const int16_t *) samples[0] + count);
+    }
+    audio_resampler_destroy(resampler);
+    return out;
+}
+
+// blackman windowed sinc weights for reading a signal frac samples after an integer position, taps k - half + 1
+static vector<double> interpolator_taps(double frac) {
+    vector<double> taps(2 * CHECK_INTERP_HALF_TAPS);
+    for (size_t i = 0; i < taps.size(); i++) {
+        const double t = (double) i + 1 - CHECK_INTERP_HALF_TAPS - frac;
+        const double sinc = t == 0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+        const double w = (t + CHECK_INTERP_HALF_TAPS) / (2.0 * CHECK_INTERP_HALF_TAPS);
+        taps[i] = sinc * (0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w));
+    }
+    return taps;
+}
+
+struct comparison {
+    double delay;
+    double snr_db;
+    double max_error;
+};
+
+// difference of reference[n] and signal[n + delay] over the compared range
+static comparison compare_at(const vector<double> &signal, const vector<double> &reference, double delay) {
+    comparison result = {delay, 0, 0};
+    const long offset = (long) floor(delay);
+    const vector<double> taps = interpolator_taps(delay - offset);
+    const bool integer_delay = delay == offset;
+
+    double signal_energy = 0, error_energy = 0;
+    const long end = (long) min(signal.size(), reference.size()) - CHECK_SKIP_SAMPLES;
+    for (long n = CHECK_SKIP_SAMPLES; n < end; n++) {
+        double value = 0;
+        if (integer_delay) {
+            value = signal[n + offset];
+        } else {
+            const double *in = &signal[n + offset + 1 - CHECK_INTERP_HALF_TAPS];
+            for (size_t t = 0; t < taps.size(); t++)
+                value += in[t] * taps[t];
+        }
+
+        const double error = value - reference[n];
+        signal_energy += reference[n] * reference[n];
+        error_energy += error * error;
+        result.max_error = max(result.max_error, fabs(error));
+    }
+    result.snr_db = 10 * log10((signal_energy + 1) / (error_energy + 1));
+    return result;
+}
+
+// both paths delay the signal by a different, possibly fractional, amount: best integer lag first, then a golden
+// section search for the fractional part around it
+static comparison compare_aligned(const vector<double> &signal, const vector<double> &reference) {
+    comparison best = compare_at(signal, reference, 0);
+    for (int lag = -CHECK_MAX_LAG; lag <= CHECK_MAX_LAG; lag++) {
+        const comparison c = compare_at(signal, reference, lag);
+        if (c.snr_db > best.snr_db)
+            best = c;
+    }
+
+    const double ratio = (sqrt(5.0) - 1) / 2;
+    double low = best.delay - 1, high = best.delay + 1;
+    for (int i = 0; i < 30; i++) {
+        const double a = high - ratio * (high - low);
+        const double b = low + ratio * (high - low);
+        if (compare_at(signal, reference, a).snr_db > compare_at(signal, reference, b).snr_db)
+            high = b;
+        else
+            low = a;
+    }
+    const comparison fractional = compare_at(signal, reference, (low + high) / 2);
+    return fractional.snr_db > best.snr_db ? fractional : best;
+}
+
+static double level_db(const vector<double> &out, double input_rms) {
+    double energy = 0;
+    size_t count = 0;
+    for (size_t n = CHECK_SKIP_SAMPLES; n + CHECK_SKIP_SAMPLES < out.size(); n++, count++)
+        energy += out[n] * out[n];
+    const double rms = sqrt(energy / max(count, (size_t) 1)) / 32767.0;
+    return 20 * log10((rms + 1e-9) / input_rms);
+}
+
+static bool check(const test_signal &signal, uint32_t rate, size_t channels) {
+    const size_t frames = (size_t) rate * CHECK_SECONDS;
+    vector<vector<float>> planes;
+    planes.push_back(tones(signal.left_hz, rate, frames));
+    if (channels == 2)
+        planes.push_back(tones(signal.right_hz.empty() ? signal.left_hz : signal.right_hz, rate, frames));
+
+    const vector<double> downsampled = run_downsampler(planes, rate);
+    const vector<double> resampled = run_resampler(planes, rate);
+    if (min(downsampled.size(), resampled.size()) < 3 * CHECK_SKIP_SAMPLES) {
+        printf("%-6u %d  %-12s too little output: %d / %d samples  FAIL\n", rate, (int) channels, signal.name,
+               (int) downsampled.size(), (int) resampled.size());
+        return false;
+    }
+
+    if (signal.stopband) {
+        double input_energy = 0;
+        for (size_t n = 0; n < frames; n++) {
+            double mono = 0;
+            for (const vector<float> &plane : planes)
+                mono += plane[n] / channels;
+            input_energy += mono * mono;
+        }
+        const double input_rms = sqrt(input_energy / frames);
+        const double down_db = level_db(downsampled, input_rms);
+        const double ref_db = level_db(resampled, input_rms);
+        const bool ok = down_db <= CHECK_MAX_ALIAS_DB;
+        printf("%-6u %d  %-12s alias level downsampler %7.1f dB, resampler %7.1f dB  %s\n", rate, (int) channels,
+               signal.name, down_db, ref_db, ok ? "ok" : "FAIL");
+        return ok;
+    }
+
+    const comparison c = compare_aligned(downsampled, resampled);
+    const bool ok = c.snr_db >= CHECK_MIN_SNR_DB && c.max_error <= CHECK_MAX_ERROR;
+    printf("%-6u %d  %-12s snr %6.1f dB, max error %5.0f, delay %+7.3f samples  %s\n", rate, (int) channels,
+           signal.name, c.snr_db, c.max_error, c.delay, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int main() {
+    const vector<test_signal> signals = {
+            {"300Hz",      {300},                          {},     false},
+            {"1kHz",       {1000},                         {},     false},
+            {"3kHz",       {3000},                         {},     false},
+            {"multitone",  {200, 450, 900, 1700, 2600, 3400}, {},  false},
+            {"lr-differ",  {440},                          {2200}, false},
+            {"10kHz",      {10000},                        {},     true},
+    };
+    const uint32_t rates[] = {32000, 48000, 96000};
+
+    printf("limits: snr >= %.0f dB, max error <= %d, alias <= %.0f dB\n", CHECK_MIN_SNR_DB, CHECK_MAX_ERROR,
+           CHECK_MAX_ALIAS_DB);
+
+    int failed = 0;
+    for (uint32_t rate : rates) {
+        for (size_t channels = 1; channels <= 2; channels++) {
+            for (const test_signal &signal : signals) {
+                if (channels == 1 && !signal.right_hz.empty())
+                    continue;
+                try {
+                    if (!check(signal, rate, channels))
+                        failed++;
+                } catch (const string &err) {
+                    printf("%-6u %d  %-12s error: %s\n", rate, (int) channels, signal.name, err.c_str());
+                    failed++;
+                }
+            }
+        }
+    }
+
+    printf("%s, %d failed\n", failed ? "FAILED" : "passed", failed);
+    return failed ? 1 : 0;
+}
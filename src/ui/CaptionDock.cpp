@@ -88,6 +88,8 @@ void CaptionDock::handle_caption_data_cb(
 
     this->captionLinesPlainTextEdit->setPlainText(QString::fromStdString(single_caption_line));
     last_output_line = caption_result->output_line;
+
+    this->latencyTextLabel->setText(QString::fromStdString(plugin_manager.source_captioner.latency_summary()));
 }
 
 void CaptionDock::on_settingsToolButton_clicked() {
@@ -36,7 +36,8 @@ static bool captioning_status_string(
         } else if (status.event_type == SOURCE_CAPTIONER_STATUS_EVENT_STARTED_ERROR) {
             output = "Off";
         } else if (status.event_type == SOURCE_CAPTIONER_STATUS_EVENT_STARTED_OK
-                   || status.event_type == SOURCE_CAPTIONER_STATUS_EVENT_AUDIO_CAPTURE_STATUS_CHANGE) {
+                   || status.event_type == SOURCE_CAPTIONER_STATUS_EVENT_AUDIO_CAPTURE_STATUS_CHANGE
+                   || status.event_type == SOURCE_CAPTIONER_STATUS_EVENT_RECONNECT_STATUS_CHANGE) {
 
             string source_name_use = string("(") + source_name + ")";
             if (status.audio_capture_status == AUDIO_SOURCE_CAPTURING) {
@@ -55,6 +56,15 @@ static bool captioning_status_string(
 
                 output = "🔴 CC " + source_name_use + target;
 
+                const ReconnectStatus &reconnect = status.reconnect_status;
+                const string retry_in = reconnect.retry_in_ms
+                                        ? ", retry in " + std::to_string(reconnect.retry_in_ms / 1000) + " s"
+                                        : "";
+                if (reconnect.state == RECONNECT_CIRCUIT_OPEN)
+                    output = "⚠ CC API unreachable " + source_name_use + retry_in;
+                else if (reconnect.state == RECONNECT_BACKING_OFF || reconnect.state == RECONNECT_PROBING)
+                    output = "⚠ CC reconnecting " + source_name_use + retry_in;
+
             } else if (status.audio_capture_status == AUDIO_SOURCE_MUTED)
                 output = "Muted " + source_name_use;
             else if (status.audio_capture_status == AUDIO_SOURCE_NOT_STREAMED)